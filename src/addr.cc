@@ -8,6 +8,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <locale.h>
 #include "addr.h"
 
@@ -15,27 +17,45 @@
     extern "C" {
 #endif
 #include "lctrie/lctrie.h"
+#include "lctrie/lctrie_dir24.h"
 #include "lctrie/lctrie_bgp.h"
 #if defined(__cplusplus)
     }
 #endif
 
 /*
- * ipv4_subnet_trie and ipv4_subnet_array are global variables holding the
- * level compressed path trie data and subnet information for IPv4 BGP
- * Autonomous System Numbers and so on.
+ * struct subnet_db holds the level compressed path trie data and
+ * subnet information for IPv4 BGP Autonomous System Numbers and so
+ * on.  It is not changed after subnet_db_init() returns, so a single
+ * subnet_db can be shared by any number of threads.
+ *
+ * If SUBNET_DB_DIR24_8 is defined at compile time, a DIR-24-8 table
+ * is used for lookups instead of the trie; it takes at most two
+ * memory accesses per lookup, but uses 64 MB or more of memory.
  */
-lct_t ipv4_subnet_trie;
-lct_subnet_t *ipv4_subnet_array;
+struct subnet_db {
+#ifdef SUBNET_DB_DIR24_8
+    lct_dir24_t ipv4_subnet_table;
+#else
+    lct_t ipv4_subnet_trie;
+#endif
+    lct_subnet_t *ipv4_subnet_array;
+    char *labels;                  /* text of the label file, or NULL */
+};
 
-uint32_t get_asn_info(char* dst_ip) {
+uint32_t subnet_db_get_asn(const struct subnet_db *db, const char *dst_ip) {
     uint32_t ipv4_addr;
 
     if (inet_pton(AF_INET, dst_ip, &ipv4_addr) != 1) {
         return 0;
     }
 
-    lct_subnet_t *subnet = lct_find(&ipv4_subnet_trie, ntohl(ipv4_addr));
+#ifdef SUBNET_DB_DIR24_8
+    lct_subnet_t *subnet = lct_dir24_find(&db->ipv4_subnet_table, ntohl(ipv4_addr));
+#else
+    /* note: lct_find() does not modify the trie */
+    lct_subnet_t *subnet = lct_find((lct_t *)&db->ipv4_subnet_trie, ntohl(ipv4_addr));
+#endif
     if (subnet == NULL) {
         return 0;
     }
@@ -46,46 +66,38 @@ uint32_t get_asn_info(char* dst_ip) {
     return 0;
 }
 
+const char *subnet_db_get_label(const struct subnet_db *db, uint32_t addr) {
+
+#ifdef SUBNET_DB_DIR24_8
+    lct_subnet_t *subnet = lct_dir24_find(&db->ipv4_subnet_table, ntohl(addr));
+#else
+    /* note: lct_find() does not modify the trie */
+    lct_subnet_t *subnet = lct_find((lct_t *)&db->ipv4_subnet_trie, ntohl(addr));
+#endif
+    if (subnet == NULL || subnet->info.type != IP_SUBNET_USER) {
+        return NULL;
+    }
+    return (const char *)subnet->info.usr.data;
+}
+
 /*
  * BGP_MAX_ENTRIES is the maximum number of subnets
  */
 #define BGP_MAX_ENTRIES             4000000
 
 /*
- * lct_init_from_file(lct, filename) initializes the lctrie lct by
- * reading data from the file filename.  On success, the location of
- * the subnet array allocated by this function is returned; on error,
- * NULL is returned, and the caller should use errno/perror to
- * determine the cause.
+ * subnets_prepare(p, num, num_subnets) turns the array p of num
+ * subnets into a sorted, de-duplicated, and prefixed array, from
+ * which an lctrie or a DIR-24-8 table can be built.  On success, the
+ * location of the (reallocated) array is returned, and num_subnets is
+ * set to its number of elements; on error, p is freed and NULL is
+ * returned.
  */
-lct_subnet_t *lct_init_from_file(lct_t *lct, char *filename) {
-  int num = 0;
+static lct_subnet_t *subnets_prepare(lct_subnet_t *p, int num, uint32_t *num_subnets) {
   uint32_t prefix;
-  lct_subnet_t *p;
   lct_subnet_t *tmp = NULL;
   lct_ip_stats_t *stats = NULL;
 
-  // we need this to get thousands separators
-  setlocale(LC_NUMERIC, "");
-
-  if (!(p = (lct_subnet_t *)calloc(sizeof(lct_subnet_t), BGP_MAX_ENTRIES))) {
-      return NULL;  /* could not allocate subnet input buffer */
-  }
-
-  // start with the RFC 1918 and 3927 private and link local
-  // subnets as a basis for any table set
-  num += init_private_subnets(&p[num], BGP_MAX_ENTRIES);
-
-  // fill up the rest of the array with reserved IP subnets
-  num += init_special_subnets(&p[num], BGP_MAX_ENTRIES);
-
-  // read in the ASN prefixes
-  int rc;
-  if (0 > (rc = read_prefix_table(filename, &p[num], BGP_MAX_ENTRIES - num))) {
-      goto bail; /* could not read prefix file */
-  }
-  num += rc;
-
   // validate subnet prefixes against their netmasks
   // and sort the resulting array
   subnet_mask(p, num);
@@ -121,10 +133,7 @@ lct_subnet_t *lct_init_from_file(lct_t *lct, char *filename) {
     }
   }
 
-  // actually build the trie and get the trie node count for statistics printing
-  memset(lct, 0, sizeof(lct_t));
-  lct_build(lct, p, num);
-
+  *num_subnets = num;
   return p;
 
  bail:   /* handle errors by freeing memory as needed */
@@ -133,17 +142,231 @@ lct_subnet_t *lct_init_from_file(lct_t *lct, char *filename) {
   return NULL;
 }
 
-int addr_init(const char *resources_dir) {
+/*
+ * subnets_init_from_file(filename, num) reads the subnets in the file
+ * filename, along with the private and special subnets, into a
+ * prepared array (see subnets_prepare()).  On success, the location of
+ * the subnet array allocated by this function is returned, and num is
+ * set to its number of elements; on error, NULL is returned, and the
+ * caller should use errno/perror to determine the cause.
+ */
+lct_subnet_t *subnets_init_from_file(char *filename, uint32_t *num_subnets) {
+  int num = 0;
+  lct_subnet_t *p;
+
+  // we need this to get thousands separators
+  setlocale(LC_NUMERIC, "");
 
-    ipv4_subnet_array = lct_init_from_file(&ipv4_subnet_trie, (char *)resources_dir);
-    if (ipv4_subnet_array == NULL) {
-        return -1;
+  if (!(p = (lct_subnet_t *)calloc(sizeof(lct_subnet_t), BGP_MAX_ENTRIES))) {
+      return NULL;  /* could not allocate subnet input buffer */
+  }
+
+  // start with the RFC 1918 and 3927 private and link local
+  // subnets as a basis for any table set
+  num += init_private_subnets(&p[num], BGP_MAX_ENTRIES);
+
+  // fill up the rest of the array with reserved IP subnets
+  num += init_special_subnets(&p[num], BGP_MAX_ENTRIES);
+
+  // read in the ASN prefixes
+  int rc;
+  if (0 > (rc = read_prefix_table(filename, &p[num], BGP_MAX_ENTRIES - num))) {
+      free(p);
+      return NULL; /* could not read prefix file */
+  }
+  num += rc;
+
+  return subnets_prepare(p, num, num_subnets);
+}
+
+/*
+ * read_file(filename) returns a null-terminated copy of the contents
+ * of the file filename, which the caller must free, or NULL on error
+ */
+static char *read_file(const char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "error: could not open subnet label file %s (%s)\n", filename, strerror(errno));
+        return NULL;
     }
-    return 0;
+    std::string contents;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        contents.append(buf, n);
+    }
+    fclose(f);
+    return strdup(contents.c_str());
 }
 
-void addr_finalize() {
-    free(ipv4_subnet_trie.root);
-    lct_free(&ipv4_subnet_trie);
-    free(ipv4_subnet_array);
+/*
+ * label_is_valid(label) returns true if label is a non-empty string
+ * of printable characters that can be written into a JSON string
+ * without escaping
+ */
+static bool label_is_valid(const char *label) {
+    if (*label == '\0') {
+        return false;
+    }
+    for (const char *c = label; *c != '\0'; c++) {
+        if (!isprint((unsigned char)*c) || *c == '"' || *c == '\\') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * labels_init_from_file(filename, num, labels) reads the subnets and
+ * labels in the file filename into a prepared array (see
+ * subnets_prepare()), whose elements are user subnets that point to
+ * their labels in the text of the file, which is returned in labels.
+ * Each line of the file holds a subnet in CIDR notation (with a
+ * non-zero prefix length, as in the BGP prefix file), then
+ * whitespace, then a label, which extends to the end of the line;
+ * blank lines and lines starting with '#' are ignored.  On success,
+ * the location of the subnet array is returned, and num is set to its
+ * number of elements; on error, NULL is returned.
+ */
+static lct_subnet_t *labels_init_from_file(const char *filename, uint32_t *num_subnets, char **labels) {
+    char *text = read_file(filename);
+    if (text == NULL) {
+        return NULL;
+    }
+    size_t max_lines = 1;
+    for (const char *c = text; *c != '\0'; c++) {
+        if (*c == '\n') {
+            max_lines++;
+        }
+    }
+    lct_subnet_t *p = (lct_subnet_t *)calloc(sizeof(lct_subnet_t), max_lines);
+    if (p == NULL) {
+        free(text);
+        return NULL;
+    }
+
+    int num = 0;
+    unsigned int line_number = 0;
+    char *line = text;
+    while (line != NULL) {
+        line_number++;
+        char *end = strchr(line, '\n');
+        char *next = NULL;
+        if (end != NULL) {
+            *end = '\0';
+            next = end + 1;
+        } else {
+            end = line + strlen(line);
+        }
+        while (end > line && isspace((unsigned char)end[-1])) {
+            *--end = '\0';    /* trim trailing whitespace */
+        }
+        while (isspace((unsigned char)*line)) {
+            line++;
+        }
+        if (*line != '\0' && *line != '#') {
+            uint8_t dq[4];
+            uint8_t len;
+            int label_offset = 0;
+            int items = sscanf(line, "%hhu.%hhu.%hhu.%hhu/%hhu %n", dq, dq + 1, dq + 2, dq + 3, &len, &label_offset);
+            if (items != 5 || label_offset == 0 || len == 0 || len > 32 || !isspace((unsigned char)line[label_offset - 1])
+                || !label_is_valid(line + label_offset)) {
+                fprintf(stderr, "error: could not parse line %u of subnet label file %s\n", line_number, filename);
+                free(p);
+                free(text);
+                return NULL;
+            }
+            p[num].addr = (uint32_t)dq[0] << 24 | (uint32_t)dq[1] << 16 | (uint32_t)dq[2] << 8 | dq[3];
+            p[num].len = len;
+            p[num].info.type = IP_SUBNET_USER;
+            p[num].info.usr.data = line + label_offset;
+            num++;
+        }
+        line = next;
+    }
+    if (num == 0) {
+        fprintf(stderr, "error: no subnets in subnet label file %s\n", filename);
+        free(p);
+        free(text);
+        return NULL;
+    }
+
+    p = subnets_prepare(p, num, num_subnets);
+    if (p == NULL) {
+        free(text);
+        return NULL;
+    }
+    *labels = text;
+    return p;
+}
+
+/*
+ * subnet_db_build(db, num_subnets) builds the lookup structure of db
+ * from its subnet array, and returns false on failure
+ */
+static bool subnet_db_build(struct subnet_db *db, uint32_t num_subnets) {
+#ifdef SUBNET_DB_DIR24_8
+    return lct_dir24_build(&db->ipv4_subnet_table, db->ipv4_subnet_array, num_subnets) == 0;
+#else
+    return lct_build(&db->ipv4_subnet_trie, db->ipv4_subnet_array, num_subnets) == 0;
+#endif
+}
+
+struct subnet_db *subnet_db_init(const char *filename) {
+
+    struct subnet_db *db = (struct subnet_db *)calloc(1, sizeof(struct subnet_db));
+    if (db == NULL) {
+        return NULL;
+    }
+    uint32_t num_subnets = 0;
+    db->ipv4_subnet_array = subnets_init_from_file((char *)filename, &num_subnets);
+    if (db->ipv4_subnet_array == NULL) {
+        free(db);
+        return NULL;
+    }
+    if (subnet_db_build(db, num_subnets) == false) {
+        free(db->ipv4_subnet_array);
+        free(db);
+        return NULL;
+    }
+    return db;
+}
+
+struct subnet_db *subnet_db_init_labels(const char *filename, int verbosity) {
+
+    struct subnet_db *db = (struct subnet_db *)calloc(1, sizeof(struct subnet_db));
+    if (db == NULL) {
+        return NULL;
+    }
+    uint32_t num_subnets = 0;
+    db->ipv4_subnet_array = labels_init_from_file(filename, &num_subnets, &db->labels);
+    if (db->ipv4_subnet_array == NULL) {
+        free(db);
+        return NULL;
+    }
+    if (subnet_db_build(db, num_subnets) == false) {
+        free(db->ipv4_subnet_array);
+        free(db->labels);
+        free(db);
+        return NULL;
+    }
+    if (verbosity > 0) {
+        fprintf(stderr, "read %u labeled subnets from %s\n", num_subnets, filename);
+    }
+    return db;
+}
+
+void subnet_db_finalize(struct subnet_db *db) {
+    if (db == NULL) {
+        return;
+    }
+#ifdef SUBNET_DB_DIR24_8
+    lct_dir24_free(&db->ipv4_subnet_table);
+#else
+    free(db->ipv4_subnet_trie.root);
+    lct_free(&db->ipv4_subnet_trie);
+#endif
+    free(db->ipv4_subnet_array);
+    free(db->labels);
+    free(db);
 }
@@ -5,12 +5,46 @@
  * prefix matching
  */
 
+#ifndef ADDR_H
+#define ADDR_H
 
 #include <string>
 #include "mercury.h"
 
-uint32_t get_asn_info(char* dst_ip);
+/*
+ * struct subnet_db is an (opaque) database of IPv4 subnets and their
+ * Autonomous System Numbers; it is immutable once initialized
+ */
+struct subnet_db;
+
+/*
+ * subnet_db_init(filename) returns a new subnet_db initialized from
+ * the prefix file filename (e.g. pyasn.db), or NULL on failure
+ */
+struct subnet_db *subnet_db_init(const char *filename);
+
+/*
+ * subnet_db_get_asn(db, dst_ip) returns the ASN of the subnet that
+ * contains the IPv4 address in the string dst_ip, or zero if there is
+ * none
+ */
+uint32_t subnet_db_get_asn(const struct subnet_db *db, const char *dst_ip);
+
+/*
+ * subnet_db_init_labels(filename, verbosity) returns a new subnet_db
+ * initialized from the label file filename, each line of which holds
+ * an IPv4 subnet in CIDR notation and a label (see --subnet-labels),
+ * or NULL on failure
+ */
+struct subnet_db *subnet_db_init_labels(const char *filename, int verbosity);
+
+/*
+ * subnet_db_get_label(db, addr) returns the label of the longest
+ * labeled subnet that contains the IPv4 address addr (in network byte
+ * order), or NULL if there is none
+ */
+const char *subnet_db_get_label(const struct subnet_db *db, uint32_t addr);
 
-int addr_init(const char *resources_dir);
+void subnet_db_finalize(struct subnet_db *db);
 
-void addr_finalize();
+#endif /* ADDR_H */
@@ -37,6 +37,7 @@
 #include "rnd_pkt_drop.h"
 #include "output.h"
 #include "pkt_proc.h"
+#include "metrics.h"
 
 /*
  * The thread_storage, stats_tracking, and ring_limits structs are
@@ -57,6 +58,21 @@ struct ring_limits {
 };
 
 
+/*
+ * struct interface_stats holds the counters for a single capture
+ * interface; when packets are captured from more than one interface,
+ * each has a group of worker threads, and these counters are
+ * reported separately for each group
+ */
+struct interface_stats {
+  const char *if_name;
+  uint64_t received_packets;
+  uint64_t received_bytes;
+  uint64_t socket_packets;
+  uint64_t socket_drops;
+  uint64_t socket_freezes;
+};
+
 /*
  * Our stats tracking function will get a pointer to a struct
  * that has the info it needs to track stats for each thread
@@ -65,6 +81,8 @@ struct ring_limits {
 struct stats_tracking {
   struct thread_storage *tstor;
   int num_threads;
+  struct interface_stats *ifstats;
+  int num_interfaces;
   uint64_t received_packets;
   uint64_t received_bytes;
   uint64_t socket_packets;
@@ -74,6 +92,7 @@ struct stats_tracking {
   pthread_cond_t *t_start_c;  /* The clean start condition */
   pthread_mutex_t *t_start_m; /* The clean start mutex */
   int verbosity;
+  const struct output_file *out_ctx; /* The output thread's context, for its latency */
 };
 
 /*
@@ -87,6 +106,7 @@ struct thread_storage {
   pthread_attr_t thread_attributes;
   int sockfd;               /* Socket owned by this thread */
   const char *if_name;      /* The name of the interface to bind the socket to */
+  struct interface_stats *ifstats; /* The counters for that interface */
   uint8_t *mapped_buffer;   /* The pointer to the mmap()'d region */
   struct tpacket_block_desc **block_header; /* The pointer to each block in the mmap()'d region */
   struct tpacket_req3 ring_params; /* The ring allocation params to setsockopt() */
@@ -128,7 +148,7 @@ static double time_elapsed(struct timespec *ts) {
   return (ts->tv_sec + (ts->tv_nsec / 1000000000.0)) - time_s;
 }
 
-void af_packet_stats(int sockfd, struct stats_tracking *statst) {
+void af_packet_stats(int sockfd, struct stats_tracking *statst, struct interface_stats *ifstats) {
   int err;
   struct tpacket_stats_v3 tp3_stats;
 
@@ -144,16 +164,79 @@ void af_packet_stats(int sockfd, struct stats_tracking *statst) {
     statst->socket_drops += tp3_stats.tp_drops;
     statst->socket_freezes += tp3_stats.tp_freeze_q_cnt;
   }
+  if (ifstats != NULL) {
+    ifstats->socket_packets += tp3_stats.tp_packets;
+    ifstats->socket_drops += tp3_stats.tp_drops;
+    ifstats->socket_freezes += tp3_stats.tp_freeze_q_cnt;
+  }
+}
+
+/*
+ * struct latency_snapshot holds copies of the latency histograms of
+ * the worker threads (combined) and of the output thread
+ */
+struct latency_snapshot {
+  struct latency_histogram wire_to_apply;  /* kernel timestamp to pkt_proc::apply() */
+  struct latency_histogram apply;          /* duration of pkt_proc::apply()         */
+  struct latency_histogram wire_to_write;  /* kernel timestamp to output fwrite()   */
+};
+
+static void latency_snapshot_get(struct latency_snapshot *s, const struct output_file *out_ctx) {
+  metrics_get_latency(&s->wire_to_apply, &s->apply);
+  memset(&s->wire_to_write, 0, sizeof(s->wire_to_write));
+  if (out_ctx != NULL) {
+    latency_histogram_add(&s->wire_to_write, &out_ctx->wire_to_write);
+  }
+}
+
+static void latency_snapshot_subtract(struct latency_snapshot *s, const struct latency_snapshot *before) {
+  latency_histogram_subtract(&s->wire_to_apply, &before->wire_to_apply);
+  latency_histogram_subtract(&s->apply, &before->apply);
+  latency_histogram_subtract(&s->wire_to_write, &before->wire_to_write);
+}
+
+static void fprint_latency(FILE *f, const char *name, const struct latency_histogram *h) {
+  fprintf(f, "%s p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f",
+	  name,
+	  latency_histogram_percentile(h, 50.0) / 1000.0,
+	  latency_histogram_percentile(h, 90.0) / 1000.0,
+	  latency_histogram_percentile(h, 99.0) / 1000.0,
+	  latency_histogram_percentile(h, 99.9) / 1000.0,
+	  latency_histogram_percentile(h, 100.0) / 1000.0);
+}
+
+static void fprint_latency_snapshot(FILE *f, const char *title, const struct latency_snapshot *s, bool include_output) {
+  fprintf(f, "%s (us): ", title);
+  fprint_latency(f, "wire to apply", &s->wire_to_apply);
+  fprintf(f, "; ");
+  fprint_latency(f, "apply", &s->apply);
+  if (include_output) {
+    fprintf(f, "; ");
+    fprint_latency(f, "wire to write", &s->wire_to_write);
+  }
+  fprintf(f, "\n");
 }
 
 void process_all_packets_in_block(struct tpacket_block_desc *block_hdr,
                                   struct stats_tracking *statst,
+                                  struct interface_stats *ifstats,
                                   struct pkt_proc *pkt_processor) {
   int num_pkts = block_hdr->hdr.bh1.num_pkts, i;
   unsigned long byte_count = 0;
   struct tpacket3_hdr *pkt_hdr;
   //struct timespec ts;
   struct packet_info pi;
+  struct thread_metrics *metrics = pkt_processor->metrics;
+
+  /*
+   * Latency is measured with one clock reading per packet: the time
+   * at which the processing of a packet ends is the time at which
+   * the processing of the next one starts
+   */
+  struct timespec apply_start, apply_end;
+  if (metrics) {
+    clock_gettime(CLOCK_REALTIME, &apply_start);
+  }
 
   pkt_hdr = (struct tpacket3_hdr *) ((uint8_t *) block_hdr + block_hdr->hdr.bh1.offset_to_first_pkt);
   for (i = 0; i < num_pkts; ++i) {
@@ -175,6 +258,13 @@ void process_all_packets_in_block(struct tpacket_block_desc *block_hdr,
     uint8_t *eth = (uint8_t *)pkt_hdr + pkt_hdr->tp_mac;
     pkt_processor->apply(&pi, eth);
 
+    if (metrics) {
+      clock_gettime(CLOCK_REALTIME, &apply_end);
+      latency_histogram_record(&metrics->wire_to_apply, latency_ns(&apply_start, &pi.ts));
+      latency_histogram_record(&metrics->apply, latency_ns(&apply_end, &apply_start));
+      apply_start = apply_end;
+    }
+
     pkt_hdr = (struct tpacket3_hdr *) ((uint8_t *)pkt_hdr + pkt_hdr->tp_next_offset);
   }
 
@@ -183,34 +273,20 @@ void process_all_packets_in_block(struct tpacket_block_desc *block_hdr,
    */
   __sync_add_and_fetch(&(statst->received_packets), num_pkts);
   __sync_add_and_fetch(&(statst->received_bytes), byte_count);
-}
+  __sync_add_and_fetch(&(ifstats->received_packets), num_pkts);
+  __sync_add_and_fetch(&(ifstats->received_bytes), byte_count);
 
-void check_socket_drops(int duration, uint64_t sdps, uint64_t sfps, int *socket_drops, int *zero_drops) {
-    int current_percent;
-
-    if (sdps == 0 && sfps == 0) {
-       (*zero_drops)++;
-       (*socket_drops) = 0;
-       if (*zero_drops >= 60) {
-          *zero_drops = 0;
-          current_percent = increment_percent_accept(5);
-          fprintf(stderr, "  Duration: %6d, Current percent acceptance Increased to %d\n", duration, current_percent);
-       }
-    } else {
-       (*zero_drops) = 0;
-       (*socket_drops)++;
-       if (*socket_drops > 1) {
-           *socket_drops = -58;
-           current_percent = increment_percent_accept(-10);
-           fprintf(stderr, "  Duration: %6d,    Current percent acceptance Decreased to %d\n", duration, current_percent);
-       }
-    }
+  /* per-thread metrics, without locked instructions */
+  if (metrics) {
+    metrics_add(metrics->packets, num_pkts);
+    metrics_add(metrics->bytes, byte_count);
+  }
 }
 
 void *stats_thread_func(void *statst_arg) {
 
     struct stats_tracking *statst = (struct stats_tracking *)statst_arg;
-    int duration = 0, socket_drops = 0, zero_drops = 0;
+    int duration = 0;
 
   /* The stats thread is one of the first to get started and it has to wait
    * for the other threads otherwise we'll be tracking bogus stats
@@ -244,7 +320,24 @@ void *stats_thread_func(void *statst_arg) {
    */
   enable_all_signals();
 
+  /* per-interface counters at the start of each second */
+  struct interface_stats *ifstats_before = (struct interface_stats *)calloc(statst->num_interfaces, sizeof(struct interface_stats));
+  if (ifstats_before == NULL) {
+    fprintf(stderr, "error: could not allocate memory for interface stats\n");
+    exit(255);
+  }
+
+  /* latency histograms at the start of each second, and now */
+  struct latency_snapshot *latency_before = (struct latency_snapshot *)calloc(2, sizeof(struct latency_snapshot));
+  if (latency_before == NULL) {
+    fprintf(stderr, "error: could not allocate memory for latency stats\n");
+    exit(255);
+  }
+  struct latency_snapshot *latency_now = latency_before + 1;
+
   while (sig_close_flag == 0) {
+    memcpy(ifstats_before, statst->ifstats, statst->num_interfaces * sizeof(struct interface_stats));
+    latency_snapshot_get(latency_before, statst->out_ctx);
     uint64_t packets_before = statst->received_packets;
     uint64_t bytes_before = statst->received_bytes;
     uint64_t socket_packets_before = statst->socket_packets;
@@ -270,7 +363,13 @@ void *stats_thread_func(void *statst_arg) {
     double worst_rusage = 0; /* Worst average rbuffer usage */
     double worst_i_rusage = 0; /* Worst instantaneous rbuffer usage */
     for (int thread = 0; thread < statst->num_threads; thread++) {
-      af_packet_stats(statst->tstor[thread].sockfd, statst);
+      uint64_t thread_socket_packets = statst->socket_packets;
+      uint64_t thread_socket_drops = statst->socket_drops;
+      uint64_t thread_socket_freezes = statst->socket_freezes;
+      af_packet_stats(statst->tstor[thread].sockfd, statst, statst->tstor[thread].ifstats);
+      thread_socket_packets = statst->socket_packets - thread_socket_packets;
+      thread_socket_drops = statst->socket_drops - thread_socket_drops;
+      thread_socket_freezes = statst->socket_freezes - thread_socket_freezes;
 
       int thread_block_count = statst->tstor[thread].ring_params.tp_block_nr;
       double *bstreak_hist = statst->tstor[thread].block_streak_hist;
@@ -305,7 +404,9 @@ void *stats_thread_func(void *statst_arg) {
 	}
       }
 
-      /* Now clear the bstreak histogram */
+      /* Record the histogram in the metrics, then clear it */
+      metrics_update_ring(thread, bstreak_hist, thread_block_count,
+                          thread_socket_packets, thread_socket_drops, thread_socket_freezes);
       for (int i = 0; i <= thread_block_count; i++) {
 	bstreak_hist[i] = 0;
       }
@@ -382,15 +483,56 @@ void *stats_thread_func(void *statst_arg) {
                 r_spps, r_spps_s, sdps, sfps,
                 (tot_rusage / (statst->num_threads)) * 100.0, worst_rusage * 100.0,
                 worst_i_rusage * 100.0);
+
+        latency_snapshot_get(latency_now, statst->out_ctx);
+        latency_snapshot_subtract(latency_now, latency_before);
+        if (latency_histogram_total(&latency_now->wire_to_apply)) {
+            fprint_latency_snapshot(stderr, "  Latency", latency_now, statst->out_ctx && statst->out_ctx->track_latency);
+        }
+
+        if (statst->num_interfaces > 1) {
+            for (int i = 0; i < statst->num_interfaces; i++) {
+                const struct interface_stats *ifs = &statst->ifstats[i];
+                const struct interface_stats *ifb = &ifstats_before[i];
+                double if_pps = (ifs->received_packets - ifb->received_packets) / time_d;
+                double if_byps = (ifs->received_bytes - ifb->received_bytes) / time_d;
+                double r_if_pps, r_if_byps;
+                char *r_if_pps_s, *r_if_byps_s;
+                get_readable_number_float(1000, if_pps, &r_if_pps, &r_if_pps_s);
+                if (r_if_pps_s[0] == '\0') {
+                    r_if_pps_s = &(space[0]);
+                }
+                get_readable_number_float(1000, if_byps, &r_if_byps, &r_if_byps_s);
+                if (r_if_byps_s[0] == '\0') {
+                    r_if_byps_s = &(space[0]);
+                }
+                fprintf(stderr,
+                        "  Interface %s: %7.03f%s Packets/s; Data Rate %7.03f%s bytes/s; "
+                        "Socket Drops %" PRIu64 " (packets); Socket Freezes %" PRIu64 "\n",
+                        ifs->if_name, r_if_pps, r_if_pps_s, r_if_byps, r_if_byps_s,
+                        ifs->socket_drops - ifb->socket_drops,
+                        ifs->socket_freezes - ifb->socket_freezes);
+            }
+        }
     }
 
     duration++;
-    if (get_percent_accept() > 0) {
-        /* check socket drops and update accept percentage only when percent accept > 0 */
-        check_socket_drops(duration, sdps, sfps, &socket_drops, &zero_drops);
+    if (rnd_pkt_drop_enabled) {
+        /* adjust the fraction of flows accepted, based on socket drops and ring usage */
+        int previous_percent = get_percent_accept();
+        int current_percent = adjust_percent_accept(worst_rusage,
+                                                    statst->socket_packets - socket_packets_before,
+                                                    sdps, sfps);
+        if (current_percent != previous_percent) {
+            fprintf(stderr, "  Duration: %6d, Current percent acceptance %s to %d (fraction %.4f)\n", duration,
+                    current_percent > previous_percent ? "Increased" : "Decreased", current_percent, get_fraction_accept());
+        }
     }
   }
 
+  free(ifstats_before);
+  free(latency_before);
+
   return NULL;
 }
 
@@ -450,9 +592,9 @@ int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg)
   /*
    * set up RX_RING
    */
-  fprintf(stderr, "Requesting PACKET_RX_RING with %u bytes (%d blocks of size %d) for thread %d\n",
+  fprintf(stderr, "Requesting PACKET_RX_RING with %u bytes (%d blocks of size %d) for thread %d on interface %s\n",
 	  thread_stor->ring_params.tp_block_size * thread_stor->ring_params.tp_block_nr,
-	  thread_stor->ring_params.tp_block_nr, thread_stor->ring_params.tp_block_size, thread_stor->tnum);
+	  thread_stor->ring_params.tp_block_nr, thread_stor->ring_params.tp_block_size, thread_stor->tnum, thread_stor->if_name);
   err = setsockopt(sockfd, SOL_PACKET, PACKET_RX_RING, (void*)&(thread_stor->ring_params), sizeof(thread_stor->ring_params));
   if (err == -1) {
     perror("could not enable RX_RING for AF_PACKET socket");
@@ -576,7 +718,7 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
    * the kernel
    */
   uint32_t thread_block_count = thread_stor->ring_params.tp_block_nr;
-  af_packet_stats(sockfd, NULL); // Discard bogus stats
+  af_packet_stats(sockfd, NULL, NULL); // Discard bogus stats
   for (unsigned int b = 0; b < thread_block_count; b++) {
     if ((block_header[b]->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
       continue;
@@ -585,7 +727,7 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
       block_header[b]->hdr.bh1.block_status = TP_STATUS_KERNEL;
     }
   }
-  af_packet_stats(sockfd, NULL); // Discard bogus stats
+  af_packet_stats(sockfd, NULL, NULL); // Discard bogus stats
 
   fprintf(stderr, "Thread %d with thread id %lu started...\n", thread_stor->tnum, thread_stor->tid);
 
@@ -731,7 +873,7 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor) {
       bstreak++; /* We've gotten another block */
 
       /* We found data, process it! */
-      process_all_packets_in_block(block_header[cb], statst, pkt_processor);
+      process_all_packets_in_block(block_header[cb], statst, thread_stor->ifstats, pkt_processor);
 
       /* Reset our accounting */
       pstreak = 0; /* Reset the poll streak tracking */
@@ -768,6 +910,20 @@ void *packet_capture_thread_func(void *arg)  {
   return NULL;
 }
 
+int capture_interface_count(const char *interface_list) {
+  int count = 0;
+  char *if_list = strdup(interface_list);
+  if (if_list == NULL) {
+    return 0;
+  }
+  char *saveptr = NULL;
+  for (char *name = strtok_r(if_list, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+    count++;
+  }
+  free(if_list);
+  return count;
+}
+
 enum status bind_and_dispatch(struct mercury_config *cfg,
 			      struct output_file *out_ctx) {
   /* initialize the ring limits from the configuration */
@@ -776,7 +932,32 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
 
   int err;
   int num_threads = cfg->num_threads;
-  int fanout_arg = ((getpid() & 0xffff) | (rl.af_fanout_type << 16));
+
+  /*
+   * the capture interface can be a comma-separated list of interfaces;
+   * the threads are divided into a group for each interface, and each
+   * group has its own fanout, since a fanout group cannot span devices
+   */
+  int num_interfaces = capture_interface_count(cfg->capture_interface);
+  if (num_interfaces == 0) {
+    fprintf(stderr, "error: no capture interface specified\n");
+    return status_err;
+  }
+  if (num_threads < num_interfaces) {
+    fprintf(stderr, "error: %d thread(s) cannot capture from %d interfaces\n", num_threads, num_interfaces);
+    return status_err;
+  }
+  char *if_list = strdup(cfg->capture_interface);
+  struct interface_stats *ifstats = (struct interface_stats *)calloc(num_interfaces, sizeof(struct interface_stats));
+  if (if_list == NULL || ifstats == NULL) {
+    fprintf(stderr, "error: could not allocate memory for interface list\n");
+    return status_err;
+  }
+  char *saveptr = NULL;
+  int if_num = 0;
+  for (char *name = strtok_r(if_list, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+    ifstats[if_num++].if_name = name;
+  }
 
   /* We need all our threads to get a clean start at the same time or
    * else some threads will start working before other threads are ready
@@ -792,10 +973,13 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
   struct stats_tracking statst;
   memset(&statst, 0, sizeof(statst));
   statst.num_threads = num_threads;
+  statst.ifstats = ifstats;
+  statst.num_interfaces = num_interfaces;
   statst.t_start_p = &t_start_p;
   statst.t_start_c = &t_start_c;
   statst.t_start_m = &t_start_m;
   statst.verbosity = cfg->verbosity;
+  statst.out_ctx = out_ctx;
 
   struct thread_storage *tstor;  // Holds the array of struct thread_storage, one for each thread
   tstor = (struct thread_storage *)malloc(num_threads * sizeof(struct thread_storage));
@@ -851,11 +1035,15 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
   
   /* Get all the thread storage ready and allocate the sockets */
   for (int thread = 0; thread < num_threads; thread++) {
+    int if_idx = (int)((int64_t)thread * num_interfaces / num_threads);  /* this thread's interface group */
+    int fanout_arg = (((getpid() + if_idx) & 0xffff) | (rl.af_fanout_type << 16));
+
     /* Init the thread storage for this thread */
       tstor[thread].tnum = thread;
       tstor[thread].tid = 0;
       tstor[thread].sockfd = -1;
-      tstor[thread].if_name = cfg->capture_interface;
+      tstor[thread].if_name = ifstats[if_idx].if_name;
+      tstor[thread].ifstats = &ifstats[if_idx];
       tstor[thread].statst = &statst;
       tstor[thread].t_start_p = &t_start_p;
       tstor[thread].t_start_c = &t_start_c;
@@ -883,7 +1071,8 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
     tstor[thread].tnum = thread;
     tstor[thread].tid = 0;
     tstor[thread].sockfd = -1;
-    tstor[thread].if_name = cfg->capture_interface;
+    tstor[thread].if_name = ifstats[if_idx].if_name;
+    tstor[thread].ifstats = &ifstats[if_idx];
     tstor[thread].statst = &statst;
     tstor[thread].t_start_p = &t_start_p;
     tstor[thread].t_start_c = &t_start_c;
@@ -919,7 +1108,10 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
    */
   for (int thread = 0; thread < num_threads; thread++) {
 
-      tstor[thread].pkt_processor = pkt_proc_new_from_config(cfg, thread, &out_ctx->qs.queue[thread]);
+      /* with more than one interface, output is tagged with the ingress interface */
+      const char *ingress_interface = num_interfaces > 1 ? tstor[thread].if_name : NULL;
+      struct ll_queue *pcap_llq = out_ctx->pcap_output ? &out_ctx->pcap_output->qs.queue[thread] : NULL;
+      tstor[thread].pkt_processor = pkt_proc_new_from_config(cfg, thread, &out_ctx->qs.queue[thread], ingress_interface, pcap_llq);
       if (tstor[thread].pkt_processor == NULL) {
           printf("error: could not initialize frame handler\n");
           return status_err;
@@ -949,8 +1141,7 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
   }
 
   /* Wake up output thread so it's polling the queues waiting for data */
-  out_ctx->t_output_p = 1;
-  err = pthread_cond_broadcast(&(out_ctx->t_output_c)); /* Wake up output */
+  err = output_thread_start(out_ctx);
   if (err != 0) {
       printf("%s: error broadcasting all clear on output start condition\n", strerror(err));
       exit(255);
@@ -994,6 +1185,25 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
 	  "%" PRIu64 " packets dropped\n"
 	  "%" PRIu64 " socket queue freezes\n",
 	  statst.received_packets, statst.received_bytes, statst.socket_packets, statst.socket_drops, statst.socket_freezes);
+  if (num_interfaces > 1) {
+    for (int i = 0; i < num_interfaces; i++) {
+      fprintf(stderr, "%s: %" PRIu64 " packets captured, %" PRIu64 " bytes captured, %" PRIu64 " packets seen by socket, "
+              "%" PRIu64 " packets dropped, %" PRIu64 " socket queue freezes\n",
+              ifstats[i].if_name, ifstats[i].received_packets, ifstats[i].received_bytes,
+              ifstats[i].socket_packets, ifstats[i].socket_drops, ifstats[i].socket_freezes);
+    }
+  }
+  if (statst.received_packets) {
+    /* the output thread is still running, so only the worker latencies are complete */
+    struct latency_snapshot *latency = (struct latency_snapshot *)calloc(1, sizeof(struct latency_snapshot));
+    if (latency != NULL) {
+      latency_snapshot_get(latency, NULL);
+      fprint_latency_snapshot(stderr, "latency", latency, false);
+      free(latency);
+    }
+  }
+  free(ifstats);
+  free(if_list);
 
   return status_ok;
 }
@@ -11,6 +11,12 @@
 #include "mercury.h"
 #include "output.h"
 
+/*
+ * capture_interface_count(list) returns the number of interface
+ * names in the comma-separated list
+ */
+int capture_interface_count(const char *interface_list);
+
 enum status bind_and_dispatch(struct mercury_config *cfg,
 			      struct output_file *out_ctx);
 
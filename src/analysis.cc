@@ -10,9 +10,9 @@
 #include <pthread.h>
 #include <iostream>
 #include <fstream>
-#include <sstream>
 #include <math.h>
 #include <unordered_map>
+#include <map>
 #include <zlib.h>
 #include <vector>
 #include <algorithm>
@@ -20,12 +20,11 @@
 #include "analysis.h"
 #include "utils.h"
 #include "tls.h"
+#include "public_suffix.h"
 
 #include "rapidjson/document.h"
 #include "rapidjson/stringbuffer.h"
 
-rapidjson::Document fp_db;
-
 #define MAX_FP_STR_LEN 4096
 #define MAX_SNI_LEN     257
 
@@ -41,8 +40,131 @@ std::unordered_map<uint16_t, std::string> port_mapping = {{443, "https"},  {448,
                                                           {9000,"tor"},    {9001,"tor"},     {9002,"tor"},
                                                           {9101,"tor"}};
 
-bool MALWARE_DB = true;
-bool EXTENDED_FP_METADATA = true;
+/*
+ * The destination features used in analysis are mapped to small
+ * integer equivalence class IDs when the fingerprint database is
+ * loaded: a class is a destination ASN, domain, port application,
+ * address, or server name that appears in the database, so each of
+ * the features of a flow is looked up once, in a hash table (or, for
+ * the port, an array), and not once per process.  The order of the
+ * features is the order in which perform_analysis() adds their
+ * scores.
+ */
+enum analysis_feature {
+    feature_asn      = 0,
+    feature_domain   = 1,
+    feature_port_app = 2,
+    feature_ip       = 3,   /* extended metadata only */
+    feature_sni      = 4,   /* extended metadata only */
+    num_features     = 5
+};
+
+static const char *feature_name[num_features] = {
+    "classes_ip_as",
+    "classes_hostname_domains",
+    "classes_port_applications",
+    "classes_ip_ip",
+    "classes_hostname_sni"
+};
+
+static const long double feature_weight[num_features] = {
+    0.13924,
+    0.15590,
+    0.00528,
+    0.56735,
+    0.96941
+};
+
+#define NO_CLASS UINT32_MAX
+
+/*
+ * struct class_table maps the values of a feature to class IDs,
+ * which are assigned in the order in which the values are added
+ */
+template <typename T>
+struct class_table {
+    std::unordered_map<T, uint32_t> ids;
+
+    uint32_t add(const T &value) {
+        uint32_t next_id = ids.size();
+        return ids.emplace(value, next_id).first->second;
+    }
+
+    uint32_t find(const T &value) const {
+        auto it = ids.find(value);
+        if (it == ids.end()) {
+            return NO_CLASS;
+        }
+        return it->second;
+    }
+};
+
+/*
+ * struct feature_scores holds the terms that a feature adds to the
+ * (log) score of each process of a fingerprint, which are constants
+ * of the database: for a class seen with process i, the weighted
+ * log-probability weight*log(count/total_count), and otherwise the
+ * weighted base prior of process i.  The terms are stored by class,
+ * then by process, so that the terms of a class are contiguous:
+ * classes is the sorted list of the classes seen with the
+ * fingerprint, the terms of the class classes[j] for the processes 0,
+ * 1, ..., num_procs-1 are terms[j*num_procs + 0, 1, ...], and the
+ * terms for a class not in classes are miss[0, 1, ...].
+ */
+struct feature_scores {
+    std::vector<uint32_t> classes;
+    std::vector<double> terms;
+    std::vector<double> miss;
+
+    /*
+     * find(c, num_procs) returns the terms of class c, indexed by
+     * process
+     */
+    const double *find(uint32_t c, size_t num_procs) const {
+        auto it = std::lower_bound(classes.begin(), classes.end(), c);
+        if (it == classes.end() || *it != c) {
+            return miss.data();
+        }
+        return &terms[(it - classes.begin()) * num_procs];
+    }
+};
+
+struct process_info {
+    std::string name;
+    bool malware;
+};
+
+/*
+ * struct fingerprint_info holds the processes of a fingerprint, and
+ * their scores, in structure-of-arrays form: the score of process i
+ * for a flow is the exponential of base_score[i] plus the term of
+ * each feature of the flow for process i
+ */
+struct fingerprint_info {
+    std::vector<struct process_info> procs;
+    std::vector<double> base_score;     /* log of P(process|fingerprint), at least log(.1) */
+    struct feature_scores features[num_features];
+};
+
+/*
+ * struct analysis_resources holds the fingerprint database, with its
+ * feature classes, and the subnet database used by perform_analysis();
+ * it is not changed after analysis_resources_init() returns, so that
+ * it can be shared by any number of threads
+ */
+struct analysis_resources {
+    std::unordered_map<std::string, struct fingerprint_info> fp_db;
+    bool malware_db = true;            /* process_info includes "malware" */
+    bool extended_fp_metadata = true;  /* process_info includes classes_hostname_sni, classes_ip_ip */
+    struct subnet_db *subnets = NULL;
+    class_table<uint32_t> asn_classes;
+    class_table<std::string> string_classes[num_features];  /* all other features */
+    std::vector<uint32_t> port_app_class;                    /* class of each port */
+    public_suffix_list public_suffixes;  /* empty if the domain classes are last two labels */
+};
+
+std::string get_port_app(uint16_t dst_port);
+struct datum get_domain_name(const struct analysis_resources &r, const char *server_name);
 
 
 int gzgetline(gzFile f, std::vector<char>& v) {
@@ -66,9 +188,99 @@ int gzgetline(gzFile f, std::vector<char>& v) {
 }
 
 
-int database_init(const char *resource_file) {
-    fp_db.SetObject();
-    rapidjson::Document::AllocatorType& allocator = fp_db.GetAllocator();
+/*
+ * add_feature_class(r, f, value) returns the class ID of the value
+ * (a key of one of the classes_* objects in the fingerprint database)
+ * of feature f, adding it if need be, or NO_CLASS if the value can
+ * never match a destination
+ */
+static uint32_t add_feature_class(struct analysis_resources *r, enum analysis_feature f, const char *value) {
+    if (f == feature_asn) {
+        uint32_t asn = strtoul(value, NULL, 10);
+        if (std::to_string(asn) != value) {
+            return NO_CLASS;  /* not in the form written by perform_analysis() */
+        }
+        return r->asn_classes.add(asn);
+    }
+    return r->string_classes[f].add(value);
+}
+
+/*
+ * fingerprint_info_init(r, info, fp) sets info from the fingerprint
+ * database entry fp, precomputing the base score of each process and
+ * converting the feature counts of each process into the terms of
+ * info.features.  The logarithms are computed in long double
+ * precision, then stored as doubles.
+ */
+static void fingerprint_info_init(struct analysis_resources *r,
+                                  struct fingerprint_info &info,
+                                  const rapidjson::Value &fp) {
+    uint32_t fp_tc = fp["total_count"].GetUint();
+    long double proc_prior = log(.1);
+
+    const rapidjson::Value &procs = fp["process_info"];
+    size_t num_procs = procs.Size();
+    info.procs.resize(num_procs);
+    info.base_score.resize(num_procs);
+    std::vector<long double> base_prior(num_procs);
+    for (rapidjson::SizeType i = 0; i < num_procs; i++) {
+        struct process_info &p = info.procs[i];
+        p.name = procs[i]["process"].GetString();
+        rapidjson::Value::ConstMemberIterator itr = procs[i].FindMember("malware");
+        p.malware = (itr != procs[i].MemberEnd()) && itr->value.GetBool();
+
+        uint32_t p_count = procs[i]["count"].GetUint();
+        long double prob_process_given_fp = (long double)p_count/fp_tc;
+        info.base_score[i] = fmax(log(prob_process_given_fp), proc_prior);
+
+        base_prior[i] = log(1.0/fp_tc);
+        itr = procs[i].FindMember("domain_mean");
+        if ((itr != procs[i].MemberEnd()) && (itr->value.GetFloat() < 0.5)) {
+            base_prior[i] = log(.1/fp_tc);
+        }
+    }
+
+    for (int f = 0; f < num_features; f++) {
+        std::map<uint32_t, std::vector<uint32_t>> columns;  /* counts by class, then by process */
+        for (rapidjson::SizeType i = 0; i < num_procs; i++) {
+            rapidjson::Value::ConstMemberIterator itr = procs[i].FindMember(feature_name[f]);
+            if (itr == procs[i].MemberEnd() || !itr->value.IsObject()) {
+                continue;
+            }
+            for (rapidjson::Value::ConstMemberIterator m = itr->value.MemberBegin(); m != itr->value.MemberEnd(); ++m) {
+                uint32_t c = add_feature_class(r, (enum analysis_feature)f, m->name.GetString());
+                if (c == NO_CLASS) {
+                    continue;
+                }
+                std::vector<uint32_t> &column = columns[c];
+                if (column.empty()) {
+                    column.resize(num_procs, 0);
+                }
+                column[i] = m->value.GetUint();
+            }
+        }
+        struct feature_scores &fs = info.features[f];
+        fs.miss.resize(num_procs);
+        for (size_t i = 0; i < num_procs; i++) {
+            fs.miss[i] = base_prior[i]*feature_weight[f];
+        }
+        fs.classes.reserve(columns.size());
+        fs.terms.reserve(columns.size() * num_procs);
+        for (const auto &column : columns) {
+            fs.classes.push_back(column.first);
+            for (size_t i = 0; i < num_procs; i++) {
+                uint32_t count = column.second[i];
+                if (count != 0) {
+                    fs.terms.push_back(log((long double)count/fp_tc)*feature_weight[f]);
+                } else {
+                    fs.terms.push_back(fs.miss[i]);
+                }
+            }
+        }
+    }
+}
+
+int database_init(struct analysis_resources *r, const char *resource_file) {
 
     gzFile in_file = gzopen(resource_file, "r");
     if (in_file == NULL) {
@@ -77,36 +289,57 @@ int database_init(const char *resource_file) {
     std::vector<char> line;
     while (gzgetline(in_file, line)) {
         std::string line_str(line.begin(), line.end());
-        rapidjson::Document fp(&allocator);
+        rapidjson::Document fp;
         fp.Parse(line_str.c_str());
 
         rapidjson::Value::ConstMemberIterator itr = fp["process_info"][0].FindMember("malware");
         if (itr == fp["process_info"][0].MemberEnd()) {
-            MALWARE_DB = false;
+            r->malware_db = false;
         }
 
         itr = fp["process_info"][0].FindMember("classes_hostname_sni");
         if (itr == fp["process_info"][0].MemberEnd()) {
-            EXTENDED_FP_METADATA = false;
+            r->extended_fp_metadata = false;
         }
 
-        fp_db.AddMember(fp["str_repr"], fp, allocator);
+        auto entry = r->fp_db.emplace(fp["str_repr"].GetString(), fingerprint_info{});
+        if (entry.second) {
+            fingerprint_info_init(r, entry.first->second, fp);
+        }
     }
     gzclose(in_file);
 
+    // precompute the port application class of each port
+    r->port_app_class.resize(65536);
+    for (unsigned int port = 0; port < 65536; port++) {
+        r->port_app_class[port] = r->string_classes[feature_port_app].find(get_port_app(port));
+    }
+
     return 0;  /* success */
 }
 
-void database_finalize() {
-    fp_db.SetObject();
-}
 
 
+/*
+ * database_has_registered_domains(r) returns true if the domain
+ * classes of the fingerprint database are registered domains, found
+ * with the public suffix list, rather than the last two labels of
+ * each server name; only the former have more than two labels
+ */
+static bool database_has_registered_domains(const struct analysis_resources *r) {
+    for (const auto &domain : r->string_classes[feature_domain].ids) {
+        if (std::count(domain.first.begin(), domain.first.end(), '.') > 1) {
+            return true;
+        }
+    }
+    return false;
+}
+
 #ifndef DEFAULT_RESOURCE_DIR
 #define DEFAULT_RESOURCE_DIR "/usr/local/share/mercury"
 #endif
 
-int analysis_init(int verbosity, const char *resource_dir) {
+struct analysis_resources *analysis_resources_init(int verbosity, const char *resource_dir) {
 
 //    if (pthread_mutex_init(&lock_fp_cache, NULL) != 0) {
 //       printf("\n mutex init has failed\n");
@@ -132,19 +365,28 @@ int analysis_init(int verbosity, const char *resource_dir) {
     while (resource_dir_list[index] != NULL) {
         strncpy(resource_file_name, resource_dir_list[index], PATH_MAX-1);
         strncat(resource_file_name, "/pyasn.db", PATH_MAX-1);
-        int retcode = addr_init(resource_file_name);
+        struct analysis_resources *r = new struct analysis_resources;
+        r->subnets = subnet_db_init(resource_file_name);
 
-        if (retcode == 0) {
+        if (r->subnets != NULL) {
             strncpy(resource_file_name, resource_dir_list[index], PATH_MAX-1);
             strncat(resource_file_name, "/fingerprint_db.json.gz", PATH_MAX-1);
-            retcode = database_init(resource_file_name);
+            int retcode = database_init(r, resource_file_name);
             if (retcode == 0) {
+                if (database_has_registered_domains(r)) {
+                    strncpy(resource_file_name, resource_dir_list[index], PATH_MAX-1);
+                    strncat(resource_file_name, "/public_suffix_list.dat.gz", PATH_MAX-1);
+                    if (!r->public_suffixes.load(resource_file_name)) {
+                        fprintf(stderr, "warning: could not open file '%s'; using the last two labels of server names as their domains\n", resource_file_name);
+                    }
+                }
                 if (verbosity > 0) {
                     fprintf(stderr, "initialized analysis module with resource directory %s\n", resource_dir_list[index]);
                 }
-                return 0;
+                return r;
             }
         }
+        analysis_resources_finalize(r);
         if (verbosity > 0) {
             fprintf(stderr, "warning: could not open file '%s'\n", resource_file_name);
             fprintf(stderr, "warning: could not initialize analysis module with resource directory '%s', trying next in list\n", resource_dir_list[index]);
@@ -153,17 +395,16 @@ int analysis_init(int verbosity, const char *resource_dir) {
         index++;  /* try next directory in the list */
     }
     fprintf(stderr, "warning: could not initialize analysis module\n");
-    return -1;
+    return NULL;
 }
 
 
-int analysis_finalize() {
-
-    addr_finalize();
-    database_finalize();
-//    cache_finalize();
-
-    return 1;
+void analysis_resources_finalize(struct analysis_resources *r) {
+    if (r == NULL) {
+        return;
+    }
+    subnet_db_finalize(r->subnets);
+    delete r;
 }
 
 #define SNI_HEADER_LEN 9
@@ -234,29 +475,12 @@ std::string get_port_app(uint16_t dst_port) {
     return "unknown";
 }
 
-std::string get_domain_name(char* server_name) {
-    std::string r_server_name(server_name);
-    std::reverse(r_server_name.begin(), r_server_name.end());
-
-    size_t pos = 0;
-    uint8_t n = 2;
-    std::string token;
-    std::string out_domain;
-    std::stringstream domain;
-    while (((pos = r_server_name.find(".")) != std::string::npos) && (n > 0)) {
-        token = r_server_name.substr(0, pos);
-        domain << token;
-        if (n > 1) {
-            domain << ".";
-        }
-        r_server_name.erase(0, pos + 1);
-        n -= 1;
-    }
-
-    out_domain = domain.str();
-    std::reverse(out_domain.begin(), out_domain.end());
-
-    return out_domain;
+/*
+ * get_domain_name(r, server_name) returns the domain of server_name
+ * that is used as its class, as a datum that points into server_name
+ */
+struct datum get_domain_name(const struct analysis_resources &r, const char *server_name) {
+    return r.public_suffixes.registered_domain(server_name, strlen(server_name));
 }
 
 // #include <iostream> // for debugging
@@ -267,125 +491,99 @@ std::string get_domain_name(char* server_name) {
 // fp_db.Accept(writer);
 // std::cerr << buffer.GetString() << std::endl;
 
-int perform_analysis(char **result, size_t max_bytes, char *fp_str, char *server_name, char *dst_ip, uint16_t dst_port) {
-    rapidjson::Value::ConstMemberIterator matcher = fp_db.FindMember(fp_str);
-    if (matcher == fp_db.MemberEnd()) {
+bool perform_analysis(const struct analysis_resources &r,
+                      struct analysis_result &result,
+                      const char *fp_str,
+                      const char *server_name,
+                      const char *dst_ip,
+                      uint16_t dst_port) {
+    auto matcher = r.fp_db.find(fp_str);
+    if (matcher == r.fp_db.end()) {
 
-        return -1;
+        return false;
+    }
+    const struct fingerprint_info &fp = matcher->second;
+    size_t num_procs = fp.procs.size();
+
+    // map the destination to its feature classes, then find the
+    // score terms of those classes for the processes of this fingerprint
+    uint32_t feature_class[num_features];
+    uint32_t asn_int = subnet_db_get_asn(r.subnets, dst_ip);
+    feature_class[feature_asn] = r.asn_classes.find(asn_int);
+    static thread_local std::string domain;
+    struct datum domain_name = get_domain_name(r, server_name);
+    domain.assign((const char *)domain_name.data, domain_name.length());
+    feature_class[feature_domain] = r.string_classes[feature_domain].find(domain);
+    feature_class[feature_port_app] = r.port_app_class[dst_port];
+    if (r.extended_fp_metadata) {
+        feature_class[feature_ip] = r.string_classes[feature_ip].find(dst_ip);
+        feature_class[feature_sni] = r.string_classes[feature_sni].find(server_name);
+    }
+    const double *terms[num_features];
+    for (unsigned int f = 0; f < (r.extended_fp_metadata ? num_features : feature_ip); f++) {
+        terms[f] = fp.features[f].find(feature_class[f], num_procs);
     }
-    rapidjson::Value& fp = fp_db[fp_str];
-
-    uint32_t asn_int = get_asn_info(dst_ip);
-    std::string asn = std::to_string(asn_int);
-    std::string port_app = get_port_app(dst_port);
-    std::string domain = get_domain_name(server_name);
-    std::string server_name_str(server_name);
-    std::string dst_ip_str(dst_ip);
-
-    uint32_t fp_tc, p_count, tmp_value;
-    long double prob_process_given_fp, score;
-    long double max_score = -1.0;
-    long double sec_score = -1.0;
-    long double score_sum = 0.0;
-    long double malware_prob = 0.0;
-    rapidjson::Value equiv_class;
-    std::string max_proc, sec_proc;
-    bool max_mal = false;
-    bool sec_mal = false;
-
-    rapidjson::Value proc;
-    fp_tc = fp["total_count"].GetInt();
-
-    long double base_prior;
-    long double proc_prior = log(.1);
-    rapidjson::Value::ConstMemberIterator itr;
-
-    const rapidjson::Value& procs = fp["process_info"];
-    for (rapidjson::SizeType i = 0; i < procs.Size(); i++) {
-        p_count = procs[i]["count"].GetInt();
-        prob_process_given_fp = (long double)p_count/fp_tc;
-
-        base_prior = log(1.0/fp_tc);
-        itr = procs[i].FindMember("domain_mean");
-        if ((itr != procs[i].MemberEnd()) && (procs[i]["domain_mean"].GetFloat() < 0.5)) {
-            base_prior = log(.1/fp_tc);
-        }
-
-        score = log(prob_process_given_fp);
-        score = fmax(score, proc_prior);
-
-        itr = procs[i]["classes_ip_as"].FindMember(asn.c_str());
-        if (itr != procs[i]["classes_ip_as"].MemberEnd()) {
-            tmp_value = procs[i]["classes_ip_as"][asn.c_str()].GetInt();
-            score += log((long double)tmp_value/fp_tc)*0.13924;
-        } else {
-            score += base_prior*0.13924;
-        }
-
-        itr = procs[i]["classes_hostname_domains"].FindMember(domain.c_str());
-        if (itr != procs[i]["classes_hostname_domains"].MemberEnd()) {
-            tmp_value = procs[i]["classes_hostname_domains"][domain.c_str()].GetInt();
-            score += log((long double)tmp_value/fp_tc)*0.15590;
-        } else {
-            score += base_prior*0.15590;
-        }
 
-        itr = procs[i]["classes_port_applications"].FindMember(port_app.c_str());
-        if (itr != procs[i]["classes_port_applications"].MemberEnd()) {
-            tmp_value = procs[i]["classes_port_applications"][port_app.c_str()].GetInt();
-            score += log((long double)tmp_value/fp_tc)*0.00528;
-        } else {
-            score += base_prior*0.00528;
+    // sum the terms of all of the processes at once, in a loop that
+    // the compiler vectorizes
+    static thread_local std::vector<double> scores;
+    scores.resize(num_procs);
+    double *score = scores.data();
+    const double *base = fp.base_score.data();
+    const double *t0 = terms[feature_asn];
+    const double *t1 = terms[feature_domain];
+    const double *t2 = terms[feature_port_app];
+    for (size_t i = 0; i < num_procs; i++) {
+        score[i] = base[i] + t0[i] + t1[i] + t2[i];
+    }
+    if (r.extended_fp_metadata) {
+        const double *t3 = terms[feature_ip];
+        const double *t4 = terms[feature_sni];
+        for (size_t i = 0; i < num_procs; i++) {
+            score[i] = score[i] + t3[i] + t4[i];
         }
+    }
 
-        if (EXTENDED_FP_METADATA) {
-            itr = procs[i]["classes_ip_ip"].FindMember(dst_ip_str.c_str());
-            if (itr != procs[i]["classes_ip_ip"].MemberEnd()) {
-                tmp_value = procs[i]["classes_ip_ip"][dst_ip_str.c_str()].GetInt();
-                score += log((long double)tmp_value/fp_tc)*0.56735;
-            } else {
-                score += base_prior*0.56735;
-            }
-
-            itr = procs[i]["classes_hostname_sni"].FindMember(server_name_str.c_str());
-            if (itr != procs[i]["classes_hostname_sni"].MemberEnd()) {
-                tmp_value = procs[i]["classes_hostname_sni"][server_name_str.c_str()].GetInt();
-                score += log((long double)tmp_value/fp_tc)*0.96941;
-            } else {
-                score += base_prior*0.96941;
-            }
-        }
+    double max_score = -1.0;
+    double sec_score = -1.0;
+    double score_sum = 0.0;
+    double malware_prob = 0.0;
+    const struct process_info *max_proc = NULL;
+    const struct process_info *sec_proc = NULL;
+    bool max_mal = false;
+    bool sec_mal = false;
 
-        score = exp(score);
-        score_sum += score;
+    for (size_t i = 0; i < num_procs; i++) {
+        const struct process_info &proc = fp.procs[i];
+        double p_score = exp(score[i]);
+        score_sum += p_score;
 
-        if (MALWARE_DB) {
-            if (procs[i]["malware"].GetBool() == true && score > 0.0) {
-                malware_prob += score;
+        if (r.malware_db) {
+            if (proc.malware == true && p_score > 0.0) {
+                malware_prob += p_score;
             }
 
-            if (score > max_score) {
+            if (p_score > max_score) {
                 sec_score = max_score;
                 sec_proc = max_proc;
                 sec_mal = max_mal;
-                max_score = score;
-                max_proc = procs[i]["process"].GetString();
-                max_mal = procs[i]["malware"].GetBool();
-            } else if (score > sec_score) {
-                sec_score = score;
-                sec_proc = procs[i]["process"].GetString();
-                sec_mal = procs[i]["malware"].GetBool();
+                max_score = p_score;
+                max_proc = &proc;
+                max_mal = proc.malware;
+            } else if (p_score > sec_score) {
+                sec_score = p_score;
+                sec_proc = &proc;
+                sec_mal = proc.malware;
             }
         } else {
-            if (score > max_score) {
-                max_score = score;
-                max_proc = procs[i]["process"].GetString();
+            if (p_score > max_score) {
+                max_score = p_score;
+                max_proc = &proc;
             }
         }
-
     }
 
-    if (MALWARE_DB && max_proc == "Generic DMZ Traffic" && sec_mal == false) {
+    if (r.malware_db && max_proc != NULL && max_proc->name == "Generic DMZ Traffic" && sec_mal == false) {
         max_proc = sec_proc;
         max_score = sec_score;
         max_mal = sec_mal;
@@ -393,27 +591,26 @@ int perform_analysis(char **result, size_t max_bytes, char *fp_str, char *server
 
     if (score_sum > 0.0) {
         max_score /= score_sum;
-        if (MALWARE_DB) {
+        if (r.malware_db) {
             malware_prob /= score_sum;
         }
     }
 
-    *result = (char*)calloc(max_bytes, sizeof(char));
-    if (MALWARE_DB) {
-        snprintf(*result, max_bytes, "\"analysis\":{\"process\":\"%s\",\"score\":%Lf,\"malware\":%d,\"p_malware\":%Lf}", max_proc.c_str(), max_score, max_mal, malware_prob);
-    } else {
-        snprintf(*result, max_bytes, "\"analysis\":{\"process\":\"%s\",\"score\":%Lf}", max_proc.c_str(), max_score);
-    }
+    const char *max_proc_name = max_proc ? max_proc->name.c_str() : "";
+    strncpy(result.process, max_proc_name, sizeof(result.process) - 1);
+    result.process[sizeof(result.process) - 1] = '\0';
+    result.score = max_score;
+    result.malware_info = r.malware_db;
+    result.malware = max_mal;
+    result.p_malware = malware_prob;
 
-    return 0;
+    return true;
 }
 
-void write_analysis_from_extractor_and_flow_key(struct buffer_stream &buf,
-                                                const struct tls_client_hello &hello,
-                                                const struct key &key) {
-    char* results;
-
-    int ret_value;
+bool analysis_from_extractor_and_flow_key(const struct analysis_resources &r,
+                                          struct analysis_result &result,
+                                          const struct tls_client_hello &hello,
+                                          const struct key &key) {
     uint16_t dst_port = flow_key_get_dst_port(key);
     char dst_ip_str[MAX_DST_ADDR_LEN];
     flow_key_sprintf_dst_addr(key, dst_ip_str);
@@ -431,16 +628,28 @@ void write_analysis_from_extractor_and_flow_key(struct buffer_stream &buf,
     sn.strncpy(sn_str, MAX_SNI_LEN);
     // fprintf(stderr, "server_name: '%.*s'\tcopy: '%s'\n", (int)sn.length(), sn.data, sn_str);
 
-    ret_value = perform_analysis(&results, MAX_FP_STR_LEN, fp_str, sn_str, dst_ip_str, dst_port);
-    if (ret_value == -1) {
-        return;
+    return perform_analysis(r, result, fp_str, sn_str, dst_ip_str, dst_port);
+}
+
+bool write_analysis_from_extractor_and_flow_key(struct buffer_stream &buf,
+                                                const struct analysis_resources &r,
+                                                const struct tls_client_hello &hello,
+                                                const struct key &key) {
+    struct analysis_result result;
+    if (!analysis_from_extractor_and_flow_key(r, result, hello, key)) {
+        return false;
+    }
+
+    char results[MAX_FP_STR_LEN];
+    if (result.malware_info) {
+        snprintf(results, sizeof(results), "\"analysis\":{\"process\":\"%s\",\"score\":%Lf,\"malware\":%d,\"p_malware\":%Lf}", result.process, result.score, result.malware, result.p_malware);
+    } else {
+        snprintf(results, sizeof(results), "\"analysis\":{\"process\":\"%s\",\"score\":%Lf}", result.process, result.score);
     }
     // fprintf(stderr, "analysis: %s\n", results);
 
     buf.write_char(',');
     buf.strncpy(results);
 
-    free(results);
-
+    return true;
 }
-
@@ -14,11 +14,73 @@
 #include "addr.h"
 #include "buffer_stream.h"
 
-int analysis_init(int verbosity, const char *resource_dir);
+/*
+ * struct analysis_resources (defined in analysis.cc) holds the
+ * fingerprint and subnet databases; it is immutable once initialized,
+ * and can be shared between threads
+ */
+struct analysis_resources;
+
+/*
+ * analysis_resources_init(verbosity, resource_dir) returns a new
+ * analysis_resources object initialized from the files in
+ * resource_dir, or (if resource_dir is NULL) in the first of the
+ * default resource directories that holds them, or NULL on failure
+ */
+struct analysis_resources *analysis_resources_init(int verbosity, const char *resource_dir);
 
-int analysis_finalize();
+void analysis_resources_finalize(struct analysis_resources *r);
+
+#define MAX_PROCESS_NAME_LEN 256
+
+/*
+ * struct analysis_result holds the most probable process for a
+ * fingerprint and destination, and its score; malware and p_malware
+ * are set only if malware_info is true, which happens when the
+ * fingerprint database has malware labels
+ */
+struct analysis_result {
+    char process[MAX_PROCESS_NAME_LEN];
+    long double score;
+    bool malware_info;
+    bool malware;
+    long double p_malware;
+};
 
-void write_analysis_from_extractor_and_flow_key(struct buffer_stream &buf,
+/*
+ * perform_analysis(r, result, fp_str, server_name, dst_ip, dst_port)
+ * sets result to the analysis of the fingerprint fp_str (in the form
+ * of the str_repr of the fingerprint database) for a flow to the
+ * destination address dst_ip (as a printable string), server name,
+ * and port; it returns true if the fingerprint is in the database,
+ * and false (leaving result unchanged) otherwise
+ */
+bool perform_analysis(const struct analysis_resources &r,
+                      struct analysis_result &result,
+                      const char *fp_str,
+                      const char *server_name,
+                      const char *dst_ip,
+                      uint16_t dst_port);
+
+/*
+ * analysis_from_extractor_and_flow_key(r, result, hello, key) sets
+ * result to the analysis of the fingerprint of hello and the
+ * destination in key; it returns true if the fingerprint is in the
+ * database, and false (leaving result unchanged) otherwise
+ */
+bool analysis_from_extractor_and_flow_key(const struct analysis_resources &r,
+                                          struct analysis_result &result,
+                                          const struct tls_client_hello &hello,
+                                          const struct key &key);
+
+/*
+ * write_analysis_from_extractor_and_flow_key(buf, r, hello, key)
+ * writes the analysis of the fingerprint of hello, and of the
+ * destination in key, into buf; it returns true if the fingerprint is
+ * in the database, and false (writing nothing) otherwise
+ */
+bool write_analysis_from_extractor_and_flow_key(struct buffer_stream &buf,
+                                                const struct analysis_resources &r,
                                                 const struct tls_client_hello &hello,
                                                 const struct key &key);
 
@@ -1,67 +1,497 @@
 /*
  * batch-gcd.cc
+ *
+ * find RSA moduli that share a prime factor, using the batch GCD
+ * algorithm (Bernstein; Heninger et al., "Mining Your Ps and Qs")
+ *
+ * For moduli N_1, ..., N_n, the product tree is built bottom up,
+ * with the moduli at the leaves and the product P of all of them at
+ * the root.  The remainder tree is then built top down, by reducing
+ * each parent remainder modulo the square of each child, so that the
+ * leaves hold z_i = P mod N_i^2.  Each modulus N_i shares a factor
+ * with another modulus exactly when gcd(z_i / N_i, N_i) != 1.
+ *
+ * Each level of both trees is computed in parallel across a pool of
+ * threads.  With --spill <dir>, the product tree levels are written
+ * to files in <dir> as they are completed, and read back one at a
+ * time while the remainder tree is built, so that only two levels
+ * are held in memory at any time.
  */
 
-
-#include <stdint.h>
-#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <gmpxx.h>
+#include <string>
+#include <vector>
 #include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <algorithm>
 
-int main(int argc, char *argv[]) {
-    using namespace std;
-    list<uint64_t> moduli{ 3*5, 5*7, 7*11, 11*13, 13*17, 17*19, 19*23, 23*29 };
-    // list<uint64_t> *tmp = &moduli;
-    list<list<uint64_t> *> product_tree;
+#include "x509.h"
+#include "base64.h"
+#include "../rapidjson/document.h"
 
-    for (auto it = moduli.begin(); it != moduli.end(); ) {
-        uint64_t y = *it++;
-        uint64_t z = *it++;
-        cout << y << '\t' << z << '\n';
+// a level of a product or remainder tree is a vector of integers;
+// write_level(f, v) writes a level to f in GMP's portable raw format,
+// and read_level(f, v) reads a level written by write_level()
+//
+typedef std::vector<mpz_class> tree_level;
+
+bool write_level(FILE *f, const tree_level &v) {
+    uint64_t n = v.size();
+    if (fwrite(&n, sizeof(n), 1, f) != 1) {
+        return false;
     }
+    for (const auto &x : v) {
+        if (mpz_out_raw(f, x.get_mpz_t()) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    // create product tree
-    list<uint64_t>::iterator product;
-    product_tree.push_back(&moduli);
-    auto last_level = &moduli;
-    while (1) {
-        auto tmp = new list<uint64_t>;
-        product_tree.push_back(tmp);
-        for (auto it = last_level->begin(); it != last_level->end(); ) {
-            auto first = it++;
-            auto second = it++;
-            tmp->push_back(*first * *second);
-        }
-
-        bool first = true;
-        cout << "[";
-        for (auto it = tmp->begin(); it != tmp->end(); ) {
-            if (first) {
-                first = false;
-            } else {
-                cout << ',';
+bool read_level(FILE *f, tree_level &v) {
+    uint64_t n = 0;
+    if (fread(&n, sizeof(n), 1, f) != 1) {
+        return false;
+    }
+    v.resize(n);
+    for (auto &x : v) {
+        if (mpz_inp_raw(x.get_mpz_t(), f) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// parallel_for(n, num_threads, f) calls f(i) for each i in [0, n),
+// dividing the indices into contiguous ranges, one per thread
+//
+template <typename F>
+void parallel_for(size_t n, unsigned int num_threads, F f) {
+    if (num_threads <= 1 || n <= 1) {
+        for (size_t i = 0; i < n; i++) {
+            f(i);
+        }
+        return;
+    }
+    size_t per_thread = (n + num_threads - 1) / num_threads;
+    std::vector<std::thread> threads;
+    for (size_t begin = 0; begin < n; begin += per_thread) {
+        size_t end = std::min(begin + per_thread, n);
+        threads.emplace_back([begin, end, &f]() {
+            for (size_t i = begin; i < end; i++) {
+                f(i);
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
+struct stage_timer {
+    struct timespec start;
+
+    stage_timer() { clock_gettime(CLOCK_MONOTONIC, &start); }
+
+    void report(const char *stage) {
+        struct timespec stop;
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "%-16s %10.3f seconds\n", stage, seconds);
+        start = stop;
+    }
+};
+
+// moduli input
+//
+// moduli can be read as hexadecimal integers (one per line), as
+// base64-encoded DER certificates (one per line), or from mercury
+// JSON output; in the latter two cases, the RSA moduli are extracted
+// from the subjectPublicKeyInfo of each certificate.  Duplicate
+// moduli are discarded, since each one trivially shares both of its
+// factors with its duplicate.  Duplicates are found by the canonical
+// hexadecimal form of each modulus (see canonical_hex() below), so
+// that the same modulus written with a 0x prefix, leading zeros, or
+// upper case digits, or read from a DER integer with its leading zero
+// byte, counts only once.
+
+enum class input_format { hex, base64, json };
+
+// canonical_hex(hex) removes an optional 0x prefix and any leading
+// zeros from hex, and converts its digits to lower case
+//
+void canonical_hex(std::string &hex) {
+    size_t start = 0;
+    if (hex.length() >= 2 && hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X')) {
+        start = 2;
+    }
+    while (start + 1 < hex.length() && hex[start] == '0') {
+        start++;
+    }
+    hex.erase(0, start);
+    for (auto &c : hex) {
+        c = tolower((unsigned char)c);
+    }
+}
+
+struct moduli_reader {
+    std::vector<std::string> moduli;         // hexadecimal
+    std::unordered_set<std::string> seen;
+    size_t duplicates = 0;
+    size_t certs = 0;
+    size_t malformed = 0;
+    std::vector<uint8_t> cert_buf;
+
+    moduli_reader() : moduli{}, seen{}, cert_buf(256 * 1024) {}
+
+    void add_modulus(std::string &&hex) {
+        canonical_hex(hex);
+        if (seen.insert(hex).second) {
+            moduli.push_back(std::move(hex));
+        } else {
+            duplicates++;
+        }
+    }
+
+    void add_cert(const char *b64, size_t b64_len) {
+        certs++;
+        ssize_t cert_len = base64::decode(cert_buf.data(), cert_buf.size(), b64, b64_len);
+        if (cert_len <= 0) {
+            malformed++;
+            return;
+        }
+        try {
+            struct x509_cert c;
+            c.parse(cert_buf.data(), cert_len, true);  // only the subject public key is decoded
+            const struct subject_public_key_info &spki = c.get_subject_public_key_info();
+            if (spki.algorithm.type() != oid::rsaEncryption) {
+                return;
+            }
+            struct tlv tmp_key = spki.subject_public_key;
+            tmp_key.remove_bitstring_encoding();
+            struct rsa_public_key pub_key(&tmp_key.value);
+            const struct datum &n = pub_key.modulus.value;
+            if (!pub_key.modulus.is_complete() || n.is_not_readable()) {   // truncated certificate
+                malformed++;
+                return;
+            }
+            std::string hex;
+            hex.reserve(2 * n.length());
+            for (const uint8_t *d = n.data; d < n.data_end; d++) {
+                hex.push_back(hex_table[*d >> 4]);
+                hex.push_back(hex_table[*d & 0x0f]);
+            }
+            add_modulus(std::move(hex));
+
+        } catch (const char *s) {
+            malformed++;
+        }
+    }
+
+    void add_json_line(char *line) {
+        rapidjson::Document document;
+        document.ParseInsitu(line);
+        if (document.HasParseError() || !document.IsObject() || !document.HasMember("tls")) {
+            return;
+        }
+        const rapidjson::Value &tls = document["tls"];
+        if (!tls.IsObject() || !tls.HasMember("server")) {
+            return;
+        }
+        const rapidjson::Value &server = tls["server"];
+        if (!server.IsObject() || !server.HasMember("certs") || !server["certs"].IsArray()) {
+            return;
+        }
+        for (auto &c : server["certs"].GetArray()) {
+            if (c.IsObject() && c.HasMember("base64") && c["base64"].IsString()) {
+                add_cert(c["base64"].GetString(), c["base64"].GetStringLength());
+            }
+        }
+    }
+
+    bool read(const char *infile, input_format format) {
+        FILE *stream = stdin;
+        if (infile) {
+            stream = fopen(infile, "r");
+            if (stream == NULL) {
+                fprintf(stderr, "error: could not open file %s (%s)\n", infile, strerror(errno));
+                return false;
             }
-            uint64_t y = *it++;
-            cout << y;
         }
-        cout << "]" << '\n';
+        char *line = NULL;
+        size_t line_len = 0;
+        ssize_t nread;
+        while ((nread = getline(&line, &line_len, stream)) != -1) {
+            while (nread > 0 && isspace((unsigned char)line[nread-1])) {
+                line[--nread] = '\0';
+            }
+            if (nread == 0) {
+                continue;
+            }
+            switch(format) {
+            case input_format::hex:
+                add_modulus(std::string(line, nread));
+                break;
+            case input_format::base64:
+                add_cert(line, nread);
+                break;
+            case input_format::json:
+                add_json_line(line);
+                break;
+            }
+        }
+        free(line);
+        if (stream != stdin) {
+            fclose(stream);
+        }
+        return true;
+    }
+};
+
+// struct batch_gcd holds the moduli and tree levels, which are
+// either all kept in memory or spilled to files in spill_dir
+//
+struct batch_gcd {
+    unsigned int num_threads;
+    const char *spill_dir;
+    std::vector<tree_level> levels;     // product tree, when not spilled
+    size_t num_levels;
+
+    batch_gcd(unsigned int threads, const char *dir) : num_threads{threads}, spill_dir{dir}, levels{}, num_levels{0} {}
+
+    std::string spill_file_name(size_t level) const {
+        std::string name(spill_dir);
+        name.append("/product-tree-level-");
+        name.append(std::to_string(level));
+        name.append(".mpz");
+        return name;
+    }
+
+    void store_level(size_t level, tree_level &&v) {
+        if (spill_dir == NULL) {
+            levels.push_back(std::move(v));
+            return;
+        }
+        std::string name = spill_file_name(level);
+        FILE *f = fopen(name.c_str(), "w");
+        if (f == NULL || !write_level(f, v)) {
+            fprintf(stderr, "error: could not write product tree level to %s (%s)\n", name.c_str(), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        fclose(f);
+    }
+
+    // load_level(level) returns the product tree level from memory or
+    // from its spill file; spilled levels are read once and then
+    // removed
+    //
+    tree_level load_level(size_t level) {
+        if (spill_dir == NULL) {
+            return std::move(levels[level]);
+        }
+        std::string name = spill_file_name(level);
+        FILE *f = fopen(name.c_str(), "r");
+        tree_level v;
+        if (f == NULL || !read_level(f, v)) {
+            fprintf(stderr, "error: could not read product tree level from %s (%s)\n", name.c_str(), strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        fclose(f);
+        remove(name.c_str());
+        return v;
+    }
+
+    // product_tree(leaves) builds the product tree over leaves and
+    // stores every level except for the root, which is returned
+    //
+    tree_level product_tree(tree_level &&leaves) {
+        tree_level current = std::move(leaves);
+        while (current.size() > 1) {
+            tree_level next((current.size() + 1) / 2);
+            parallel_for(next.size(), num_threads, [&](size_t i) {
+                if (2*i + 1 < current.size()) {
+                    next[i] = current[2*i] * current[2*i + 1];
+                } else {
+                    next[i] = current[2*i];
+                }
+            });
+            store_level(num_levels++, std::move(current));
+            current = std::move(next);
+        }
+        return current;
+    }
+
+    // remainder_tree(root) descends from the root of the product tree,
+    // and returns the leaves of the remainder tree, z_i = P mod N_i^2
+    //
+    tree_level remainder_tree(tree_level &&root) {
+        tree_level remainders = std::move(root);
+        for (size_t level = num_levels; level-- > 0; ) {
+            tree_level products = load_level(level);
+            tree_level next(products.size());
+            parallel_for(products.size(), num_threads, [&](size_t i) {
+                mpz_class square = products[i] * products[i];
+                mpz_mod(next[i].get_mpz_t(), remainders[i / 2].get_mpz_t(), square.get_mpz_t());
+            });
+            remainders = std::move(next);
+        }
+        return remainders;
+    }
+};
+
+void usage(const char *progname) {
+    const char *help_message =
+        "usage: %s: [--input <infile>] [INPUT OPTIONS] [OPTIONS]\n"
+        "   --input <infile> reads RSA moduli from <infile>\n"
+        "   otherwise, moduli are read from standard input\n"
+        "INPUT\n"
+        "   no option        input is hexadecimal moduli, one per line\n"
+        "   --certs          input is base64 DER certificates, one per line\n"
+        "   --json           input is mercury JSON output\n"
+        "OPTIONS\n"
+        "   --threads <n>    use <n> threads (default: number of cpus)\n"
+        "   --spill <dir>    write product tree levels to files in <dir>\n"
+        "   --help           print this message\n"
+        "OUTPUT\n"
+        "   a JSON object for each modulus that shares a factor with another\n"
+        "   modulus, and the time spent in each stage on standard error\n";
 
-        if (tmp->size() == 1) {
-            product = tmp->begin();
+    fprintf(stdout, help_message, progname);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *infile = NULL;
+    const char *spill_dir = NULL;
+    input_format format = input_format::hex;
+    unsigned int num_threads = 0;
+
+    // parse arguments
+    while (1) {
+        int option_index = 0;
+        enum arg_type {
+             case_input,
+             case_certs,
+             case_json,
+             case_threads,
+             case_spill,
+             case_help,
+        };
+        static struct option long_options[] = {
+             {"input",   required_argument, NULL,  case_input   },
+             {"certs",   no_argument,       NULL,  case_certs   },
+             {"json",    no_argument,       NULL,  case_json    },
+             {"threads", required_argument, NULL,  case_threads },
+             {"spill",   required_argument, NULL,  case_spill   },
+             {"help",    no_argument,       NULL,  case_help    },
+             {0,         0,                 0,     0            }
+        };
+
+        int c = getopt_long(argc, argv, "", long_options, &option_index);
+        if (c == -1)
+            break;
+        switch (c) {
+        case case_input:
+            infile = optarg;
             break;
+        case case_certs:
+            format = input_format::base64;
+            break;
+        case case_json:
+            format = input_format::json;
+            break;
+        case case_threads:
+            num_threads = strtoul(optarg, NULL, 10);
+            if (num_threads == 0) {
+                fprintf(stderr, "error: option 'threads' needs a positive integer argument\n");
+                usage(argv[0]);
+            }
+            break;
+        case case_spill:
+            spill_dir = optarg;
+            break;
+        case case_help:
+        case '?':
+        default:
+            usage(argv[0]);
         }
+    }
+    if (optind < argc) {
+        printf("error: unrecognized options string(s): ");
+        while (optind < argc) {
+            printf("%s ", argv[optind++]);
+        }
+        printf("\n");
+        usage(argv[0]);
+    }
+    if (num_threads == 0) {
+        num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    stage_timer timer;
+
+    struct moduli_reader reader;
+    if (!reader.read(infile, format)) {
+        exit(EXIT_FAILURE);
+    }
+    tree_level moduli(reader.moduli.size());
+    size_t invalid = 0;
+    for (size_t i = 0; i < moduli.size(); i++) {
+        if (moduli[i].set_str(reader.moduli[i], 16) != 0 || moduli[i] <= 1) {
+            invalid++;
+            moduli[i] = 1;   // neutral element for the product tree
+        }
+    }
+    if (format != input_format::hex) {
+        fprintf(stderr, "read %zu certificates (%zu malformed)\n", reader.certs, reader.malformed);
+    }
+    fprintf(stderr, "read %zu distinct moduli (%zu duplicates, %zu invalid)\n", moduli.size(), reader.duplicates, invalid);
+    timer.report("input");
 
-        last_level = tmp;
+    if (moduli.size() < 2) {
+        return 0;   // nothing to compare
     }
 
-    cout << "product: " << *product << '\n';
+    // the leaves are needed again after the remainder tree is
+    // built, so the product tree gets its own copy of them
+    //
+    tree_level leaves = moduli;
 
-    // create remainder tree
+    struct batch_gcd bg{num_threads, spill_dir};
+    tree_level root = bg.product_tree(std::move(leaves));
+    fprintf(stderr, "product tree has %zu levels; product has %zu bits\n", bg.num_levels + 1, mpz_sizeinbase(root[0].get_mpz_t(), 2));
+    timer.report("product tree");
 
-    // TBD
+    tree_level remainders = bg.remainder_tree(std::move(root));
+    timer.report("remainder tree");
 
-    // report on common factors
+    // compute gcd(z_i / N_i, N_i) for each modulus
+    //
+    tree_level gcds(moduli.size());
+    parallel_for(moduli.size(), num_threads, [&](size_t i) {
+        mpz_divexact(remainders[i].get_mpz_t(), remainders[i].get_mpz_t(), moduli[i].get_mpz_t());
+        mpz_gcd(gcds[i].get_mpz_t(), remainders[i].get_mpz_t(), moduli[i].get_mpz_t());
+    });
+    timer.report("gcd");
+
+    size_t vulnerable = 0;
+    for (size_t i = 0; i < moduli.size(); i++) {
+        if (gcds[i] == 1 || moduli[i] == 1) {
+            continue;
+        }
+        vulnerable++;
+        fprintf(stdout, "{\"modulus\":\"%s\",\"shared_factor\":\"%s\",\"all_factors_shared\":%s}\n",
+                reader.moduli[i].c_str(), gcds[i].get_str(16).c_str(), gcds[i] == moduli[i] ? "true" : "false");
+    }
+    fprintf(stderr, "found %zu moduli that share a factor with another modulus\n", vulnerable);
+    timer.report("output");
 
-    // TBD
-    
     return 0;
 }
@@ -6,11 +6,23 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <time.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <string>
 #include <unordered_map>
 #include <string>
 #include <list>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "x509.h"
 #include "base64.h"
@@ -181,9 +193,10 @@ struct json_file_reader : public file_reader {
 struct base64_file_reader : public file_reader {
     FILE *stream;
     char *line = NULL;
+    size_t line_len = 0;
     unsigned int line_number = 0;
 
-    base64_file_reader(const char *infile) : stream{NULL}, line{NULL} {
+    base64_file_reader(const char *infile) : stream{NULL}, line{NULL}, line_len{0} {
         if (infile == NULL) {
             stream = stdin;
         } else {
@@ -195,11 +208,9 @@ struct base64_file_reader : public file_reader {
         }
     }
     ssize_t get_cert(uint8_t *outbuf, size_t outbuf_len) {
-        size_t len = 0;
         line_number++;
-        ssize_t nread = getline(&line, &len, stream); // note: could skip zero-length lines
+        ssize_t nread = getline(&line, &line_len, stream); // note: could skip zero-length lines
         if (nread == -1) {
-            free(line);
             return 0;
         }
         ssize_t cert_len = base64::decode(outbuf, outbuf_len, line, nread);
@@ -227,10 +238,10 @@ struct base64_file_reader : public file_reader {
                 fprintf(stderr, "input may be in JSON format; try --json\n");
             }
         }
-        free(line); // TBD: we shouldn't need to call this after every read, but valgrind says we do :-(
         return cert_len;
     }
     ~base64_file_reader() {
+        free(line);
         fclose(stream);
     }
 };
@@ -238,9 +249,10 @@ struct base64_file_reader : public file_reader {
 struct pem_file_reader : public file_reader {
     FILE *stream;
     char *line;
+    size_t line_len;
     size_t cert_number;
 
-    pem_file_reader(const char *infile) : stream{NULL}, line{NULL}, cert_number{0} {
+    pem_file_reader(const char *infile) : stream{NULL}, line{NULL}, line_len{0}, cert_number{0} {
         if (infile == NULL) {
             stream = stdin;
         } else {
@@ -252,7 +264,6 @@ struct pem_file_reader : public file_reader {
         }
     }
     ssize_t get_cert(uint8_t *outbuf, size_t outbuf_len) {
-        size_t len = 0;
         ssize_t nread = 0;
         const char opening_line[] = "-----BEGIN CERTIFICATE-----";
         const char closing_line[] = "-----END CERTIFICATE-----";
@@ -260,9 +271,8 @@ struct pem_file_reader : public file_reader {
         cert_number++;
 
         // check for opening
-        nread = getline(&line, &len, stream);
+        nread = getline(&line, &line_len, stream);
         if (nread == -1) {
-            free(line); // TBD: we shouldn't need to call this after every read, but valgrind says we do :-(
             return 0;  // empty line; assue we are done with certificates
         }
         if ((size_t)nread >= sizeof(opening_line)-1 && strncmp(line, opening_line, sizeof(opening_line)-1) != 0) {
@@ -272,7 +282,6 @@ struct pem_file_reader : public file_reader {
             } else {
                 fprintf(stderr, "error: not in PEM format, or missing opening line in certificate %zd\n", cert_number);
             }
-            free(line); // TBD: we shouldn't need to call this after every read, but valgrind says we do :-(
             return -1; // missing opening line; not in PEM format
         }
 
@@ -280,10 +289,9 @@ struct pem_file_reader : public file_reader {
         char base64_buffer[8*8192];       // note: hardcoded length for now
         char *base64_buffer_end = base64_buffer + sizeof(base64_buffer);
         char *b_ptr = base64_buffer;
-        while ((nread = getline(&line, &len, stream)) > 0 ) {
+        while ((nread = getline(&line, &line_len, stream)) > 0 ) {
             if (nread == -1) {
                 fprintf(stderr, "error: PEM format incomplete for certificate %zd\n", cert_number);
-                free(line); // TBD: we shouldn't need to call this after every read, but valgrind says we do :-(
                 return -1; // empty line; PEM format incomplete
             }
             ssize_t advance = 0;
@@ -304,10 +312,10 @@ struct pem_file_reader : public file_reader {
             b_ptr += advance;
         }
         ssize_t cert_len = base64::decode(outbuf, outbuf_len, base64_buffer, b_ptr - base64_buffer);
-        free(line); // TBD: we shouldn't need to call this after every read, but valgrind says we do :-(
         return cert_len;
     }
     ~pem_file_reader() {
+        free(line);
         fclose(stream);
     }
 };
@@ -334,8 +342,350 @@ struct der_file_writer {
     };
 };
 
-// std::unordered_map<std::string, std::string> cert_dict;
-//#include <thread>
+// batch mode
+//
+// In batch mode, the input file is mapped into memory and split into
+// chunks at record boundaries (newlines for base64 input, closing
+// lines for PEM input).  A pool of worker threads decodes, parses,
+// and prints the certificates in each chunk into a per-chunk output
+// buffer, and those buffers are written out in input order, or in
+// completion order if unordered output was requested.
+
+struct mapped_file {
+    int fd;
+    const char *data;
+    size_t length;
+
+    mapped_file(const char *infile) : fd{-1}, data{NULL}, length{0} {
+        fd = open(infile, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "error: could not open file %s (%s)\n", infile, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            fprintf(stderr, "error: could not stat file %s (%s)\n", infile, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        length = st.st_size;
+        if (length == 0) {
+            return;      // nothing to map
+        }
+        void *addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            fprintf(stderr, "error: could not mmap file %s (%s)\n", infile, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        madvise(addr, length, MADV_SEQUENTIAL);
+        data = (const char *)addr;
+    }
+
+    ~mapped_file() {
+        if (data) {
+            munmap((void *)data, length);
+        }
+        close(fd);
+    }
+};
+
+enum class batch_input { base64, pem };
+
+struct batch_options {
+    batch_input input;
+    bool prefix;
+    bool prefix_as_hex;
+    const char *filter;
+    const char *logfile;
+    const struct x509_trusted_issuers *trusted_issuers;
+    unsigned int num_threads;
+    size_t chunk_size;
+    bool unordered;
+};
+
+// a batch_chunk holds the boundaries of a contiguous range of records
+// in the input, along with the output and counts for that range
+//
+struct batch_chunk {
+    const char *begin;
+    const char *end;
+    std::string output;
+    size_t records;
+    size_t malformed;
+    bool done;
+
+    batch_chunk(const char *b, const char *e) : begin{b}, end{e}, output{}, records{0}, malformed{0}, done{false} {}
+};
+
+static const char pem_opening_line[] = "-----BEGIN CERTIFICATE-----";
+static const char pem_closing_line[] = "-----END CERTIFICATE-----";
+
+// end_of_record(p, end, input) returns a pointer just past the
+// record that contains location p, or end if there is no complete
+// record boundary between p and end
+//
+static const char *end_of_record(const char *p, const char *end, batch_input input) {
+    if (input == batch_input::pem) {
+        const char *c = (const char *)memmem(p, end - p, pem_closing_line, sizeof(pem_closing_line) - 1);
+        if (c == NULL) {
+            return end;
+        }
+        p = c;
+    }
+    const char *nl = (const char *)memchr(p, '\n', end - p);
+    if (nl == NULL) {
+        return end;
+    }
+    return nl + 1;
+}
+
+static void batch_split(std::vector<batch_chunk> &chunks, const char *data, size_t length, batch_input input, size_t chunk_size) {
+    const char *p = data;
+    const char *end = data + length;
+    while (p < end) {
+        const char *q = p + chunk_size;
+        if (q >= end) {
+            q = end;
+        } else {
+            q = end_of_record(q, end, input);
+        }
+        chunks.emplace_back(p, q);
+        p = q;
+    }
+}
+
+// trim_line(line, end) strips trailing whitespace (including carriage
+// returns) from the line that starts at line and ends at end
+//
+static const char *trim_line(const char *line, const char *end) {
+    while (end > line && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    return end;
+}
+
+struct batch_worker {
+    const struct batch_options &opt;
+    std::atomic<unsigned int> &log_index;
+    std::vector<uint8_t> cert_buf;
+    std::vector<char> json_buf;
+    std::string base64_buf;
+
+    batch_worker(const struct batch_options &o, std::atomic<unsigned int> &index)
+        : opt{o}, log_index{index}, cert_buf(256 * 1024), json_buf(256 * 1024), base64_buf{} { }
+
+    void log_malformed(const uint8_t *cert, size_t cert_len) {
+        if (opt.logfile) {
+            std::string filename(opt.logfile);
+            filename.append(std::to_string(log_index++));
+            filename.append(".der");
+            der_file_writer der_file(filename.c_str());
+            if (der_file.write_cert((uint8_t *)cert, cert_len) < 0) {
+                fprintf(stderr, "error: could not write certificate %s to file\n", filename.c_str());
+            }
+        }
+    }
+
+    // process_cert(chunk, b64, b64_len) decodes, parses, and prints
+    // the base64-encoded certificate b64, appending the output to
+    // chunk; a certificate that can not be decoded or parsed, or whose
+    // output would be empty or truncated, is counted as malformed, and
+    // nothing is output for it
+    //
+    void process_cert(struct batch_chunk &chunk, const char *b64, size_t b64_len) {
+        chunk.records++;
+        ssize_t cert_len = base64::decode(cert_buf.data(), cert_buf.size(), b64, b64_len);
+        if (cert_len <= 0) {
+            chunk.malformed++;
+            return;
+        }
+        struct buffer_stream buf(json_buf.data(), json_buf.size());
+        try {
+            if (opt.prefix || opt.prefix_as_hex) {
+                struct x509_cert_prefix p;
+                p.parse(cert_buf.data(), cert_len);
+                if (!p.is_not_empty()) {
+                    throw "could not parse certificate prefix";
+                }
+                if (opt.prefix) {
+                    p.print_as_json(buf);
+                    buf.write_char('\n');
+                }
+                if (opt.prefix_as_hex) {
+                    p.print_as_json_hex(buf);
+                    buf.write_char('\n');
+                }
+            } else {
+                struct x509_cert c;
+                c.parse(cert_buf.data(), cert_len, opt.filter != NULL);  // with a filter, decode fields as they are checked
+                if (!c.is_not_empty()) {
+                    throw "could not parse certificate";
+                }
+                if ((opt.filter == NULL)
+                    || c.is_not_currently_valid()
+                    || c.subject_key_is_weak()
+                    || c.signature_is_weak()
+                    || c.is_nonconformant()
+                    || c.is_self_issued()
+                    || !c.is_trusted(*opt.trusted_issuers)) {
+                    c.print_as_json(buf, *opt.trusted_issuers, NULL);
+                    buf.write_char('\n');
+                }
+            }
+        } catch (const char *s) {
+            chunk.malformed++;
+            log_malformed(cert_buf.data(), cert_len);
+            return;
+        }
+        if (buf.trunc || has_empty_record(buf)) {
+            chunk.malformed++;
+            log_malformed(cert_buf.data(), cert_len);
+            return;
+        }
+        chunk.output.append(buf.dstr, buf.length());
+    }
+
+    // has_empty_record(buf) returns true if buf holds a JSON record
+    // with no members, which is what is printed for a certificate
+    // with no fields that could be decoded
+    //
+    static bool has_empty_record(const struct buffer_stream &buf) {
+        return memmem(buf.dstr, buf.doff, "{}\n", 3) != NULL;
+    }
+
+    void process_base64(struct batch_chunk &chunk) {
+        const char *p = chunk.begin;
+        while (p < chunk.end) {
+            const char *nl = (const char *)memchr(p, '\n', chunk.end - p);
+            const char *line_end = nl ? nl : chunk.end;
+            const char *b64_end = trim_line(p, line_end);
+            if (b64_end > p) {
+                process_cert(chunk, p, b64_end - p);
+            }
+            p = nl ? nl + 1 : chunk.end;
+        }
+    }
+
+    void process_pem(struct batch_chunk &chunk) {
+        const char *p = chunk.begin;
+        while (p < chunk.end) {
+            const char *opening = (const char *)memmem(p, chunk.end - p, pem_opening_line, sizeof(pem_opening_line) - 1);
+            if (opening == NULL) {
+                return;
+            }
+            const char *closing = (const char *)memmem(opening, chunk.end - opening, pem_closing_line, sizeof(pem_closing_line) - 1);
+            if (closing == NULL) {
+                chunk.records++;
+                chunk.malformed++;   // missing closing line
+                return;
+            }
+
+            // marshall base64 data, skipping the opening line
+            base64_buf.clear();
+            const char *line = (const char *)memchr(opening, '\n', closing - opening);
+            line = line ? line + 1 : closing;
+            while (line < closing) {
+                const char *nl = (const char *)memchr(line, '\n', closing - line);
+                const char *line_end = nl ? nl : closing;
+                base64_buf.append(line, trim_line(line, line_end) - line);
+                line = nl ? nl + 1 : closing;
+            }
+            process_cert(chunk, base64_buf.data(), base64_buf.size());
+
+            p = closing + sizeof(pem_closing_line) - 1;
+        }
+    }
+
+    void process(struct batch_chunk &chunk) {
+        if (opt.input == batch_input::pem) {
+            process_pem(chunk);
+        } else {
+            process_base64(chunk);
+        }
+    }
+};
+
+// batch_process(infile, opt) processes all of the certificates in
+// infile using a pool of opt.num_threads worker threads, writes the
+// output to stdout, and reports throughput and malformed certificate
+// counts to stderr
+//
+void batch_process(const char *infile, const struct batch_options &opt) {
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct mapped_file input(infile);
+    std::vector<batch_chunk> chunks;
+    batch_split(chunks, input.data, input.length, opt.input, opt.chunk_size);
+
+    // in ordered mode, workers can get at most max_in_flight chunks
+    // ahead of the writer, to bound the memory used for output
+    //
+    const size_t max_in_flight = 4 * opt.num_threads;
+    std::atomic<size_t> next_chunk{0};
+    std::atomic<unsigned int> log_index{0};
+    size_t chunks_written = 0;
+    std::mutex m;
+    std::condition_variable chunk_done;
+    std::condition_variable chunk_written;
+
+    auto worker_func = [&]() {
+        struct batch_worker worker{opt, log_index};
+        size_t i;
+        while ((i = next_chunk++) < chunks.size()) {
+            if (!opt.unordered) {
+                std::unique_lock<std::mutex> lock{m};
+                chunk_written.wait(lock, [&]{ return i < chunks_written + max_in_flight; });
+            }
+            worker.process(chunks[i]);
+            if (opt.unordered) {
+                fwrite(chunks[i].output.data(), 1, chunks[i].output.size(), stdout);
+                std::string().swap(chunks[i].output);
+            }
+            std::lock_guard<std::mutex> lock{m};
+            chunks[i].done = true;
+            chunk_done.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < opt.num_threads; t++) {
+        workers.emplace_back(worker_func);
+    }
+
+    size_t records = 0;
+    size_t malformed = 0;
+    for (auto &chunk : chunks) {
+        {
+            std::unique_lock<std::mutex> lock{m};
+            chunk_done.wait(lock, [&]{ return chunk.done; });
+        }
+        if (!opt.unordered) {
+            fwrite(chunk.output.data(), 1, chunk.output.size(), stdout);
+            std::string().swap(chunk.output);
+        }
+        records += chunk.records;
+        malformed += chunk.malformed;
+        {
+            std::lock_guard<std::mutex> lock{m};
+            chunks_written++;
+            chunk_written.notify_all();
+        }
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    fflush(stdout);
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0.0) {
+        seconds = 1e-9;
+    }
+    fprintf(stderr,
+            "processed %zu certificates (%zu malformed) from %zu bytes in %zu chunks with %u threads in %.3f seconds (%.0f certs/s, %.2f MB/s)\n",
+            records, malformed, input.length, chunks.size(), opt.num_threads, seconds,
+            records / seconds, input.length / seconds / 1e6);
+}
 
 void usage(const char *progname) {
     const char *help_message =
@@ -355,6 +705,11 @@ void usage(const char *progname) {
         "            weak\n"
         "   --key-group      identify duplicate keys with key_group number\n"
         "   --trunc-test     parse every possible truncation of certificates\n"
+        "BATCH\n"
+        "   --batch          process <infile> with a pool of worker threads\n"
+        "                    (base64 or PEM input only)\n"
+        "   --threads <n>    use <n> worker threads in batch mode (default: number of cpus)\n"
+        "   --unordered      write batch output in completion order, not input order\n"
         "OTHER\n"
         "   --trust <roots>  trust certificates in <roots>\n"
         "   --help           print this message\n";
@@ -375,6 +730,9 @@ int main(int argc, char *argv[]) {
     bool input_is_der = false;
     bool key_group = false;
     bool trunc_test = false;
+    bool batch = false;
+    bool unordered = false;
+    unsigned int num_threads = 0;
     //const char *outfile = NULL;
 
     // parse arguments
@@ -393,6 +751,9 @@ int main(int argc, char *argv[]) {
              case_key_group,
              case_trunc_test,
              case_trust,
+             case_batch,
+             case_threads,
+             case_unordered,
              case_help,
         };
         static struct option long_options[] = {
@@ -407,6 +768,9 @@ int main(int argc, char *argv[]) {
              {"key-group",      no_argument,       NULL,  case_key_group     },
              {"trunc-test",     no_argument,       NULL,  case_trunc_test    },
              {"trust",          required_argument, NULL,  case_trust         },
+             {"batch",          no_argument,       NULL,  case_batch         },
+             {"threads",        required_argument, NULL,  case_threads       },
+             {"unordered",      no_argument,       NULL,  case_unordered     },
              {"help",           no_argument,       NULL,  case_help          },
              {0,                0,                 0,     0                  }
         };
@@ -496,6 +860,31 @@ int main(int argc, char *argv[]) {
             }
             trust = optarg;
             break;
+        case case_batch:
+            if (optarg) {
+                fprintf(stderr, "error: option 'batch' does not accept an argument\n");
+                usage(argv[0]);
+            }
+            batch = true;
+            break;
+        case case_threads:
+            if (!optarg) {
+                fprintf(stderr, "error: option 'threads' needs an argument\n");
+                usage(argv[0]);
+            }
+            num_threads = strtoul(optarg, NULL, 10);
+            if (num_threads == 0) {
+                fprintf(stderr, "error: option 'threads' needs a positive integer argument\n");
+                usage(argv[0]);
+            }
+            break;
+        case case_unordered:
+            if (optarg) {
+                fprintf(stderr, "error: option 'unordered' does not accept an argument\n");
+                usage(argv[0]);
+            }
+            unordered = true;
+            break;
         case case_help:
             if (optarg) {
                 fprintf(stderr, "error: option 'help' does not accept an argument\n");
@@ -524,8 +913,27 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "warning: filter cannot be applied to certificate prefix\n");
     }
 
+    if (batch) {
+        if (infile == NULL) {
+            fprintf(stderr, "error: batch mode requires an input file\n");
+            usage(argv[0]);
+        }
+        if (input_is_json || input_is_der) {
+            fprintf(stderr, "error: batch mode requires base64 or PEM input\n");
+            usage(argv[0]);
+        }
+        if (key_group || trunc_test) {
+            fprintf(stderr, "error: options 'key-group' and 'trunc-test' are not supported in batch mode\n");
+            usage(argv[0]);
+        }
+    } else if (num_threads || unordered) {
+        fprintf(stderr, "warning: options 'threads' and 'unordered' are ignored outside of batch mode\n");
+    }
+
     struct file_reader *reader = NULL;
-    if (input_is_pem) {
+    if (batch) {
+        ;  // batch mode maps the input file directly
+    } else if (input_is_pem) {
         reader = new pem_file_reader(infile);
     } else if (input_is_json) {
         reader = new json_file_reader(infile);
@@ -542,15 +950,31 @@ int main(int argc, char *argv[]) {
     }
 
     std::list<struct x509_cert> trusted_certs;
+    struct x509_trusted_issuers trusted_issuers;
     uint8_t trusted_cert_buf[256 * 1024];
     uint8_t *cb = trusted_cert_buf;
     size_t cb_len = sizeof(trusted_cert_buf);
     if (trust) {
         struct file_reader *reader = new pem_file_reader(trust);
         reader->get_cert_list(trusted_certs, cb, cb_len);
-        // for (auto &c : trusted_certs) {
-        //    c.print_as_json(stdout);
-        // }
+        for (auto &c : trusted_certs) {
+            trusted_issuers.add(c.issuer);
+        }
+    }
+
+    if (batch) {
+        struct batch_options opt;
+        opt.input = input_is_pem ? batch_input::pem : batch_input::base64;
+        opt.prefix = prefix;
+        opt.prefix_as_hex = prefix_as_hex;
+        opt.filter = filter;
+        opt.logfile = logfile;
+        opt.trusted_issuers = &trusted_issuers;
+        opt.num_threads = num_threads ? num_threads : std::max(std::thread::hardware_concurrency(), 1u);
+        opt.chunk_size = 4 * 1024 * 1024;
+        opt.unordered = unordered;
+        batch_process(infile, opt);
+        exit(EXIT_SUCCESS);
     }
 
     unsigned int log_index = 0;
@@ -588,21 +1012,21 @@ int main(int argc, char *argv[]) {
                         buf = { buffer, sizeof(buffer) };
                         struct x509_cert cc;
                         cc.parse(cert_buf, trunc_len);
-                        cc.print_as_json(buf, trusted_certs, kg);
+                        cc.print_as_json(buf, trusted_issuers, kg);
                         buf.write_line(stdout);
                     }
 
                 } else {
 
-                    c.parse(cert_buf, cert_len);
+                    c.parse(cert_buf, cert_len, filter != NULL);  // with a filter, decode fields as they are checked
                     if ((filter == NULL)
                         || c.is_not_currently_valid()
                         || c.subject_key_is_weak()
                         || c.signature_is_weak()
                         || c.is_nonconformant()
                         || c.is_self_issued()
-                        || !c.is_trusted(trusted_certs)) {
-                        c.print_as_json(buf, trusted_certs, kg);
+                        || !c.is_trusted(trusted_issuers)) {
+                        c.print_as_json(buf, trusted_issuers, kg);
                         buf.write_line(stdout);
                     }
 
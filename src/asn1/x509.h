@@ -7,8 +7,11 @@
 #define X509_H
 
 #include <stdio.h>
+#include <time.h>
+#include <string>
 #include <unordered_set>
 #include <list>
+#include <vector>
 #include "bytestring.h"
 #include "oid.h"    // oid dictionary
 
@@ -114,6 +117,96 @@ struct name {
         }
         return true;
     }
+
+    // normalize(n, boundaries) sets n to the attribute types and
+    // attribute values of the name, each as its tag, its length, and
+    // the bytes of its value that are present, without the SET and
+    // SEQUENCE encodings that wrap them, and sets boundaries to the
+    // length of n before the first attribute and after each one; two
+    // attributes have the same normalized form exactly when
+    // attribute::matches() holds for them, even if they are truncated,
+    // and each leading run of attributes of the name has the
+    // normalized form n.substr(0, boundaries[i])
+    //
+    void normalize(std::string &n, std::vector<size_t> &boundaries) const {
+        n.clear();
+        boundaries.assign(1, 0);
+        struct datum tlv_sequence = RDNsequence.value;
+        while (tlv_sequence.is_not_empty()) {
+            struct attribute attr(&tlv_sequence);
+            append_normalized(n, attr.attribute_type);
+            append_normalized(n, attr.attribute_value);
+            boundaries.push_back(n.length());
+        }
+    }
+
+private:
+
+    static void append_uint64(std::string &n, uint64_t x) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            n.push_back((char)(x >> shift));
+        }
+    }
+
+    static void append_normalized(std::string &n, const struct tlv &t) {
+        size_t present = t.value.is_not_readable() ? 0 : t.value.length();
+        n.push_back((char)t.tag);
+        append_uint64(n, t.length);
+        append_uint64(n, present);
+        if (present) {
+            n.append((const char *)t.value.data, present);
+        }
+    }
+};
+
+/*
+ * struct x509_trusted_issuers holds the issuer names of a set of
+ * trusted certificates, hashed by their normalized form, so that
+ * checking whether a certificate has a trusted issuer takes a few
+ * lookups, rather than a scan of the trusted certificates.  As with
+ * name::matches(), an issuer is trusted when its attributes and those
+ * of a trusted issuer agree until either of them runs out, so that an
+ * issuer whose encoding has been truncated is still trusted if the
+ * attributes that remain agree; to find those matches, the normalized
+ * form of each leading run of attributes of each trusted issuer is
+ * held as well.
+ */
+struct x509_trusted_issuers {
+    std::unordered_set<std::string> issuers;    // normalized names
+    std::unordered_set<std::string> prefixes;   // leading attributes of names
+
+    x509_trusted_issuers() : issuers{}, prefixes{} {}
+
+    void add(const struct name &issuer) {
+        std::string n;
+        std::vector<size_t> boundaries;
+        issuer.normalize(n, boundaries);
+        issuers.insert(n);
+        for (size_t b : boundaries) {
+            prefixes.insert(n.substr(0, b));
+        }
+    }
+
+    bool empty() const { return issuers.empty(); }
+
+    // contains(issuer) returns true if issuer, or a leading run of its
+    // attributes, is a trusted issuer, or if issuer is a leading run
+    // of the attributes of a trusted issuer
+    //
+    bool contains(const struct name &issuer) const {
+        std::string n;
+        std::vector<size_t> boundaries;
+        issuer.normalize(n, boundaries);
+        if (prefixes.find(n) != prefixes.end()) {
+            return true;
+        }
+        for (size_t b : boundaries) {
+            if (issuers.find(n.substr(0, b)) != issuers.end()) {
+                return true;
+            }
+        }
+        return false;
+    }
 };
 
 /*
@@ -1468,22 +1561,69 @@ static std::unordered_set <unsigned int> ecdsa_algorithms {
  *
  */
 
+/*
+ * struct x509_current_time holds the current time as a UTCTime
+ * string, which is formatted at most once per second, rather than
+ * for each certificate whose validity is checked; each thread has
+ * its own (see x509_cert::is_not_currently_valid())
+ */
+struct x509_current_time {
+    time_t t;
+    bool valid;
+    char time_str[16];
+
+    x509_current_time() : t{0}, valid{false}, time_str{} {}
+
+    // get() returns the current time string, or NULL if it could not
+    // be formatted
+    //
+    const char *get() {
+        time_t now = time(NULL);
+        if (now != t) {
+            t = now;
+            struct tm tt;
+            localtime_r(&now, &tt);   // reentrant, so that batch workers can call this concurrently
+            valid = strftime(time_str, sizeof(time_str), "%y%m%d%H%M%SZ", &tt) != 0;
+        }
+        return valid ? time_str : NULL;
+    }
+};
+
+/*
+ * struct x509_cert holds a certificate.  By default, parse() decodes
+ * the certificate in full.  With lazy=true, parse() records only the
+ * boundaries of the top-level fields of the certificate and of the
+ * tbsCertificate, and the AlgorithmIdentifiers, Validity, and
+ * SubjectPublicKeyInfo are decoded when they are first accessed,
+ * through the get_*() functions, so that callers that need only a
+ * few fields pay only for those.  The member functions of x509_cert
+ * use the get_*() functions, so they work in either mode; a lazily
+ * parsed certificate must not be accessed by more than one thread.
+ */
 struct x509_cert {
     struct tlv certificate;
     struct tlv tbs_certificate;
     struct tlv explicitly_tagged_version;
     struct tlv version;
     struct tlv serial_number;
-    struct algorithm_identifier signature_identifier; // note: confusingly called 'signature' in RFC5280
+    mutable struct algorithm_identifier signature_identifier; // note: confusingly called 'signature' in RFC5280
     struct name issuer;
-    struct validity validity;
+    mutable struct validity validity;
     struct name subject;
-    struct subject_public_key_info subjectPublicKeyInfo;
+    mutable struct subject_public_key_info subjectPublicKeyInfo;
     struct tlv explicitly_tagged_extensions;
     struct tlv extensions;
-    struct algorithm_identifier signature_algorithm;
+    mutable struct algorithm_identifier signature_algorithm;
     struct tlv signature;
 
+    // with lazy parsing, the encodings of the fields above that have not
+    // yet been decoded, or null
+    //
+    mutable struct datum lazy_signature_identifier;
+    mutable struct datum lazy_validity;
+    mutable struct datum lazy_subject_public_key_info;
+    mutable struct datum lazy_signature_algorithm;
+
     x509_cert()
         : certificate{},
           tbs_certificate{},
@@ -1498,9 +1638,61 @@ struct x509_cert {
           explicitly_tagged_extensions{},
           extensions{},
           signature_algorithm{},
-          signature{} {   }
+          signature{},
+          lazy_signature_identifier{NULL, NULL},
+          lazy_validity{NULL, NULL},
+          lazy_subject_public_key_info{NULL, NULL},
+          lazy_signature_algorithm{NULL, NULL} {   }
 
-    void parse(const void *buffer, unsigned int len) {
+    const struct algorithm_identifier &get_signature_identifier() const {
+        decode(lazy_signature_identifier, signature_identifier);
+        return signature_identifier;
+    }
+
+    const struct validity &get_validity() const {
+        decode(lazy_validity, validity);
+        return validity;
+    }
+
+    const struct subject_public_key_info &get_subject_public_key_info() const {
+        decode(lazy_subject_public_key_info, subjectPublicKeyInfo);
+        return subjectPublicKeyInfo;
+    }
+
+    const struct algorithm_identifier &get_signature_algorithm() const {
+        decode(lazy_signature_algorithm, signature_algorithm);
+        return signature_algorithm;
+    }
+
+private:
+
+    // decode(encoding, field) parses field from encoding, if that has
+    // not yet been done, then sets encoding to null
+    //
+    template <typename T>
+    static void decode(struct datum &encoding, T &field) {
+        if (encoding.data != NULL) {
+            struct datum tmp = encoding;
+            encoding.set_null();
+            field.parse(&tmp);
+        }
+    }
+
+    // skip(p, expected_tag, encoding) sets encoding to the data from the
+    // start of p to its end, then skips over the TLV at the start of p,
+    // exactly as the first TLV parse of the (eager) decoding of that
+    // field would, so that decoding the field from encoding later has
+    // the same result as decoding it from p now
+    //
+    static void skip(struct datum *p, uint8_t expected_tag, struct datum &encoding) {
+        encoding = *p;
+        struct tlv tmp;
+        tmp.parse(p, expected_tag);
+    }
+
+public:
+
+    void parse(const void *buffer, unsigned int len, bool lazy=false) {
 
         struct datum p;
         parser_init(&p, (const unsigned char *)buffer, len);
@@ -1527,19 +1719,31 @@ struct x509_cert {
             serial_number.parse(&tbs_certificate.value, tlv::INTEGER, "serial number");
         }
 
-        signature_identifier.parse(&tbs_certificate.value);
+        if (lazy) {
+            skip(&tbs_certificate.value, tlv::SEQUENCE, lazy_signature_identifier);
+        } else {
+            signature_identifier.parse(&tbs_certificate.value);
+        }
 
         // parse issuer
         issuer.parse(&tbs_certificate.value, "issuer");
 
         // parse validity
-        validity.parse(&tbs_certificate.value);
+        if (lazy) {
+            skip(&tbs_certificate.value, tlv::SEQUENCE, lazy_validity);
+        } else {
+            validity.parse(&tbs_certificate.value);
+        }
 
         // parse subject
         subject.parse(&tbs_certificate.value, "subject");
 
         // parse subjectPublicKeyInfo
-        subjectPublicKeyInfo.parse(&tbs_certificate.value);
+        if (lazy) {
+            skip(&tbs_certificate.value, 0, lazy_subject_public_key_info);
+        } else {
+            subjectPublicKeyInfo.parse(&tbs_certificate.value);
+        }
 
         if (tbs_certificate.value.is_not_empty() == false) {
             return;    // optional extensions are not present
@@ -1563,11 +1767,22 @@ struct x509_cert {
             //            tmp_tlv.fprint_tlv(stderr, "tbs_certificate trailing data");
         }
 
-        signature_algorithm.parse(&certificate.value);
+        if (lazy) {
+            skip(&certificate.value, tlv::SEQUENCE, lazy_signature_algorithm);
+        } else {
+            signature_algorithm.parse(&certificate.value);
+        }
         signature.parse(&certificate.value, tlv::BIT_STRING, "signature");
 
     }
 
+    // is_not_empty() returns true if the certificate and its
+    // tbsCertificate could be parsed
+    //
+    bool is_not_empty() const {
+        return certificate.is_not_null() && tbs_certificate.is_not_null();
+    }
+
     std::string get_json_string() const {
         char buffer[8192*8];
         struct buffer_stream buf(buffer, sizeof(buffer));
@@ -1581,12 +1796,12 @@ struct x509_cert {
         print_as_json(buf, {}, NULL);
         buf.write_line(f);
     }
-    void print_as_json(struct buffer_stream &buf, const std::list<struct x509_cert> &trusted_certs, struct dictionary *key_group) const {
+    void print_as_json(struct buffer_stream &buf, const struct x509_trusted_issuers &trusted_issuers, struct dictionary *key_group) const {
         struct json_object_asn1 o{&buf};
-        print_as_json(o, trusted_certs, key_group);
+        print_as_json(o, trusted_issuers, key_group);
         o.close();
     }
-    void print_as_json(struct json_object_asn1 &o, const std::list<struct x509_cert> &trusted_certs, struct dictionary *key_group) const {
+    void print_as_json(struct json_object_asn1 &o, const struct x509_trusted_issuers &trusted_issuers, struct dictionary *key_group) const {
 
         if (!version.is_null()) {
             version.print_as_json_hex(o, "version");
@@ -1594,20 +1809,20 @@ struct x509_cert {
         if (!serial_number.is_null()) {
             serial_number.print_as_json_hex(o, "serial_number");
         }
-        if (!signature_identifier.sequence.is_null()) {
-            signature_identifier.print_as_json(o, "signature_identifier");
+        if (!get_signature_identifier().sequence.is_null()) {
+            get_signature_identifier().print_as_json(o, "signature_identifier");
         }
         if (!issuer.RDNsequence.is_null()) {
             issuer.print_as_json(o, "issuer");
         }
-        if (!validity.sequence.is_null()) {
-            validity.print_as_json(o);
+        if (!get_validity().sequence.is_null()) {
+            get_validity().print_as_json(o);
         }
         if (!subject.RDNsequence.is_null()) {
             subject.print_as_json(o, "subject");
         }
-        if (!subjectPublicKeyInfo.sequence.is_null()) {
-            subjectPublicKeyInfo.print_as_json(o, "subject_public_key_info");
+        if (!get_subject_public_key_info().sequence.is_null()) {
+            get_subject_public_key_info().print_as_json(o, "subject_public_key_info");
         }
 
         if (!extensions.is_null()) {
@@ -1622,12 +1837,12 @@ struct x509_cert {
             extensions_array.close();
         }
 
-        if (!signature_algorithm.sequence.is_null()) {
-            signature_algorithm.print_as_json(o, "signature_algorithm");
+        if (!get_signature_algorithm().sequence.is_null()) {
+            get_signature_algorithm().print_as_json(o, "signature_algorithm");
         }
         if (!signature.value.is_not_readable()) {
 
-            enum oid alg_oid = signature_algorithm.type();
+            enum oid alg_oid = get_signature_algorithm().type();
             if (ecdsa_algorithms.find(alg_oid) != ecdsa_algorithms.end()) {
                 struct tlv tmp_sig = signature;
                 tmp_sig.remove_bitstring_encoding();
@@ -1641,12 +1856,12 @@ struct x509_cert {
                 o.print_key_uint("bits_in_signature", tmp_sig.value.bits_in_data());
             }
         }
-        report_violations(o, trusted_certs);
+        report_violations(o, trusted_issuers);
         report_key_group(o, key_group);
     }
 
     unsigned int bits_in_signature() const {
-        enum oid alg_oid = signature_algorithm.type();
+        enum oid alg_oid = get_signature_algorithm().type();
         if (ecdsa_algorithms.find(alg_oid) != ecdsa_algorithms.end()) {
             struct tlv tmp_sig = signature;
             tmp_sig.remove_bitstring_encoding();
@@ -1668,13 +1883,14 @@ struct x509_cert {
     }
 
     bool subject_key_is_weak() const {
-        if (subjectPublicKeyInfo.complete == false) {
+        const struct subject_public_key_info &spki = get_subject_public_key_info();
+        if (spki.complete == false) {
             return false;  // missing data
         }
 
-        enum oid alg_type = subjectPublicKeyInfo.algorithm.type();
+        enum oid alg_type = spki.algorithm.type();
         if (alg_type == rsaEncryption) {
-            struct tlv tmp_key = subjectPublicKeyInfo.subject_public_key;  // make copy to leave original intact
+            struct tlv tmp_key = spki.subject_public_key;  // make copy to leave original intact
             tmp_key.remove_bitstring_encoding();
             struct rsa_public_key pub_key(&tmp_key.value);
             if (pub_key.bits_in_modulus() < 2048) {
@@ -1684,8 +1900,8 @@ struct x509_cert {
                 return true;
             }
         } else if (alg_type == id_ecPublicKey) {
-            enum oid parameters = subjectPublicKeyInfo.algorithm.get_parameters();
-            std::unordered_set<unsigned int> strong_ec_parameters {
+            enum oid parameters = spki.algorithm.get_parameters();
+            static const std::unordered_set<unsigned int> strong_ec_parameters {
                 oid::prime256v1, // oid::secp256r1
                 oid::secp384r1,
                 oid::secp521r1
@@ -1694,7 +1910,7 @@ struct x509_cert {
                 return true;
             }
         } else if (alg_type == id_dsa) {
-            if (subjectPublicKeyInfo.subject_public_key.value.bits_in_data() < 2048) {
+            if (spki.subject_public_key.value.bits_in_data() < 2048) {
                 return true;
             }
         } else if (alg_type == id_Ed25519) {
@@ -1709,18 +1925,18 @@ struct x509_cert {
 
     bool signature_is_weak(bool unsigned_is_weak=false) const {
 
-        if (signature_algorithm.parameters.is_truncated()) {
+        if (get_signature_algorithm().parameters.is_truncated()) {
             fprintf(stdout, "truncated signature_algorithm\n");
             return false;   // missing data
         }
 
         if (!signature.is_null()) {
-            std::unordered_map<unsigned int, unsigned int> strong_ecdsa_algs{
+            static const std::unordered_map<unsigned int, unsigned int> strong_ecdsa_algs{
                 { oid::ecdsa_with_SHA256, 256 },
                 { oid::ecdsa_with_SHA1, 256 }
             };
 
-            enum oid alg_oid = signature_algorithm.type();
+            enum oid alg_oid = get_signature_algorithm().type();
             std::unordered_map<unsigned int, unsigned int>::const_iterator ecdsa_alg = strong_ecdsa_algs.find(alg_oid);
             if (ecdsa_alg != strong_ecdsa_algs.end()) {
 
@@ -1742,7 +1958,7 @@ struct x509_cert {
 
             }
 
-            std::unordered_map<unsigned int, unsigned int> strong_rsa_algs{
+            static const std::unordered_map<unsigned int, unsigned int> strong_rsa_algs{
                 // { "rsaEncryption", 2048 },
                 { oid::sha256WithRSAEncryption, 2048 },
                 { oid::sha384WithRSAEncryption, 2048 },
@@ -1777,14 +1993,16 @@ struct x509_cert {
     }
 
     bool is_nonconformant() const {
-        if (signature_algorithm.algorithm.is_null() || signature_identifier.algorithm.is_null()) {
+        const struct algorithm_identifier &sig_alg = get_signature_algorithm();
+        const struct algorithm_identifier &tbs_sig_alg = get_signature_identifier();
+        if (sig_alg.algorithm.is_null() || tbs_sig_alg.algorithm.is_null()) {
             return false;  // missing data
         }
-        if (signature_algorithm.algorithm.is_truncated() || signature_identifier.algorithm.is_truncated()) {
+        if (sig_alg.algorithm.is_truncated() || tbs_sig_alg.algorithm.is_truncated()) {
             return false;  // missing data
         }
-        enum oid sig_alg_type = signature_algorithm.type();
-        enum oid tbs_sig_alg_type = signature_identifier.type();
+        enum oid sig_alg_type = sig_alg.type();
+        enum oid tbs_sig_alg_type = tbs_sig_alg.type();
         if (sig_alg_type != tbs_sig_alg_type) {
             if (sig_alg_type == oid::unknown) {
                 return false;  // assume missing data (TBD: ?)
@@ -1795,45 +2013,41 @@ struct x509_cert {
     }
 
     bool is_not_currently_valid() const {
-        char time_str[16];
-        time_t t = time(NULL);
-        struct tm *tt = localtime(&t);
-        size_t retval = strftime(time_str, sizeof(time_str), "%y%m%d%H%M%SZ", tt);
-        if (retval == 0) {
+        static thread_local struct x509_current_time current_time;
+        const char *time_str = current_time.get();
+        if (time_str == NULL) {
             return true;  // error: can't get current time
         }
 
-        return !validity.contains(time_str, sizeof(time_str));
+        return !get_validity().contains(time_str, sizeof(current_time.time_str));
     }
 
-    bool is_trusted(const std::list<struct x509_cert> &trusted_certs) const {
-        if (trusted_certs.empty()) {
+    bool is_trusted(const struct x509_trusted_issuers &trusted_issuers) const {
+        if (trusted_issuers.empty()) {
             return true; // no trust list provided, so don't perform check
         }
-        for (auto &c : trusted_certs) {
-            if (c.issuer.matches(issuer)) {
-                return true;
-            }
+        if (issuer.RDNsequence.is_null()) {
+            return true; // missing data
         }
-        return false;
+        return trusted_issuers.contains(issuer);
     }
 
     void report_key_group(struct json_object_asn1 &o, struct dictionary *d) const {
         if (d) {
-            std::basic_string<uint8_t> s = subjectPublicKeyInfo.subject_public_key.value.get_bytestring();
+            std::basic_string<uint8_t> s = get_subject_public_key_info().subject_public_key.value.get_bytestring();
             unsigned int g = d->get(s);
             o.print_key_uint("key_group", g);
         }
     }
 
     void report_violations(struct json_object_asn1 &o,
-                           const std::list<struct x509_cert> &trusted_certs) const {
+                           const struct x509_trusted_issuers &trusted_issuers) const {
         bool not_currently_valid = is_not_currently_valid();
         bool self_issued = is_self_issued();
         bool weak_subject_key = subject_key_is_weak();
         bool weak_signature = signature_is_weak();
         bool nonconformant = is_nonconformant();
-        bool trusted = is_trusted(trusted_certs);
+        bool trusted = is_trusted(trusted_issuers);
 
         if (not_currently_valid || self_issued || weak_subject_key || weak_signature || nonconformant || !trusted) {
             struct json_array_asn1 violations{o, "violations"};
@@ -1868,20 +2082,20 @@ struct x509_cert {
         if (!serial_number.is_null()) {
             serial_number.print_as_json_hex(o, "serial_number");
         }
-        if (!signature_identifier.sequence.is_null()) {
-            signature_identifier.print_as_json(o, "signature_identifier");
+        if (!get_signature_identifier().sequence.is_null()) {
+            get_signature_identifier().print_as_json(o, "signature_identifier");
         }
         if (!issuer.RDNsequence.is_null()) {
             issuer.print_as_json(o, "issuer");
         }
-        if (!validity.sequence.is_null()) {
-            validity.print_as_json(o);
+        if (!get_validity().sequence.is_null()) {
+            get_validity().print_as_json(o);
         }
         if (!subject.RDNsequence.is_null()) {
             subject.print_as_json(o, "subject");
         }
-        if (!subjectPublicKeyInfo.sequence.is_null()) {
-            subjectPublicKeyInfo.print_as_json(o, "subject_public_key_info");
+        if (!get_subject_public_key_info().sequence.is_null()) {
+            get_subject_public_key_info().print_as_json(o, "subject_public_key_info");
         }
 
         if (!extensions.is_null()) {
@@ -1896,12 +2110,12 @@ struct x509_cert {
             extensions_array.close();
         }
 
-        if (!signature_algorithm.sequence.is_null()) {
-            signature_algorithm.print_as_json(o, "signature_algorithm");
+        if (!get_signature_algorithm().sequence.is_null()) {
+            get_signature_algorithm().print_as_json(o, "signature_algorithm");
         }
         if (!signature.is_null()) {
 
-            enum oid alg_oid = signature_algorithm.type();
+            enum oid alg_oid = get_signature_algorithm().type();
             if (ecdsa_algorithms.find(alg_oid) != ecdsa_algorithms.end()) {
                 struct tlv tmp_sig = signature;
                 tmp_sig.remove_bitstring_encoding();
@@ -1978,6 +2192,11 @@ struct x509_cert_prefix {
         return prefix.data_end - prefix.data;
     }
 
+    // is_not_empty() returns true if the prefix, up to the end of
+    // the issuer, could be parsed
+    //
+    bool is_not_empty() const { return prefix.is_not_empty(); }
+
     void print_as_json(struct buffer_stream &buf) const {
         json_object_asn1 o{&buf};
         o.print_key_hex("version", version.value);
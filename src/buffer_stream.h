@@ -10,6 +10,7 @@
 
 #include <string.h>  /* for memcpy() */
 #include "utils.h"
+#include "simd_encode.h"
 
 
 /* append_null(...)
@@ -155,11 +156,6 @@ static inline int append_memcpy(char *dstr, int *doff, int dlen, int *trunc, con
     }
 }
 
-static char hex_table[] = {'0', '1', '2', '3',
-                           '4', '5', '6', '7',
-                           '8', '9', 'a', 'b',
-                           'c', 'd', 'e', 'f'};
-
 static inline int append_raw_as_hex(char *dstr, int *doff, int dlen, int *trunc,
                                     const uint8_t *data, unsigned int len) {
 
@@ -167,6 +163,13 @@ static inline int append_raw_as_hex(char *dstr, int *doff, int dlen, int *trunc,
         return 0;
     }
 
+    /* if all of the output fits, encode it directly into dstr */
+    if (*doff + 2 * (ssize_t)len < dlen - 1) {
+        int r = simd_encoder_select().hex(dstr + *doff, data, len);
+        *doff += r;
+        return r;
+    }
+
     int r = 0;
     char outb[256]; /* A local buffer of up to 256 hex chars at a time */
     int oi = 0;    /* The index into the output buffer */
@@ -476,6 +479,15 @@ static inline int append_json_string_escaped(char *dstr, int *doff, int dlen, in
     r += append_strncpy(dstr, doff, dlen, trunc, key);
     r += append_strncpy(dstr, doff, dlen, trunc, "\":\"");
 
+    /* if the output fits even if every byte is escaped, write it directly */
+    if (*trunc == 0 && *doff + 6 * (ssize_t)len + 1 <= dlen - 1) {
+        int n = simd_encoder_select().json_escape(dstr + *doff, data, len);
+        *doff += n;
+        r += n;
+        r += append_putc(dstr, doff, dlen, trunc, '"');
+        return r;
+    }
+
     for (unsigned int i = 0; (i < len) && (*trunc == 0); i++) {
         if ((data[i] < 0x20) || /* escape control characters   */
             (data[i] > 0x7f)) { /* escape non-ASCII characters */
@@ -536,16 +548,6 @@ static inline int append_json_string(char *dstr, int *doff, int dlen, int *trunc
 }
 
 
-static char encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
-                                'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
-                                'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
-                                'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
-                                'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
-                                'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
-                                'w', 'x', 'y', 'z', '0', '1', '2', '3',
-                                '4', '5', '6', '7', '8', '9', '+', '/'};
-
-
 static inline int append_raw_as_base64(char *dstr, int *doff, int dlen, int *trunc,
                                        const unsigned char *data,
                                        size_t input_length) {
@@ -554,6 +556,15 @@ static inline int append_raw_as_base64(char *dstr, int *doff, int dlen, int *tru
         return 0;
     }
 
+    /* if all of the output fits, encode it directly into dstr */
+    if (*doff + 2 + (ssize_t)base64_length(input_length) <= dlen - 1) {
+        dstr[*doff] = '"';
+        int r = simd_encoder_select().base64(dstr + *doff + 1, data, input_length);
+        dstr[*doff + 1 + r] = '"';
+        *doff += r + 2;
+        return r + 2;
+    }
+
     int r = 0;
     size_t i = 0;
     size_t rem = input_length % 3; /* so it can be 0, 1 or 2 */
@@ -74,6 +74,14 @@ static enum status mercury_config_parse_line(struct mercury_config *cfg, char *l
         cfg->read_filename = strdup(arg);
         return status_ok;
 
+    } else if ((arg = command_get_argument("write-direct=", line)) != NULL) {
+        /* note: must be checked before write=, which matches its prefix */
+        return argument_parse_as_boolean(arg, &cfg->write_direct);
+
+    } else if ((arg = command_get_argument("write-limit=", line)) != NULL) {
+        /* note: must be checked before write=, which matches its prefix */
+        return argument_parse_as_uint64(arg, &cfg->write_rotate);
+
     } else if ((arg = command_get_argument("write=", line)) != NULL) {
         cfg->write_filename = strdup(arg);
         return status_ok;
@@ -86,6 +94,14 @@ static enum status mercury_config_parse_line(struct mercury_config *cfg, char *l
         cfg->capture_interface = strdup(arg);
         return status_ok;
 
+    } else if ((arg = command_get_argument("keylog=", line)) != NULL) {
+        cfg->keylog = strdup(arg);
+        return status_ok;
+
+    } else if ((arg = command_get_argument("subnet-labels=", line)) != NULL) {
+        cfg->subnet_labels = strdup(arg);
+        return status_ok;
+
     } else if ((arg = command_get_argument("resources=", line)) != NULL) {
         cfg->resources = strdup(arg);
         return status_ok;
@@ -128,16 +144,58 @@ static enum status mercury_config_parse_line(struct mercury_config *cfg, char *l
         cfg->packet_filter_cfg = strdup(arg);
         return status_ok;
 
+    } else if ((arg = command_get_argument("os-identification=", line)) != NULL) {
+        cfg->os_identification_file = strdup(arg);
+        return status_ok;
+
+    } else if ((arg = command_get_argument("os-max-hosts=", line)) != NULL) {
+        int tmp;
+        if (argument_parse_as_int(arg, &tmp) == status_ok && tmp > 0) {
+            cfg->os_max_hosts = tmp;
+            return status_ok;
+        }
+        return status_err;
+
+    } else if ((arg = command_get_argument("os-idle-timeout=", line)) != NULL) {
+        int tmp;
+        if (argument_parse_as_int(arg, &tmp) == status_ok && tmp > 0) {
+            cfg->os_idle_timeout = tmp;
+            return status_ok;
+        }
+        return status_err;
+
+    } else if ((arg = command_get_argument("shm-size=", line)) != NULL) {
+        uint64_t megabytes;
+        if (argument_parse_as_uint64(arg, &megabytes) != status_ok) {
+            return status_err;
+        }
+        cfg->shm_size = megabytes * 1024 * 1024;
+        return status_ok;
+
+    } else if ((arg = command_get_argument("shm=", line)) != NULL) {   /* note: must follow shm-size= */
+        cfg->shm = strdup(arg);
+        return status_ok;
+
+    } else if ((arg = command_get_argument("snaplen=", line)) != NULL) {
+        return argument_parse_as_int(arg, &cfg->snaplen);
+
+    } else if ((arg = command_get_argument("nanosecond=", line)) != NULL) {
+        return argument_parse_as_boolean(arg, &cfg->nanosecond);
+
+    } else if ((arg = command_get_argument("metrics=", line)) != NULL) {
+        cfg->metrics = strdup(arg);
+        return status_ok;
+
     } else if ((arg = command_get_argument("dns-json", line)) != NULL) {
-        global_vars.dns_json_output = true;
+        cfg->libmerc.dns_json_output = true;
         return status_ok;
 
     } else if ((arg = command_get_argument("certs-json", line)) != NULL) {
-        global_vars.certs_json_output = true;
+        cfg->libmerc.certs_json_output = true;
         return status_ok;
 
     } else if ((arg = command_get_argument("metadata", line)) != NULL) {
-        global_vars.metadata_output = true;
+        cfg->libmerc.metadata_output = true;
         return status_ok;
 
     } else {
@@ -0,0 +1,184 @@
+/*
+ * batch.cc
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <thread>
+#include "batch.h"
+#include "../dns.h"
+#include "../tls.h"
+
+/*
+ * batch_num_threads(num_threads) returns num_threads, or if that is
+ * zero, the number of hardware threads; hardware_concurrency() may
+ * return zero when that number is not known, so at least one thread
+ * is always returned
+ */
+static unsigned int batch_num_threads(unsigned int num_threads) {
+    if (num_threads == 0) {
+        num_threads = std::thread::hardware_concurrency();
+    }
+    return num_threads ? num_threads : 1;
+}
+
+/*
+ * parallel_for(n, num_threads, f) calls f(begin, end) for consecutive
+ * ranges of [0, n) on num_threads threads, which take ranges of
+ * batch_chunk_size elements from a shared counter, so that the work is
+ * balanced even when elements differ in cost.  Each thread calls
+ * thread_init() first, and stops if it returns false.
+ */
+static const size_t batch_chunk_size = 64;
+
+template <typename I, typename F>
+static void parallel_for(size_t n, unsigned int num_threads, I thread_init, F f) {
+    num_threads = batch_num_threads(num_threads);
+    size_t num_chunks = (n + batch_chunk_size - 1) / batch_chunk_size;
+    if (num_threads > num_chunks) {
+        num_threads = num_chunks;
+    }
+    if (num_threads == 0) {
+        return;
+    }
+
+    std::atomic<size_t> next{0};
+    auto worker = [&](unsigned int tnum) {
+        if (!thread_init(tnum)) {
+            return;
+        }
+        size_t begin;
+        while ((begin = next.fetch_add(batch_chunk_size)) < n) {
+            f(tnum, begin, std::min(begin + batch_chunk_size, n));
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < num_threads; i++) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
+void fingerprint_columns::resize(size_t n) {
+    type.assign(n, fingerprint_type_unknown);
+    fingerprint.assign(n, std::string{});
+    server_name.assign(n, std::string{});
+    src_ip.assign(n, std::string{});
+    dst_ip.assign(n, std::string{});
+    src_port.assign(n, 0);
+    dst_port.assign(n, 0);
+    protocol.assign(n, 0);
+    analysis_valid.assign(n, 0);
+    process.assign(n, std::string{});
+    score.assign(n, 0.0);
+    malware.assign(n, 0);
+    p_malware.assign(n, 0.0);
+}
+
+static std::string addr_to_string(uint8_t ip_version, const uint8_t *addr) {
+    char s[INET6_ADDRSTRLEN];
+    if (inet_ntop(ip_version == 6 ? AF_INET6 : AF_INET, addr, s, sizeof(s)) == NULL) {
+        return std::string{};
+    }
+    return std::string{s};
+}
+
+int batch_fingerprint_packets(const std::vector<batch_input> &in,
+                              struct fingerprint_columns &out,
+                              const struct mercury_resources *resources,
+                              const struct libmerc_config *config,
+                              unsigned int num_threads) {
+
+    out.resize(in.size());
+
+    std::vector<struct mercury_context *> ctx(batch_num_threads(num_threads), nullptr);
+    std::atomic<bool> failed{false};
+    auto init = [&](unsigned int tnum) {
+        ctx[tnum] = mercury_context_init(resources, config);
+        if (ctx[tnum] == nullptr) {
+            failed = true;
+            return false;
+        }
+        return true;
+    };
+    parallel_for(in.size(), ctx.size(), init, [&](unsigned int tnum, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            struct mercury_fingerprint_result r;
+            if (!mercury_context_get_fingerprint(ctx[tnum], (uint8_t *)in[i].data, in[i].length, &r)) {
+                continue;
+            }
+            out.type[i] = r.type;
+            out.fingerprint[i] = r.fingerprint;
+            if (r.server_name) {
+                out.server_name[i] = r.server_name;
+            }
+            out.src_ip[i] = addr_to_string(r.flow_key.ip_version, r.flow_key.src_addr);
+            out.dst_ip[i] = addr_to_string(r.flow_key.ip_version, r.flow_key.dst_addr);
+            out.src_port[i] = r.flow_key.src_port;
+            out.dst_port[i] = r.flow_key.dst_port;
+            out.protocol[i] = r.flow_key.protocol;
+            if (r.analysis.valid) {
+                out.analysis_valid[i] = 1;
+                out.process[i] = r.analysis.process;
+                out.score[i] = r.analysis.score;
+                out.malware[i] = r.analysis.malware;
+                out.p_malware[i] = r.analysis.p_malware;
+            }
+        }
+    });
+    for (auto c : ctx) {
+        mercury_context_finalize(c);
+    }
+
+    return failed ? -1 : 0;
+}
+
+/*
+ * parse_to_json_array(in, out, num_threads, f) sets out to a JSON
+ * array of the JSON objects f(in[i]), which are computed in parallel
+ */
+template <typename F>
+static void parse_to_json_array(const std::vector<batch_input> &in, std::string &out, unsigned int num_threads, F f) {
+    std::vector<std::string> json(in.size());
+    parallel_for(in.size(), num_threads, [](unsigned int) { return true; }, [&](unsigned int, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            json[i] = f(in[i]);
+            if (json[i].empty()) {
+                json[i] = "{}";
+            }
+        }
+    });
+
+    size_t length = 2 + in.size();
+    for (const auto &s : json) {
+        length += s.length();
+    }
+    out.clear();
+    out.reserve(length);
+    out += '[';
+    for (size_t i = 0; i < json.size(); i++) {
+        if (i) {
+            out += ',';
+        }
+        out += json[i];
+    }
+    out += ']';
+}
+
+void batch_parse_certs(const std::vector<batch_input> &in, std::string &out, unsigned int num_threads) {
+    parse_to_json_array(in, out, num_threads, [](const batch_input &x) {
+        return x509_cert_get_json_string(x.data, x.length);
+    });
+}
+
+void batch_parse_dns(const std::vector<batch_input> &in, std::string &out, unsigned int num_threads) {
+    parse_to_json_array(in, out, num_threads, [](const batch_input &x) {
+        return dns_get_json_string((const char *)x.data, x.length);
+    });
+}
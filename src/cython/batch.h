@@ -0,0 +1,80 @@
+/*
+ * batch.h
+ *
+ * batch processing of packets, certificates, and DNS messages on
+ * multiple threads, for the cython interface (mercury.pyx).  These
+ * functions do not touch the python interpreter, so that it can
+ * release the GIL while they run.
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "../libmerc.h"
+
+/*
+ * struct batch_input is one element of a batch: a packet (starting
+ * with its Ethernet header), a DER certificate, or a DNS message
+ */
+struct batch_input {
+    const uint8_t *data;
+    size_t length;
+};
+
+/*
+ * struct fingerprint_columns holds the fingerprints of a batch of
+ * packets, one column per field, each with one element per packet.
+ * Packets without a fingerprint have type fingerprint_type_unknown,
+ * and empty strings.  The analysis columns are set only for TLS
+ * clients, when analysis is configured and the fingerprint is in the
+ * database; analysis_valid is nonzero for those packets.
+ */
+struct fingerprint_columns {
+    std::vector<uint8_t> type;               /* enum fingerprint_type */
+    std::vector<std::string> fingerprint;
+    std::vector<std::string> server_name;
+    std::vector<std::string> src_ip;
+    std::vector<std::string> dst_ip;
+    std::vector<uint16_t> src_port;
+    std::vector<uint16_t> dst_port;
+    std::vector<uint8_t> protocol;
+    std::vector<uint8_t> analysis_valid;
+    std::vector<std::string> process;
+    std::vector<double> score;
+    std::vector<uint8_t> malware;
+    std::vector<double> p_malware;
+
+    void resize(size_t n);
+};
+
+/*
+ * batch_fingerprint_packets(in, out, resources, config, num_threads)
+ * sets out to the fingerprints of the packets in, found by
+ * num_threads threads (or one per CPU, if num_threads is zero), each
+ * with its own libmerc context created from resources and config.
+ * Returns 0 on success, and -1 if a context could not be created.
+ */
+int batch_fingerprint_packets(const std::vector<batch_input> &in,
+                              struct fingerprint_columns &out,
+                              const struct mercury_resources *resources,
+                              const struct libmerc_config *config,
+                              unsigned int num_threads);
+
+/*
+ * batch_parse_certs(in, out, num_threads) and batch_parse_dns(in,
+ * out, num_threads) parse the certificates or DNS messages in on
+ * num_threads threads (or one per CPU, if num_threads is zero), and
+ * set out to a JSON array with one object for each of them
+ */
+void batch_parse_certs(const std::vector<batch_input> &in, std::string &out, unsigned int num_threads);
+
+void batch_parse_dns(const std::vector<batch_input> &in, std::string &out, unsigned int num_threads);
+
+#endif /* BATCH_H */
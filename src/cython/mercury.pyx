@@ -2,10 +2,13 @@
 
 import json
 from base64 import b64decode
+from array import array
 
 from libcpp.unordered_map cimport unordered_map
 from libcpp.string cimport string
+from libcpp.vector cimport vector
 from libc.stdio cimport *
+from libc.stdint cimport uint8_t, uint16_t
 
 ### BUILD INSTRUCTIONS
 # To build in-place:
@@ -14,11 +17,9 @@ from libc.stdio cimport *
 #   CC=g++ python setup.py install
 
 
-# imports from mercury's asn1 parser
-cdef extern from "../asn1/x509.h":
-    cdef struct x509_cert:
-        void parse(const void *buffer, unsigned int len)
-        string get_json_string()
+# imports from mercury's asn1 parser, through tls.h (see the note there)
+cdef extern from "../tls.h":
+    string x509_cert_get_json_string(const uint8_t *data, size_t length)
 
 # imports from mercury's dns
 cdef extern from "../dns.h":
@@ -32,16 +33,12 @@ cdef extern from "../dns.h":
 def parse_cert(str b64_cert):
     cdef bytes cert = b64decode(b64_cert)
     cdef unsigned int len_ = len(cert)
-    cdef x509_cert x
 
     # create reference to cert so that it doesn't get garbage collected
     cdef char* c_string_ref = cert
 
-    # use mercury's asn1 parser to parse certificate data
-    x.parse(<const void*>c_string_ref, len_)
-
-    # get JSON string and return JSON object
-    return json.loads(x.get_json_string())
+    # use mercury's asn1 parser to parse certificate data, and return JSON object
+    return json.loads(x509_cert_get_json_string(<const uint8_t*>c_string_ref, len_))
 
 
 # parse_dns
@@ -57,3 +54,196 @@ def parse_dns(str b64_dns):
     # use mercury's dns parser to parse the DNS request
     return json.loads(dns_get_json_string(c_string_ref, len_))
 
+
+# imports from libmerc and the batch interface (batch.h)
+cdef extern from "../libmerc.h":
+    cdef struct tls_keylog:
+        pass
+    cdef struct subnet_db:
+        pass
+    cdef struct libmerc_config:
+        bint do_analysis
+        bint dns_json_output
+        bint certs_json_output
+        bint metadata_output
+        const char *packet_filter_cfg
+        const tls_keylog *keylog
+        const subnet_db *subnet_labels
+    cdef struct mercury_resources:
+        pass
+    mercury_resources *mercury_resources_init(const char *resource_dir, int verbosity)
+    void mercury_resources_finalize(mercury_resources *resources)
+
+cdef extern from "batch.h":
+    cdef struct batch_input:
+        const uint8_t *data
+        size_t length
+    cdef struct fingerprint_columns:
+        vector[uint8_t] type
+        vector[string] fingerprint
+        vector[string] server_name
+        vector[string] src_ip
+        vector[string] dst_ip
+        vector[uint16_t] src_port
+        vector[uint16_t] dst_port
+        vector[uint8_t] protocol
+        vector[uint8_t] analysis_valid
+        vector[string] process
+        vector[double] score
+        vector[uint8_t] malware
+        vector[double] p_malware
+    int batch_fingerprint_packets(const vector[batch_input] &inputs, fingerprint_columns &out,
+                                  const mercury_resources *resources, const libmerc_config *config,
+                                  unsigned int num_threads) nogil
+    void batch_parse_certs(const vector[batch_input] &inputs, string &out, unsigned int num_threads) nogil
+    void batch_parse_dns(const vector[batch_input] &inputs, string &out, unsigned int num_threads) nogil
+
+
+# names of the values of enum fingerprint_type, as used in mercury's JSON output
+fingerprint_type_names = [None, 'tcp', 'tls', 'tls_sni', 'tls_server', 'http', 'http_server',
+                          'dhcp', 'dtls', 'dtls_server', 'ssh', 'ssh_kex', 'quic']
+
+
+# Resources
+#  Input: resource_dir - directory holding mercury's analysis resources, or
+#         None for mercury's default resource directories
+#  Loads the fingerprint and subnet databases once, so that they can be
+#  shared by any number of calls to fingerprint_packets()
+cdef class Resources:
+    cdef mercury_resources *resources
+
+    def __cinit__(self, resource_dir=None, int verbosity=0):
+        cdef bytes dir_bytes
+        if resource_dir is None:
+            self.resources = mercury_resources_init(NULL, verbosity)
+        else:
+            dir_bytes = resource_dir.encode()
+            self.resources = mercury_resources_init(dir_bytes, verbosity)
+        if self.resources == NULL:
+            raise RuntimeError('could not load mercury resources')
+
+    def __dealloc__(self):
+        mercury_resources_finalize(self.resources)
+
+
+# batch inputs are either a sequence of bytes-like objects, or a single
+# bytes-like object holding all of them back to back, along with a
+# sequence of n+1 offsets, such that element i is data[offsets[i]:offsets[i+1]].
+# The returned list holds the memoryviews that must stay alive while the
+# batch is processed.
+cdef list get_batch_inputs(data, offsets, vector[batch_input] &inputs):
+    cdef const uint8_t[::1] view
+    cdef batch_input x
+    cdef size_t begin, end
+    keep = []
+    if offsets is None:
+        inputs.reserve(len(data))
+        for d in data:
+            view = d
+            keep.append(view)
+            x.data = &view[0] if view.shape[0] > 0 else NULL
+            x.length = view.shape[0]
+            inputs.push_back(x)
+    else:
+        view = data
+        keep.append(view)
+        if len(offsets) > 0:
+            inputs.reserve(len(offsets) - 1)
+        for i in range(1, len(offsets)):
+            begin = offsets[i - 1]
+            end = offsets[i]
+            if begin > end or end > <size_t>view.shape[0]:
+                raise ValueError('offsets must be nondecreasing, and within data')
+            x.data = &view[0] + begin if end > begin else NULL
+            x.length = end - begin
+            inputs.push_back(x)
+    return keep
+
+
+cdef list string_column(vector[string] &v):
+    return [s.decode('utf-8', 'replace') if s.size() > 0 else None for s in v]
+
+
+# fingerprint_packets
+#  Input: packets - sequence of bytes-like objects, each an Ethernet frame,
+#                   or a single bytes-like object and offsets (see above)
+#         num_threads - number of threads, or 0 for one per CPU
+#         resources - Resources object, to report the analysis of TLS clients
+#         select - protocols to report, as in mercury's --select option
+#  Output: dict of columns, each with one element per packet; packets
+#          without a fingerprint have type None.  The ports, protocol,
+#          score, and p_malware columns are arrays.
+#  The packets are processed without holding the GIL.
+def fingerprint_packets(packets, offsets=None, unsigned int num_threads=0, Resources resources=None, str select=None):
+    cdef vector[batch_input] inputs
+    cdef fingerprint_columns out
+    cdef libmerc_config config
+    cdef mercury_resources *r = NULL
+    cdef bytes select_bytes
+    cdef int status
+
+    keep = get_batch_inputs(packets, offsets, inputs)
+    config.do_analysis = resources is not None
+    config.dns_json_output = False
+    config.certs_json_output = False
+    config.metadata_output = False
+    config.packet_filter_cfg = NULL
+    config.keylog = NULL
+    config.subnet_labels = NULL
+    if resources is not None:
+        r = resources.resources
+    if select is not None:
+        select_bytes = select.encode()
+        config.packet_filter_cfg = select_bytes
+
+    with nogil:
+        status = batch_fingerprint_packets(inputs, out, r, &config, num_threads)
+    if status != 0:
+        raise RuntimeError('could not create libmerc context')
+
+    result = {
+        'type': [fingerprint_type_names[t] for t in out.type],
+        'fingerprint': string_column(out.fingerprint),
+        'server_name': string_column(out.server_name),
+        'src_ip': string_column(out.src_ip),
+        'dst_ip': string_column(out.dst_ip),
+        'src_port': array('H', out.src_port),
+        'dst_port': array('H', out.dst_port),
+        'protocol': array('B', out.protocol),
+    }
+    if resources is not None:
+        result['process'] = [out.process[i].decode() if out.analysis_valid[i] else None for i in range(out.process.size())]
+        result['score'] = array('d', out.score)
+        result['malware'] = [bool(m) for m in out.malware]
+        result['p_malware'] = array('d', out.p_malware)
+    return result
+
+
+# parse_certs
+#  Input: certs - sequence of bytes-like objects, each a DER certificate,
+#                 or a single bytes-like object and offsets (see above)
+#         num_threads - number of threads, or 0 for one per CPU
+#  Output: list of JSON objects containing the parsed certificates
+#  The certificates are parsed without holding the GIL.
+def parse_certs(certs, offsets=None, unsigned int num_threads=0):
+    cdef vector[batch_input] inputs
+    cdef string out
+    keep = get_batch_inputs(certs, offsets, inputs)
+    with nogil:
+        batch_parse_certs(inputs, out, num_threads)
+    return json.loads(out)
+
+
+# parse_dns_messages
+#  Input: messages - sequence of bytes-like objects, each a DNS message,
+#                    or a single bytes-like object and offsets (see above)
+#         num_threads - number of threads, or 0 for one per CPU
+#  Output: list of JSON objects containing the parsed DNS messages
+#  The messages are parsed without holding the GIL.
+def parse_dns_messages(messages, offsets=None, unsigned int num_threads=0):
+    cdef vector[batch_input] inputs
+    cdef string out
+    keep = get_batch_inputs(messages, offsets, inputs)
+    with nogil:
+        batch_parse_dns(inputs, out, num_threads)
+    return json.loads(out)
@@ -10,20 +10,35 @@ from distutils.extension import Extension
 ## Notes:
 #
 # "-Wno-narrowing" was needed because of the OID char conversions on my platform
-# "../parser.c" is needed to include parser functions
+# the libmerc sources are compiled here, rather than linked from
+#   libmerc.a, because the extension needs position independent code
 # "-std=c++11" is needed due to c++11 dependency
 
-sources = ['mercury.pyx','../dns.c','../utils.c','../parser.c']
+libmerc = ['analysis.cc', 'addr.cc', 'dns.cc', 'extractor.cc', 'http.cc',
+           'http2.cc', 'libmerc.cc', 'match.cc', 'os_identification.cc',
+           'packet.cc', 'quic.cc', 'ssh.cc', 'tls.cc', 'tls_decrypt.cc',
+           'udp.cc', 'utils.cc', 'wireguard.cc',
+           'lctrie/lctrie.c', 'lctrie/lctrie_dir24.c', 'lctrie/lctrie_bgp.c', 'lctrie/lctrie_ip.c']
+
+sources = ['mercury.pyx', 'batch.cc'] + ['../' + s for s in libmerc]
+
+# the lctrie library is C, and must be compiled as C even when CC=g++
+class build_ext_lctrie(build_ext):
+    def build_extensions(self):
+        compile = self.compiler._compile
+        def _compile(obj, src, ext, cc_args, extra_postargs, pp_opts):
+            if src.endswith('.c'):
+                cc_args = ['-x', 'c'] + cc_args
+                extra_postargs = [a for a in extra_postargs if a != '-std=c++11']
+            compile(obj, src, ext, cc_args, extra_postargs, pp_opts)
+        self.compiler._compile = _compile
+        build_ext.build_extensions(self)
 
 setup(ext_modules=[Extension("mercury",
                              sources=sources,
                              language="c++",
-                             extra_compile_args=["-std=c++11","-Wno-narrowing"],
-                             extra_link_args=["-std=c++11",],
-                             runtime_library_dirs=['../'])
+                             extra_compile_args=["-std=c++11","-Wno-narrowing","-pthread"],
+                             extra_link_args=["-std=c++11","-pthread"],
+                             libraries=["z", "crypto"])
                   ],
-      cmdclass={'build_ext':build_ext})
-
-
-
-
+      cmdclass={'build_ext':build_ext_lctrie})
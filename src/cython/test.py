@@ -8,3 +8,11 @@ print(parse_cert(b64_cert))
 b64_dns = '1e2BgAABAAAAAQAABGxpdmUGZ2l0aHViA2NvbQAAHAABwBEABgABAAABzQBIB25zLTE3MDcJYXdzZG5zLTIxAmNvAnVrABFhd3NkbnMtaG9zdG1hc3RlcgZhbWF6b27AGAAAAAEAABwgAAADhAASdQAAAVGA'
 
 print(parse_dns(b64_dns))
+
+# batch interface: parse many certificates or DNS messages at once, on
+# multiple threads, without holding the GIL
+from base64 import b64decode
+certs = [b64decode(b64_cert)] * 1000
+print(len(parse_certs(certs, num_threads=4)))
+dns = b64decode(b64_dns)
+print(parse_dns_messages(dns * 3, offsets=[0, len(dns), 2*len(dns), 3*len(dns)]))
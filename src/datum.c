@@ -10,7 +10,7 @@
 #include <stdio.h>
 #include <arpa/inet.h>  /* for htons()  */
 #include <net/ethernet.h>
-#include "parser.h"
+#include "datum.h"
 #include "utils.h"
 #include "eth.h"
 
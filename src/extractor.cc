@@ -773,6 +773,12 @@ unsigned int packet_filter_process_tcp(struct packet_filter *pf, struct key *k)
 
     const struct tcp_header *tcp = (const struct tcp_header *)data;
     if (pf->tcp_init_msg_filter) {
+        size_t hdr_len = tcp_offrsv_get_length(tcp->offrsv);
+        if (parser_get_data_length(p) >= TCP_FIXED_HDR_LEN && hdr_len >= TCP_FIXED_HDR_LEN && data + hdr_len <= p->data_end) {
+            /* note the start of the payload, for packet_filter_truncated_length() */
+            x->transport_data.data = data + hdr_len;
+            x->transport_data.data_end = p->data_end;
+        }
         return pf->tcp_init_msg_filter->apply(*k, tcp, parser_get_data_length(p));
     }
 
@@ -2348,8 +2354,14 @@ size_t packet_filter_extract(struct packet_filter *pf, struct key *k, uint8_t *p
     return packet_filter_process_packet(pf, k);
 }
 
+/*
+ * packet_filter_threshold is a (somewhat arbitrary) threshold used in
+ * the packet metadata filter; it will probably get eliminated soon,
+ * in favor of extractor::proto_state::state, but for now it remains
+ */
+unsigned int packet_filter_threshold = 7;
+
 bool packet_filter_apply(struct packet_filter *pf, uint8_t *packet, size_t length) {
-    extern unsigned int packet_filter_threshold;
     struct key k;
     size_t bytes_extracted = packet_filter_extract(pf, &k, packet, length);
     if (bytes_extracted > packet_filter_threshold) {
@@ -2358,6 +2370,91 @@ bool packet_filter_apply(struct packet_filter *pf, uint8_t *packet, size_t lengt
     return false;
 }
 
+/*
+ * tls_handshake_length(data, len) returns the length of the TLS
+ * handshake records at the start of data, or len if the last of them
+ * continues past the end of data
+ */
+static size_t tls_handshake_length(const uint8_t *data, size_t len) {
+    const uint8_t handshake = 0x16;
+    size_t offset = 0;
+    while (offset + L_ContentType + L_ProtocolVersion + L_RecordLength <= len && data[offset] == handshake) {
+        size_t record_len = (data[offset + 3] << 8) | data[offset + 4];
+        offset += L_ContentType + L_ProtocolVersion + L_RecordLength + record_len;
+    }
+    return offset < len ? offset : len;
+}
+
+/*
+ * http_headers_length(data, len) returns the length of the HTTP start
+ * line and headers at the start of data, including the empty line that
+ * ends them, or len if that line is not in data
+ */
+static size_t http_headers_length(const uint8_t *data, size_t len) {
+    const uint8_t *end = (const uint8_t *)memmem(data, len, "\r\n\r\n", 4);
+    return end ? (end + 4) - data : len;
+}
+
+size_t packet_filter_truncated_length(const struct packet_filter *pf,
+                                      const uint8_t *packet,
+                                      size_t length,
+                                      size_t payload_cap) {
+
+    return message_truncated_length(packet, length, pf->x.msg_type, pf->x.transport_data.data, payload_cap);
+}
+
+size_t message_truncated_length(const uint8_t *packet,
+                                size_t length,
+                                enum msg_type msg_type,
+                                const uint8_t *payload,
+                                size_t payload_cap) {
+
+    if (payload == NULL || payload < packet || payload > packet + length) {
+        return length;  /* TCP SYN, or no payload; the headers are all we have */
+    }
+    size_t header_len = payload - packet;
+    size_t payload_len = length - header_len;
+
+    size_t message_len;
+    switch (msg_type) {
+    case msg_type_tls_client_hello:
+    case msg_type_tls_server_hello:
+        message_len = tls_handshake_length(payload, payload_len);
+        break;
+    case msg_type_http_request:
+    case msg_type_http_response:
+        message_len = http_headers_length(payload, payload_len);
+        break;
+    case msg_type_unknown:
+        /*
+         * the TCP initial message filter does not identify protocols
+         * (and the masks used to do so are cleared for the protocols
+         * not selected), so we recognize TLS and HTTP messages here
+         */
+        if (payload_len > L_ContentType + L_ProtocolVersion && payload[0] == 0x16 && payload[1] == 0x03) {
+            message_len = tls_handshake_length(payload, payload_len);
+        } else if (payload_len > 0 && isupper(payload[0])) {
+            message_len = http_headers_length(payload, payload_len);
+            if (message_len == payload_len) {
+                message_len = 0;   /* not HTTP, as far as we can tell */
+            }
+        } else {
+            message_len = 0;
+        }
+        break;
+    default:
+        /*
+         * certificate continuations, SSH, DTLS, DNS, DHCP, WireGuard,
+         * and QUIC Initial messages are used in full
+         */
+        message_len = payload_len;
+    }
+    if (message_len < payload_cap) {
+        message_len = payload_cap < payload_len ? payload_cap : payload_len;
+    }
+    return header_len + message_len;
+}
+
 /*
  * configuration for protocol identification
  */
@@ -2365,19 +2462,24 @@ bool packet_filter_apply(struct packet_filter *pf, uint8_t *packet, size_t lengt
 extern unsigned char dhcp_client_mask[8];  /* udp.c */
 extern unsigned char dns_server_mask[8];   /* udp.c */
 extern unsigned char wireguard_mask[8];    /* udp.c */
+extern bool select_quic;                   /* udp.c */
 
 
-enum status proto_ident_config(const char *config_string) {
-    if (config_string == NULL) {
-        return status_ok;    /* use the default configuration */
-    }
+/*
+ * protocol_list_parse(config_string, protocols) sets the entries of
+ * protocols to true for each protocol named in config_string, a
+ * comma-separated list
+ */
+static enum status protocol_list_parse(const char *config_string,
+                                       std::map<std::string, bool> &protocols) {
 
-    std::map<std::string, bool> protocols{
+    protocols = {
         { "all",         false },
         { "dhcp",        false },
         { "dns",         false },
         { "dtls",        false },
         { "http",        false },
+        { "quic",        false },
         { "ssh",         false },
         { "tcp",         false },
         { "tcp.message", false },
@@ -2411,6 +2513,18 @@ enum status proto_ident_config(const char *config_string) {
         fprintf(stderr, "error: unrecognized filter command \"%s\"\n", token.c_str());
         return status_err;
     }
+    return status_ok;
+}
+
+enum status proto_ident_config(const char *config_string) {
+    if (config_string == NULL) {
+        return status_ok;    /* use the default configuration */
+    }
+
+    std::map<std::string, bool> protocols;
+    if (protocol_list_parse(config_string, protocols) != status_ok) {
+        return status_err;
+    }
 
     if (protocols["all"] == true) {
         return status_ok;
@@ -2444,6 +2558,47 @@ enum status proto_ident_config(const char *config_string) {
     if (protocols["wireguard"] == false) {
         bzero(wireguard_mask, sizeof(wireguard_mask));
     }
+    if (protocols["quic"] == false) {
+        select_quic = 0;
+    }
+    return status_ok;
+}
+
+enum status protocol_selection_init(struct protocol_selection *sel, const char *config_string) {
+    for (bool &m : sel->msg_type) {
+        m = true;
+    }
+    sel->tcp_syn = true;
+    sel->tcp_message = false;
+    if (config_string == NULL) {
+        return status_ok;    /* select all protocols */
+    }
+
+    std::map<std::string, bool> protocols;
+    if (protocol_list_parse(config_string, protocols) != status_ok) {
+        return status_err;
+    }
+
+    if (protocols["all"] == true) {
+        return status_ok;
+    }
+    sel->msg_type[msg_type_dhcp] = protocols["dhcp"];
+    sel->msg_type[msg_type_dns] = protocols["dns"];
+    sel->msg_type[msg_type_dtls_client_hello] = protocols["dtls"];
+    sel->msg_type[msg_type_dtls_server_hello] = protocols["dtls"];
+    sel->msg_type[msg_type_dtls_certificate] = protocols["dtls"];
+    sel->msg_type[msg_type_http_request] = protocols["http"];
+    sel->msg_type[msg_type_http_response] = protocols["http"];
+    sel->msg_type[msg_type_ssh] = protocols["ssh"];
+    sel->msg_type[msg_type_ssh_kex] = protocols["ssh"];
+    sel->msg_type[msg_type_tls_client_hello] = protocols["tls"];
+    sel->msg_type[msg_type_tls_server_hello] = protocols["tls"];
+    sel->msg_type[msg_type_tls_certificate] = protocols["tls"];
+    sel->msg_type[msg_type_wireguard] = protocols["wireguard"];
+    sel->msg_type[msg_type_quic] = protocols["quic"];
+    sel->tcp_message = protocols["tcp.message"];
+    sel->tcp_syn = protocols["tcp"] && !sel->tcp_message;
+
     return status_ok;
 }
 
@@ -18,21 +18,6 @@
 #include "proto_identify.h"
 
 
-enum fingerprint_type {
-    fingerprint_type_unknown     = 0,
-    fingerprint_type_tcp         = 1,
-    fingerprint_type_tls         = 2,
-    fingerprint_type_tls_sni     = 3,
-    fingerprint_type_tls_server  = 4,
-    fingerprint_type_http        = 5,
-    fingerprint_type_http_server = 6,
-    fingerprint_type_dhcp_client = 7,
-    fingerprint_type_dtls        = 8,
-    fingerprint_type_dtls_server = 9,
-    fingerprint_type_ssh         = 10,
-    fingerprint_type_ssh_kex     = 11
-};
-
 struct protocol_state {
     uint16_t proto;   /* protocol IANA number */
     uint16_t dir;     /* DIR_CLIENT, DIR_SERVER, DIR_UNKNOWN */
@@ -245,6 +230,20 @@ size_t packet_filter_extract(struct packet_filter *pf,
                              uint8_t *packet,
                              size_t length);
 
+/*
+ * packet_filter_truncated_length(pf, p, len, payload_cap) returns the
+ * number of initial bytes of the packet p of length len that should
+ * be written, given that packet_filter_apply(pf, p, len) has just
+ * accepted it: all of the headers, the part of the transport payload
+ * that holds the protocol message that the extractor recognized
+ * (e.g. the TLS handshake records, or the HTTP headers), and at most
+ * payload_cap bytes of any other payload
+ */
+size_t packet_filter_truncated_length(const struct packet_filter *pf,
+                                      const uint8_t *packet,
+                                      size_t length,
+                                      size_t payload_cap);
+
 unsigned int packet_filter_process_packet(struct packet_filter *pf, struct key *k);
 
 typedef unsigned int (*parser_extractor_func)(struct datum *p, struct extractor *x);
@@ -272,6 +271,62 @@ enum status proto_dispatch_add(struct proto_dispatch *pd,
 
 enum status proto_ident_config(const char *config_string);
 
+/*
+ * struct protocol_selection records the message types selected by a
+ * configuration string in the format used by proto_ident_config(),
+ * without changing the global protocol identification masks, so that
+ * each libmerc context can have its own selection; msg_type[t] is
+ * true if messages of type t are selected
+ */
+struct protocol_selection {
+    bool msg_type[msg_type_quic + 1];
+    bool tcp_syn;        /* TCP SYN packets are selected                */
+    bool tcp_message;    /* TCP initial messages are selected (see
+                            tcp_initial_message_filter)               */
+};
+
+/*
+ * protocol_selection_init(sel, s) initializes sel from the
+ * configuration string s, or selects all protocols if s is NULL
+ */
+enum status protocol_selection_init(struct protocol_selection *sel, const char *config_string);
+
+/*
+ * struct packet_summary holds the classification of a packet that is
+ * made while its JSON records are written (see append_packet_json()),
+ * so that it can be reused without parsing the packet again: msg_type
+ * is the type of its transport payload (or msg_type_unknown, if that
+ * type is not selected), tcp_syn is true for a TCP SYN, and payload
+ * points to the transport payload, or is NULL if there is none
+ */
+struct packet_summary {
+    enum msg_type msg_type = msg_type_unknown;
+    bool tcp_syn = false;
+    const uint8_t *payload = NULL;
+};
+
+/*
+ * packet_summary_is_selected(s, sel) returns true if the packet with
+ * summary s holds a message selected by sel, or is a selected TCP SYN
+ */
+inline bool packet_summary_is_selected(const struct packet_summary &s, const struct protocol_selection &sel) {
+    return s.msg_type != msg_type_unknown || (s.tcp_syn && sel.tcp_syn);
+}
+
+/*
+ * message_truncated_length(packet, length, msg_type, payload,
+ * payload_cap) returns the number of initial bytes of the packet,
+ * whose transport payload starts at payload (or is absent, if payload
+ * is NULL), that hold its headers, the protocol message of type
+ * msg_type at the start of its payload, and at most payload_cap bytes
+ * of other payload, as in packet_filter_truncated_length()
+ */
+size_t message_truncated_length(const uint8_t *packet,
+                                size_t length,
+                                enum msg_type msg_type,
+                                const uint8_t *payload,
+                                size_t payload_cap);
+
 ptrdiff_t parser_get_data_length(struct datum *p);
 
 enum msg_type get_message_type(const uint8_t *tcp_data,
@@ -2,145 +2,201 @@
  * http.c
  */
 
-#include <unordered_map>
-#include "asn1/bytestring.h"
 #include "http.h"
 #include "json_object.h"
 #include "match.h"
 
-void http_request::parse(struct datum &p) {
-
-    /* parse request line */
-    method.parse_up_to_delim(p, ' ');
-    p.skip(1);
-    uri.parse_up_to_delim(p, ' ');
-    p.skip(1);
-    protocol.parse_up_to_delim(p, '\r');
-    p.skip(2);
-
-    /* parse headers */
-    headers.parse(p);
-
-    return;
-}
+/*
+ * http_request_headers[] lists the request headers that are included
+ * in the fingerprint or reported in the JSON output
+ */
+static const struct http_header_info http_request_headers[] = {
+    { "accept",                    http_fp_name_and_value, NULL,              false },
+    { "accept-encoding",           http_fp_name_and_value, NULL,              false },
+    { "connection",                http_fp_name_and_value, NULL,              false },
+    { "dnt",                       http_fp_name_and_value, NULL,              false },
+    { "dpr",                       http_fp_name_and_value, NULL,              false },
+    { "upgrade-insecure-requests", http_fp_name_and_value, NULL,              false },
+    { "x-requested-with",          http_fp_name_and_value, NULL,              false },
+    { "accept-charset",            http_fp_name,           NULL,              false },
+    { "accept-language",           http_fp_name,           NULL,              false },
+    { "authorization",             http_fp_name,           NULL,              false },
+    { "cache-control",             http_fp_name,           NULL,              false },
+    { "host",                      http_fp_name,           "host",            false },
+    { "if-modified-since",         http_fp_name,           NULL,              false },
+    { "keep-alive",                http_fp_name,           NULL,              false },
+    { "user-agent",                http_fp_name,           "user_agent",      true  },
+    { "x-flash-version",           http_fp_name,           NULL,              false },
+    { "x-p2p-peerdist",            http_fp_name,           NULL,              false },
+    { "x-forwarded-for",           http_fp_none,           "x_forwarded_for", false },
+    { "via",                       http_fp_none,           "via",             false },
+    { "upgrade",                   http_fp_none,           "upgrade",         false },
+};
+
+static const http_header_table http_request_header_table{http_request_headers};
 
-void http_headers::print_matching_names(struct json_object &o, std::list<std::pair<struct datum, std::string>> &name_list) const {
-    unsigned char crlf[2] = { '\r', '\n' };
-    unsigned char csp[2] = { ':', ' ' };
+/*
+ * http_response_headers[] lists the response headers that are
+ * included in the fingerprint or reported in the JSON output
+ */
+static const struct http_header_info http_response_headers[] = {
+    { "access-control-allow-credentials", http_fp_name_and_value, NULL,             false },
+    { "access-control-allow-headers",     http_fp_name_and_value, NULL,             false },
+    { "access-control-allow-methods",     http_fp_name_and_value, NULL,             false },
+    { "access-control-expose-headers",    http_fp_name_and_value, NULL,             false },
+    { "cache-control",                    http_fp_name_and_value, NULL,             false },
+    { "code",                             http_fp_name_and_value, NULL,             false },
+    { "connection",                       http_fp_name_and_value, NULL,             false },
+    { "content-language",                 http_fp_name_and_value, NULL,             false },
+    { "content-transfer-encoding",        http_fp_name_and_value, NULL,             false },
+    { "p3p",                              http_fp_name_and_value, NULL,             false },
+    { "pragma",                           http_fp_name_and_value, NULL,             false },
+    { "reason",                           http_fp_name_and_value, NULL,             false },
+    { "server",                           http_fp_name_and_value, "server",         false },
+    { "strict-transport-security",        http_fp_name_and_value, NULL,             false },
+    { "version",                          http_fp_name_and_value, NULL,             false },
+    { "x-aspnetmvc-version",              http_fp_name_and_value, NULL,             false },
+    { "x-aspnet-version",                 http_fp_name_and_value, NULL,             false },
+    { "x-cid",                            http_fp_name_and_value, NULL,             false },
+    { "x-ms-version",                     http_fp_name_and_value, NULL,             false },
+    { "x-xss-protection",                 http_fp_name_and_value, NULL,             false },
+    { "appex-activity-id",                http_fp_name,           NULL,             false },
+    { "cdnuuid",                          http_fp_name,           NULL,             false },
+    { "cf-ray",                           http_fp_name,           NULL,             false },
+    { "content-range",                    http_fp_name,           NULL,             false },
+    { "content-type",                     http_fp_name,           "content_type",   false },
+    { "date",                             http_fp_name,           NULL,             false },
+    { "etag",                             http_fp_name,           NULL,             false },
+    { "expires",                          http_fp_name,           NULL,             false },
+    { "flow_context",                     http_fp_name,           NULL,             false },
+    { "ms-cv",                            http_fp_name,           NULL,             false },
+    { "msregion",                         http_fp_name,           NULL,             false },
+    { "ms-requestid",                     http_fp_name,           NULL,             false },
+    { "request-id",                       http_fp_name,           NULL,             false },
+    { "vary",                             http_fp_name,           NULL,             false },
+    { "x-amz-cf-pop",                     http_fp_name,           NULL,             false },
+    { "x-amz-request-id",                 http_fp_name,           NULL,             false },
+    { "x-azure-ref-originshield",         http_fp_name,           NULL,             false },
+    { "x-cache",                          http_fp_name,           NULL,             false },
+    { "x-cache-hits",                     http_fp_name,           NULL,             false },
+    { "x-ccc",                            http_fp_name,           NULL,             false },
+    { "x-diagnostic-s",                   http_fp_name,           NULL,             false },
+    { "x-feserver",                       http_fp_name,           NULL,             false },
+    { "x-hw",                             http_fp_name,           NULL,             false },
+    { "x-msedge-ref",                     http_fp_name,           NULL,             false },
+    { "x-ocsp-responder-id",              http_fp_name,           NULL,             false },
+    { "x-requestid",                      http_fp_name,           NULL,             false },
+    { "x-served-by",                      http_fp_name,           NULL,             false },
+    { "x-timer",                          http_fp_name,           NULL,             false },
+    { "x-trace-context",                  http_fp_name,           NULL,             false },
+    { "content-length",                   http_fp_none,           "content_length", false },
+    { "via",                              http_fp_none,           "via",            false },
+};
+
+static const http_header_table http_response_header_table{http_response_headers};
 
-    if (this->is_not_readable()) {
-        return;
-    }
-    struct datum p{this->data, this->data_end};  // create copy, to leave object unmodified
+/*
+ * http_headers::parse(p, table) advances p over the header lines, up
+ * to and including the empty line that terminates them (if present),
+ * and records each header whose name appears in table.  Header lines
+ * are located by scanning for CRLF and the name/value separator ": "
+ * directly in the packet; nothing is copied.
+ */
+void http_headers::parse(struct datum &p, const http_header_table &table) {
 
+    data = p.data;
+    num_matches = 0;
+    overflow.clear();
     while (parser_get_data_length(&p) > 0) {
-        if (parser_match(&p, crlf, sizeof(crlf), NULL) == status_ok) {
+        const uint8_t *line = p.data;
+        if (p.data_end - line >= 2 && line[0] == '\r' && line[1] == '\n') {
+            p.data += 2;
+            complete = true;
             break;  /* at end of headers */
         }
-
-        struct datum keyword{p.data, NULL};
-        if (parser_skip_upto_delim(&p, csp, sizeof(csp)) == status_err) {
-            return;
+        const uint8_t *crlf = line;
+        while (true) {
+            crlf = (const uint8_t *)memchr(crlf, '\r', p.data_end - crlf);
+            if (crlf == NULL || crlf + 1 >= p.data_end) {
+                crlf = NULL;
+                break;
+            }
+            if (crlf[1] == '\n') {
+                break;
+            }
+            crlf++;
         }
-        keyword.data_end = p.data;
-        const char *header_name = NULL;
+        if (crlf == NULL) {
+            break;  /* incomplete header line */
+        }
+        p.data = crlf + 2;
 
-        for (const auto &name : name_list) {
-            if (name.first.case_insensitive_match(keyword)) {
-                header_name = (const char *)name.second.c_str();
+        const uint8_t *colon = line;
+        while ((colon = (const uint8_t *)memchr(colon, ':', crlf - colon)) != NULL) {
+            if (colon + 1 < crlf && colon[1] == ' ') {
+                break;
             }
+            colon++;
         }
-        const uint8_t *value_start = p.data;
-        if (parser_skip_upto_delim(&p, crlf, sizeof(crlf)) == status_err) {
-            return;
+        if (colon == NULL) {
+            continue;  /* no name/value separator */
         }
-        const uint8_t *value_end = p.data - 2;
-        if (header_name) {
-            o.print_key_json_string(header_name, value_start, value_end - value_start);
+        const struct http_header_info *info = table.lookup(line, colon - line);
+        if (info != NULL) {
+            if (num_matches < max_matches) {
+                match[num_matches] = { info, line, colon, crlf };
+            } else {
+                overflow.push_back({ info, line, colon, crlf });
+            }
+            num_matches++;
         }
     }
+    data_end = p.data;
 }
 
-inline void to_lower(std::basic_string<uint8_t> &str, struct datum d) {
-    if (d.is_not_readable()) {
-        return;
-    }
-    while (d.data < d.data_end) {
-        str.push_back(tolower(*d.data++));
-    }
-}
+void http_request::parse(struct datum &p) {
 
-void http_headers::fingerprint(struct buffer_stream &buf, std::unordered_map<std::basic_string<uint8_t>, bool> &name_dict) const {
-    unsigned char crlf[2] = { '\r', '\n' };
-    unsigned char csp[2] = { ':', ' ' };
+    /* parse request line */
+    method.parse_up_to_delim(p, ' ');
+    p.skip(1);
+    uri.parse_up_to_delim(p, ' ');
+    p.skip(1);
+    protocol.parse_up_to_delim(p, '\r');
+    p.skip(2);
 
-    struct datum p{this->data, this->data_end};  // create copy, to leave object unmodified
+    /* parse headers */
+    headers.parse(p, http_request_header_table);
 
-    while (parser_get_data_length(&p) > 0) {
-        if (parser_match(&p, crlf, sizeof(crlf), NULL) == status_ok) {
-            break;  /* at end of headers */
-        }
+    return;
+}
 
-        struct datum name{p.data, NULL};
-        if (parser_skip_upto_delim(&p, csp, sizeof(csp)) == status_err) {
-            return;
-        }
-        name.data_end = p.data;
-        bool include_name = false;
-        bool include_value = false;
-
-        std::basic_string<uint8_t> name_lowercase;
-        to_lower(name_lowercase, name);
-        auto pair = name_dict.find(name_lowercase);
-        if (pair != name_dict.end()) {
-            include_name = true;
-            include_value = pair->second;
+void http_headers::print_metadata(struct json_object &o, bool output_all) const {
+    for (size_t i = 0; i < num_matches; i++) {
+        const struct http_header_match &m = get_match(i);
+        if (m.info->json_key && (output_all || m.info->always_report)) {
+            const uint8_t *value = m.name_end + 2;
+            o.print_key_json_string(m.info->json_key, value, m.value_end - value);
         }
+    }
+}
 
-        if (parser_skip_upto_delim(&p, crlf, sizeof(crlf)) == status_err) {
-            return;
-        }
-        const uint8_t *name_end = p.data - 2;
-        if (include_name) {
-            if (include_value) {
-                buf.write_char('(');
-                buf.raw_as_hex(name.data, name_end - name.data);         // write {name, value}
-                buf.write_char(')');
-            } else {
-                buf.write_char('(');
-                buf.raw_as_hex(name.data, name.data_end - name.data - 2); // write {name}
-                buf.write_char(')');
-            }
+void http_headers::fingerprint(struct buffer_stream &buf) const {
+    for (size_t i = 0; i < num_matches; i++) {
+        const struct http_header_match &m = get_match(i);
+        if (m.info->fp == http_fp_name_and_value) {
+            buf.write_char('(');
+            buf.raw_as_hex(m.name, m.value_end - m.name);   // write {name, value}
+            buf.write_char(')');
+        } else if (m.info->fp == http_fp_name) {
+            buf.write_char('(');
+            buf.raw_as_hex(m.name, m.name_end - m.name);    // write {name}
+            buf.write_char(')');
         }
     }
 }
 
 void http_request::write_json(struct json_object &record, bool output_metadata) {
 
-    // construct a list of http header names to be printed out
-    //
-    uint8_t ua[] = { 'u', 's', 'e', 'r', '-', 'a', 'g', 'e', 'n', 't', ':', ' ' };
-    struct datum user_agent{ua, ua+sizeof(ua)};
-    std::pair<struct datum, std::string> user_agent_name{user_agent, "user_agent"};
-
-    uint8_t h[] = { 'h', 'o', 's', 't', ':', ' ' };
-    struct datum host{h, h+sizeof(h)};
-    std::pair<struct datum, std::string> host_name{host, "host"};
-
-    uint8_t xff[] = { 'x', '-', 'f', 'o', 'r', 'w', 'a', 'r', 'd', 'e', 'd', '-', 'f', 'o', 'r', ':', ' ' };
-    struct datum xff_parser{xff, xff+sizeof(xff)};
-    std::pair<struct datum, std::string> x_forwarded_for{xff_parser, "x_forwarded_for"};
-
-    uint8_t v[] = { 'v', 'i', 'a', ':', ' ' };
-    struct datum v_parser{v, v+sizeof(v)};
-    std::pair<struct datum, std::string> via{v_parser, "via"};
-
-    uint8_t u[] = { 'u', 'p', 'g', 'r', 'a', 'd', 'e', ':', ' ' };
-    struct datum u_parser{u, u+sizeof(u)};
-    std::pair<struct datum, std::string> upgrade_pair{u_parser, "upgrade"};
-
-    std::list<std::pair<struct datum, std::string>> names_to_print{user_agent_name, host_name, x_forwarded_for, via, upgrade_pair};
-
     if (this->is_not_empty()) {
         struct json_object http{record, "http"};
         struct json_object http_request{http, "request"};
@@ -151,18 +207,15 @@ void http_request::write_json(struct json_object &record, bool output_metadata)
             // http.print_key_json_string("headers", headers.data, headers.length());
             // headers.print_host(http, "host");
 
-            // run the list of http headers to be printed out against
-            // all headers, and print the values corresponding to each
-            // of the matching names
+            // print the values of the headers selected for output
             //
-            headers.print_matching_names(http_request, names_to_print);
+            headers.print_metadata(http_request, true);
             http_request.print_key_value("fingerprint", *this);
 
         } else {
 
             // output only the user-agent
-            std::list<std::pair<struct datum, std::string>> ua_only{user_agent_name};
-            headers.print_matching_names(http_request, ua_only);
+            headers.print_metadata(http_request, false);
         }
         http_request.close();
         http.close();
@@ -181,33 +234,13 @@ void http_response::parse(struct datum &p) {
     p.skip(2);
 
     /* parse headers */
-    headers.parse(p);
+    headers.parse(p, http_response_header_table);
 
     return;
 }
 
 void http_response::write_json(struct json_object &record) {
 
-    // construct a list of http header names to be printed out
-    //
-    uint8_t ct[] = { 'c', 'o', 'n', 't', 'e', 'n', 't', '-', 't', 'y', 'p', 'e', ':', ' ' };
-    struct datum content_type{ct, ct+sizeof(ct)};
-    std::pair<struct datum, std::string> content_type_pair{content_type, "content_type"};
-
-    uint8_t cl[] = { 'c', 'o', 'n', 't', 'e', 'n', 't', '-', 'l', 'e', 'n', 'g', 't', 'h', ':', ' ' };
-    struct datum content_length{cl, cl+sizeof(cl)};
-    std::pair<struct datum, std::string> content_length_pair{content_length, "content_length"};
-
-    uint8_t srv[] = { 's', 'e', 'r', 'v', 'e', 'r', ':', ' ' };
-    struct datum server{srv, srv+sizeof(srv)};
-    std::pair<struct datum, std::string> server_pair{server, "server"};
-
-    uint8_t v[] = { 'v', 'i', 'a', ':', ' ' };
-    struct datum v_parser{v, v+sizeof(v)};
-    std::pair<struct datum, std::string> via_pair{v_parser, "via"};
-
-    std::list<std::pair<struct datum, std::string>> names_to_print{server_pair, content_type_pair, content_length_pair, via_pair};
-
     struct json_object http{record, "http"};
     struct json_object http_response{http, "response"};
     http_response.print_key_json_string("version", version.data, version.length());
@@ -215,11 +248,9 @@ void http_response::write_json(struct json_object &record) {
     http_response.print_key_json_string("status_reason", status_reason.data, status_reason.length());
     //http.print_key_json_string("headers", response.headers.data, response.headers.length());
 
-    // run the list of http headers to be printed out against
-    // all headers, and print the values corresponding to each
-    // of the matching names
+    // print the values of the headers selected for output
     //
-    headers.print_matching_names(http_response, names_to_print);
+    headers.print_metadata(http_response, true);
     http_response.print_key_value("fingerprint", *this);
 
     http_response.close();
@@ -241,26 +272,7 @@ void http_request::operator()(struct buffer_stream &b) const {
     b.raw_as_hex(protocol.data, protocol.data_end - protocol.data);
     b.write_char(')');
 
-    std::unordered_map<std::basic_string<uint8_t>, bool> http_static_keywords = {
-        { { 'a', 'c', 'c', 'e', 'p', 't', ':', ' ' }, true },
-        { { 'a', 'c', 'c', 'e', 'p', 't', '-', 'e', 'n', 'c', 'o', 'd', 'i', 'n', 'g', ':', ' '}, true },
-        { { 'c', 'o', 'n', 'n', 'e', 'c', 't', 'i', 'o', 'n', ':', ' ' }, true },
-        { { 'd', 'n', 't', ':', ' ' }, true },
-        { { 'd', 'p', 'r', ':', ' ' }, true },
-        { { 'u', 'p', 'g', 'r', 'a', 'd', 'e', '-', 'i', 'n', 's', 'e', 'c', 'u', 'r', 'e', '-', 'r', 'e', 'q', 'u', 'e', 's', 't', 's', ':', ' ' }, true },
-        { { 'x', '-', 'r', 'e', 'q', 'u', 'e', 's', 't', 'e', 'd', '-', 'w', 'i', 't', 'h', ':', ' ' }, true },
-        { { 'a', 'c', 'c', 'e', 'p', 't', '-', 'c', 'h', 'a', 'r', 's', 'e', 't', ':', ' ' }, false },
-        { { 'a', 'c', 'c', 'e', 'p', 't', '-', 'l', 'a', 'n', 'g', 'u', 'a', 'g', 'e', ':', ' ' }, false },
-        { { 'a', 'u', 't', 'h', 'o', 'r', 'i', 'z', 'a', 't', 'i', 'o', 'n', ':', ' ' }, false },
-        { { 'c', 'a', 'c', 'h', 'e', '-', 'c', 'o', 'n', 't', 'r', 'o', 'l', ':', ' ' }, false },
-        { { 'h', 'o', 's', 't', ':', ' ' }, false },
-        { { 'i', 'f', '-', 'm', 'o', 'd', 'i', 'f', 'i', 'e', 'd', '-', 's', 'i', 'n', 'c', 'e', ':', ' ' }, false },
-        { { 'k', 'e', 'e', 'p', '-', 'a', 'l', 'i', 'v', 'e', ':', ' ' }, false },
-        { { 'u', 's', 'e', 'r', '-', 'a', 'g', 'e', 'n', 't', ':', ' ' }, false },
-        { { 'x', '-', 'f', 'l', 'a', 's', 'h', '-', 'v', 'e', 'r', 's', 'i', 'o', 'n', ':', ' ' }, false },
-        { { 'x', '-', 'p', '2', 'p', '-', 'p', 'e', 'e', 'r', 'd', 'i', 's', 't', ':', ' ' }, false } 
-    };
-    headers.fingerprint(b, http_static_keywords);
+    headers.fingerprint(b);
     b.write_char('\"');
 }
 
@@ -281,58 +293,6 @@ void http_response::operator()(struct buffer_stream &buf) const {
     buf.raw_as_hex(status_reason.data, status_reason.data_end - status_reason.data);
     buf.write_char(')');
 
-    std::unordered_map<std::basic_string<uint8_t>, bool> http_static_keywords = {
-        { (uint8_t *)"access-control-allow-credentials: ", true },
-        { (uint8_t *)"access-control-allow-headers: ", true },
-        { (uint8_t *)"access-control-allow-methods: ", true },
-        { (uint8_t *)"access-control-expose-headers: ", true },
-        { (uint8_t *)"cache-control: ", true },
-        { (uint8_t *)"code: ", true },
-        { (uint8_t *)"connection: ", true },
-        { (uint8_t *)"content-language: ", true },
-        { (uint8_t *)"content-transfer-encoding: ", true },
-        { (uint8_t *)"p3p: ", true },
-        { (uint8_t *)"pragma: ", true },
-        { (uint8_t *)"reason: ", true },
-        { (uint8_t *)"server: ", true },
-        { (uint8_t *)"strict-transport-security: ", true },
-        { (uint8_t *)"version: ", true },
-        { (uint8_t *)"x-aspnetmvc-version: ", true },
-        { (uint8_t *)"x-aspnet-version: ", true },
-        { (uint8_t *)"x-cid: ", true },
-        { (uint8_t *)"x-ms-version: ", true },
-        { (uint8_t *)"x-xss-protection: ", true },
-        { (uint8_t *)"appex-activity-id: ", false },
-        { (uint8_t *)"cdnuuid: ", false },
-        { (uint8_t *)"cf-ray: ", false },
-        { (uint8_t *)"content-range: ", false },
-        { (uint8_t *)"content-type: ", false },
-        { (uint8_t *)"date: ", false },
-        { (uint8_t *)"etag: ", false },
-        { (uint8_t *)"expires: ", false },
-        { (uint8_t *)"flow_context: ", false },
-        { (uint8_t *)"ms-cv: ", false },
-        { (uint8_t *)"msregion: ", false },
-        { (uint8_t *)"ms-requestid: ", false },
-        { (uint8_t *)"request-id: ", false },
-        { (uint8_t *)"vary: ", false },
-        { (uint8_t *)"x-amz-cf-pop: ", false },
-        { (uint8_t *)"x-amz-request-id: ", false },
-        { (uint8_t *)"x-azure-ref-originshield: ", false },
-        { (uint8_t *)"x-cache: ", false },
-        { (uint8_t *)"x-cache-hits: ", false },
-        { (uint8_t *)"x-ccc: ", false },
-        { (uint8_t *)"x-diagnostic-s: ", false },
-        { (uint8_t *)"x-feserver: ", false },
-        { (uint8_t *)"x-hw: ", false },
-        { (uint8_t *)"x-msedge-ref: ", false },
-        { (uint8_t *)"x-ocsp-responder-id: ", false },
-        { (uint8_t *)"x-requestid: ", false },
-        { (uint8_t *)"x-served-by: ", false },
-        { (uint8_t *)"x-timer: ", false },
-        { (uint8_t *)"x-trace-context: ", false }
-
-    };
-    headers.fingerprint(buf, http_static_keywords);
+    headers.fingerprint(buf);
     buf.write_char('\"');
 }
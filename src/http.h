@@ -6,35 +6,146 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <string.h>
+#include <vector>
 #include "extractor.h"
 
-struct http_headers : public datum {
-    bool complete;
+/*
+ * http_header_info describes an HTTP header name that is of interest
+ * to mercury, because it is included in a fingerprint, reported as
+ * metadata in the JSON output, or both.  The name is lowercase and
+ * does not include the trailing ": " separator.
+ */
+enum http_fp_type {
+    http_fp_none           = 0,  /* not in fingerprint             */
+    http_fp_name           = 1,  /* include name in fingerprint    */
+    http_fp_name_and_value = 2   /* include name and value         */
+};
+
+struct http_header_info {
+    const char *name;
+    enum http_fp_type fp;
+    const char *json_key;        /* NULL if not reported as metadata */
+    bool always_report;          /* report even without --metadata  */
+};
+
+/*
+ * http_header_table is a static, case-insensitive perfect hash over a
+ * fixed set of http_header_info entries.  The hash seed is chosen when
+ * the table is constructed (once, at static initialization time) so
+ * that no two names share a slot; a lookup then costs one hash over
+ * the header name in the packet and at most one case-insensitive
+ * comparison, with no copying or allocation.
+ */
+class http_header_table {
+    std::vector<const struct http_header_info *> slot;
+    uint32_t mask;
+    uint32_t seed;
+    size_t min_length;
+    size_t max_length;
+
+    static uint8_t fold(uint8_t c) {
+        return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+
+    static uint32_t hash(const uint8_t *s, size_t length, uint32_t seed) {
+        uint32_t h = 2166136261u ^ seed;   // FNV-1a over case-folded bytes
+        for (size_t i = 0; i < length; i++) {
+            h = (h ^ fold(s[i])) * 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+public:
+
+    template <size_t N>
+    http_header_table(const struct http_header_info (&info)[N]);
+
+    const struct http_header_info *lookup(const uint8_t *name, size_t length) const {
+        if (length < min_length || length > max_length) {
+            return NULL;
+        }
+        const struct http_header_info *h = slot[hash(name, length, seed) & mask];
+        if (h == NULL) {
+            return NULL;
+        }
+        const uint8_t *n = (const uint8_t *)h->name;
+        for (size_t i = 0; i < length; i++) {
+            if (n[i] != fold(name[i])) {
+                return NULL;   // also catches n[i] == '\0' (shorter name)
+            }
+        }
+        return n[length] == '\0' ? h : NULL;
+    }
+};
 
-    http_headers() : datum{}, complete{false} {}
+template <size_t N>
+http_header_table::http_header_table(const struct http_header_info (&info)[N]) :
+    slot{}, mask{0}, seed{0}, min_length{SIZE_MAX}, max_length{0} {
 
-    void parse(struct datum &p) {
-        unsigned char crlf[2] = { '\r', '\n' };
+    for (const auto &h : info) {
+        size_t len = strlen(h.name);
+        min_length = len < min_length ? len : min_length;
+        max_length = len > max_length ? len : max_length;
+    }
 
-        data = p.data;
-        while (parser_get_data_length(&p) > 0) {
-            if (parser_match(&p, crlf, sizeof(crlf), NULL) == status_ok) {
-                complete = true;
-                break;  /* at end of headers */
+    // find a (table size, seed) pair for which the hash is collision
+    // free; start with a load factor of at most 1/2
+    //
+    size_t size = 1;
+    while (size < 2 * N) {
+        size *= 2;
+    }
+    while (true) {
+        for (seed = 0; seed < 4096; seed++) {
+            mask = size - 1;
+            slot.assign(size, NULL);
+            bool collision = false;
+            for (const auto &h : info) {
+                uint32_t i = hash((const uint8_t *)h.name, strlen(h.name), seed) & mask;
+                if (slot[i] != NULL) {
+                    collision = true;
+                    break;
+                }
+                slot[i] = &h;
             }
-            if (parser_skip_upto_delim(&p, crlf, sizeof(crlf)) == status_err) {
-                break;
+            if (!collision) {
+                return;
             }
         }
-        data_end = p.data;
+        size *= 2;
     }
+}
+
+/*
+ * http_header_match records the location of a header, in the packet,
+ * whose name appears in an http_header_table
+ */
+struct http_header_match {
+    const struct http_header_info *info;
+    const uint8_t *name;        /* start of header name             */
+    const uint8_t *name_end;    /* end of name; ": " follows        */
+    const uint8_t *value_end;   /* end of value; "\r\n" follows     */
+};
+
+struct http_headers : public datum {
+    bool complete;
+    static const size_t max_matches = 64;
+    size_t num_matches;
+    struct http_header_match match[max_matches];
+    std::vector<struct http_header_match> overflow;  /* matches beyond max_matches */
 
-    void print_host(struct json_object &o, const char *key) const;
-    void print_matching_name(struct json_object &o, const char *key, struct datum &name) const;
-    void print_matching_names(struct json_object &o, const char *key, std::list<struct datum> &name) const;
-    void print_matching_names(struct json_object &o, std::list<std::pair<struct datum, std::string>> &name_list) const;
+    http_headers() : datum{}, complete{false}, num_matches{0} {}
 
-    void fingerprint(struct buffer_stream &buf, std::unordered_map<std::basic_string<uint8_t>, bool> &name_dict) const;
+    void parse(struct datum &p, const http_header_table &table);
+
+    void print_metadata(struct json_object &o, bool output_all) const;
+
+    void fingerprint(struct buffer_stream &buf) const;
+
+    const struct http_header_match &get_match(size_t i) const {
+        return i < max_matches ? match[i] : overflow[i - max_matches];
+    }
 
 };
 
@@ -0,0 +1,529 @@
+/*
+ * http2.cc
+ *
+ * HTTP/2 framing (RFC 7540) and HPACK header compression (RFC 7541)
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <string.h>
+#include "http2.h"
+
+/*
+ * hpack_static_table[] is the static table of RFC 7541, Appendix A;
+ * its entries have the indexes 1 through 61
+ */
+static const struct { const char *name; const char *value; } hpack_static_table[] = {
+    { ":authority",                  ""              },
+    { ":method",                     "GET"           },
+    { ":method",                     "POST"          },
+    { ":path",                       "/"             },
+    { ":path",                       "/index.html"   },
+    { ":scheme",                     "http"          },
+    { ":scheme",                     "https"         },
+    { ":status",                     "200"           },
+    { ":status",                     "204"           },
+    { ":status",                     "206"           },
+    { ":status",                     "304"           },
+    { ":status",                     "400"           },
+    { ":status",                     "404"           },
+    { ":status",                     "500"           },
+    { "accept-charset",              ""              },
+    { "accept-encoding",             "gzip, deflate" },
+    { "accept-language",             ""              },
+    { "accept-ranges",               ""              },
+    { "accept",                      ""              },
+    { "access-control-allow-origin", ""              },
+    { "age",                         ""              },
+    { "allow",                       ""              },
+    { "authorization",               ""              },
+    { "cache-control",               ""              },
+    { "content-disposition",         ""              },
+    { "content-encoding",            ""              },
+    { "content-language",            ""              },
+    { "content-length",              ""              },
+    { "content-location",            ""              },
+    { "content-range",               ""              },
+    { "content-type",                ""              },
+    { "cookie",                      ""              },
+    { "date",                        ""              },
+    { "etag",                        ""              },
+    { "expect",                      ""              },
+    { "expires",                     ""              },
+    { "from",                        ""              },
+    { "host",                        ""              },
+    { "if-match",                    ""              },
+    { "if-modified-since",           ""              },
+    { "if-none-match",               ""              },
+    { "if-range",                    ""              },
+    { "if-unmodified-since",         ""              },
+    { "last-modified",               ""              },
+    { "link",                        ""              },
+    { "location",                    ""              },
+    { "max-forwards",                ""              },
+    { "proxy-authenticate",          ""              },
+    { "proxy-authorization",         ""              },
+    { "range",                       ""              },
+    { "referer",                     ""              },
+    { "refresh",                     ""              },
+    { "retry-after",                 ""              },
+    { "server",                      ""              },
+    { "set-cookie",                  ""              },
+    { "strict-transport-security",   ""              },
+    { "transfer-encoding",           ""              },
+    { "user-agent",                  ""              },
+    { "vary",                        ""              },
+    { "via",                         ""              },
+    { "www-authenticate",            ""              },
+};
+
+static const size_t hpack_static_table_length = sizeof(hpack_static_table) / sizeof(hpack_static_table[0]);
+
+/*
+ * hpack_huffman_code[] is the Huffman code of RFC 7541, Appendix B,
+ * indexed by symbol; symbol 256 is EOS
+ */
+static const struct { uint32_t code; uint8_t length; } hpack_huffman_code[257] = {
+    { 0x00001ff8, 13 }, { 0x007fffd8, 23 }, { 0x0fffffe2, 28 }, { 0x0fffffe3, 28 },
+    { 0x0fffffe4, 28 }, { 0x0fffffe5, 28 }, { 0x0fffffe6, 28 }, { 0x0fffffe7, 28 },
+    { 0x0fffffe8, 28 }, { 0x00ffffea, 24 }, { 0x3ffffffc, 30 }, { 0x0fffffe9, 28 },
+    { 0x0fffffea, 28 }, { 0x3ffffffd, 30 }, { 0x0fffffeb, 28 }, { 0x0fffffec, 28 },
+    { 0x0fffffed, 28 }, { 0x0fffffee, 28 }, { 0x0fffffef, 28 }, { 0x0ffffff0, 28 },
+    { 0x0ffffff1, 28 }, { 0x0ffffff2, 28 }, { 0x3ffffffe, 30 }, { 0x0ffffff3, 28 },
+    { 0x0ffffff4, 28 }, { 0x0ffffff5, 28 }, { 0x0ffffff6, 28 }, { 0x0ffffff7, 28 },
+    { 0x0ffffff8, 28 }, { 0x0ffffff9, 28 }, { 0x0ffffffa, 28 }, { 0x0ffffffb, 28 },
+    { 0x00000014,  6 }, { 0x000003f8, 10 }, { 0x000003f9, 10 }, { 0x00000ffa, 12 },
+    { 0x00001ff9, 13 }, { 0x00000015,  6 }, { 0x000000f8,  8 }, { 0x000007fa, 11 },
+    { 0x000003fa, 10 }, { 0x000003fb, 10 }, { 0x000000f9,  8 }, { 0x000007fb, 11 },
+    { 0x000000fa,  8 }, { 0x00000016,  6 }, { 0x00000017,  6 }, { 0x00000018,  6 },
+    { 0x00000000,  5 }, { 0x00000001,  5 }, { 0x00000002,  5 }, { 0x00000019,  6 },
+    { 0x0000001a,  6 }, { 0x0000001b,  6 }, { 0x0000001c,  6 }, { 0x0000001d,  6 },
+    { 0x0000001e,  6 }, { 0x0000001f,  6 }, { 0x0000005c,  7 }, { 0x000000fb,  8 },
+    { 0x00007ffc, 15 }, { 0x00000020,  6 }, { 0x00000ffb, 12 }, { 0x000003fc, 10 },
+    { 0x00001ffa, 13 }, { 0x00000021,  6 }, { 0x0000005d,  7 }, { 0x0000005e,  7 },
+    { 0x0000005f,  7 }, { 0x00000060,  7 }, { 0x00000061,  7 }, { 0x00000062,  7 },
+    { 0x00000063,  7 }, { 0x00000064,  7 }, { 0x00000065,  7 }, { 0x00000066,  7 },
+    { 0x00000067,  7 }, { 0x00000068,  7 }, { 0x00000069,  7 }, { 0x0000006a,  7 },
+    { 0x0000006b,  7 }, { 0x0000006c,  7 }, { 0x0000006d,  7 }, { 0x0000006e,  7 },
+    { 0x0000006f,  7 }, { 0x00000070,  7 }, { 0x00000071,  7 }, { 0x00000072,  7 },
+    { 0x000000fc,  8 }, { 0x00000073,  7 }, { 0x000000fd,  8 }, { 0x00001ffb, 13 },
+    { 0x0007fff0, 19 }, { 0x00001ffc, 13 }, { 0x00003ffc, 14 }, { 0x00000022,  6 },
+    { 0x00007ffd, 15 }, { 0x00000003,  5 }, { 0x00000023,  6 }, { 0x00000004,  5 },
+    { 0x00000024,  6 }, { 0x00000005,  5 }, { 0x00000025,  6 }, { 0x00000026,  6 },
+    { 0x00000027,  6 }, { 0x00000006,  5 }, { 0x00000074,  7 }, { 0x00000075,  7 },
+    { 0x00000028,  6 }, { 0x00000029,  6 }, { 0x0000002a,  6 }, { 0x00000007,  5 },
+    { 0x0000002b,  6 }, { 0x00000076,  7 }, { 0x0000002c,  6 }, { 0x00000008,  5 },
+    { 0x00000009,  5 }, { 0x0000002d,  6 }, { 0x00000077,  7 }, { 0x00000078,  7 },
+    { 0x00000079,  7 }, { 0x0000007a,  7 }, { 0x0000007b,  7 }, { 0x00007ffe, 15 },
+    { 0x000007fc, 11 }, { 0x00003ffd, 14 }, { 0x00001ffd, 13 }, { 0x0ffffffc, 28 },
+    { 0x000fffe6, 20 }, { 0x003fffd2, 22 }, { 0x000fffe7, 20 }, { 0x000fffe8, 20 },
+    { 0x003fffd3, 22 }, { 0x003fffd4, 22 }, { 0x003fffd5, 22 }, { 0x007fffd9, 23 },
+    { 0x003fffd6, 22 }, { 0x007fffda, 23 }, { 0x007fffdb, 23 }, { 0x007fffdc, 23 },
+    { 0x007fffdd, 23 }, { 0x007fffde, 23 }, { 0x00ffffeb, 24 }, { 0x007fffdf, 23 },
+    { 0x00ffffec, 24 }, { 0x00ffffed, 24 }, { 0x003fffd7, 22 }, { 0x007fffe0, 23 },
+    { 0x00ffffee, 24 }, { 0x007fffe1, 23 }, { 0x007fffe2, 23 }, { 0x007fffe3, 23 },
+    { 0x007fffe4, 23 }, { 0x001fffdc, 21 }, { 0x003fffd8, 22 }, { 0x007fffe5, 23 },
+    { 0x003fffd9, 22 }, { 0x007fffe6, 23 }, { 0x007fffe7, 23 }, { 0x00ffffef, 24 },
+    { 0x003fffda, 22 }, { 0x001fffdd, 21 }, { 0x000fffe9, 20 }, { 0x003fffdb, 22 },
+    { 0x003fffdc, 22 }, { 0x007fffe8, 23 }, { 0x007fffe9, 23 }, { 0x001fffde, 21 },
+    { 0x007fffea, 23 }, { 0x003fffdd, 22 }, { 0x003fffde, 22 }, { 0x00fffff0, 24 },
+    { 0x001fffdf, 21 }, { 0x003fffdf, 22 }, { 0x007fffeb, 23 }, { 0x007fffec, 23 },
+    { 0x001fffe0, 21 }, { 0x001fffe1, 21 }, { 0x003fffe0, 22 }, { 0x001fffe2, 21 },
+    { 0x007fffed, 23 }, { 0x003fffe1, 22 }, { 0x007fffee, 23 }, { 0x007fffef, 23 },
+    { 0x000fffea, 20 }, { 0x003fffe2, 22 }, { 0x003fffe3, 22 }, { 0x003fffe4, 22 },
+    { 0x007ffff0, 23 }, { 0x003fffe5, 22 }, { 0x003fffe6, 22 }, { 0x007ffff1, 23 },
+    { 0x03ffffe0, 26 }, { 0x03ffffe1, 26 }, { 0x000fffeb, 20 }, { 0x0007fff1, 19 },
+    { 0x003fffe7, 22 }, { 0x007ffff2, 23 }, { 0x003fffe8, 22 }, { 0x01ffffec, 25 },
+    { 0x03ffffe2, 26 }, { 0x03ffffe3, 26 }, { 0x03ffffe4, 26 }, { 0x07ffffde, 27 },
+    { 0x07ffffdf, 27 }, { 0x03ffffe5, 26 }, { 0x00fffff1, 24 }, { 0x01ffffed, 25 },
+    { 0x0007fff2, 19 }, { 0x001fffe3, 21 }, { 0x03ffffe6, 26 }, { 0x07ffffe0, 27 },
+    { 0x07ffffe1, 27 }, { 0x03ffffe7, 26 }, { 0x07ffffe2, 27 }, { 0x00fffff2, 24 },
+    { 0x001fffe4, 21 }, { 0x001fffe5, 21 }, { 0x03ffffe8, 26 }, { 0x03ffffe9, 26 },
+    { 0x0ffffffd, 28 }, { 0x07ffffe3, 27 }, { 0x07ffffe4, 27 }, { 0x07ffffe5, 27 },
+    { 0x000fffec, 20 }, { 0x00fffff3, 24 }, { 0x000fffed, 20 }, { 0x001fffe6, 21 },
+    { 0x003fffe9, 22 }, { 0x001fffe7, 21 }, { 0x001fffe8, 21 }, { 0x007ffff3, 23 },
+    { 0x003fffea, 22 }, { 0x003fffeb, 22 }, { 0x01ffffee, 25 }, { 0x01ffffef, 25 },
+    { 0x00fffff4, 24 }, { 0x00fffff5, 24 }, { 0x03ffffea, 26 }, { 0x007ffff4, 23 },
+    { 0x03ffffeb, 26 }, { 0x07ffffe6, 27 }, { 0x03ffffec, 26 }, { 0x03ffffed, 26 },
+    { 0x07ffffe7, 27 }, { 0x07ffffe8, 27 }, { 0x07ffffe9, 27 }, { 0x07ffffea, 27 },
+    { 0x07ffffeb, 27 }, { 0x0ffffffe, 28 }, { 0x07ffffec, 27 }, { 0x07ffffed, 27 },
+    { 0x07ffffee, 27 }, { 0x07ffffef, 27 }, { 0x07fffff0, 27 }, { 0x03ffffee, 26 },
+    { 0x3fffffff, 30 }
+};
+
+/*
+ * struct hpack_huffman_decoder decodes the canonical Huffman code of
+ * HPACK: the codes of each length are consecutive integers, so a code
+ * of length n is found by subtracting the first code of that length,
+ * and the result (if it is less than the number of codes of that
+ * length) is an index into the symbols sorted by code
+ */
+#define HPACK_HUFFMAN_MAX_LENGTH 30
+
+class hpack_huffman_decoder {
+    uint32_t first_code[HPACK_HUFFMAN_MAX_LENGTH + 1];
+    uint32_t count[HPACK_HUFFMAN_MAX_LENGTH + 1];
+    uint32_t first_index[HPACK_HUFFMAN_MAX_LENGTH + 1];
+    uint16_t symbol[257];
+
+public:
+
+    hpack_huffman_decoder() : first_code{}, count{}, first_index{}, symbol{} {
+        for (const auto &c : hpack_huffman_code) {
+            count[c.length]++;
+        }
+        uint32_t code = 0;
+        uint32_t index = 0;
+        for (unsigned int len = 1; len <= HPACK_HUFFMAN_MAX_LENGTH; len++) {
+            code = (code + count[len - 1]) << 1;
+            first_code[len] = code;
+            first_index[len] = index;
+            index += count[len];
+        }
+        uint32_t next[HPACK_HUFFMAN_MAX_LENGTH + 1];
+        memcpy(next, first_index, sizeof(next));
+        for (unsigned int len = 1; len <= HPACK_HUFFMAN_MAX_LENGTH; len++) {
+            for (uint16_t s = 0; s < 257; s++) {    // symbols of a length are in code order
+                if (hpack_huffman_code[s].length == len) {
+                    symbol[next[len]++] = s;
+                }
+            }
+        }
+    }
+
+    bool decode(const uint8_t *data, size_t length, std::string &out) const {
+        uint32_t code = 0;
+        unsigned int len = 0;
+        for (size_t i = 0; i < length; i++) {
+            for (int bit = 7; bit >= 0; bit--) {
+                code = (code << 1) | ((data[i] >> bit) & 1);
+                len++;
+                if (code - first_code[len] < count[len]) {
+                    uint16_t s = symbol[first_index[len] + code - first_code[len]];
+                    if (s == 256) {
+                        return false;   /* EOS must not appear in a string */
+                    }
+                    out.push_back((char)s);
+                    code = 0;
+                    len = 0;
+                } else if (len == HPACK_HUFFMAN_MAX_LENGTH) {
+                    return false;
+                }
+            }
+        }
+        /* padding is at most seven bits, all ones (a prefix of EOS) */
+        return len < 8 && code == ((uint32_t)1 << len) - 1;
+    }
+};
+
+static const hpack_huffman_decoder hpack_huffman;
+
+/*
+ * hpack_read_integer(d, prefix_bits, value) reads an integer with an
+ * N-bit prefix (RFC 7541, Section 5.1); the other bits of the first
+ * byte are ignored
+ */
+static bool hpack_read_integer(struct datum &d, unsigned int prefix_bits, uint64_t *value) {
+    uint8_t b;
+    if (!d.read_uint8(&b)) {
+        return false;
+    }
+    uint64_t max_prefix = ((uint64_t)1 << prefix_bits) - 1;
+    uint64_t x = b & max_prefix;
+    if (x == max_prefix) {
+        unsigned int shift = 0;
+        do {
+            if (!d.read_uint8(&b) || shift > 28) {
+                return false;
+            }
+            x += (uint64_t)(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+    }
+    *value = x;
+    return true;
+}
+
+/*
+ * hpack_read_string(d, s) reads a string literal (RFC 7541, Section
+ * 5.2), which may be Huffman encoded
+ */
+static bool hpack_read_string(struct datum &d, std::string &s) {
+    if (d.length() < 1) {
+        return false;
+    }
+    bool huffman = d.data[0] & 0x80;
+    uint64_t length;
+    if (!hpack_read_integer(d, 7, &length) || length > (uint64_t)d.length()) {
+        return false;
+    }
+    s.clear();
+    if (huffman) {
+        if (!hpack_huffman.decode(d.data, length, s)) {
+            return false;
+        }
+    } else {
+        s.assign((const char *)d.data, length);
+    }
+    d.skip(length);
+    return true;
+}
+
+bool hpack_decoder::get_indexed(uint64_t index, const http2_header **header) const {
+    static const std::vector<http2_header> static_headers = [] {
+        std::vector<http2_header> v;
+        for (const auto &h : hpack_static_table) {
+            v.push_back({ h.name, h.value });
+        }
+        return v;
+    }();
+    if (index == 0) {
+        return false;
+    }
+    if (index <= hpack_static_table_length) {
+        *header = &static_headers[index - 1];
+        return true;
+    }
+    index -= hpack_static_table_length + 1;
+    if (index >= table.size()) {
+        return false;
+    }
+    *header = &table[index];
+    return true;
+}
+
+void hpack_decoder::evict(size_t max_size) {
+    while (table_size > max_size && !table.empty()) {
+        table_size -= table.back().first.length() + table.back().second.length() + 32;
+        table.pop_back();
+    }
+}
+
+void hpack_decoder::add(const http2_header &header) {
+    size_t size = header.first.length() + header.second.length() + 32;
+    evict(max_table_size > size ? max_table_size - size : 0);
+    if (size <= max_table_size) {
+        table.push_front(header);
+        table_size += size;
+    }
+}
+
+bool hpack_decoder::decode(struct datum block, std::vector<http2_header> &headers) {
+    while (block.is_not_empty()) {
+        uint8_t first = block.data[0];
+        uint64_t index;
+        const http2_header *h = NULL;
+
+        if (first & 0x80) {
+            /* indexed header field */
+            if (!hpack_read_integer(block, 7, &index) || !get_indexed(index, &h)) {
+                return false;
+            }
+            headers.push_back(*h);
+
+        } else if ((first & 0xe0) == 0x20) {
+            /* dynamic table size update */
+            uint64_t size;
+            if (!hpack_read_integer(block, 5, &size) || size > HPACK_MAX_TABLE_SIZE) {
+                return false;
+            }
+            max_table_size = size;
+            evict(max_table_size);
+
+        } else {
+            /*
+             * literal header field with incremental indexing (01),
+             * without indexing (0000), or never indexed (0001)
+             */
+            bool incremental = (first & 0xc0) == 0x40;
+            http2_header header;
+            if (!hpack_read_integer(block, incremental ? 6 : 4, &index)) {
+                return false;
+            }
+            if (index == 0) {
+                if (!hpack_read_string(block, header.first)) {
+                    return false;
+                }
+            } else {
+                if (!get_indexed(index, &h)) {
+                    return false;
+                }
+                header.first = h->first;
+            }
+            if (!hpack_read_string(block, header.second)) {
+                return false;
+            }
+            if (incremental) {
+                add(header);
+            }
+            headers.push_back(header);
+        }
+    }
+    return true;
+}
+
+/*
+ * HTTP/2 frame types and flags (RFC 7540, Section 6)
+ */
+#define HTTP2_FRAME_HEADER_LENGTH   9
+#define HTTP2_FRAME_HEADERS         0x01
+#define HTTP2_FRAME_PUSH_PROMISE    0x05
+#define HTTP2_FRAME_CONTINUATION    0x09
+#define HTTP2_FLAG_END_HEADERS      0x04
+#define HTTP2_FLAG_PADDED           0x08
+#define HTTP2_FLAG_PRIORITY         0x20
+
+static const char http2_client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+bool http2_reader::is_client_preface(const struct datum &data) {
+    size_t preface_length = sizeof(http2_client_preface) - 1;
+    return data.length() >= (ssize_t)preface_length && memcmp(data.data, http2_client_preface, preface_length) == 0;
+}
+
+void http2_reader::process(struct datum data, std::vector<std::string> &messages) {
+    if (at_start) {
+        at_start = false;
+        if (is_client_preface(data)) {
+            data.skip(sizeof(http2_client_preface) - 1);
+        }
+    }
+    while (!failed && data.is_not_empty()) {
+        if (skip > 0) {
+            size_t n = (uint64_t)data.length() < skip ? data.length() : skip;
+            data.skip(n);
+            skip -= n;
+            continue;
+        }
+
+        /* read the frame header, then (unless it is skipped) the payload */
+        size_t needed = HTTP2_FRAME_HEADER_LENGTH;
+        if (frame.size() >= HTTP2_FRAME_HEADER_LENGTH) {
+            needed += ((size_t)frame[0] << 16) | ((size_t)frame[1] << 8) | frame[2];
+        }
+        size_t n = needed - frame.size();
+        if ((size_t)data.length() < n) {
+            n = data.length();
+        }
+        frame.insert(frame.end(), data.data, data.data + n);
+        data.skip(n);
+        if (frame.size() < needed) {
+            continue;
+        }
+        if (needed == HTTP2_FRAME_HEADER_LENGTH) {
+            size_t length = ((size_t)frame[0] << 16) | ((size_t)frame[1] << 8) | frame[2];
+            uint8_t type = frame[3];
+            if (type != HTTP2_FRAME_HEADERS && type != HTTP2_FRAME_PUSH_PROMISE && type != HTTP2_FRAME_CONTINUATION) {
+                if (continuation) {
+                    failed = true;   /* header blocks must be contiguous */
+                }
+                skip = length;
+                frame.clear();
+                continue;
+            }
+            if (length > HTTP2_MAX_HEADER_BLOCK_LENGTH) {
+                failed = true;
+                break;
+            }
+            if (length > 0) {
+                continue;    /* go on to read the payload */
+            }
+        }
+        struct datum payload{frame.data() + HTTP2_FRAME_HEADER_LENGTH, frame.data() + frame.size()};
+        process_frame(frame[3], frame[4], payload, messages);
+        frame.clear();
+    }
+}
+
+void http2_reader::process_frame(uint8_t type, uint8_t flags, struct datum payload, std::vector<std::string> &messages) {
+    if (type == HTTP2_FRAME_CONTINUATION) {
+        if (!continuation) {
+            failed = true;
+            return;
+        }
+    } else {
+        if (continuation) {
+            failed = true;
+            return;
+        }
+        uint8_t pad_length = 0;
+        if (flags & HTTP2_FLAG_PADDED) {
+            if (!payload.read_uint8(&pad_length)) {
+                failed = true;
+                return;
+            }
+        }
+        if (type == HTTP2_FRAME_PUSH_PROMISE) {
+            payload.skip(4);      /* promised stream identifier */
+        } else if (flags & HTTP2_FLAG_PRIORITY) {
+            payload.skip(5);      /* stream dependency and weight */
+        }
+        if (payload.length() < pad_length) {
+            failed = true;
+            return;
+        }
+        payload.trim(pad_length);
+        header_block.clear();
+        push_promise = (type == HTTP2_FRAME_PUSH_PROMISE);
+    }
+    header_block.append((const char *)payload.data, payload.length());
+    if (header_block.length() > HTTP2_MAX_HEADER_BLOCK_LENGTH) {
+        failed = true;
+        return;
+    }
+    continuation = !(flags & HTTP2_FLAG_END_HEADERS);
+    if (!continuation) {
+        process_header_block(messages);
+    }
+}
+
+void http2_reader::process_header_block(std::vector<std::string> &messages) {
+    const uint8_t *block = (const uint8_t *)header_block.data();
+    std::vector<http2_header> headers;
+    if (!hpack.decode({block, block + header_block.length()}, headers)) {
+        failed = true;     /* the dynamic table is now unknown */
+        return;
+    }
+    if (push_promise) {
+        return;            /* decoded only to keep the dynamic table in step */
+    }
+
+    /*
+     * build the HTTP/1.x form of the message from its pseudo-header
+     * fields, which precede all of the other fields
+     */
+    const std::string *method = NULL, *path = NULL, *authority = NULL, *status = NULL;
+    size_t i = 0;
+    for ( ; i < headers.size() && !headers[i].first.empty() && headers[i].first[0] == ':'; i++) {
+        const http2_header &h = headers[i];
+        if (h.first == ":method") {
+            method = &h.second;
+        } else if (h.first == ":path") {
+            path = &h.second;
+        } else if (h.first == ":authority") {
+            authority = &h.second;
+        } else if (h.first == ":status") {
+            status = &h.second;
+        }
+    }
+    std::string msg;
+    if (is_client) {
+        if (method == NULL) {
+            return;        /* trailers */
+        }
+        msg = *method + " " + (path ? *path : std::string{"*"}) + " HTTP/2\r\n";
+        if (authority) {
+            msg += "host: " + *authority + "\r\n";
+        }
+    } else {
+        if (status == NULL) {
+            return;        /* trailers */
+        }
+        msg = "HTTP/2 " + *status + " \r\n";
+    }
+    for ( ; i < headers.size(); i++) {
+        msg += headers[i].first + ": " + headers[i].second + "\r\n";
+    }
+    msg += "\r\n";
+    messages.push_back(msg);
+}
@@ -0,0 +1,111 @@
+/*
+ * http2.h
+ *
+ * HTTP/2 framing (RFC 7540) and HPACK header compression (RFC 7541),
+ * as needed to fingerprint the requests and responses of an HTTP/2
+ * connection whose bytes are available in the clear (for instance,
+ * after TLS decryption)
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+#include "datum.h"
+
+typedef std::pair<std::string, std::string> http2_header;
+
+/*
+ * struct hpack_decoder holds the dynamic table of one direction of an
+ * HTTP/2 connection, which is shared by all of the header blocks
+ * sent in that direction, so every block must be decoded, in order
+ */
+#define HPACK_DEFAULT_TABLE_SIZE  4096
+#define HPACK_MAX_TABLE_SIZE      65536
+
+struct hpack_decoder {
+    std::deque<http2_header> table;  /* dynamic table, newest entry first */
+    size_t table_size;               /* as defined in RFC 7541, Section 4.1 */
+    size_t max_table_size;
+
+    hpack_decoder() : table{}, table_size{0}, max_table_size{HPACK_DEFAULT_TABLE_SIZE} {}
+
+    /*
+     * decode(block, headers) decodes the header block and appends its
+     * header fields to headers; it returns false if the block is
+     * malformed, in which case the dynamic table may no longer match
+     * that of the encoder
+     */
+    bool decode(struct datum block, std::vector<http2_header> &headers);
+
+private:
+
+    bool get_indexed(uint64_t index, const http2_header **header) const;
+
+    void add(const http2_header &header);
+
+    void evict(size_t max_size);
+};
+
+/*
+ * struct http2_reader reads the frames sent in one direction of an
+ * HTTP/2 connection, from the bytes of that direction in order, and
+ * decodes each header block.  The messages are returned in the form
+ * of an HTTP/1.x header, with "HTTP/2" as the protocol version, so
+ * that they can be parsed and fingerprinted by http_request and
+ * http_response, exactly as HTTP/1.x messages are:
+ *
+ *    request:   <:method> <:path> HTTP/2\r\n
+ *               host: <:authority>\r\n
+ *               <name>: <value>\r\n ... \r\n
+ *
+ *    response:  HTTP/2 <:status> \r\n
+ *               <name>: <value>\r\n ... \r\n
+ *
+ * Frames other than HEADERS, CONTINUATION, and PUSH_PROMISE are
+ * skipped without being buffered.
+ */
+#define HTTP2_MAX_HEADER_BLOCK_LENGTH  65536
+
+struct http2_reader {
+    bool is_client;
+    bool failed;                      /* stream could not be followed   */
+    bool at_start;                    /* the client preface may follow  */
+    uint64_t skip;                    /* bytes left in an ignored frame */
+    std::vector<uint8_t> frame;       /* incomplete frame               */
+    std::string header_block;         /* awaiting CONTINUATION frames   */
+    bool continuation;
+    bool push_promise;                /* header_block is from a PUSH_PROMISE */
+    struct hpack_decoder hpack;
+
+    explicit http2_reader(bool client) :
+        is_client{client}, failed{false}, at_start{client}, skip{0}, frame{},
+        header_block{}, continuation{false}, push_promise{false}, hpack{} {}
+
+    /*
+     * process(data, messages) reads the frames in data, and appends to
+     * messages the HTTP/1.x form of each request (if is_client) or
+     * response that they complete
+     */
+    void process(struct datum data, std::vector<std::string> &messages);
+
+    /*
+     * is_client_preface(data) returns true if data starts with the
+     * HTTP/2 client connection preface (RFC 7540, Section 3.5)
+     */
+    static bool is_client_preface(const struct datum &data);
+
+private:
+
+    void process_frame(uint8_t type, uint8_t flags, struct datum payload, std::vector<std::string> &messages);
+
+    void process_header_block(std::vector<std::string> &messages);
+};
+
+#endif /* HTTP2_H */
@@ -13,6 +13,10 @@
 #include <stdint.h>
 #include "mercury.h"
 
+struct buffer_stream;
+struct thread_metrics;
+struct os_observation_queue;
+
 struct json_file {
     FILE *file;
     int64_t record_countdown;
@@ -28,11 +32,56 @@ void json_file_write(struct json_file *jf,
 		     unsigned int sec,
 		     unsigned int usec);
 
+/*
+ * append_packet_json(buf, ctx, packet, length, ts, ingress_interface,
+ * metrics, os_queue) writes the JSON record(s) for a packet into buf,
+ * as configured by the libmerc context ctx, and returns the length of
+ * buf; if ingress_interface is not NULL, it is included in each
+ * record as "interface", if metrics is not NULL, the records are
+ * counted in it, if os_queue is not NULL, the fingerprints are queued
+ * in it for OS identification, and if summary is not NULL, it is set
+ * to the classification of the packet.
+ * The context ctx is updated, as it holds the QUIC Initial packets
+ * that do not yet complete a clientHello.
+ * This function is defined in libmerc.cc.
+ */
+int append_packet_json(struct buffer_stream &buf,
+                       struct mercury_context &ctx,
+                       uint8_t *packet,
+                       size_t length,
+                       struct timespec *ts,
+                       const char *ingress_interface,
+                       struct thread_metrics *metrics,
+                       struct os_observation_queue *os_queue,
+                       struct packet_summary *summary=NULL);
+
+/*
+ * packet_summary_init(summary, ctx, packet, length) sets summary to the
+ * classification of a packet that append_packet_json() would make,
+ * without writing any records; it is defined in libmerc.cc
+ */
+void packet_summary_init(struct packet_summary *summary,
+                         const struct mercury_context &ctx,
+                         uint8_t *packet,
+                         size_t length);
+
+/*
+ * json_queue_write() writes the JSON record(s) for a packet, as
+ * configured by the libmerc context ctx, into the queue llq; if
+ * ingress_interface is not NULL, it is included in each record as
+ * "interface", and if summary is not NULL, it is set to the
+ * classification of the packet (even if the queue is full)
+ */
 void json_queue_write(struct ll_queue *llq,
+                      struct mercury_context *ctx,
                       uint8_t *packet,
                       size_t length,
                       unsigned int sec,
-                      unsigned int usec);
+                      unsigned int usec,
+                      const char *ingress_interface=NULL,
+                      struct thread_metrics *metrics=NULL,
+                      struct os_observation_queue *os_queue=NULL,
+                      struct packet_summary *summary=NULL);
 
 enum status json_file_init(struct json_file *js,
 			   const char *outfile_name,
@@ -0,0 +1,134 @@
+/*
+ * latency.h
+ *
+ * log-bucketed latency histograms, in the style of HDR histograms
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * struct latency_histogram counts latencies in nanoseconds.  Each
+ * power of two is divided into LATENCY_SUB_BUCKETS linear buckets, so
+ * that every recorded value is within 1/LATENCY_SUB_BUCKETS (12.5%)
+ * of the value reported for its bucket, from one nanosecond up to
+ * 2^LATENCY_MAX_EXPONENT nanoseconds (about 18 minutes); larger values
+ * are counted in the last bucket.
+ *
+ * A histogram has a single writer, which updates it with relaxed
+ * stores, so that recording a value takes no locks; readers (the
+ * stats and metrics threads) see a slightly stale, but never torn,
+ * copy of each counter.
+ */
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS     (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_EXPONENT    40
+#define LATENCY_BUCKETS         ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BUCKET_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram {
+    uint64_t count[LATENCY_BUCKETS];
+    uint64_t sum;                      /* sum of all values, in nanoseconds */
+};
+
+static inline unsigned int latency_bucket(uint64_t ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return ns;
+    }
+    unsigned int msb = 63 - __builtin_clzll(ns);
+    unsigned int shift = msb - LATENCY_SUB_BUCKET_BITS;
+    unsigned int b = (shift + 1) * LATENCY_SUB_BUCKETS + ((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+    return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+}
+
+/*
+ * latency_bucket_upper(b) returns the largest value that is counted
+ * in bucket b
+ */
+static inline uint64_t latency_bucket_upper(unsigned int b) {
+    if (b < LATENCY_SUB_BUCKETS) {
+        return b;
+    }
+    unsigned int shift = b / LATENCY_SUB_BUCKETS - 1;
+    uint64_t sub = b % LATENCY_SUB_BUCKETS;
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static inline void latency_histogram_record(struct latency_histogram *h, uint64_t ns) {
+    unsigned int b = latency_bucket(ns);
+    __atomic_store_n(&h->count[b], h->count[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * latency_ns(later, earlier) returns the time from earlier to later in
+ * nanoseconds, or zero if later precedes earlier (as it can, when the
+ * clocks of the NIC and the host disagree)
+ */
+static inline uint64_t latency_ns(const struct timespec *later, const struct timespec *earlier) {
+    int64_t ns = (int64_t)(later->tv_sec - earlier->tv_sec) * 1000000000 + (later->tv_nsec - earlier->tv_nsec);
+    return ns > 0 ? ns : 0;
+}
+
+/*
+ * latency_histogram_add(total, h) adds the counts in h into total,
+ * with relaxed loads, so that h may be updated concurrently
+ */
+static inline void latency_histogram_add(struct latency_histogram *total, const struct latency_histogram *h) {
+    for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+        total->count[b] += __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+    }
+    total->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+}
+
+/*
+ * latency_histogram_subtract(h, before) sets h to the difference
+ * between h and an earlier copy before of the same histogram, which
+ * holds just the values recorded between the two copies
+ */
+static inline void latency_histogram_subtract(struct latency_histogram *h, const struct latency_histogram *before) {
+    for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+        h->count[b] -= before->count[b];
+    }
+    h->sum -= before->sum;
+}
+
+static inline uint64_t latency_histogram_total(const struct latency_histogram *h) {
+    uint64_t total = 0;
+    for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+        total += h->count[b];
+    }
+    return total;
+}
+
+/*
+ * latency_histogram_percentile(h, p) returns an upper bound on the
+ * p-th percentile (0 < p <= 100) of the values in h, in nanoseconds,
+ * or zero if h is empty; p = 100 gives (an upper bound on) the maximum
+ */
+static inline uint64_t latency_histogram_percentile(const struct latency_histogram *h, double p) {
+    uint64_t total = latency_histogram_total(h);
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t cumulative = 0;
+    for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+        cumulative += h->count[b];
+        if (cumulative >= rank) {
+            return latency_bucket_upper(b);
+        }
+    }
+    return latency_bucket_upper(LATENCY_BUCKETS - 1);
+}
+
+#endif /* LATENCY_H */
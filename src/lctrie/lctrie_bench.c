@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <libgen.h>
+#include <string.h>
+#include <errno.h>
+#include <locale.h>
+
+#include <arpa/inet.h>
+#include <sys/time.h>
+
+#include "lctrie_ip.h"
+#include "lctrie_bgp.h"
+#include "lctrie.h"
+#include "lctrie_dir24.h"
+
+// compare the LC trie against the DIR-24-8 table, first checking
+// that both return the same subnet for every address in the test
+// streams, then timing the lookups of each over those streams
+
+#define BGP_MAX_ENTRIES             4000000
+#define RANDOM_ADDRS                10000000
+#define MAX_ADDRS                   50000000
+#define PASSES                      5
+
+static unsigned long next = 1;
+
+int fastrand(void) {
+  next = next * 1103515245 + 12345;
+  return((unsigned)(next/65536) % RAND_MAX);
+}
+
+// read addresses in dotted quad form, one per line, skipping
+// lines that can't be parsed
+uint32_t *read_addrs(char *filename, uint32_t *num) {
+  FILE *infile;
+  char *line = NULL;
+  size_t line_len = 0;
+  uint32_t addr;
+  uint32_t *addrs;
+
+  if (!(infile = fopen(filename, "r"))) {
+    fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+    return NULL;
+  }
+  if (!(addrs = (uint32_t *) malloc(MAX_ADDRS * sizeof(uint32_t)))) {
+    fprintf(stderr, "Could not allocate address buffer\n");
+    fclose(infile);
+    return NULL;
+  }
+
+  *num = 0;
+  while (*num < MAX_ADDRS && -1 != getline(&line, &line_len, infile)) {
+    line[strcspn(line, "\r\n")] = 0;
+    if (inet_pton(AF_INET, line, &addr) == 1) {
+      addrs[(*num)++] = ntohl(addr);
+    }
+  }
+
+  free(line);
+  fclose(infile);
+  return addrs;
+}
+
+static unsigned long elapsed_us(struct timeval *start, struct timeval *end) {
+  return 1000000 * (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec);
+}
+
+// returns zero if both lookup engines agree on every address
+int bench(const char *name, lct_t *t, lct_dir24_t *d, uint32_t *addrs, uint32_t num) {
+  struct timeval start, end;
+  unsigned long lct_us, dir24_us;
+  unsigned int nhit = 0;
+  uintptr_t sum = 0;
+
+  for (uint32_t i = 0; i < num; i++) {
+    lct_subnet_t *a = lct_find(t, addrs[i]);
+    lct_subnet_t *b = lct_dir24_find(d, addrs[i]);
+    if (a != b) {
+      uint32_t addr = htonl(addrs[i]);
+      char astr[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &addr, astr, sizeof(astr));
+      fprintf(stderr, "ERROR: lookup engines differ for %s (%d vs %d bit prefix)\n",
+              astr, a ? a->len : -1, b ? b->len : -1);
+      return -1;
+    }
+    if (a) {
+      ++nhit;
+    }
+  }
+
+  // sum up the results so the compiler can't skip the lookups
+  gettimeofday(&start, NULL);
+  for (int p = 0; p < PASSES; p++) {
+    for (uint32_t i = 0; i < num; i++) {
+      sum += (uintptr_t) lct_find(t, addrs[i]);
+    }
+  }
+  gettimeofday(&end, NULL);
+  lct_us = elapsed_us(&start, &end);
+
+  gettimeofday(&start, NULL);
+  for (int p = 0; p < PASSES; p++) {
+    for (uint32_t i = 0; i < num; i++) {
+      sum -= (uintptr_t) lct_dir24_find(d, addrs[i]);
+    }
+  }
+  gettimeofday(&end, NULL);
+  dir24_us = elapsed_us(&start, &end);
+
+  unsigned long lookups = (unsigned long) num * PASSES;
+  printf("%s: %'u addresses, %'u hits, results match (%lu)\n", name, num, nhit, (unsigned long) sum);
+  printf("  lct_find:       %'lu lookups/sec, %.1f ns/lookup\n",
+         lct_us ? lookups * 1000000 / lct_us : 0, 1000.0 * lct_us / lookups);
+  printf("  lct_dir24_find: %'lu lookups/sec, %.1f ns/lookup\n",
+         dir24_us ? lookups * 1000000 / dir24_us : 0, 1000.0 * dir24_us / lookups);
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int num = 0;
+  int rc;
+  lct_subnet_t *p;
+  lct_t t;
+  lct_dir24_t d;
+
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage: %s <BGP Prefixes File> [<Address File>]\n", basename(argv[0]));
+    exit(EXIT_FAILURE);
+  }
+
+  // we need this to get thousands separators
+  setlocale(LC_NUMERIC, "");
+
+  if (!(p = (lct_subnet_t *)calloc(sizeof(lct_subnet_t), BGP_MAX_ENTRIES))) {
+    fprintf(stderr, "Could not allocate subnet input buffer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // use the same subnets as lct_init_from_file() in mercury
+  num += init_private_subnets(&p[num], BGP_MAX_ENTRIES);
+  num += init_special_subnets(&p[num], BGP_MAX_ENTRIES);
+  if (0 > (rc = read_prefix_table(argv[1], &p[num], BGP_MAX_ENTRIES - num))) {
+    fprintf(stderr, "could not read prefix file \"%s\"\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+  num += rc;
+
+  subnet_mask(p, num);
+  qsort(p, num, sizeof(lct_subnet_t), subnet_cmp);
+  num -= subnet_dedup(p, num);
+
+  lct_ip_stats_t *stats = (lct_ip_stats_t *) calloc(num, sizeof(lct_ip_stats_t));
+  if (!stats) {
+    fprintf(stderr, "Failed to allocate prefix statistics buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  subnet_prefix(p, stats, num);
+  free(stats);
+
+  memset(&t, 0, sizeof(lct_t));
+  if (lct_build(&t, p, num) < 0 || lct_dir24_build(&d, p, num) < 0) {
+    fprintf(stderr, "could not build lookup structures\n");
+    exit(EXIT_FAILURE);
+  }
+  printf("%'d unique subnets; LC trie has %'u nodes, DIR-24-8 table has %'u long blocks\n\n",
+         num, t.ncount, d.nlong);
+
+  uint32_t *addrs = (uint32_t *) malloc(RANDOM_ADDRS * sizeof(uint32_t));
+  if (!addrs) {
+    fprintf(stderr, "Could not allocate address buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < RANDOM_ADDRS; i++) {
+    addrs[i] = ((uint32_t) fastrand() << 16) ^ (uint32_t) fastrand();
+  }
+  rc = bench("random addresses", &t, &d, addrs, RANDOM_ADDRS);
+  free(addrs);
+
+  if (rc == 0 && argc == 3) {
+    uint32_t naddrs;
+    if (!(addrs = read_addrs(argv[2], &naddrs))) {
+      exit(EXIT_FAILURE);
+    }
+    rc = bench(argv[2], &t, &d, addrs, naddrs);
+    free(addrs);
+  }
+
+  lct_dir24_free(&d);
+  free(t.root);
+  lct_free(&t);
+  free(p);
+
+  return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,122 @@
+#include "lctrie_dir24.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// the long table starts out with room for this many blocks,
+// and doubles in size whenever it fills up
+#define LONG_BLOCKS_INIT  1024
+
+static
+int add_long_block(lct_dir24_t *table, uint32_t *capacity, uint32_t fill) {
+  if (table->nlong == *capacity) {
+    uint32_t new_capacity = *capacity ? *capacity * 2 : LONG_BLOCKS_INIT;
+    uint32_t *tmp = (uint32_t *) realloc(table->tbllong, (size_t) new_capacity * 256 * sizeof(uint32_t));
+    if (!tmp) {
+      fprintf(stderr, "ERROR: failed to allocate DIR-24-8 long table\n");
+      return -1;
+    }
+    table->tbllong = tmp;
+    *capacity = new_capacity;
+  }
+
+  // the new block starts out with the entry for the /24 it replaces
+  uint32_t *block = &table->tbllong[(size_t) table->nlong * 256];
+  for (int i = 0; i < 256; ++i) {
+    block[i] = fill;
+  }
+  return table->nlong++;
+}
+
+int lct_dir24_build(lct_dir24_t *table, lct_subnet_t *subnets, uint32_t size) {
+  uint32_t count[33] = { 0 };
+  uint32_t start[33];
+  uint32_t *order;
+  uint32_t capacity = 0;
+
+  if (!table || !subnets || !size)
+    return -1;
+
+  table->nets = subnets;
+  table->tbllong = NULL;
+  table->nlong = 0;
+  table->tbl24 = (uint32_t *) calloc(LCT_DIR24_SIZE, sizeof(uint32_t));
+  if (!table->tbl24) {
+    fprintf(stderr, "ERROR: failed to allocate DIR-24-8 table\n");
+    return -1;
+  }
+
+  // order the subnets by prefix length, so that each longer prefix
+  // overwrites the entries of the shorter prefixes that contain it
+  order = (uint32_t *) malloc(size * sizeof(uint32_t));
+  if (!order) {
+    fprintf(stderr, "ERROR: failed to allocate DIR-24-8 build buffer\n");
+    lct_dir24_free(table);
+    return -1;
+  }
+  for (uint32_t i = 0; i < size; ++i) {
+    ++count[subnets[i].len];
+  }
+  start[0] = 0;
+  for (int len = 1; len <= 32; ++len) {
+    start[len] = start[len - 1] + count[len - 1];
+  }
+  for (uint32_t i = 0; i < size; ++i) {
+    order[start[subnets[i].len]++] = i;
+  }
+
+  for (uint32_t j = 0; j < size; ++j) {
+    uint32_t i = order[j];
+    uint32_t addr = subnets[i].addr;
+    uint8_t len = subnets[i].len;
+
+    if (len <= 24) {
+      // all of the prefixes up to 24 bits have been set before any
+      // long block is created, so these entries never point to one
+      uint32_t first = addr >> 8;
+      uint32_t last = first + (1 << (24 - len));
+      for (uint32_t k = first; k < last; ++k) {
+        table->tbl24[k] = i + 1;
+      }
+    } else {
+      uint32_t *entry = &table->tbl24[addr >> 8];
+      if (!(*entry & LCT_DIR24_LONG)) {
+        int block = add_long_block(table, &capacity, *entry);
+        if (block < 0) {
+          free(order);
+          lct_dir24_free(table);
+          return -1;
+        }
+        *entry = LCT_DIR24_LONG | block;
+      }
+      uint32_t *block = &table->tbllong[(size_t) (*entry & ~LCT_DIR24_LONG) * 256];
+      uint32_t first = addr & 0xff;
+      uint32_t last = first + (1 << (32 - len));
+      for (uint32_t k = first; k < last; ++k) {
+        block[k] = i + 1;
+      }
+    }
+  }
+  free(order);
+
+  // shrink the long table down to its actual size
+  if (table->nlong) {
+    uint32_t *tmp = (uint32_t *) realloc(table->tbllong, (size_t) table->nlong * 256 * sizeof(uint32_t));
+    if (tmp) {
+      table->tbllong = tmp;
+    }
+  }
+
+  return 0;
+}
+
+void lct_dir24_free(lct_dir24_t *table) {
+  if (!table)
+    return;
+
+  free(table->tbl24);
+  free(table->tbllong);
+  table->tbl24 = NULL;
+  table->tbllong = NULL;
+  table->nlong = 0;
+}
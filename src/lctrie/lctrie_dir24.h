@@ -0,0 +1,56 @@
+#ifndef __LC_TRIE_DIR24_H__
+#define __LC_TRIE_DIR24_H__
+// begin #ifndef guard
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "lctrie_ip.h"
+
+// DIR-24-8 fixed stride lookup table
+//
+// An alternative to the LC trie for IPv4 longest prefix matching,
+// built from the same sorted and de-duplicated subnet array.  The
+// first 24 bits of the key index directly into a table with one
+// entry per /24, so every lookup takes a single memory access, plus
+// a second one into a block of 256 entries for the /24s that are
+// split by a prefix longer than 24 bits.  There are no data dependent
+// loops or shifts, at the cost of a fixed 64 MB for the first table.
+//
+// Each entry holds the index of the matching subnet plus one, or
+// zero if there is no match; if LCT_DIR24_LONG is set, the rest of
+// the entry is instead the number of the block in the long table
+// that holds the entries for the last 8 bits of the key.
+#define LCT_DIR24_LONG    0x80000000
+#define LCT_DIR24_SIZE    (1 << 24)
+
+typedef struct lct_dir24 {
+  uint32_t *tbl24;    // LCT_DIR24_SIZE entries, one per /24
+  uint32_t *tbllong;  // blocks of 256 entries, one per address
+  uint32_t nlong;     // number of blocks in tbllong
+
+  lct_subnet_t *nets; // pointer to a sorted and prefixed array of subnets
+} lct_dir24_t;
+
+// lifecycle functions
+//
+// as with lct_build(), we store a pointer to the subnet array, which must
+// remain static during the lifetime of the table.  returns 0 on success
+// and -1 if memory could not be allocated.
+extern int lct_dir24_build(lct_dir24_t *table, lct_subnet_t *subnets, uint32_t size);
+extern void lct_dir24_free(lct_dir24_t *table);
+
+// table search function
+// return the IP subnet corresponding to the element,
+// otherwise return NULL if not found
+// key must be provided in host byte ordering
+static inline lct_subnet_t *lct_dir24_find(const lct_dir24_t *table, uint32_t key) {
+  uint32_t entry = table->tbl24[key >> 8];
+  if (entry & LCT_DIR24_LONG) {
+    entry = table->tbllong[((entry & ~LCT_DIR24_LONG) << 8) | (key & 0xff)];
+  }
+  return entry ? &table->nets[entry - 1] : NULL;
+}
+
+// end #ifndef guard
+#endif
@@ -0,0 +1,997 @@
+/*
+ * libmerc.cc
+ *
+ * packet processing contexts, through which mercury (and other
+ * programs that embed libmerc) turn packets into JSON records or
+ * fingerprints, without any global state
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <string.h>
+#include <limits.h>
+#include <new>
+#include "libmerc.h"
+#include "json_file_io.h"
+#include "json_object.h"
+#include "extractor.h"
+#include "packet.h"
+#include "utils.h"
+#include "analysis.h"
+#include "os_identification.h"
+#include "buffer_stream.h"
+#include "dns.h"
+#include "proto_identify.h"
+#include "tls.h"
+#include "http.h"
+#include "wireguard.h"
+#include "quic.h"
+#include "tls_decrypt.h"
+#include "ssh.h"
+#include "dhcp.h"
+#include "tcpip.h"
+#include "eth.h"
+#include "udp.h"
+#include "metrics.h"
+#include "addr.h"
+
+#define MAX_FP_STR_LEN 4096
+#define MAX_SNI_LEN     257
+
+struct mercury_resources {
+    struct analysis_resources *analysis;
+};
+
+/*
+ * struct mercury_context holds a copy of the configuration of a
+ * context, with its protocol selection parsed, along with the
+ * storage for the strings in the mercury_fingerprint_result that it
+ * returns, the state of QUIC Initial processing, and the state of
+ * TLS decryption (if a keylog is configured)
+ */
+struct mercury_context {
+    struct libmerc_config cfg;
+    const struct analysis_resources *analysis;  /* NULL unless analysis is configured */
+    struct protocol_selection selection;
+    char fingerprint[MAX_FP_STR_LEN];
+    char server_name[MAX_SNI_LEN];
+    struct analysis_result analysis_result;
+    struct quic_initial_processor quic;
+    struct tls_decryptor *tls_decrypt = NULL;
+};
+
+void write_flow_key(struct buffer_stream &buf, const struct key &k) {
+    if (k.ip_vers == 6) {
+        const uint8_t *s = (const uint8_t *)&k.addr.ipv6.src;
+        buf.strncpy("\"src_ip\":\"");
+        buf.write_ipv6_addr(s);
+
+        const uint8_t *d = (const uint8_t *)&k.addr.ipv6.dst;
+        buf.strncpy("\",\"dst_ip\":\"");
+        buf.write_ipv6_addr(d);
+
+    } else {
+
+        const uint8_t *s = (const uint8_t *)&k.addr.ipv4.src;
+        buf.strncpy("\"src_ip\":\"");
+        buf.write_ipv4_addr(s);
+
+        const uint8_t *d = (const uint8_t *)&k.addr.ipv4.dst;
+        buf.strncpy("\",\"dst_ip\":\"");
+        buf.write_ipv4_addr(d);
+    }
+
+    buf.strncpy("\",\"protocol\":");
+    buf.write_uint8(k.protocol);
+
+    buf.strncpy(",\"src_port\":");
+    buf.write_uint16(k.src_port);
+
+    buf.strncpy(",\"dst_port\":");
+    buf.write_uint16(k.dst_port);
+
+}
+
+/*
+ * write_flow_key() writes the flow key and, if subnet_labels is not
+ * NULL, the labels of the subnets of its IPv4 addresses
+ */
+void write_flow_key(struct json_object &o, const struct key &k, const struct subnet_db *subnet_labels) {
+    if (k.ip_vers == 6) {
+        const uint8_t *s = (const uint8_t *)&k.addr.ipv6.src;
+        o.print_key_ipv6_addr("src_ip", s);
+
+        const uint8_t *d = (const uint8_t *)&k.addr.ipv6.dst;
+        o.print_key_ipv6_addr("dst_ip", d);
+
+    } else {
+
+        const uint8_t *s = (const uint8_t *)&k.addr.ipv4.src;
+        o.print_key_ipv4_addr("src_ip", s);
+
+        const uint8_t *d = (const uint8_t *)&k.addr.ipv4.dst;
+        o.print_key_ipv4_addr("dst_ip", d);
+
+        if (subnet_labels) {
+            const char *src_label = subnet_db_get_label(subnet_labels, k.addr.ipv4.src);
+            if (src_label) {
+                o.print_key_string("src_label", src_label);
+            }
+            const char *dst_label = subnet_db_get_label(subnet_labels, k.addr.ipv4.dst);
+            if (dst_label) {
+                o.print_key_string("dst_label", dst_label);
+            }
+        }
+    }
+
+    o.print_key_uint8("protocol", k.protocol);
+    o.print_key_uint16("src_port", k.src_port);
+    o.print_key_uint16("dst_port", k.dst_port);
+
+}
+
+/*
+ * write_event_info() writes the event time and, if it is not NULL,
+ * the interface on which the packet was captured
+ */
+static inline void write_event_info(struct json_object &record,
+                                    struct timespec *ts,
+                                    const char *ingress_interface) {
+    record.print_key_timestamp("event_start", ts);
+    if (ingress_interface) {
+        record.print_key_json_string("interface", (const uint8_t *)ingress_interface, strlen(ingress_interface));
+    }
+}
+
+void packet_summary_init(struct packet_summary *summary,
+                         const struct mercury_context &ctx,
+                         uint8_t *packet,
+                         size_t length) {
+    struct key k;
+    struct datum pkt{packet, packet+length};
+    size_t transport_proto = 0;
+    size_t ethertype = 0;
+    parser_process_eth(&pkt, &ethertype);
+    switch(ethertype) {
+    case ETH_TYPE_IP:
+        parser_process_ipv4(&pkt, &transport_proto, &k);
+        break;
+    case ETH_TYPE_IPV6:
+        parser_process_ipv6(&pkt, &transport_proto, &k);
+        break;
+    default:
+        ;
+    }
+    *summary = packet_summary{};
+    enum msg_type msg_type = msg_type_unknown;
+    if (transport_proto == 6) {
+        struct tcp_packet tcp_pkt;
+        tcp_pkt.parse(pkt);
+        summary->tcp_syn = tcp_pkt.is_SYN();
+        msg_type = get_message_type(pkt.data, pkt.length());
+    } else if (transport_proto == 17) {
+        struct udp_packet udp_pkt;
+        udp_pkt.parse(pkt);
+        msg_type = udp_get_message_type(pkt.data, pkt.length());
+    } else {
+        return;
+    }
+    summary->msg_type = ctx.selection.msg_type[msg_type] ? msg_type : msg_type_unknown;
+    summary->payload = pkt.data;
+}
+
+/*
+ * write_decrypted_messages() writes a record for each of the HTTP
+ * requests and responses decrypted from a TLS session, which are
+ * fingerprinted exactly as those sent in the clear, and marked as
+ * decrypted
+ */
+static void write_decrypted_messages(struct buffer_stream &buf,
+                                     struct mercury_context &ctx,
+                                     const std::vector<struct tls_decrypted_message> &messages,
+                                     const struct key &k,
+                                     struct timespec *ts,
+                                     const char *ingress_interface,
+                                     struct thread_metrics *metrics) {
+    for (const struct tls_decrypted_message &m : messages) {
+        struct datum msg{(const uint8_t *)m.data.data(), (const uint8_t *)m.data.data() + m.data.length()};
+        if (m.from_server) {
+            if (ctx.selection.msg_type[msg_type_http_response] == false) {
+                continue;
+            }
+            struct http_response response;
+            response.parse(msg);
+            if (response.is_not_empty() == false) {
+                continue;
+            }
+            if (buf.length() != 0) {
+                buf.strncpy("\n");
+            }
+            struct json_object record{&buf};
+            struct json_object fps{record, "fingerprints"};
+            fps.print_key_value("http_server", response);
+            fps.close();
+            record.print_key_string("complete", response.headers.complete ? "yes" : "no");
+            if (ctx.cfg.metadata_output) {
+                response.write_json(record);
+            }
+            record.print_key_bool("decrypted", true);
+            write_flow_key(record, k, ctx.cfg.subnet_labels);
+            write_event_info(record, ts, ingress_interface);
+            record.close();
+            if (metrics) {
+                metrics_increment(metrics->records[msg_type_http_response]);
+            }
+        } else {
+            if (ctx.selection.msg_type[msg_type_http_request] == false) {
+                continue;
+            }
+            struct http_request request;
+            request.parse(msg);
+            if (request.is_not_empty() == false) {
+                continue;
+            }
+            if (buf.length() != 0) {
+                buf.strncpy("\n");
+            }
+            struct json_object record{&buf};
+            struct json_object fps{record, "fingerprints"};
+            fps.print_key_value("http", request);
+            fps.close();
+            record.print_key_string("complete", request.headers.complete ? "yes" : "no");
+            request.write_json(record, ctx.cfg.metadata_output);
+            record.print_key_bool("decrypted", true);
+            write_flow_key(record, k, ctx.cfg.subnet_labels);
+            write_event_info(record, ts, ingress_interface);
+            record.close();
+            if (metrics) {
+                metrics_increment(metrics->records[msg_type_http_request]);
+            }
+        }
+    }
+}
+
+/*
+ * written_string(buf, offset) returns the string value that
+ * json_object::print_key_value() wrote into buf after offset, without
+ * its quotes, so that a fingerprint need not be computed again; it
+ * returns an empty datum if buf is truncated
+ */
+static struct datum written_string(const struct buffer_stream &buf, int offset) {
+    if (buf.trunc || buf.doff - offset < 2) {
+        return {NULL, NULL};
+    }
+    const char *colon = (const char *)memchr(buf.dstr + offset, ':', buf.doff - offset);
+    if (colon == NULL || buf.dstr + buf.doff - colon < 3) {
+        return {NULL, NULL};
+    }
+    return {(const uint8_t *)colon + 2, (const uint8_t *)buf.dstr + buf.doff - 1};
+}
+
+int append_packet_json(struct buffer_stream &buf,
+                       struct mercury_context &ctx,
+                       uint8_t *packet,
+                       size_t length,
+                       struct timespec *ts,
+                       const char *ingress_interface,
+                       struct thread_metrics *metrics,
+                       struct os_observation_queue *os_queue,
+                       struct packet_summary *summary) {
+    struct key k;
+    struct datum pkt{packet, packet+length};
+    if (summary) {
+        *summary = packet_summary{};
+    }
+    size_t transport_proto = 0;
+    size_t ethertype = 0;
+    parser_process_eth(&pkt, &ethertype);
+    switch(ethertype) {
+    case ETH_TYPE_IP:
+        parser_process_ipv4(&pkt, &transport_proto, &k);
+        break;
+    case ETH_TYPE_IPV6:
+        parser_process_ipv6(&pkt, &transport_proto, &k);
+        break;
+    default:
+        ;
+    }
+    enum msg_type msg_type = msg_type_unknown;
+    const std::vector<struct tls_decrypted_message> *decrypted = NULL;
+    if (transport_proto == 6) {
+        struct tcp_packet tcp_pkt;
+        tcp_pkt.parse(pkt);
+        tcp_pkt.set_key(k);
+        if (tcp_pkt.is_SYN()) {
+            if (summary) {
+                summary->tcp_syn = true;
+            }
+            struct json_object record{&buf};
+            struct json_object fps{record, "fingerprints"};
+            int fp_offset = buf.length();
+            fps.print_key_value("tcp", tcp_pkt);
+            struct datum fp = written_string(buf, fp_offset);
+            fps.close();
+            if (ctx.cfg.metadata_output) {
+                 tcp_pkt.write_json(fps);
+            }
+            write_flow_key(record, k, ctx.cfg.subnet_labels);
+            write_event_info(record, ts, ingress_interface);
+            record.close();
+            if (metrics) {
+                metrics_increment(metrics->records[msg_type_unknown]);
+            }
+            if (os_queue && fp.is_not_empty()) {
+                os_identification_update(os_queue, k, os_fp_type_tcp, (const char *)fp.data, fp.length(), ts);
+            }
+        }
+        msg_type = get_message_type(pkt.data, pkt.length());
+        if (ctx.tls_decrypt) {
+            decrypted = &ctx.tls_decrypt->process(k, tcp_pkt, pkt);
+        }
+    } else if (transport_proto == 17) {
+        struct udp_packet udp_pkt;
+        udp_pkt.parse(pkt);
+        udp_pkt.set_key(k);
+        msg_type = udp_get_message_type(pkt.data, pkt.length());
+    }
+    if (ctx.selection.msg_type[msg_type] == false) {
+        msg_type = msg_type_unknown;
+    }
+    if (summary) {
+        summary->msg_type = msg_type;
+        summary->payload = (transport_proto == 6 || transport_proto == 17) ? pkt.data : NULL;
+    }
+    size_t length_before_msg = buf.length();
+
+    switch(msg_type) {
+    case msg_type_http_request:
+        {
+            struct http_request request;
+            request.parse(pkt);
+            if (request.is_not_empty()) {
+                struct json_object record{&buf};
+                struct json_object fps{record, "fingerprints"};
+                int fp_offset = buf.length();
+                fps.print_key_value("http", request);
+                struct datum fp = written_string(buf, fp_offset);
+                fps.close();
+                record.print_key_string("complete", request.headers.complete ? "yes" : "no");
+                request.write_json(record, ctx.cfg.metadata_output);
+                write_flow_key(record, k, ctx.cfg.subnet_labels);
+                write_event_info(record, ts, ingress_interface);
+                record.close();
+                if (os_queue && fp.is_not_empty()) {
+                    os_identification_update(os_queue, k, os_fp_type_http, (const char *)fp.data, fp.length(), ts);
+                }
+            }
+        }
+        break;
+    case msg_type_tls_client_hello:
+        {
+            struct tls_record rec;
+            rec.parse(pkt);
+            struct tls_handshake handshake;
+            handshake.parse(rec.fragment);
+            struct tls_client_hello hello;
+            hello.parse(handshake.body);
+            if (hello.is_not_empty()) {
+                struct json_object record{&buf};
+                struct json_object fps{record, "fingerprints"};
+                int fp_offset = buf.length();
+                fps.print_key_value("tls", hello);
+                struct datum fp = written_string(buf, fp_offset);
+                fps.close();
+                hello.write_json(record, ctx.cfg.metadata_output);
+                /*
+                 * output analysis (if it's configured)
+                 */
+                if (ctx.analysis) {
+                    bool found = write_analysis_from_extractor_and_flow_key(buf, *ctx.analysis, hello, k);
+                    if (metrics) {
+                        metrics_increment(found ? metrics->analysis_hits : metrics->analysis_misses);
+                    }
+                }
+                write_flow_key(record, k, ctx.cfg.subnet_labels);
+                write_event_info(record, ts, ingress_interface);
+                record.close();
+                if (os_queue && fp.is_not_empty()) {
+                    os_identification_update(os_queue, k, os_fp_type_tls, (const char *)fp.data, fp.length(), ts);
+                }
+            }
+        }
+        break;
+    case msg_type_tls_server_hello:
+    case msg_type_tls_certificate:
+        {
+            struct tls_record rec;
+            struct tls_handshake handshake;
+            struct tls_server_hello hello;
+            struct tls_server_certificate certificate;
+
+            // parse server_hello and/or certificate
+            //
+            rec.parse(pkt);
+            handshake.parse(rec.fragment);
+            if (handshake.msg_type == handshake_type::server_hello) {
+                hello.parse(handshake.body);
+                if (rec.is_not_empty()) {
+                    struct tls_handshake h;
+                    h.parse(rec.fragment);
+                    certificate.parse(h.body);
+                }
+
+            } else if (handshake.msg_type == handshake_type::certificate) {
+                certificate.parse(handshake.body);
+            }
+            struct tls_record rec2;
+            rec2.parse(pkt);
+            struct tls_handshake handshake2;
+            handshake2.parse(rec2.fragment);
+            if (handshake2.msg_type == handshake_type::certificate) {
+                certificate.parse(handshake2.body);
+            }
+
+            bool have_hello = hello.is_not_empty();
+            bool have_certificate = certificate.is_not_empty();
+            if (have_hello || have_certificate) {
+                struct json_object record{&buf};
+
+                // output fingerprint
+                if (have_hello) {
+                    struct json_object fps{record, "fingerprints"};
+                    fps.print_key_value("tls_server", hello);
+                    fps.close();
+                }
+
+                // output certificate (always) and server_hello (if configured to)
+                //
+                if ((ctx.cfg.metadata_output && have_hello) || have_certificate) {
+                    struct json_object tls{record, "tls"};
+                    struct json_object tls_server{tls, "server"};
+                    if (ctx.cfg.metadata_output && have_hello) {
+                        hello.write_json(tls_server);
+                    }
+                    if (have_certificate) {
+                        struct json_array server_certs{tls_server, "certs"};
+                        certificate.write_json(server_certs, ctx.cfg.certs_json_output);
+                        server_certs.close();
+                    }
+                    tls_server.close();
+                    tls.close();
+                }
+                write_flow_key(record, k, ctx.cfg.subnet_labels);
+                write_event_info(record, ts, ingress_interface);
+                record.close();
+            }
+        }
+        break;
+    case msg_type_http_response:
+        {
+            struct http_response response;
+            response.parse(pkt);
+            if (response.is_not_empty()) {
+                struct json_object record{&buf};
+                struct json_object fps{record, "fingerprints"};
+                fps.print_key_value("http_server", response);
+                fps.close();
+                record.print_key_string("complete", response.headers.complete ? "yes" : "no");
+                if (ctx.cfg.metadata_output) {
+                    response.write_json(record);
+                }
+                write_flow_key(record, k, ctx.cfg.subnet_labels);
+                write_event_info(record, ts, ingress_interface);
+                record.close();
+            }
+        }
+        break;
+    case msg_type_wireguard:
+        {
+            wireguard_handshake_init wg;
+            wg.parse(pkt);
+            struct json_object record{&buf};
+            wg.write_json(record);
+            write_flow_key(record, k, ctx.cfg.subnet_labels);
+            write_event_info(record, ts, ingress_interface);
+            record.close();
+        }
+        break;
+    case msg_type_dns:
+        {
+            struct json_object record{&buf};
+            struct json_object dns{record, "dns"};
+            write_dns_server_data(pkt.data,
+                                  pkt.length(),
+                                  dns,
+                                  !ctx.cfg.dns_json_output);
+            dns.close();
+            write_flow_key(record, k, ctx.cfg.subnet_labels);
+            write_event_info(record, ts, ingress_interface);
+            record.close();
+        }
+        break;
+    case msg_type_dtls_client_hello:
+        {
+            struct dtls_record dtls_rec;
+            dtls_rec.parse(pkt);
+            struct dtls_handshake handshake;
+            handshake.parse(dtls_rec.fragment);
+            if (handshake.msg_type == handshake_type::client_hello) {
+                struct tls_client_hello hello;
+                hello.parse(handshake.body);
+                if (hello.is_not_empty()) {
+                    struct json_object record{&buf};
+                    struct json_object fps{record, "fingerprints"};
+                    fps.print_key_value("dtls", hello);
+                    fps.close();
+                    hello.write_json(record, ctx.cfg.metadata_output);
+                    write_flow_key(record, k, ctx.cfg.subnet_labels);
+                    write_event_info(record, ts, ingress_interface);
+                    record.close();
+                }
+            }
+        }
+        break;
+    case msg_type_quic:
+        {
+            struct quic_initial_packet initial;
+            initial.parse(pkt);
+            struct datum handshake_msg;
+            if (ctx.quic.process(initial, handshake_msg)) {
+                struct quic_client_hello quic_hello;
+                quic_hello.parse(initial, handshake_msg);
+                if (quic_hello.is_not_empty()) {
+                    struct json_object record{&buf};
+                    struct json_object fps{record, "fingerprints"};
+                    fps.print_key_value("quic", quic_hello);
+                    fps.close();
+                    quic_hello.write_json(record, ctx.cfg.metadata_output);
+                    write_flow_key(record, k, ctx.cfg.subnet_labels);
+                    write_event_info(record, ts, ingress_interface);
+                    record.close();
+                }
+            }
+        }
+        break;
+    case msg_type_ssh:
+        {
+            struct ssh_init_packet init_packet;
+            init_packet.parse(pkt);
+            struct json_object record{&buf};
+            struct json_object fps{record, "fingerprints"};
+            fps.print_key_value("ssh", init_packet);
+            fps.close();
+            init_packet.write_json(record, ctx.cfg.metadata_output);
+#ifdef SSHM
+            if (pkt.is_not_empty()) {
+                record.print_key_json_string("ssh_residual_data", pkt.data, pkt.length());
+                struct ssh_binary_packet pkt;
+                pkt.parse(pkt);
+                struct ssh_kex_init kex_init;
+                kex_init.parse(pkt.payload);
+                kex_init.write_json(record, ctx.cfg.metadata_output);
+            }
+#endif
+            write_flow_key(record, k, ctx.cfg.subnet_labels);
+            write_event_info(record, ts, ingress_interface);
+            record.close();
+        }
+        break;
+    case msg_type_ssh_kex:
+        {
+            // record.print_key_json_string("ssh_kex_data", pkt.data, pkt.length());
+            struct ssh_binary_packet ssh_pkt;
+            ssh_pkt.parse(pkt);
+            struct ssh_kex_init kex_init;
+            kex_init.parse(ssh_pkt.payload);
+            if (kex_init.is_not_empty()) {
+                struct json_object record{&buf};
+                struct json_object fps{record, "fingerprints"};
+                fps.print_key_value("ssh_kex", kex_init);
+                fps.close();
+                kex_init.write_json(record, ctx.cfg.metadata_output);
+                write_flow_key(record, k, ctx.cfg.subnet_labels);
+                write_event_info(record, ts, ingress_interface);
+                record.close();
+            }
+        }
+        break;
+    case msg_type_dhcp:
+        {
+            struct dhcp_discover dhcp_disco;
+            dhcp_disco.parse(pkt);
+            if (dhcp_disco.is_not_empty()) {
+                struct json_object record{&buf};
+                struct json_object fps{record, "fingerprints"};
+                fps.print_key_value("dhcp", dhcp_disco);
+                fps.close();
+                if (ctx.cfg.metadata_output) {
+                    dhcp_disco.write_json(record);
+                    write_flow_key(record, k, ctx.cfg.subnet_labels);
+                    write_event_info(record, ts, ingress_interface);
+                }
+                record.close();
+            }
+        }
+        break;
+    case msg_type_dtls_server_hello:
+    case msg_type_dtls_certificate:
+        // cases that fall through here are not yet supported
+    case msg_type_unknown:
+        // no output
+        break;
+    }
+
+    if (metrics && buf.length() > length_before_msg) {
+        metrics_increment(metrics->records[msg_type]);
+    }
+    if (decrypted) {
+        write_decrypted_messages(buf, ctx, *decrypted, k, ts, ingress_interface, metrics);
+    }
+
+    //    buf.snprintf(dstr, doff, dlen, trunc, ",\"flowhash\":\"%016lx\"", flowhash(key, ts->tv_sec));
+
+    if (buf.length() != 0) {
+        buf.strncpy("\n");
+        return buf.length();
+    }
+    return 0;
+}
+
+
+size_t extract_fp_from_tls_client_hello(uint8_t *data,
+                                        size_t data_len,
+                                        uint8_t *outbuf,
+                                        size_t outbuf_len) {
+    if (outbuf_len == 0) {
+        return 0;
+    }
+    struct datum pkt{data, data + data_len};
+    struct tls_record rec;
+    rec.parse(pkt);
+    struct tls_handshake handshake;
+    handshake.parse(rec.fragment);
+    if (handshake.msg_type != handshake_type::client_hello) {
+        return 0;
+    }
+    struct tls_client_hello hello;
+    hello.parse(handshake.body);
+    if (hello.is_not_empty() == false) {
+        return 0;
+    }
+    struct buffer_stream buf{(char *)outbuf, outbuf_len - 1 > INT_MAX ? INT_MAX : (int)(outbuf_len - 1)};
+    hello.write_fingerprint(buf);
+    if (buf.trunc) {
+        return 0;
+    }
+    outbuf[buf.length()] = '\0';
+    return buf.length();
+}
+
+struct mercury_resources *mercury_resources_init(const char *resource_dir, int verbosity) {
+    struct analysis_resources *analysis = analysis_resources_init(verbosity, resource_dir);
+    if (analysis == NULL) {
+        return NULL;
+    }
+    struct mercury_resources *resources = new (std::nothrow) struct mercury_resources;
+    if (resources == NULL) {
+        analysis_resources_finalize(analysis);
+        return NULL;
+    }
+    resources->analysis = analysis;
+    return resources;
+}
+
+void mercury_resources_finalize(struct mercury_resources *resources) {
+    if (resources == NULL) {
+        return;
+    }
+    analysis_resources_finalize(resources->analysis);
+    delete resources;
+}
+
+struct mercury_context *mercury_context_init(const struct mercury_resources *resources,
+                                             const struct libmerc_config *config) {
+    if (config->do_analysis && resources == NULL) {
+        fprintf(stderr, "error: analysis requires resources\n");
+        return NULL;
+    }
+    struct mercury_context *ctx = new (std::nothrow) struct mercury_context;
+    if (ctx == NULL) {
+        return NULL;
+    }
+    if (ctx->quic.is_valid() == false) {
+        fprintf(stderr, "error: could not initialize QUIC ciphers\n");
+        delete ctx;
+        return NULL;
+    }
+    if (protocol_selection_init(&ctx->selection, config->packet_filter_cfg) != status_ok) {
+        delete ctx;
+        return NULL;
+    }
+    ctx->cfg = *config;
+    ctx->cfg.packet_filter_cfg = NULL;  /* parsed into ctx->selection, not retained */
+    ctx->analysis = config->do_analysis ? resources->analysis : NULL;
+    if (config->keylog) {
+        ctx->tls_decrypt = new (std::nothrow) tls_decryptor(*config->keylog);
+        if (ctx->tls_decrypt == NULL || ctx->tls_decrypt->is_valid() == false) {
+            fprintf(stderr, "error: could not initialize TLS decryption\n");
+            delete ctx->tls_decrypt;
+            delete ctx;
+            return NULL;
+        }
+    }
+
+    return ctx;
+}
+
+void mercury_context_finalize(struct mercury_context *ctx) {
+    if (ctx) {
+        delete ctx->tls_decrypt;
+    }
+    delete ctx;
+}
+
+struct tls_keylog *tls_keylog_init(const char *keylog_file, int verbosity) {
+    struct tls_keylog *keylog = new (std::nothrow) struct tls_keylog;
+    if (keylog == NULL) {
+        return NULL;
+    }
+    if (keylog->load(keylog_file, verbosity) == false) {
+        delete keylog;
+        return NULL;
+    }
+    return keylog;
+}
+
+void tls_keylog_finalize(struct tls_keylog *keylog) {
+    delete keylog;
+}
+
+struct subnet_db *subnet_labels_init(const char *subnet_file, int verbosity) {
+    return subnet_db_init_labels(subnet_file, verbosity);
+}
+
+void subnet_labels_finalize(struct subnet_db *subnet_labels) {
+    subnet_db_finalize(subnet_labels);
+}
+
+size_t mercury_context_write_json(struct mercury_context *ctx,
+                                  uint8_t *buffer,
+                                  size_t buffer_size,
+                                  uint8_t *packet,
+                                  size_t length,
+                                  const struct timespec *ts) {
+    struct buffer_stream buf{(char *)buffer, buffer_size > INT_MAX ? INT_MAX : (int)buffer_size};
+    struct timespec event_time = *ts;
+    append_packet_json(buf, *ctx, packet, length, &event_time, NULL, NULL, NULL);
+    if (buf.trunc) {
+        return 0;
+    }
+    return buf.length();
+}
+
+static void set_flow_key(struct mercury_flow_key &fk, const struct key &k) {
+    fk.ip_version = k.ip_vers;
+    fk.protocol = k.protocol;
+    fk.src_port = k.src_port;
+    fk.dst_port = k.dst_port;
+    memset(fk.src_addr, 0, sizeof(fk.src_addr));
+    memset(fk.dst_addr, 0, sizeof(fk.dst_addr));
+    if (k.ip_vers == 6) {
+        memcpy(fk.src_addr, &k.addr.ipv6.src, sizeof(k.addr.ipv6.src));
+        memcpy(fk.dst_addr, &k.addr.ipv6.dst, sizeof(k.addr.ipv6.dst));
+    } else {
+        memcpy(fk.src_addr, &k.addr.ipv4.src, sizeof(k.addr.ipv4.src));
+        memcpy(fk.dst_addr, &k.addr.ipv4.dst, sizeof(k.addr.ipv4.dst));
+    }
+}
+
+/*
+ * set_fingerprint(ctx, result, type, msg, k) writes the fingerprint
+ * of msg into ctx, without its surrounding quotes, and sets result to
+ * refer to it; it returns false if the fingerprint is empty or too
+ * long
+ */
+template <typename T>
+static bool set_fingerprint(struct mercury_context &ctx,
+                            struct mercury_fingerprint_result &result,
+                            enum fingerprint_type type,
+                            T &msg,
+                            const struct key &k) {
+    struct buffer_stream fp_buf{ctx.fingerprint, sizeof(ctx.fingerprint) - 1};
+    msg(fp_buf);
+    if (fp_buf.trunc || fp_buf.length() <= 2) {
+        return false;
+    }
+    size_t fp_len = fp_buf.length() - 2;
+    memmove(ctx.fingerprint, ctx.fingerprint + 1, fp_len);
+    ctx.fingerprint[fp_len] = '\0';
+
+    result.type = type;
+    result.fingerprint = ctx.fingerprint;
+    result.server_name = NULL;
+    set_flow_key(result.flow_key, k);
+    result.analysis = { false, NULL, 0.0, false, false, 0.0 };
+    return true;
+}
+
+bool mercury_context_get_fingerprint(struct mercury_context *ctx,
+                                     uint8_t *packet,
+                                     size_t length,
+                                     struct mercury_fingerprint_result *result) {
+    struct mercury_fingerprint_result r;
+    struct key k;
+    struct datum pkt{packet, packet+length};
+    size_t transport_proto = 0;
+    size_t ethertype = 0;
+    parser_process_eth(&pkt, &ethertype);
+    switch(ethertype) {
+    case ETH_TYPE_IP:
+        parser_process_ipv4(&pkt, &transport_proto, &k);
+        break;
+    case ETH_TYPE_IPV6:
+        parser_process_ipv6(&pkt, &transport_proto, &k);
+        break;
+    default:
+        return false;
+    }
+    enum msg_type msg_type = msg_type_unknown;
+    if (transport_proto == 6) {
+        struct tcp_packet tcp_pkt;
+        tcp_pkt.parse(pkt);
+        tcp_pkt.set_key(k);
+        if (tcp_pkt.is_SYN()) {
+            if (set_fingerprint(*ctx, r, fingerprint_type_tcp, tcp_pkt, k)) {
+                *result = r;
+                return true;
+            }
+            return false;
+        }
+        msg_type = get_message_type(pkt.data, pkt.length());
+    } else if (transport_proto == 17) {
+        struct udp_packet udp_pkt;
+        udp_pkt.parse(pkt);
+        udp_pkt.set_key(k);
+        msg_type = udp_get_message_type(pkt.data, pkt.length());
+    }
+    if (ctx->selection.msg_type[msg_type] == false) {
+        return false;
+    }
+
+    bool found = false;
+    switch(msg_type) {
+    case msg_type_http_request:
+        {
+            struct http_request request;
+            request.parse(pkt);
+            if (request.is_not_empty()) {
+                found = set_fingerprint(*ctx, r, fingerprint_type_http, request, k);
+            }
+        }
+        break;
+    case msg_type_http_response:
+        {
+            struct http_response response;
+            response.parse(pkt);
+            if (response.is_not_empty()) {
+                found = set_fingerprint(*ctx, r, fingerprint_type_http_server, response, k);
+            }
+        }
+        break;
+    case msg_type_tls_client_hello:
+        {
+            struct tls_record rec;
+            rec.parse(pkt);
+            struct tls_handshake handshake;
+            handshake.parse(rec.fragment);
+            struct tls_client_hello hello;
+            hello.parse(handshake.body);
+            if (hello.is_not_empty()) {
+                found = set_fingerprint(*ctx, r, fingerprint_type_tls, hello, k);
+            }
+            if (found) {
+                struct datum sn{NULL, NULL};
+                hello.extensions.set_server_name(sn);
+                if (sn.is_not_empty()) {
+                    sn.strncpy(ctx->server_name, sizeof(ctx->server_name));
+                    r.server_name = ctx->server_name;
+                }
+                if (ctx->analysis && analysis_from_extractor_and_flow_key(*ctx->analysis, ctx->analysis_result, hello, k)) {
+                    r.analysis.valid = true;
+                    r.analysis.process = ctx->analysis_result.process;
+                    r.analysis.score = ctx->analysis_result.score;
+                    r.analysis.malware_info = ctx->analysis_result.malware_info;
+                    r.analysis.malware = ctx->analysis_result.malware;
+                    r.analysis.p_malware = ctx->analysis_result.p_malware;
+                }
+            }
+        }
+        break;
+    case msg_type_tls_server_hello:
+        {
+            struct tls_record rec;
+            rec.parse(pkt);
+            struct tls_handshake handshake;
+            handshake.parse(rec.fragment);
+            if (handshake.msg_type == handshake_type::server_hello) {
+                struct tls_server_hello hello;
+                hello.parse(handshake.body);
+                if (hello.is_not_empty()) {
+                    found = set_fingerprint(*ctx, r, fingerprint_type_tls_server, hello, k);
+                }
+            }
+        }
+        break;
+    case msg_type_dtls_client_hello:
+        {
+            struct dtls_record dtls_rec;
+            dtls_rec.parse(pkt);
+            struct dtls_handshake handshake;
+            handshake.parse(dtls_rec.fragment);
+            if (handshake.msg_type == handshake_type::client_hello) {
+                struct tls_client_hello hello;
+                hello.parse(handshake.body);
+                if (hello.is_not_empty()) {
+                    found = set_fingerprint(*ctx, r, fingerprint_type_dtls, hello, k);
+                }
+            }
+        }
+        break;
+    case msg_type_quic:
+        {
+            struct quic_initial_packet initial;
+            initial.parse(pkt);
+            struct datum handshake_msg;
+            if (ctx->quic.process(initial, handshake_msg)) {
+                struct quic_client_hello quic_hello;
+                quic_hello.parse(initial, handshake_msg);
+                if (quic_hello.is_not_empty()) {
+                    found = set_fingerprint(*ctx, r, fingerprint_type_quic, quic_hello, k);
+                }
+                if (found) {
+                    struct datum sn{NULL, NULL};
+                    quic_hello.hello.extensions.set_server_name(sn);
+                    if (sn.is_not_empty()) {
+                        sn.strncpy(ctx->server_name, sizeof(ctx->server_name));
+                        r.server_name = ctx->server_name;
+                    }
+                }
+            }
+        }
+        break;
+    case msg_type_ssh:
+        {
+            struct ssh_init_packet init_packet;
+            init_packet.parse(pkt);
+            found = set_fingerprint(*ctx, r, fingerprint_type_ssh, init_packet, k);
+        }
+        break;
+    case msg_type_ssh_kex:
+        {
+            struct ssh_binary_packet ssh_pkt;
+            ssh_pkt.parse(pkt);
+            struct ssh_kex_init kex_init;
+            kex_init.parse(ssh_pkt.payload);
+            if (kex_init.is_not_empty()) {
+                found = set_fingerprint(*ctx, r, fingerprint_type_ssh_kex, kex_init, k);
+            }
+        }
+        break;
+    case msg_type_dhcp:
+        {
+            struct dhcp_discover dhcp_disco;
+            dhcp_disco.parse(pkt);
+            if (dhcp_disco.is_not_empty()) {
+                found = set_fingerprint(*ctx, r, fingerprint_type_dhcp_client, dhcp_disco, k);
+            }
+        }
+        break;
+    default:
+        ;  // no fingerprint
+    }
+    if (found) {
+        *result = r;
+    }
+    return found;
+}
@@ -2,11 +2,28 @@
  * @file libmerc.h
  *
  * @brief interface to mercury packet metadata capture and analysis library
+ *
+ * The library has no global state of its own.  A mercury_resources
+ * object holds the (read-only) analysis databases, and can be shared
+ * by any number of threads; a mercury_context holds the configuration
+ * and scratch space of a single thread of packet processing, and must
+ * not be used by two threads at the same time.  Any number of
+ * contexts, with different configurations, can be used in the same
+ * process, and they can share a mercury_resources object or use
+ * their own.
  */
 
 #ifndef LIBMERC_H
 #define LIBMERC_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /**
  * @brief extracts a TLS client fingerprint from a packet
@@ -22,16 +39,223 @@
  * @param [out] outbuf the output buffer
  * @param [in] outbuf_len the number of bytes in the output buffer
  *
+ * @return the number of bytes written, not including the terminating
+ * null character, or zero if there is no clientHello or not enough room
  */
 size_t extract_fp_from_tls_client_hello(uint8_t *data,
                                         size_t data_len,
                                         uint8_t *outbuf,
                                         size_t outbuf_len);
 
+/**
+ * @brief configuration of a packet processing context
+ *
+ * These options correspond to mercury's command line options of the
+ * same names; libmerc_config_init() sets them to their defaults.
+ */
+struct libmerc_config {
+    bool do_analysis;               /* report the analysis of TLS clients     */
+    bool dns_json_output;           /* output DNS as JSON, not base64         */
+    bool certs_json_output;         /* output certificates as JSON, not base64 */
+    bool metadata_output;           /* output metadata, not just fingerprints */
+    const char *packet_filter_cfg;  /* protocols to report, as in --select, or NULL for all */
+    const struct tls_keylog *keylog; /* TLS secrets, as in --keylog, or NULL  */
+    const struct subnet_db *subnet_labels; /* as in --subnet-labels, or NULL  */
+};
+
+#define libmerc_config_init() { false, false, false, false, NULL, NULL, NULL }
 
+/**
+ * @brief the TLS secrets read from a key log file
+ */
+struct tls_keylog;
+
+/**
+ * @brief reads a key log file
+ *
+ * Reads the TLS secrets in @em keylog_file, which is in the
+ * SSLKEYLOGFILE format written by browsers and TLS libraries, so
+ * that contexts configured with them can decrypt the TLS sessions of
+ * those secrets and report the HTTP messages inside of them.  The
+ * keylog is not modified by the contexts that use it, and must
+ * outlive them.
+ *
+ * @return a new tls_keylog, or NULL on failure
+ */
+struct tls_keylog *tls_keylog_init(const char *keylog_file, int verbosity);
+
+/**
+ * @brief frees a tls_keylog, which must no longer be used by any context
+ */
+void tls_keylog_finalize(struct tls_keylog *keylog);
+
+/**
+ * @brief the labels of IPv4 subnets, read from a subnet label file
+ */
+struct subnet_db;
+
+/**
+ * @brief reads a subnet label file
+ *
+ * Reads the subnets and labels in @em subnet_file, each line of which
+ * holds an IPv4 subnet in CIDR notation, then whitespace, then a
+ * label, so that contexts configured with them add the labels of the
+ * longest matching subnets of the source and destination addresses to
+ * each record, as "src_label" and "dst_label".  The subnet labels are
+ * not modified by the contexts that use them, and must outlive them.
+ *
+ * @return a new subnet_db, or NULL on failure
+ */
+struct subnet_db *subnet_labels_init(const char *subnet_file, int verbosity);
+
+/**
+ * @brief frees a subnet_db, which must no longer be used by any context
+ */
+void subnet_labels_finalize(struct subnet_db *subnet_labels);
+
+/**
+ * @brief shared, immutable resources used by packet processing contexts
+ */
+struct mercury_resources;
+
+/**
+ * @brief loads the analysis resources
+ *
+ * Reads the fingerprint and subnet databases in the directory @em
+ * resource_dir, or, if it is NULL, in the first of mercury's default
+ * resource directories that holds them.
+ *
+ * @return a new mercury_resources object, or NULL on failure
+ */
+struct mercury_resources *mercury_resources_init(const char *resource_dir, int verbosity);
+
+/**
+ * @brief frees a mercury_resources object, which must no longer be
+ * used by any context
+ */
+void mercury_resources_finalize(struct mercury_resources *resources);
+
+/**
+ * @brief the state of a single thread of packet processing
+ */
+struct mercury_context;
+
+/**
+ * @brief creates a packet processing context
+ *
+ * The configuration is copied, so @em config need not outlive the
+ * context; @em resources must, and may be NULL if analysis is not
+ * configured.
+ *
+ * @return a new mercury_context, or NULL on failure
+ */
+struct mercury_context *mercury_context_init(const struct mercury_resources *resources,
+                                             const struct libmerc_config *config);
+
+void mercury_context_finalize(struct mercury_context *ctx);
+
+/**
+ * @brief writes the JSON records for a packet into a buffer
+ *
+ * Processes the Ethernet frame at @em packet, which contains @em
+ * length bytes and was seen at the time @em ts, and writes the
+ * mercury JSON records for it (one per line) into @em buffer.
+ *
+ * @return the number of bytes written, or zero if the packet produced
+ * no records or they did not fit into @em buffer_size bytes
+ */
+size_t mercury_context_write_json(struct mercury_context *ctx,
+                                  uint8_t *buffer,
+                                  size_t buffer_size,
+                                  uint8_t *packet,
+                                  size_t length,
+                                  const struct timespec *ts);
+
+enum fingerprint_type {
+    fingerprint_type_unknown     = 0,
+    fingerprint_type_tcp         = 1,
+    fingerprint_type_tls         = 2,
+    fingerprint_type_tls_sni     = 3,
+    fingerprint_type_tls_server  = 4,
+    fingerprint_type_http        = 5,
+    fingerprint_type_http_server = 6,
+    fingerprint_type_dhcp_client = 7,
+    fingerprint_type_dtls        = 8,
+    fingerprint_type_dtls_server = 9,
+    fingerprint_type_ssh         = 10,
+    fingerprint_type_ssh_kex     = 11,
+    fingerprint_type_quic        = 12
+};
+
+/**
+ * @brief the flow key of a packet; addresses are in network byte
+ * order, with IPv4 addresses in the first four bytes, and ports are
+ * in host byte order
+ */
+struct mercury_flow_key {
+    uint8_t ip_version;
+    uint8_t protocol;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint8_t src_addr[16];
+    uint8_t dst_addr[16];
+};
+
+/**
+ * @brief the analysis of a TLS client fingerprint; malware and
+ * p_malware are set only if malware_info is true
+ */
+struct mercury_analysis_result {
+    bool valid;                /* the fingerprint is in the database */
+    const char *process;       /* most probable process              */
+    double score;
+    bool malware_info;
+    bool malware;
+    double p_malware;
+};
+
+/**
+ * @brief the fingerprint of a packet, and its analysis
+ *
+ * The strings are owned by the context, and are valid until its next
+ * use.
+ */
+struct mercury_fingerprint_result {
+    enum fingerprint_type type;
+    const char *fingerprint;     /* bracket notation                  */
+    const char *server_name;     /* TLS server name, or NULL if none  */
+    struct mercury_flow_key flow_key;
+    struct mercury_analysis_result analysis;  /* TLS clients, if configured */
+};
+
+/**
+ * @brief finds the fingerprint of a packet
+ *
+ * Processes the Ethernet frame at @em packet, which contains @em
+ * length bytes, and sets @em result to its fingerprint (and, for a
+ * TLS client when analysis is configured, its analysis).
+ *
+ * @return true if the packet has a selected fingerprint, and false
+ * (leaving @em result unchanged) otherwise
+ */
+bool mercury_context_get_fingerprint(struct mercury_context *ctx,
+                                     uint8_t *packet,
+                                     size_t length,
+                                     struct mercury_fingerprint_result *result);
+
+#ifdef __cplusplus
+}
+
+#include "mercury.h"   /* for enum status */
+
+/*
+ * the following functions configure mercury's packet filter, which
+ * (unlike a mercury_context) uses global state
+ */
 enum status proto_ident_config(const char *config_string);
 
 enum status static_data_config(const char *config_string);
 
+#endif
 
 #endif /* LIBMERC_H */
@@ -1,5 +1,5 @@
 /*
- * match.c
+ * match.cc
  *
  * Copyright (c) 2020 Cisco Systems, Inc. All rights reserved.
  * License at https://github.com/cisco/mercury/blob/master/LICENSE
@@ -20,9 +20,11 @@
 #include "af_packet_v3.h"
 #include "pcap_reader.h"
 #include "analysis.h"
+#include "os_identification.h"
 #include "signal_handling.h"
 #include "config.h"
 #include "output.h"
+#include "metrics.h"
 #include "license.h"
 #include "version.h"
 
@@ -36,26 +38,38 @@ struct semantic_version mercury_version(MERCURY_SEMANTIC_VERSION);
 char mercury_help[] =
     "%s INPUT [OUTPUT] [OPTIONS]:\n"
     "INPUT\n"
-    "   [-c or --capture] capture_interface   # capture packets from interface\n"
+    "   [-c or --capture] capture_interface   # capture packets from interface(s)\n"
     "   [-r or --read] read_file              # read packets from file\n"
     "OUTPUT\n"
     "   [-f or --fingerprint] json_file_name  # write JSON fingerprints to file\n"
     "   [-w or --write] pcap_file_name        # write packets to PCAP/MCAP file\n"
+    "   --shm r                               # write JSON to shared memory ring r\n"
     "   no output option                      # write JSON fingerprints to stdout\n"
     "--capture OPTIONS\n"
     "   [-b or --buffer] b                    # set RX_RING size to (b * PHYS_MEM)\n"
     "   [-t or --threads] [num_threads | cpu] # set number of threads\n"
     "   [-u or --user] u                      # set UID and GID to those of user u\n"
     "   [-d or --directory] d                 # set working directory to d\n"
+    "   --write-direct                        # write one PCAP file per thread\n"
+    "   --adaptive                            # drop flows when overloaded\n"
+    "   --nanosecond                          # write nanosecond PCAP timestamps\n"
+    "--read OPTIONS\n"
+    "   [-t or --threads] [num_threads | cpu] # set number of threads, with -f\n"
+    "   --keylog k                            # decrypt TLS with SSLKEYLOGFILE k\n"
     "GENERAL OPTIONS\n"
     "   --config c                            # read configuration from file c\n"
     "   [-a or --analysis]                    # analyze fingerprints\n"
     "   --resources d                         # use resource directory d\n"
     "   [-s or --select] filter               # select only metadata (see --help)\n"
     "   [-l or --limit] l                     # rotate output file after l records\n"
+    "   --write-limit l                       # with -f and -w, rotate PCAP after l\n"
+    "   --snaplen n                           # with --select, truncate payloads\n"
     "   --dns-json                            # output DNS as JSON, not base64\n"
     "   --certs-json                          # output certs as JSON, not base64\n"
     "   --metadata                            # output more protocol metadata in JSON\n"
+    "   --os-identification o                 # write per-host OS identification to o\n"
+    "   --subnet-labels s                     # label addresses in the subnets in file s\n"
+    "   --metrics m                           # serve live metrics on socket m\n"
     "   [-v or --verbose]                     # additional information sent to stderr\n"
     "   --license                             # write license information to stdout\n"
     "   --version                             # write version information to stdout\n"
@@ -73,16 +87,69 @@ char mercury_extended_help[] =
     "   is the available memory; USE b < 0.1 EXCEPT WHEN THERE ARE GIGABYTES OF SPARE\n"
     "   RAM to avoid OS failure due to memory starvation.\n"
     "\n"
+    "   Packets can be captured from several interfaces at once, by setting c to a\n"
+    "   comma-separated list of interfaces (e.g. eth0,eth1); the threads are divided\n"
+    "   evenly between the interfaces, there is a single output file, and each JSON\n"
+    "   record includes the name of the \"interface\" on which it was captured.\n"
+    "\n"
     "   \"[-f or --fingerprint] f\" writes a JSON record for each fingerprint observed,\n"
     "   which incorporates the flow key and the time of observation, into the file f.\n"
     "   With [-a or --analysis], fingerprints and destinations are analyzed and the\n"
     "   results are included in the JSON output.\n"
     "\n"
+    "   \"--shm r\" publishes the JSON records into the shared memory ring r (the\n"
+    "   file /dev/shm/r), from which co-located processes can read them as they\n"
+    "   are written, without any file I/O.  The ring holds the most recent 64 MB\n"
+    "   of records (shm-size in the configuration file sets its size in MB);\n"
+    "   readers can attach and detach at any time, and a reader that falls too far\n"
+    "   behind loses records, which are counted, rather than slowing down mercury.\n"
+    "   The layout of the ring, and a reader library, are in src/shm_ring.h and\n"
+    "   src/shm_ring.c, and src/shm_ring_reader.c is an example reader.\n"
+    "\n"
     "   \"[-w or --write] w\" writes packets to the file w, in PCAP format.  With the\n"
     "   option [-s or --select], packets are filtered so that only ones with\n"
     "   fingerprint metadata are written.\n"
     "\n"
-    "   \"[r or --read] r\" reads packets from the file r, in PCAP format.\n"
+    "   [-f or --fingerprint] and [-w or --write] can be used together, to write\n"
+    "   both JSON records and packets from a single capture: each packet is parsed\n"
+    "   once, and the packets selected by [-s or --select] are those whose\n"
+    "   metadata was recognized while writing the JSON records.  Each output has\n"
+    "   its own output thread and file rotation; \"--write-limit l\" rotates the\n"
+    "   PCAP file after l packets (by default, it is rotated as the JSON file is).\n"
+    "\n"
+    "   --write-direct writes packets from each thread into its own PCAP file,\n"
+    "   named w-0, w-1, and so on, with large page-aligned (O_DIRECT) writes that\n"
+    "   bypass the output thread; this avoids copying packets into the output\n"
+    "   queues, allows packets of any size (including jumbo frames) to be written,\n"
+    "   and is suited to full packet capture at high data rates.  The packets in\n"
+    "   each file are in time order, but the files are not merged; use a tool\n"
+    "   like mergecap to produce a single time-ordered file.  This option requires\n"
+    "   [-w or --write], and cannot be used with [-l or --limit].\n"
+    "\n"
+    "   --adaptive sheds load when capturing with [-w or --write]: when the kernel\n"
+    "   drops packets or the ring buffers fill up, only a fraction of the flows are\n"
+    "   written, selected by a randomly seeded hash of the flow key, so that each\n"
+    "   flow is written in full (in both directions) or not at all.  The fraction\n"
+    "   is adjusted every second, and written to the standard error whenever it\n"
+    "   changes, so that counts can be scaled up accordingly.\n"
+    "\n"
+    "   --nanosecond writes PCAP files with nanosecond timestamps (the\n"
+    "   0xa1b23c4d magic number), which preserve the full resolution of the\n"
+    "   kernel timestamps; by default, timestamps are written in microseconds.\n"
+    "\n"
+    "   \"[r or --read] r\" reads packets from the file r, in PCAP (with microsecond\n"
+    "   or nanosecond timestamps) or PCAPNG format.  When JSON records are written,\n"
+    "   \"[-t or --threads] t\" divides the packets between t worker threads by a\n"
+    "   hash of their flow key, so that each flow (in both directions) is\n"
+    "   processed by a single thread, in order.\n"
+    "\n"
+    "   \"--keylog k\" decrypts the TLS sessions in the file read with [-r or --read]\n"
+    "   whose secrets are in the key log file k, in the SSLKEYLOGFILE format written\n"
+    "   by browsers and TLS libraries, and writes a JSON record, with \"decrypted\"\n"
+    "   set to true, for each HTTP/1.x and HTTP/2 request and response inside of\n"
+    "   them; HTTP/2 messages are fingerprinted as HTTP/1.x messages are, with\n"
+    "   the version \"HTTP/2\".  TLS 1.3 and the AES-GCM and ChaCha20-Poly1305\n"
+    "   cipher suites of TLS 1.2 are supported.\n"
     "\n"
     "   \"[-s or --select] f\" selects packets according to the metadata filter f, which\n"
     "   is a comma-separated list of the following strings:\n"
@@ -90,6 +157,7 @@ char mercury_extended_help[] =
     "      dns           DNS response\n"
     "      tls           DTLS clientHello, serverHello, and certificates\n"
     "      http          HTTP request and response\n"
+    "      quic          QUIC Initial packets (clientHello)\n"
     "      ssh           SSH handshake and KEX\n"
     "      tcp           TCP headers\n"
     "      tcp.message   TCP initial message\n"
@@ -98,6 +166,14 @@ char mercury_extended_help[] =
     "      all           all of the above\n"
     "      <no option>   all of the above\n"
     "\n"
+    "   \"--snaplen n\" truncates the packets written with [-s or --select] to\n"
+    "   their headers, the part of their payload that holds the selected protocol\n"
+    "   message (such as the TLS handshake records, or the HTTP start line and\n"
+    "   headers), and at most n bytes of any other payload; the original length\n"
+    "   of each packet is kept in its PCAP record.  This reduces the size of the\n"
+    "   output files, which can still be fingerprinted, when the filter selects\n"
+    "   bulk data packets (e.g. with tcp.message).\n"
+    "\n"
     "   \"[-u or --user] u\" sets the UID and GID to those of user u, so that\n"
     "   output file(s) are owned by this user.  If this option is not set, then\n"
     "   the UID is set to SUDO_UID, so that privileges are dropped to those of\n"
@@ -126,9 +202,33 @@ char mercury_extended_help[] =
     "\n"
     "   --metadata writes out additional metadata into the protocol JSON objects.\n"
     "\n"
+    "   \"--os-identification o\" identifies the operating system of each source\n"
+    "   address from its TCP, TLS, and HTTP client fingerprints, and writes one JSON\n"
+    "   record per host into the file o when the host has been idle for ten minutes\n"
+    "   (os-idle-timeout in the configuration file), when it is evicted from the\n"
+    "   table of 65536 hosts (os-max-hosts), or when mercury halts.  This option\n"
+    "   only works with the option [-f or --fingerprint] or with stdout output.\n"
+    "\n"
+    "   \"--subnet-labels s\" reads the file s, each line of which holds an IPv4\n"
+    "   subnet in CIDR notation, then whitespace, then a label (such as a site,\n"
+    "   VLAN, or asset group), and adds the labels of the longest subnets that\n"
+    "   contain the source and destination addresses of each JSON record as\n"
+    "   \"src_label\" and \"dst_label\".  Lines starting with '#' are ignored.\n"
+    "\n"
+    "   \"--metrics m\" serves live metrics in the Prometheus text format on the unix\n"
+    "   socket m, or on the TCP port p of the loopback interface if m has the form\n"
+    "   localhost:p.  The metrics include packet, byte, and record counts per thread\n"
+    "   and record type, analysis hits and misses, output queue occupancy and\n"
+    "   overflows, output file writes and rotations, socket drops, a histogram of\n"
+    "   ring buffer usage, and the adaptive flow acceptance fraction.  For example,\n"
+    "   \"curl --unix-socket m http://localhost/metrics\" reads them.\n"
+    "\n"
     "   [-v or --verbose] writes additional information to the standard error,\n"
     "   including the packet count, byte count, elapsed time and processing rate, as\n"
-    "   well as information about threads and files.\n"
+    "   well as information about threads and files.  When capturing, it includes\n"
+    "   percentiles (in microseconds) of the time from the kernel timestamp of each\n"
+    "   packet to the start of its processing, the processing time, and the time\n"
+    "   from the kernel timestamp to the write of its record by the output thread.\n"
     "\n"
     "   --license and --version write their information to stdout, then halt.\n"
     "\n"
@@ -145,7 +245,11 @@ char mercury_extended_help[] =
     "   mercury -c eth0 -w foo.mcap -t cpu -s # as above, selecting packet metadata\n"
     "   mercury -r foo.mcap -f foo.json       # read foo.mcap, write fingerprints\n"
     "   mercury -r foo.mcap -f foo.json -a    # as above, with fingerprint analysis\n"
-    "   mercury -c eth0 -t cpu -f foo.json -a # capture and analyze fingerprints\n";
+    "   mercury -c eth0 -t cpu -f foo.json -a # capture and analyze fingerprints\n"
+    "   mercury -c eth0,eth1 -t 8 -f foo.json # capture from two interfaces\n"
+    "   mercury -c eth0 -f f.json -w f.pcap -s # fingerprints and metadata packets\n"
+    "   mercury -r f.pcap --keylog k.log       # fingerprint HTTP inside of TLS\n"
+    "   mercury -r f.pcap --subnet-labels s   # label addresses by subnet\n";
 
 
 enum extended_help {
@@ -180,7 +284,7 @@ int main(int argc, char *argv[]) {
     struct mercury_config cfg = mercury_config_init();
 
     while(1) {
-        enum opt { config=1, version=2, license=3, dns_json=4, certs_json=5, metadata=6, resources=7 };
+        enum opt { config=1, version=2, license=3, dns_json=4, certs_json=5, metadata=6, resources=7, os_identification=8, write_direct=9, adaptive=10, metrics=11, nanosecond=12, snaplen=13, shm=14, write_limit=15, keylog=16, subnet_labels=17 };
         int opt_idx = 0;
         static struct option long_opts[] = {
             { "config",      required_argument, NULL, config  },
@@ -190,8 +294,18 @@ int main(int argc, char *argv[]) {
             { "dns-json",    no_argument,       NULL, dns_json },
             { "certs-json",  no_argument,       NULL, certs_json },
             { "metadata",    no_argument,       NULL, metadata },
+            { "os-identification", required_argument, NULL, os_identification },
             { "read",        required_argument, NULL, 'r' },
             { "write",       required_argument, NULL, 'w' },
+            { "write-direct", no_argument,      NULL, write_direct },
+            { "adaptive",    no_argument,       NULL, adaptive },
+            { "metrics",     required_argument, NULL, metrics },
+            { "nanosecond",  no_argument,       NULL, nanosecond },
+            { "snaplen",     required_argument, NULL, snaplen },
+            { "shm",         required_argument, NULL, shm },
+            { "write-limit", required_argument, NULL, write_limit },
+            { "keylog",      required_argument, NULL, keylog },
+            { "subnet-labels", required_argument, NULL, subnet_labels },
             { "directory",   required_argument, NULL, 'd' },
             { "capture",     required_argument, NULL, 'c' },
             { "fingerprint", required_argument, NULL, 'f' },
@@ -236,21 +350,92 @@ int main(int argc, char *argv[]) {
             if (optarg) {
                 usage(argv[0], "option dns-json does not use an argument", extended_help_off);
             } else {
-                global_vars.dns_json_output = true;
+                cfg.libmerc.dns_json_output = true;
             }
             break;
         case certs_json:
             if (optarg) {
                 usage(argv[0], "option certs-json does not use an argument", extended_help_off);
             } else {
-                global_vars.certs_json_output = true;
+                cfg.libmerc.certs_json_output = true;
             }
             break;
         case metadata:
             if (optarg) {
                 usage(argv[0], "option metadata does not use an argument", extended_help_off);
             } else {
-                global_vars.metadata_output = true;
+                cfg.libmerc.metadata_output = true;
+            }
+            break;
+        case os_identification:
+            if (option_is_valid(optarg)) {
+                cfg.os_identification_file = optarg;
+            } else {
+                usage(argv[0], "option os-identification requires filename argument", extended_help_off);
+            }
+            break;
+        case metrics:
+            if (option_is_valid(optarg)) {
+                cfg.metrics = optarg;
+            } else {
+                usage(argv[0], "option metrics requires a socket path or localhost:port argument", extended_help_off);
+            }
+            break;
+        case shm:
+            if (option_is_valid(optarg)) {
+                cfg.shm = optarg;
+            } else {
+                usage(argv[0], "option shm requires a shared memory name argument", extended_help_off);
+            }
+            break;
+        case write_limit:
+            if (option_is_valid(optarg)) {
+                errno = 0;
+                cfg.write_rotate = strtol(optarg, NULL, 10);
+                if (errno) {
+                    printf("%s: could not convert argument \"%s\" to a number\n", strerror(errno), optarg);
+                }
+            } else {
+                usage(argv[0], "option write-limit requires a numeric argument", extended_help_off);
+            }
+            break;
+        case keylog:
+            if (option_is_valid(optarg)) {
+                cfg.keylog = optarg;
+            } else {
+                usage(argv[0], "option keylog requires filename argument", extended_help_off);
+            }
+            break;
+        case subnet_labels:
+            if (option_is_valid(optarg)) {
+                cfg.subnet_labels = optarg;
+            } else {
+                usage(argv[0], "option subnet-labels requires filename argument", extended_help_off);
+            }
+            break;
+        case snaplen:
+            if (option_is_valid(optarg)) {
+                errno = 0;
+                cfg.snaplen = strtol(optarg, NULL, 10);
+                if (errno || cfg.snaplen < 0) {
+                    usage(argv[0], "option snaplen requires a non-negative numeric argument", extended_help_off);
+                }
+            } else {
+                usage(argv[0], "option snaplen requires a numeric argument", extended_help_off);
+            }
+            break;
+        case nanosecond:
+            if (optarg) {
+                usage(argv[0], "option nanosecond does not use an argument", extended_help_off);
+            } else {
+                cfg.nanosecond = true;
+            }
+            break;
+        case write_direct:
+            if (optarg) {
+                usage(argv[0], "option write-direct does not use an argument", extended_help_off);
+            } else {
+                cfg.write_direct = true;
             }
             break;
         case 'r':
@@ -375,8 +560,8 @@ int main(int argc, char *argv[]) {
                 usage(argv[0], "option p or loop requires a numeric argument", extended_help_off);
             }
             break;
-        case 0:
-            /* The option --adaptive to adaptively accept or skip packets for PCAP file. */
+        case adaptive:
+            /* The option --adaptive to adaptively accept or skip flows for PCAP file. */
             if (optarg) {
                 usage(argv[0], "option --adaptive does not use an argument", extended_help_off);
             } else {
@@ -433,8 +618,37 @@ int main(int argc, char *argv[]) {
     if (cfg.read_filename != NULL && cfg.capture_interface != NULL) {
         usage(argv[0], "incompatible arguments read [r] and capture [c] specified on command line", extended_help_off);
     }
-    if (cfg.fingerprint_filename && cfg.write_filename) {
-        usage(argv[0], "both fingerprint [f] and write [w] specified on command line", extended_help_off);
+    if (cfg.write_rotate && (cfg.fingerprint_filename == NULL || cfg.write_filename == NULL)) {
+        usage(argv[0], "option write-limit requires fingerprint [f] and write [w]", extended_help_off);
+    }
+
+    if (cfg.write_direct) {
+        if (cfg.write_filename == NULL) {
+            usage(argv[0], "option write-direct requires write [w]", extended_help_off);
+        }
+        if (cfg.rotate) {
+            usage(argv[0], "option write-direct cannot be used with limit [l]", extended_help_off);
+        }
+        if (cfg.fingerprint_filename) {
+            usage(argv[0], "option write-direct cannot be used with fingerprint [f]", extended_help_off);
+        }
+    }
+
+    if (cfg.shm) {
+        if (cfg.fingerprint_filename || cfg.write_filename) {
+            usage(argv[0], "option shm cannot be used with fingerprint [f] or write [w]", extended_help_off);
+        }
+        if (cfg.rotate) {
+            usage(argv[0], "option shm cannot be used with limit [l]", extended_help_off);
+        }
+    }
+
+    if (cfg.snaplen >= 0 && (cfg.write_filename == NULL || cfg.filter == false)) {
+        usage(argv[0], "option snaplen requires write [w] and select [s]", extended_help_off);
+    }
+
+    if (cfg.keylog && cfg.read_filename == NULL) {
+        usage(argv[0], "option keylog requires read [r]", extended_help_off);
     }
 
     if (cfg.write_filename && cfg.read_filename) {
@@ -442,10 +656,29 @@ int main(int argc, char *argv[]) {
     }
 
     if (cfg.analysis) {
-        if (analysis_init(cfg.verbosity, cfg.resources) == -1) {
+        cfg.libmerc_resources = mercury_resources_init(cfg.resources, cfg.verbosity);
+        if (cfg.libmerc_resources == NULL) {
             return EXIT_FAILURE;  /* analysis engine could not be initialized */
         };
-        global_vars.do_analysis = true;
+        cfg.libmerc.do_analysis = true;
+    }
+
+    if (cfg.keylog) {
+        cfg.libmerc.keylog = tls_keylog_init(cfg.keylog, cfg.verbosity);
+        if (cfg.libmerc.keylog == NULL) {
+            return EXIT_FAILURE;  /* key log file could not be read */
+        }
+    }
+
+    if (cfg.subnet_labels) {
+        cfg.libmerc.subnet_labels = subnet_labels_init(cfg.subnet_labels, cfg.verbosity);
+        if (cfg.libmerc.subnet_labels == NULL) {
+            return EXIT_FAILURE;  /* subnet label file could not be read */
+        }
+    }
+
+    if (cfg.os_identification_file && cfg.write_filename && cfg.fingerprint_filename == NULL) {
+        usage(argv[0], "option os-identification cannot be used with write [w] alone", extended_help_off);
     }
 
     /*
@@ -464,7 +697,7 @@ int main(int argc, char *argv[]) {
         if (cfg.write_filename == NULL || cfg.capture_interface == NULL) {
             usage(argv[0], "The option --adaptive requires options -c capture interface and -w pcap file.", extended_help_off);
         } else {
-            set_percent_accept(30); /* set starting percentage */
+            set_percent_accept(100); /* start by accepting all flows */
         }
     }
 
@@ -484,8 +717,24 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    /* init random number generator */
-    srand(time(0));
+    /* each capture interface needs at least one thread */
+    if (cfg.capture_interface) {
+        int num_interfaces = capture_interface_count(cfg.capture_interface);
+        if (cfg.num_threads < num_interfaces) {
+            if (cfg.verbosity) {
+                fprintf(stderr, "capturing from %d interfaces, creating %d threads\n", num_interfaces, num_interfaces);
+            }
+            cfg.num_threads = num_interfaces;
+        }
+    }
+
+    if (cfg.os_identification_file) {
+        if (os_identification_init(cfg.verbosity, cfg.resources, cfg.os_identification_file,
+                                   cfg.os_max_hosts, cfg.os_idle_timeout, cfg.num_threads) == -1) {
+            return EXIT_FAILURE;  /* OS identification could not be initialized */
+        }
+        global_vars.do_os_identification = true;
+    }
 
     pthread_t output_thread;
     struct output_file out_file;
@@ -493,6 +742,18 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "error: unable to initialize output thread\n");
         return EXIT_FAILURE;
     }
+    pthread_t pcap_output_thread;
+    struct output_file pcap_out_file;
+    if (cfg.fingerprint_filename && cfg.write_filename) {
+        if (output_thread_init_pcap(pcap_output_thread, pcap_out_file, cfg) != 0) {
+            fprintf(stderr, "error: unable to initialize output thread\n");
+            return EXIT_FAILURE;
+        }
+        out_file.pcap_output = &pcap_out_file;
+    }
+    if (metrics_init(cfg.metrics, cfg.num_threads, &out_file) != 0) {
+        return EXIT_FAILURE;
+    }
     if (cfg.capture_interface) {
 
         if (cfg.verbosity) {
@@ -510,13 +771,27 @@ int main(int argc, char *argv[]) {
     }
 
     if (cfg.analysis) {
-        analysis_finalize();
+        mercury_resources_finalize(cfg.libmerc_resources);
+    }
+    if (cfg.libmerc.keylog) {
+        tls_keylog_finalize((struct tls_keylog *)cfg.libmerc.keylog);
+    }
+    if (cfg.libmerc.subnet_labels) {
+        subnet_labels_finalize((struct subnet_db *)cfg.libmerc.subnet_labels);
+    }
+    if (global_vars.do_os_identification) {
+        os_identification_finalize();
     }
 
+    metrics_finalize();  /* note: must precede output_thread_finalize(), which frees the queues and unmaps the ring */
+
     if (cfg.verbosity) {
         fprintf(stderr, "stopping output thread and flushing queued output to disk.\n");
     }
     output_thread_finalize(output_thread, &out_file);
+    if (out_file.pcap_output) {
+        output_thread_finalize(pcap_output_thread, &pcap_out_file);
+    }
 
     return 0;
 }
@@ -44,6 +44,8 @@ enum status {
     status_err_no_more_data = 2
 };
 
+#include "libmerc.h"
+
 /*
  * struct mercury_config holds the configuration information for a run
  * of the program
@@ -70,25 +72,35 @@ struct mercury_config {
     int use_test_packet;            /* use test packet to write output file           */
     int adaptive;                   /* adaptively accept/skip packets for PCAP output */
     bool output_block;              /* use blocking output                            */
+    char *os_identification_file;   /* file for per-host OS identification output     */
+    unsigned int os_max_hosts;      /* hosts tracked by OS identification (0=default) */
+    unsigned int os_idle_timeout;   /* seconds until an idle host is reported         */
+    bool write_direct;              /* write per-thread pcap files, bypassing queues  */
+    char *metrics;                  /* socket path or localhost:port for metrics      */
+    bool nanosecond;                /* write pcap files with nanosecond timestamps    */
+    int snaplen;                    /* other payload bytes kept by select, or -1      */
+    char *shm;                      /* name of shared memory ring for output, if any  */
+    uint64_t shm_size;              /* size of shared memory ring in bytes, or 0      */
+    uint64_t write_rotate;          /* packets per PCAP file rotation with -f, or 0   */
+    char *keylog;                   /* TLS key log file for decryption, if any        */
+    char *subnet_labels;            /* file of subnets and labels, if any             */
+    struct libmerc_config libmerc;  /* options for each thread's libmerc context      */
+    struct mercury_resources *libmerc_resources; /* analysis resources, or NULL    */
 };
 
-#define mercury_config_init() { NULL, NULL, NULL, NULL, NULL, NULL, false, false, O_EXCL, (char *)"w", 0, 8, 1, 0, NULL, 1, 0, NULL, 0, 0, false }
+#define mercury_config_init() { NULL, NULL, NULL, NULL, NULL, NULL, false, false, O_EXCL, (char *)"w", 0, 8, 1, 0, NULL, 1, 0, NULL, 0, 0, false, NULL, 0, 0, false, NULL, false, -1, NULL, 0, 0, NULL, NULL, libmerc_config_init(), NULL }
 
 /*
  * struct global_variables holds all of mercury's global variables.
- * This set is currently limited to booleans that control the
- * processing and output.  It would be nice avoid global state by
- * passing these values into the packet processor (struct pkt_proc),
- * but for now we are using this global struct to keep track of the
- * global state, and put them all on the same cache line.
+ * The options that control packet processing and output are passed
+ * into each packet processor, through its libmerc context (see
+ * struct libmerc_config); what remains is the state of OS
+ * identification, which is shared by all threads.
  */
 struct global_variables {
-    global_variables() : dns_json_output{false}, certs_json_output{false}, metadata_output{false}, do_analysis{false} {}
+    global_variables() : do_os_identification{false} {}
 
-    bool dns_json_output;   /* output DNS as JSON              */
-    bool certs_json_output; /* output certificates as JSON     */
-    bool metadata_output;   /* output lots of metadata         */
-    bool do_analysis;       /* write analysys{} JSON object    */
+    bool do_os_identification; /* track hosts for OS identification */
 };
 
 #endif /* MERCURY_H */
@@ -0,0 +1,516 @@
+/*
+ * metrics.c
+ *
+ * live capture, parsing, and output metrics, served in the Prometheus
+ * text exposition format
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+#include "rnd_pkt_drop.h"
+
+#define METRICS_POLL_TIMEOUT     200   /* milliseconds between checks for shutdown  */
+#define METRICS_REQUEST_TIMEOUT  100   /* milliseconds to wait for a request        */
+#define METRICS_REQUEST_LEN      1024
+#define METRICS_RING_BUCKETS     10    /* ring usage buckets: 0.1, 0.2, ..., 1.0    */
+
+/*
+ * struct ring_metrics holds the per-thread ring buffer and socket
+ * metrics, which are updated once per second by the stats thread, and
+ * are protected by metrics_m
+ */
+struct ring_metrics {
+    uint64_t socket_packets;
+    uint64_t socket_drops;
+    uint64_t socket_freezes;
+    double usage_seconds[METRICS_RING_BUCKETS]; /* time spent in each bucket (not cumulative) */
+    double usage_sum;                           /* integral of ring usage over time           */
+    double usage_count;                         /* total time                                 */
+};
+
+/* note: the names are indexed by enum msg_type (proto_identify.h) */
+static const char *record_type_name[] = {
+    "tcp",
+    "http_request",
+    "http_response",
+    "tls_client_hello",
+    "tls_server_hello",
+    "tls_certificate",
+    "ssh",
+    "ssh_kex",
+    "dns",
+    "dhcp",
+    "dtls_client_hello",
+    "dtls_server_hello",
+    "dtls_certificate",
+    "wireguard",
+    "quic",
+};
+
+static_assert(sizeof(record_type_name) / sizeof(record_type_name[0]) == METRICS_NUM_RECORD_TYPES,
+              "record_type_name[] must have a name for each enum msg_type");
+static_assert(sizeof(((struct thread_metrics *)0)->records) / sizeof(uint64_t) == msg_type_quic + 1,
+              "thread_metrics::records[] must have a counter for each enum msg_type");
+
+static struct metrics_context {
+    struct thread_metrics *threads;
+    struct ring_metrics *rings;
+    int num_threads;
+    const struct output_file *out_file;
+    pthread_mutex_t metrics_m;
+    pthread_t server_thread;
+    bool server_running;
+    int sig_stop_server;
+    int listen_fd;
+    char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} metrics = { NULL, NULL, 0, NULL, PTHREAD_MUTEX_INITIALIZER, 0, false, 0, -1, { '\0' } };
+
+static inline uint64_t metrics_read(const uint64_t &counter) {
+    return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
+void metrics_get_latency(struct latency_histogram *wire_to_apply, struct latency_histogram *apply) {
+    memset(wire_to_apply, 0, sizeof(*wire_to_apply));
+    memset(apply, 0, sizeof(*apply));
+    for (int t = 0; t < metrics.num_threads; t++) {
+        latency_histogram_add(wire_to_apply, &metrics.threads[t].wire_to_apply);
+        latency_histogram_add(apply, &metrics.threads[t].apply);
+    }
+}
+
+struct thread_metrics *metrics_get_thread(int tnum) {
+    if (metrics.threads == NULL || tnum < 0 || tnum >= metrics.num_threads) {
+        return NULL;
+    }
+    return &metrics.threads[tnum];
+}
+
+void metrics_update_ring(int tnum,
+                         const double *block_streak_hist,
+                         unsigned int block_count,
+                         uint64_t socket_packets,
+                         uint64_t socket_drops,
+                         uint64_t socket_freezes) {
+
+    if (metrics.rings == NULL || tnum < 0 || tnum >= metrics.num_threads || block_count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&metrics.metrics_m);
+    struct ring_metrics *r = &metrics.rings[tnum];
+    r->socket_packets += socket_packets;
+    r->socket_drops += socket_drops;
+    r->socket_freezes += socket_freezes;
+    for (unsigned int i = 0; i <= block_count; i++) {
+        if (block_streak_hist[i] > 0) {
+            double usage = (double)i / block_count;
+            unsigned int bucket = (i * METRICS_RING_BUCKETS + block_count - 1) / block_count;
+            bucket = bucket ? bucket - 1 : 0;
+            r->usage_seconds[bucket] += block_streak_hist[i];
+            r->usage_sum += block_streak_hist[i] * usage;
+            r->usage_count += block_streak_hist[i];
+        }
+    }
+    pthread_mutex_unlock(&metrics.metrics_m);
+}
+
+/*
+ * metrics_queue_occupancy(q) returns the number of messages in the
+ * output queue q; it is read without synchronization, so it is only
+ * an estimate
+ */
+static unsigned int metrics_queue_occupancy(const struct ll_queue *q) {
+    int widx = __atomic_load_n(&q->widx, __ATOMIC_RELAXED);
+    int ridx = __atomic_load_n(&q->ridx, __ATOMIC_RELAXED);
+    if (widx == ridx) {
+        return q->msgs[ridx].used ? LLQ_DEPTH : 0;
+    }
+    return (widx - ridx + LLQ_DEPTH) % LLQ_DEPTH;
+}
+
+static void metrics_write_header(FILE *f, const char *name, const char *type, const char *help) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * metrics_write_thread_counter(f, name, help, offset) writes the
+ * counter at the byte offset offset in struct thread_metrics, for
+ * each thread
+ */
+static void metrics_write_thread_counter(FILE *f, const char *name, const char *help, size_t offset) {
+    metrics_write_header(f, name, "counter", help);
+    for (int t = 0; t < metrics.num_threads; t++) {
+        const uint64_t *counter = (const uint64_t *)((const char *)&metrics.threads[t] + offset);
+        fprintf(f, "%s{thread=\"%d\"} %" PRIu64 "\n", name, t, metrics_read(*counter));
+    }
+}
+
+/*
+ * metrics_write_latency(f, name, labels, h) writes the latency
+ * histogram h, in seconds, with a bucket for each power of two
+ * nanoseconds from about one microsecond to about one minute; labels
+ * is a (possibly empty) list of labels
+ */
+#define METRICS_LATENCY_MIN_EXPONENT 10
+#define METRICS_LATENCY_MAX_EXPONENT 36
+
+static void metrics_write_latency(FILE *f, const char *name, const char *labels, const struct latency_histogram *h) {
+    const char *sep = labels[0] ? "," : "";
+    uint64_t cumulative = 0;
+    unsigned int b = 0;
+    for (int e = METRICS_LATENCY_MIN_EXPONENT; e <= METRICS_LATENCY_MAX_EXPONENT; e++) {
+        uint64_t le = (uint64_t)1 << e;
+        for ( ; b < latency_bucket(le); b++) {
+            cumulative += __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+        }
+        fprintf(f, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, labels, sep, le / 1.0e9, cumulative);
+    }
+    for ( ; b < LATENCY_BUCKETS; b++) {
+        cumulative += __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+    }
+    fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, sep, cumulative);
+    fprintf(f, "%s_sum{%s} %.9f\n", name, labels, __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1.0e9);
+    fprintf(f, "%s_count{%s} %" PRIu64 "\n", name, labels, cumulative);
+}
+
+static void metrics_write_all(FILE *f) {
+
+    metrics_write_thread_counter(f, "mercury_packets_total", "Packets received.",
+                                 offsetof(struct thread_metrics, packets));
+    metrics_write_thread_counter(f, "mercury_bytes_total", "Bytes received.",
+                                 offsetof(struct thread_metrics, bytes));
+
+    metrics_write_header(f, "mercury_records_total", "counter", "JSON records written, by record type.");
+    for (int t = 0; t < metrics.num_threads; t++) {
+        for (int i = 0; i < METRICS_NUM_RECORD_TYPES; i++) {
+            uint64_t count = metrics_read(metrics.threads[t].records[i]);
+            if (count) {
+                fprintf(f, "mercury_records_total{thread=\"%d\",type=\"%s\"} %" PRIu64 "\n",
+                        t, record_type_name[i], count);
+            }
+        }
+    }
+
+    metrics_write_header(f, "mercury_analysis_lookups_total", "counter", "Fingerprint analysis lookups, by result.");
+    for (int t = 0; t < metrics.num_threads; t++) {
+        fprintf(f, "mercury_analysis_lookups_total{thread=\"%d\",result=\"hit\"} %" PRIu64 "\n",
+                t, metrics_read(metrics.threads[t].analysis_hits));
+        fprintf(f, "mercury_analysis_lookups_total{thread=\"%d\",result=\"miss\"} %" PRIu64 "\n",
+                t, metrics_read(metrics.threads[t].analysis_misses));
+    }
+
+    metrics_write_thread_counter(f, "mercury_output_queue_full_total",
+                                 "Records or packets discarded because the output queue was full.",
+                                 offsetof(struct thread_metrics, queue_full));
+
+    const struct output_file *out = metrics.out_file;
+    if (out != NULL && out->qs.queue != NULL) {
+        metrics_write_header(f, "mercury_output_queue_occupancy", "gauge", "Messages in the output queue.");
+        for (int q = 0; q < out->qs.qnum; q++) {
+            fprintf(f, "mercury_output_queue_occupancy{thread=\"%d\"} %u\n", q, metrics_queue_occupancy(&out->qs.queue[q]));
+        }
+    }
+    if (out != NULL && out->type != file_type_none) {
+        metrics_write_header(f, "mercury_output_bytes_total", "counter", "Bytes written by the output thread.");
+        fprintf(f, "mercury_output_bytes_total %" PRIu64 "\n", metrics_read(out->bytes_written));
+        metrics_write_header(f, "mercury_output_records_total", "counter", "Messages written by the output thread.");
+        fprintf(f, "mercury_output_records_total %" PRIu64 "\n", metrics_read(out->records_written));
+        metrics_write_header(f, "mercury_output_rotations_total", "counter", "Output file rotations.");
+        fprintf(f, "mercury_output_rotations_total %" PRIu64 "\n", metrics_read(out->rotations));
+    }
+
+    // the output thread creates the ring once it starts, and it is
+    // unmapped only after this server has stopped
+    const struct shm_ring_header *ring = (out != NULL) ? __atomic_load_n(&out->ring.hdr, __ATOMIC_ACQUIRE) : NULL;
+    if (ring != NULL) {
+        metrics_write_header(f, "mercury_shm_records_dropped_total", "counter",
+                             "Records too large for the shared memory ring.");
+        fprintf(f, "mercury_shm_records_dropped_total %" PRIu64 "\n", metrics_read(ring->records_dropped));
+        metrics_write_header(f, "mercury_shm_reader_records_lost_total", "counter",
+                             "Records overwritten before a shared memory ring reader read them.");
+        for (int i = 0; i < SHM_RING_MAX_READERS; i++) {
+            int32_t pid = __atomic_load_n(&ring->readers[i].pid, __ATOMIC_RELAXED);
+            if (pid != 0) {
+                fprintf(f, "mercury_shm_reader_records_lost_total{pid=\"%d\"} %" PRIu64 "\n",
+                        pid, metrics_read(ring->readers[i].records_lost));
+            }
+        }
+        metrics_write_header(f, "mercury_shm_reader_lag_bytes", "gauge",
+                             "Bytes published to the shared memory ring but not yet read, by reader.");
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        for (int i = 0; i < SHM_RING_MAX_READERS; i++) {
+            int32_t pid = __atomic_load_n(&ring->readers[i].pid, __ATOMIC_RELAXED);
+            if (pid != 0) {
+                uint64_t position = metrics_read(ring->readers[i].position);
+                fprintf(f, "mercury_shm_reader_lag_bytes{pid=\"%d\"} %" PRIu64 "\n",
+                        pid, head > position ? head - position : 0);
+            }
+        }
+    }
+
+    if (out != NULL && out->track_latency) {
+        metrics_write_header(f, "mercury_wire_to_write_seconds", "histogram",
+                             "Time from packet capture to the output thread's write of its record.");
+        metrics_write_latency(f, "mercury_wire_to_write_seconds", "", &out->wire_to_write);
+    }
+
+    metrics_write_header(f, "mercury_flow_accept_fraction", "gauge", "Fraction of flows accepted by adaptive load shedding.");
+    fprintf(f, "mercury_flow_accept_fraction %g\n", get_fraction_accept());
+
+    pthread_mutex_lock(&metrics.metrics_m);
+    bool have_rings = false;
+    for (int t = 0; t < metrics.num_threads; t++) {
+        if (metrics.rings[t].usage_count > 0) {
+            have_rings = true;
+        }
+    }
+    if (have_rings) {
+        metrics_write_header(f, "mercury_socket_packets_total", "counter", "Packets counted by the capture socket.");
+        for (int t = 0; t < metrics.num_threads; t++) {
+            fprintf(f, "mercury_socket_packets_total{thread=\"%d\"} %" PRIu64 "\n", t, metrics.rings[t].socket_packets);
+        }
+        metrics_write_header(f, "mercury_socket_drops_total", "counter", "Packets dropped by the capture socket.");
+        for (int t = 0; t < metrics.num_threads; t++) {
+            fprintf(f, "mercury_socket_drops_total{thread=\"%d\"} %" PRIu64 "\n", t, metrics.rings[t].socket_drops);
+        }
+        metrics_write_header(f, "mercury_socket_freezes_total", "counter", "Capture socket queue freezes.");
+        for (int t = 0; t < metrics.num_threads; t++) {
+            fprintf(f, "mercury_socket_freezes_total{thread=\"%d\"} %" PRIu64 "\n", t, metrics.rings[t].socket_freezes);
+        }
+        metrics_write_header(f, "mercury_ring_usage_seconds", "histogram",
+                             "Time spent at each fraction of ring buffer blocks in use.");
+        for (int t = 0; t < metrics.num_threads; t++) {
+            const struct ring_metrics *r = &metrics.rings[t];
+            double cumulative = 0.0;
+            for (int b = 0; b < METRICS_RING_BUCKETS; b++) {
+                cumulative += r->usage_seconds[b];
+                fprintf(f, "mercury_ring_usage_seconds_bucket{thread=\"%d\",le=\"%.1f\"} %f\n",
+                        t, (double)(b + 1) / METRICS_RING_BUCKETS, cumulative);
+            }
+            fprintf(f, "mercury_ring_usage_seconds_bucket{thread=\"%d\",le=\"+Inf\"} %f\n", t, r->usage_count);
+            fprintf(f, "mercury_ring_usage_seconds_sum{thread=\"%d\"} %f\n", t, r->usage_sum);
+            fprintf(f, "mercury_ring_usage_seconds_count{thread=\"%d\"} %f\n", t, r->usage_count);
+        }
+
+        /* latencies are only recorded when capturing */
+        char labels[32];
+        metrics_write_header(f, "mercury_wire_to_apply_seconds", "histogram",
+                             "Time from packet capture to the start of its processing.");
+        for (int t = 0; t < metrics.num_threads; t++) {
+            snprintf(labels, sizeof(labels), "thread=\"%d\"", t);
+            metrics_write_latency(f, "mercury_wire_to_apply_seconds", labels, &metrics.threads[t].wire_to_apply);
+        }
+        metrics_write_header(f, "mercury_apply_seconds", "histogram", "Time spent processing each packet.");
+        for (int t = 0; t < metrics.num_threads; t++) {
+            snprintf(labels, sizeof(labels), "thread=\"%d\"", t);
+            metrics_write_latency(f, "mercury_apply_seconds", labels, &metrics.threads[t].apply);
+        }
+    }
+    pthread_mutex_unlock(&metrics.metrics_m);
+}
+
+static void metrics_write_all_fd(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;  /* client went away */
+        }
+        buf += w;
+        len -= w;
+    }
+}
+
+/*
+ * metrics_serve_connection(fd) reads the request, if the client sends
+ * one promptly, and writes the metrics; a client that only connects
+ * and reads (e.g. socat or nc) gets the bare exposition text
+ */
+static void metrics_serve_connection(int fd) {
+    char request[METRICS_REQUEST_LEN];
+    ssize_t request_len = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT) > 0) {
+        request_len = read(fd, request, sizeof(request) - 1);
+    }
+    bool http = (request_len >= 3 && memcmp(request, "GET", 3) == 0);
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *f = open_memstream(&body, &body_len);
+    if (f == NULL) {
+        return;
+    }
+    metrics_write_all(f);
+    fclose(f);
+
+    if (http) {
+        char header[256];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\n"
+                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zu\r\n"
+                                  "Connection: close\r\n"
+                                  "\r\n",
+                                  body_len);
+        metrics_write_all_fd(fd, header, header_len);
+    }
+    metrics_write_all_fd(fd, body, body_len);
+    free(body);
+}
+
+static void *metrics_server_thread_func(void *) {
+    while (__atomic_load_n(&metrics.sig_stop_server, __ATOMIC_RELAXED) == 0) {
+        struct pollfd pfd = { metrics.listen_fd, POLLIN, 0 };
+        int r = poll(&pfd, 1, METRICS_POLL_TIMEOUT);
+        if (r <= 0) {
+            continue;
+        }
+        int fd = accept(metrics.listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        metrics_serve_connection(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int metrics_listen_tcp(const char *port_str) {
+    char *end = NULL;
+    errno = 0;
+    long port = strtol(port_str, &end, 10);
+    if (errno || end == port_str || *end != '\0' || port < 1 || port > 65535) {
+        fprintf(stderr, "error: invalid metrics port \"%s\"\n", port_str);
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "%s: could not create metrics socket\n", strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "%s: could not bind metrics socket to 127.0.0.1:%ld\n", strerror(errno), port);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int metrics_listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: metrics socket path \"%s\" is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    /* remove a socket left over from a previous run, but nothing else */
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "%s: could not create metrics socket\n", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "%s: could not bind metrics socket to %s\n", strerror(errno), path);
+        close(fd);
+        return -1;
+    }
+    strcpy(metrics.socket_path, path);
+    return fd;
+}
+
+int metrics_init(const char *addr, int num_threads, const struct output_file *out_file) {
+
+    metrics.threads = (struct thread_metrics *)aligned_alloc(alignof(struct thread_metrics),
+                                                             num_threads * sizeof(struct thread_metrics));
+    metrics.rings = (struct ring_metrics *)calloc(num_threads, sizeof(struct ring_metrics));
+    if (metrics.threads == NULL || metrics.rings == NULL) {
+        fprintf(stderr, "error: could not allocate metrics\n");
+        return -1;
+    }
+    memset(metrics.threads, 0, num_threads * sizeof(struct thread_metrics));
+    metrics.num_threads = num_threads;
+    metrics.out_file = out_file;
+
+    if (addr == NULL) {
+        return 0;
+    }
+
+    if (strncmp(addr, "localhost:", strlen("localhost:")) == 0) {
+        metrics.listen_fd = metrics_listen_tcp(addr + strlen("localhost:"));
+    } else if (strncmp(addr, "127.0.0.1:", strlen("127.0.0.1:")) == 0) {
+        metrics.listen_fd = metrics_listen_tcp(addr + strlen("127.0.0.1:"));
+    } else {
+        metrics.listen_fd = metrics_listen_unix(addr);
+    }
+    if (metrics.listen_fd < 0) {
+        return -1;
+    }
+    if (listen(metrics.listen_fd, 8) != 0) {
+        fprintf(stderr, "%s: could not listen on metrics socket\n", strerror(errno));
+        return -1;
+    }
+
+    int err = pthread_create(&metrics.server_thread, NULL, metrics_server_thread_func, NULL);
+    if (err != 0) {
+        fprintf(stderr, "%s: could not start metrics thread\n", strerror(err));
+        return -1;
+    }
+    metrics.server_running = true;
+
+    return 0;
+}
+
+void metrics_finalize() {
+    if (metrics.server_running) {
+        __atomic_store_n(&metrics.sig_stop_server, 1, __ATOMIC_RELAXED);
+        pthread_join(metrics.server_thread, NULL);
+        metrics.server_running = false;
+    }
+    if (metrics.listen_fd >= 0) {
+        close(metrics.listen_fd);
+        metrics.listen_fd = -1;
+    }
+    if (metrics.socket_path[0] != '\0') {
+        unlink(metrics.socket_path);  /* may fail after privileges are dropped */
+        metrics.socket_path[0] = '\0';
+    }
+    free(metrics.threads);
+    free(metrics.rings);
+    metrics.threads = NULL;
+    metrics.rings = NULL;
+    metrics.num_threads = 0;
+    metrics.out_file = NULL;
+}
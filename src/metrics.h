@@ -0,0 +1,90 @@
+/*
+ * metrics.h
+ *
+ * live capture, parsing, and output metrics, served in the Prometheus
+ * text exposition format on a unix domain socket or a localhost TCP
+ * port
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "output.h"
+#include "latency.h"
+#include "proto_identify.h"
+
+/*
+ * struct thread_metrics holds the counters of a single worker thread.
+ * Each counter is written only by that thread, with a plain (relaxed
+ * atomic) store, and read by the metrics thread, so that collection
+ * adds no locks or locked instructions to the packet processing path;
+ * each thread's counters are on their own cache lines.
+ *
+ * The records[] array is indexed by enum msg_type (proto_identify.h),
+ * whose last value is msg_type_quic; TCP SYN records are counted at
+ * index msg_type_unknown.
+ *
+ * When capturing, the time from the kernel timestamp of each packet
+ * to the start of its processing (pkt_proc::apply()), and the time
+ * spent processing it, are recorded in latency histograms.
+ */
+#define METRICS_NUM_RECORD_TYPES (msg_type_quic + 1)
+
+struct thread_metrics {
+    uint64_t packets;             /* packets received                        */
+    uint64_t bytes;               /* bytes received                          */
+    uint64_t records[METRICS_NUM_RECORD_TYPES]; /* JSON records, by type     */
+    uint64_t queue_full;          /* records or packets lost to a full queue */
+    uint64_t analysis_hits;       /* fingerprints found in the analysis db   */
+    uint64_t analysis_misses;     /* fingerprints not found                  */
+    struct latency_histogram wire_to_apply;
+    struct latency_histogram apply;
+} __attribute__((aligned(64)));
+
+#define metrics_add(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define metrics_increment(counter) metrics_add(counter, 1)
+
+/*
+ * metrics_init(addr, num_threads, out_file) allocates the counters for
+ * num_threads worker threads; if addr is not NULL, it also starts a
+ * thread that serves the metrics, on the TCP port p of the loopback
+ * interface if addr has the form localhost:p or 127.0.0.1:p, and
+ * otherwise on a unix domain socket with the path addr.  Each
+ * connection receives the current metrics, as an HTTP response if
+ * the client sent an HTTP GET request, and is then closed.  Returns 0
+ * on success and -1 on failure.
+ */
+int metrics_init(const char *addr, int num_threads, const struct output_file *out_file);
+
+void metrics_finalize();
+
+/*
+ * metrics_get_latency(wire_to_apply, apply) sets its arguments to the
+ * sum of the corresponding latency histograms of all worker threads
+ */
+void metrics_get_latency(struct latency_histogram *wire_to_apply, struct latency_histogram *apply);
+
+/*
+ * metrics_get_thread(tnum) returns the counters for worker thread
+ * tnum, or NULL if there are none
+ */
+struct thread_metrics *metrics_get_thread(int tnum);
+
+/*
+ * metrics_update_ring(tnum, ...) is called once per interval by the
+ * stats thread, with the block streak histogram of a capture thread
+ * (the time, in seconds, spent with i blocks of the ring in use, for
+ * i from 0 to block_count) and the socket counters for that interval
+ */
+void metrics_update_ring(int tnum,
+                         const double *block_streak_hist,
+                         unsigned int block_count,
+                         uint64_t socket_packets,
+                         uint64_t socket_drops,
+                         uint64_t socket_freezes);
+
+#endif /* METRICS_H */
@@ -0,0 +1,714 @@
+/*
+ * os_identification.cc
+ *
+ * streaming, per-host operating system identification from TCP, TLS,
+ * and HTTP client fingerprints
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "os_identification.h"
+#include "json_object.h"
+
+#include "rapidjson/document.h"
+#include "rapidjson/istreamwrapper.h"
+
+extern int gzgetline(gzFile f, std::vector<char>& v);  /* defined in analysis.cc */
+
+#ifndef DEFAULT_RESOURCE_DIR
+#define DEFAULT_RESOURCE_DIR "/usr/local/share/mercury"
+#endif
+
+#define OS_NUM_FP_TYPES   3
+#define OS_MAX_HOST_FPS  16   /* distinct fingerprints held inline per host */
+
+static const char *os_fp_type_name[OS_NUM_FP_TYPES] = { "tcp", "tls", "http" };
+
+/*
+ * os_fp_hash(type, s, len) is a 64-bit FNV-1a hash of a fingerprint
+ * string, seeded by its type, used to index the fingerprint database
+ * without constructing a std::string from packet data
+ */
+static inline uint64_t os_fp_hash(enum os_fp_type type, const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ull ^ type;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)s[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+/*
+ * struct os_classifier holds a multinomial logistic regression model
+ * over the concatenated, normalized TCP, TLS, and HTTP OS vectors of
+ * a host; the coefficients are stored as one contiguous row per label
+ */
+struct os_classifier {
+    size_t os_len = 0;
+    size_t num_features = 0;
+    std::vector<std::string> labels;
+    std::vector<double> intercepts;
+    std::vector<double> coefficients;
+    std::unordered_map<std::string, unsigned int> os_map;
+
+    bool load(const char *model_file) {
+        std::ifstream ifs{model_file};
+        if (!ifs.is_open()) {
+            return false;
+        }
+        rapidjson::IStreamWrapper isw{ifs};
+        rapidjson::Document params;
+        params.ParseStream(isw);
+        if (params.HasParseError() || !params.IsObject()
+            || !params.HasMember("os_len") || !params.HasMember("labels") || !params.HasMember("intercepts")
+            || !params.HasMember("coefficients") || !params.HasMember("os_map")) {
+            return false;
+        }
+
+        os_len = params["os_len"].GetInt();
+        num_features = os_len * OS_NUM_FP_TYPES;
+
+        const rapidjson::Value &lbls = params["labels"];
+        for (rapidjson::SizeType i = 0; i < lbls.Size(); i++) {
+            labels.push_back(lbls[i].GetString());
+        }
+        const rapidjson::Value &intc = params["intercepts"];
+        if (intc.Size() != labels.size()) {
+            return false;
+        }
+        for (rapidjson::SizeType i = 0; i < intc.Size(); i++) {
+            intercepts.push_back(intc[i].GetDouble());
+        }
+        const rapidjson::Value &cff = params["coefficients"];
+        if (cff.Size() != labels.size()) {
+            return false;
+        }
+        coefficients.assign(labels.size() * num_features, 0.0);
+        for (rapidjson::SizeType i = 0; i < cff.Size(); i++) {
+            const rapidjson::Value &row = cff[i];
+            for (rapidjson::SizeType j = 0; j < row.Size() && j < num_features; j++) {
+                coefficients[i * num_features + j] = row[j].GetDouble();
+            }
+        }
+        const rapidjson::Value &os_m = params["os_map"];
+        for (auto iter = os_m.MemberBegin(); iter != os_m.MemberEnd(); ++iter) {
+            unsigned int idx = iter->value.GetInt();
+            if (idx < os_len) {
+                os_map[iter->name.GetString()] = idx;
+            }
+        }
+        return labels.size() > 0;
+    }
+
+    // classify(features, &probability) returns the index of the most
+    // probable label for the feature vector (of length num_features)
+    //
+    unsigned int classify(const double *features, double *probability) const {
+        std::vector<double> scores(labels.size());
+        double max_score = -HUGE_VAL;
+        for (size_t i = 0; i < labels.size(); i++) {
+            const double *c = &coefficients[i * num_features];
+            double s = intercepts[i];
+            for (size_t j = 0; j < num_features; j++) {
+                s += c[j] * features[j];
+            }
+            scores[i] = s;
+            max_score = s > max_score ? s : max_score;
+        }
+        double score_sum = 0.0;
+        unsigned int label_idx = 0;
+        for (size_t i = 0; i < labels.size(); i++) {
+            score_sum += exp(scores[i] - max_score);   // softmax, shifted for stability
+            if (scores[i] > scores[label_idx]) {
+                label_idx = i;
+            }
+        }
+        *probability = 1.0 / score_sum;   // exp(max_score - max_score) / score_sum
+        return label_idx;
+    }
+};
+
+/*
+ * struct os_fingerprint_db maps each known fingerprint (of each type)
+ * to a row of os_len OS prevalence values, taken from the os_info
+ * objects in fingerprint-db-{tcp,tls,http}-os.json.gz
+ */
+struct os_fingerprint_db {
+    size_t os_len = 0;
+    std::vector<double> rows;
+    std::vector<uint8_t> row_type;
+    std::vector<std::string> str_repr;
+    std::unordered_map<uint64_t, uint32_t> index;
+
+    int load(const char *resource_file, enum os_fp_type type, const struct os_classifier &clf) {
+        os_len = clf.os_len;
+        gzFile in_file = gzopen(resource_file, "r");
+        if (in_file == NULL) {
+            return -1;
+        }
+        std::vector<char> line;
+        while (gzgetline(in_file, line)) {
+            std::string line_str(line.begin(), line.end());
+            rapidjson::Document fp;
+            fp.Parse(line_str.c_str());
+            if (fp.HasParseError() || !fp.IsObject() || !fp.HasMember("str_repr") || !fp.HasMember("os_info")) {
+                continue;
+            }
+            const rapidjson::Value &s = fp["str_repr"];
+            uint64_t h = os_fp_hash(type, s.GetString(), s.GetStringLength());
+            if (index.find(h) != index.end()) {
+                continue;   // duplicate (or, very unlikely, a hash collision)
+            }
+            uint32_t row = row_type.size();
+            rows.resize(rows.size() + os_len, 0.0);
+            double *r = &rows[row * os_len];
+            const rapidjson::Value &os_info = fp["os_info"];
+            for (auto iter = os_info.MemberBegin(); iter != os_info.MemberEnd(); ++iter) {
+                auto os = clf.os_map.find(iter->name.GetString());
+                if (os != clf.os_map.end()) {
+                    r[os->second] += iter->value.GetDouble();
+                }
+            }
+            row_type.push_back(type);
+            str_repr.push_back(std::string(s.GetString(), s.GetStringLength()));
+            index[h] = row;
+        }
+        gzclose(in_file);
+        return 0;
+    }
+
+    // lookup(type, fp, len) returns the row for the fingerprint, or -1
+    // if it is not in the database
+    //
+    int64_t lookup(enum os_fp_type type, const char *fp, size_t len) const {
+        auto it = index.find(os_fp_hash(type, fp, len));
+        if (it == index.end()) {
+            return -1;
+        }
+        const std::string &s = str_repr[it->second];
+        if (s.length() != len || memcmp(s.data(), fp, len) != 0) {
+            return -1;
+        }
+        return it->second;
+    }
+};
+
+/*
+ * struct os_host holds the fingerprint observations for one source
+ * address, and the links of the least-recently-seen list.  The first
+ * OS_MAX_HOST_FPS distinct fingerprints are kept as (row, count)
+ * pairs; the OS vectors of any further ones are summed into overflow,
+ * which is allocated only for hosts that need it
+ */
+struct os_host_addr {
+    uint64_t a[2];
+    uint8_t ip_vers;
+
+    bool operator==(const struct os_host_addr &rhs) const {
+        return a[0] == rhs.a[0] && a[1] == rhs.a[1] && ip_vers == rhs.ip_vers;
+    }
+};
+
+struct os_host_addr_hash {
+    size_t operator()(const struct os_host_addr &addr) const {
+        uint64_t h = (addr.a[0] ^ (addr.a[1] * 0x9e3779b97f4a7c15ull)) + addr.ip_vers;
+        return h ^ (h >> 29);
+    }
+};
+
+struct os_observation {
+    uint32_t row;
+    uint32_t count;
+};
+
+struct os_host {
+    struct os_host_addr addr;
+    struct timespec first_seen;
+    struct timespec last_seen;
+    uint32_t type_count[OS_NUM_FP_TYPES];
+    uint32_t num_obs;
+    struct os_observation obs[OS_MAX_HOST_FPS];
+    std::vector<double> overflow;
+    uint32_t prev;   /* toward most recently seen  */
+    uint32_t next;   /* toward least recently seen */
+};
+
+static const uint32_t os_host_none = UINT32_MAX;
+
+static inline bool timespec_before(const struct timespec &a, const struct timespec &b) {
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+/*
+ * struct os_observation_queue is a single-producer, single-consumer
+ * ring of observations, from a packet processing thread to the OS
+ * identification thread; head is written only by the former, and tail
+ * only by the latter, so no locks are needed
+ */
+#define OS_QUEUE_DEPTH 4096   /* a power of two */
+
+struct os_observation_msg {
+    struct os_host_addr addr;
+    uint32_t row;
+    enum os_fp_type type;
+    struct timespec ts;
+};
+
+struct os_observation_queue {
+    struct os_observation_msg msgs[OS_QUEUE_DEPTH];
+    alignas(64) uint32_t head;    /* next message to write */
+    alignas(64) uint32_t tail;    /* next message to read  */
+    uint64_t dropped;             /* written only by the producer */
+
+    bool push(const struct os_observation_msg &m) {
+        uint32_t h = head;
+        if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == OS_QUEUE_DEPTH) {
+            dropped++;
+            return false;
+        }
+        msgs[h % OS_QUEUE_DEPTH] = m;
+        __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+/*
+ * struct os_identifier is the OS identification engine: the model
+ * and fingerprint database (read-only after initialization), the
+ * observation queues of the packet processing threads, and the
+ * bounded host table, which is only used by the OS identification
+ * thread (or by os_identification_finalize(), after that thread has
+ * stopped)
+ */
+struct os_identifier {
+    struct os_classifier clf;
+    struct os_fingerprint_db db;
+
+    struct os_observation_queue *queues = NULL;
+    int num_queues = 0;
+    pthread_t thread;
+    bool thread_running = false;
+    int sig_stop = 0;
+
+    std::vector<struct os_host> hosts;
+    std::vector<uint32_t> free_list;
+    std::unordered_map<struct os_host_addr, uint32_t, os_host_addr_hash> host_index;
+    uint32_t most_recent = os_host_none;
+    uint32_t least_recent = os_host_none;
+    unsigned int idle_timeout = OS_DEFAULT_IDLE_TIMEOUT;
+    std::vector<double> features;
+    FILE *output = NULL;
+    uint64_t hosts_reported = 0;
+    uint64_t hosts_evicted = 0;
+    struct timespec newest_ts = { 0, 0 };     /* newest observation timestamp       */
+    struct timespec newest_clock = { 0, 0 };  /* CLOCK_MONOTONIC when it was taken */
+
+    void init_hosts(unsigned int max_hosts) {
+        hosts.resize(max_hosts);
+        free_list.reserve(max_hosts);
+        for (uint32_t i = max_hosts; i > 0; i--) {
+            free_list.push_back(i - 1);
+        }
+        host_index.reserve(max_hosts);
+        features.resize(clf.num_features);
+    }
+
+    void unlink(uint32_t i) {
+        struct os_host &h = hosts[i];
+        if (h.prev != os_host_none) {
+            hosts[h.prev].next = h.next;
+        } else {
+            most_recent = h.next;
+        }
+        if (h.next != os_host_none) {
+            hosts[h.next].prev = h.prev;
+        } else {
+            least_recent = h.prev;
+        }
+    }
+
+    void link_most_recent(uint32_t i) {
+        hosts[i].prev = os_host_none;
+        hosts[i].next = most_recent;
+        if (most_recent != os_host_none) {
+            hosts[most_recent].prev = i;
+        }
+        most_recent = i;
+        if (least_recent == os_host_none) {
+            least_recent = i;
+        }
+    }
+
+    void remove(uint32_t i) {
+        report(hosts[i]);
+        unlink(i);
+        host_index.erase(hosts[i].addr);
+        free_list.push_back(i);
+    }
+
+    void expire(const struct timespec *now) {
+        while (least_recent != os_host_none
+               && hosts[least_recent].last_seen.tv_sec + (time_t)idle_timeout < now->tv_sec) {
+            remove(least_recent);
+        }
+    }
+
+    void update(const struct os_host_addr &addr, uint32_t row, enum os_fp_type type, const struct timespec *ts) {
+        expire(ts);
+
+        uint32_t i;
+        auto it = host_index.find(addr);
+        if (it != host_index.end()) {
+            i = it->second;
+            unlink(i);
+        } else {
+            if (free_list.empty()) {
+                hosts_evicted++;
+                remove(least_recent);
+            }
+            i = free_list.back();
+            free_list.pop_back();
+            struct os_host &h = hosts[i];
+            h.addr = addr;
+            h.first_seen = *ts;
+            h.last_seen = *ts;
+            h.num_obs = 0;
+            h.overflow.clear();
+            for (auto &c : h.type_count) {
+                c = 0;
+            }
+            host_index[addr] = i;
+        }
+        link_most_recent(i);
+
+        struct os_host &h = hosts[i];
+        if (timespec_before(h.last_seen, *ts)) {
+            h.last_seen = *ts;   /* the threads' observations are not in time order */
+        } else if (timespec_before(*ts, h.first_seen)) {
+            h.first_seen = *ts;
+        }
+        h.type_count[type]++;
+        for (uint32_t j = 0; j < h.num_obs; j++) {
+            if (h.obs[j].row == row) {
+                h.obs[j].count++;
+                return;
+            }
+        }
+        if (h.num_obs < OS_MAX_HOST_FPS) {
+            h.obs[h.num_obs++] = { row, 1 };
+            return;
+        }
+        size_t os_len = clf.os_len;
+        if (h.overflow.empty()) {
+            h.overflow.assign(clf.num_features, 0.0);
+        }
+        const double *r = &db.rows[row * os_len];
+        double *f = &h.overflow[type * os_len];
+        for (size_t k = 0; k < os_len; k++) {
+            f[k] += r[k];
+        }
+    }
+
+    // report(h) classifies host h and writes a JSON line for it; the
+    // feature vector of each type is the sum of the OS vectors of the
+    // fingerprints observed, normalized to sum to one
+    //
+    void report(const struct os_host &h) {
+        if (output == NULL) {
+            return;
+        }
+        size_t os_len = clf.os_len;
+        if (h.overflow.empty()) {
+            features.assign(clf.num_features, 0.0);
+        } else {
+            features = h.overflow;
+        }
+        for (uint32_t j = 0; j < h.num_obs; j++) {
+            const double *r = &db.rows[h.obs[j].row * os_len];
+            double *f = &features[db.row_type[h.obs[j].row] * os_len];
+            double count = h.obs[j].count;
+            for (size_t k = 0; k < os_len; k++) {
+                f[k] += count * r[k];
+            }
+        }
+        for (size_t t = 0; t < OS_NUM_FP_TYPES; t++) {
+            double *f = &features[t * os_len];
+            double sum = 0.0;
+            for (size_t k = 0; k < os_len; k++) {
+                sum += f[k];
+            }
+            if (sum > 0.0) {
+                for (size_t k = 0; k < os_len; k++) {
+                    f[k] /= sum;
+                }
+            }
+        }
+        double probability;
+        unsigned int label = clf.classify(features.data(), &probability);
+
+        char buffer[1024];
+        struct buffer_stream buf{buffer, sizeof(buffer)};
+        struct json_object record{&buf};
+        if (h.addr.ip_vers == 6) {
+            record.print_key_ipv6_addr("src_ip", (const uint8_t *)h.addr.a);
+        } else {
+            record.print_key_ipv4_addr("src_ip", (const uint8_t *)h.addr.a);
+        }
+        struct json_object os_info{record, "os_info"};
+        os_info.print_key_string("os", clf.labels[label].c_str());
+        os_info.print_key_float("score", probability);
+        os_info.close();
+        struct json_object counts{record, "fingerprint_counts"};
+        for (size_t t = 0; t < OS_NUM_FP_TYPES; t++) {
+            counts.print_key_uint(os_fp_type_name[t], h.type_count[t]);
+        }
+        counts.close();
+        struct timespec first_seen = h.first_seen;
+        struct timespec last_seen = h.last_seen;
+        record.print_key_timestamp("event_start", &first_seen);
+        record.print_key_timestamp("event_end", &last_seen);
+        record.close();
+        if (buf.trunc == 0) {
+            buf.write_line(output);
+            hosts_reported++;
+        }
+    }
+
+    // drain() takes all of the observations in the queues, and
+    // returns the number taken
+    //
+    size_t drain() {
+        size_t count = 0;
+        bool newer = false;
+        for (int t = 0; t < num_queues; t++) {
+            struct os_observation_queue &q = queues[t];
+            uint32_t tail = q.tail;
+            uint32_t head = __atomic_load_n(&q.head, __ATOMIC_ACQUIRE);
+            for ( ; tail != head; tail++) {
+                const struct os_observation_msg &m = q.msgs[tail % OS_QUEUE_DEPTH];
+                update(m.addr, m.row, m.type, &m.ts);
+                if (timespec_before(newest_ts, m.ts)) {
+                    newest_ts = m.ts;
+                    newer = true;
+                }
+                count++;
+            }
+            __atomic_store_n(&q.tail, tail, __ATOMIC_RELEASE);
+        }
+        if (newer) {
+            clock_gettime(CLOCK_MONOTONIC, &newest_clock);
+        }
+        return count;
+    }
+
+    // expire_idle() reports the hosts that have been idle for longer
+    // than idle_timeout while no observations arrive; the current time
+    // is taken to be the newest observation timestamp, advanced by the
+    // time that has elapsed since that observation was taken, so that
+    // packet timestamps and the system clock need not agree
+    //
+    void expire_idle() {
+        if (newest_ts.tv_sec == 0 && newest_ts.tv_nsec == 0) {
+            return;   /* no observations yet */
+        }
+        struct timespec clock;
+        clock_gettime(CLOCK_MONOTONIC, &clock);
+        struct timespec now = newest_ts;
+        now.tv_sec += clock.tv_sec - newest_clock.tv_sec;
+        now.tv_nsec += clock.tv_nsec - newest_clock.tv_nsec;
+        if (now.tv_nsec < 0) {
+            now.tv_sec--;
+            now.tv_nsec += 1000000000;
+        } else if (now.tv_nsec >= 1000000000) {
+            now.tv_sec++;
+            now.tv_nsec -= 1000000000;
+        }
+        uint64_t reported = hosts_reported;
+        expire(&now);
+        if (hosts_reported != reported) {
+            fflush(output);
+        }
+    }
+
+    static void *thread_func(void *arg) {
+        struct os_identifier *o = (struct os_identifier *)arg;
+        const struct timespec idle{0, 10000000};   /* 10 ms */
+        while (__atomic_load_n(&o->sig_stop, __ATOMIC_RELAXED) == 0) {
+            if (o->drain() == 0) {
+                o->expire_idle();
+                nanosleep(&idle, NULL);
+            }
+        }
+        return NULL;
+    }
+
+    int start_thread() {
+        int err = pthread_create(&thread, NULL, thread_func, this);
+        if (err != 0) {
+            fprintf(stderr, "%s: could not start OS identification thread\n", strerror(err));
+            return -1;
+        }
+        thread_running = true;
+        return 0;
+    }
+
+    void finalize() {
+        if (thread_running) {
+            __atomic_store_n(&sig_stop, 1, __ATOMIC_RELAXED);
+            pthread_join(thread, NULL);
+            thread_running = false;
+        }
+        drain();
+        uint64_t dropped = 0;
+        for (int t = 0; t < num_queues; t++) {
+            dropped += queues[t].dropped;
+        }
+        if (dropped) {
+            fprintf(stderr, "warning: %" PRIu64 " OS identification observations were dropped\n", dropped);
+        }
+        while (least_recent != os_host_none) {
+            remove(least_recent);
+        }
+        if (output) {
+            fclose(output);
+            output = NULL;
+        }
+    }
+
+    ~os_identifier() {
+        free(queues);
+    }
+};
+
+static struct os_identifier *os_ident = NULL;
+
+int os_identification_init(int verbosity,
+                           const char *resource_dir,
+                           const char *output_file,
+                           unsigned int max_hosts,
+                           unsigned int idle_timeout,
+                           int num_threads) {
+
+    const char *resource_dir_list[] =
+      {
+       DEFAULT_RESOURCE_DIR,
+       "resources",
+       "../resources",
+       NULL
+      };
+    if (resource_dir) {
+        resource_dir_list[0] = resource_dir;  // use directory from configuration
+        resource_dir_list[1] = NULL;          // fail otherwise
+    }
+    const char *db_file_name[OS_NUM_FP_TYPES] = {
+        "/fingerprint-db-tcp-os.json.gz",
+        "/fingerprint-db-tls-os.json.gz",
+        "/fingerprint-db-http-os.json.gz"
+    };
+
+    char resource_file_name[PATH_MAX];
+
+    unsigned int index = 0;
+    while (resource_dir_list[index] != NULL) {
+        struct os_identifier *o = new struct os_identifier;
+
+        strncpy(resource_file_name, resource_dir_list[index], PATH_MAX-1);
+        strncat(resource_file_name, "/os_detection_model.json", PATH_MAX-1);
+        bool ok = o->clf.load(resource_file_name);
+        for (int t = 0; ok && t < OS_NUM_FP_TYPES; t++) {
+            strncpy(resource_file_name, resource_dir_list[index], PATH_MAX-1);
+            strncat(resource_file_name, db_file_name[t], PATH_MAX-1);
+            ok = (o->db.load(resource_file_name, (enum os_fp_type)t, o->clf) == 0);
+        }
+        if (ok) {
+            o->output = fopen(output_file, "w");
+            if (o->output == NULL) {
+                fprintf(stderr, "%s: could not open OS identification output file '%s'\n", strerror(errno), output_file);
+                delete o;
+                return -1;
+            }
+            o->idle_timeout = idle_timeout ? idle_timeout : OS_DEFAULT_IDLE_TIMEOUT;
+            o->init_hosts(max_hosts ? max_hosts : OS_DEFAULT_MAX_HOSTS);
+            o->num_queues = num_threads > 0 ? num_threads : 1;
+            o->queues = (struct os_observation_queue *)aligned_alloc(alignof(struct os_observation_queue),
+                                                                     o->num_queues * sizeof(struct os_observation_queue));
+            if (o->queues == NULL) {
+                fprintf(stderr, "error: could not allocate OS identification queues\n");
+            } else {
+                memset(o->queues, 0, o->num_queues * sizeof(struct os_observation_queue));
+            }
+            if (o->queues == NULL || o->start_thread() != 0) {
+                fclose(o->output);
+                delete o;
+                return -1;
+            }
+            os_ident = o;
+            if (verbosity > 0) {
+                fprintf(stderr, "initialized OS identification module with resource directory %s (%zu fingerprints, %zu labels)\n",
+                        resource_dir_list[index], o->db.row_type.size(), o->clf.labels.size());
+            }
+            return 0;
+        }
+        delete o;
+        if (verbosity > 0) {
+            fprintf(stderr, "warning: could not open file '%s'\n", resource_file_name);
+            fprintf(stderr, "warning: could not initialize OS identification module with resource directory '%s', trying next in list\n", resource_dir_list[index]);
+        }
+
+        index++;  /* try next directory in the list */
+    }
+    fprintf(stderr, "warning: could not initialize OS identification module\n");
+    return -1;
+}
+
+void os_identification_finalize() {
+    if (os_ident) {
+        os_ident->finalize();
+        delete os_ident;
+        os_ident = NULL;
+    }
+}
+
+struct os_observation_queue *os_identification_get_thread(int tnum) {
+    if (os_ident == NULL || tnum < 0 || tnum >= os_ident->num_queues) {
+        return NULL;
+    }
+    return &os_ident->queues[tnum];
+}
+
+void os_identification_update(struct os_observation_queue *q,
+                              const struct key &k,
+                              enum os_fp_type type,
+                              const char *fp_str,
+                              size_t fp_len,
+                              const struct timespec *ts) {
+    if (os_ident == NULL || q == NULL) {
+        return;
+    }
+    int64_t row = os_ident->db.lookup(type, fp_str, fp_len);
+    if (row < 0) {
+        return;   // fingerprint carries no OS information
+    }
+
+    struct os_host_addr addr{};
+    addr.ip_vers = k.ip_vers;
+    if (k.ip_vers == 6) {
+        memcpy(addr.a, &k.addr.ipv6.src, sizeof(addr.a));
+    } else {
+        memcpy(addr.a, &k.addr.ipv4.src, sizeof(k.addr.ipv4.src));
+    }
+    q->push({ addr, (uint32_t)row, type, *ts });
+}
@@ -0,0 +1,87 @@
+/*
+ * os_identification.h
+ *
+ * streaming, per-host operating system identification from TCP, TLS,
+ * and HTTP client fingerprints
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef OS_IDENTIFICATION_H
+#define OS_IDENTIFICATION_H
+
+#include <stdio.h>
+#include <time.h>
+#include "tcp.h"
+
+/*
+ * Each host (source address) that sends a TCP SYN, TLS clientHello,
+ * or HTTP request is tracked in a bounded table.  For each host, the
+ * table holds the count of each known fingerprint that was observed;
+ * those counts select rows in a precomputed matrix of per-fingerprint
+ * OS prevalence vectors, which are summed, normalized, and run through
+ * a multinomial logistic regression model (os_detection_model.json)
+ * when the host is reported.
+ *
+ * The packet processing threads do not touch the host table: each of
+ * them looks up its fingerprints in the (read-only) database and puts
+ * the observations into a queue of its own, without locks, and an OS
+ * identification thread takes them from the queues, updates the host
+ * table, and writes the reports.  If a queue is full, the observation
+ * is dropped.
+ *
+ * A host is reported, as a JSON line in the OS identification output
+ * file, when it has not been seen for idle_timeout seconds, when it is
+ * evicted (least recently seen first) to make room for a new host, or
+ * when os_identification_finalize() is called.  Idle hosts are also
+ * reported while no observations arrive, by advancing the newest
+ * observation timestamp by the time that has elapsed since then.
+ */
+
+enum os_fp_type {
+    os_fp_type_tcp  = 0,
+    os_fp_type_tls  = 1,
+    os_fp_type_http = 2
+};
+
+#define OS_DEFAULT_MAX_HOSTS    65536
+#define OS_DEFAULT_IDLE_TIMEOUT 600     /* seconds */
+
+struct os_observation_queue;   /* one per packet processing thread */
+
+int os_identification_init(int verbosity,
+                           const char *resource_dir,
+                           const char *output_file,
+                           unsigned int max_hosts,
+                           unsigned int idle_timeout,
+                           int num_threads);
+
+/*
+ * os_identification_finalize() stops the OS identification thread,
+ * after it has taken all of the queued observations, and reports all
+ * of the hosts; the packet processing threads must have stopped
+ */
+void os_identification_finalize();
+
+/*
+ * os_identification_get_thread(tnum) returns the observation queue of
+ * packet processing thread tnum, or NULL if OS identification is not
+ * initialized
+ */
+struct os_observation_queue *os_identification_get_thread(int tnum);
+
+/*
+ * os_identification_update(q, k, type, fp_str, fp_len, ts) queues the
+ * observation of the fingerprint fp_str (without its surrounding
+ * quotes) from the source of the flow k in q, if the fingerprint is
+ * in the OS fingerprint database
+ */
+void os_identification_update(struct os_observation_queue *q,
+                              const struct key &k,
+                              enum os_fp_type type,
+                              const char *fp_str,
+                              size_t fp_len,
+                              const struct timespec *ts);
+
+#endif /* OS_IDENTIFICATION_H */
@@ -8,6 +8,7 @@
 #include "output.h"
 #include "pcap_file_io.h"  // for write_pcap_file_header()
 #include "utils.h"
+#include "metrics.h"
 
 
 #define output_file_needs_rotation(ojf) (--((ojf)->record_countdown) == 0)
@@ -228,6 +229,17 @@ enum status output_file_rotate(struct output_file *ojf) {
         ojf->file = stdout;
         return status_ok;
     }
+    if (ojf->type == file_type_none) {
+        ojf->file = NULL;
+        return status_ok;
+    }
+    if (ojf->type == file_type_shm) {
+        ojf->file = NULL;
+        if (ojf->ring.hdr == NULL && shm_ring_create(&ojf->ring, ojf->outfile_name, ojf->shm_size) != 0) {
+            return status_err;
+        }
+        return status_ok;
+    }
 
     if (ojf->file) {
         // printf("rotating output file\n");
@@ -235,6 +247,7 @@ enum status output_file_rotate(struct output_file *ojf) {
         if (fclose(ojf->file) != 0) {
             perror("could not close json file");
         }
+        metrics_increment(ojf->rotations);
     }
 
     if (ojf->max_records) {
@@ -267,7 +280,7 @@ enum status output_file_rotate(struct output_file *ojf) {
         return status_err;
     }
     if (ojf->type == file_type_pcap) {
-        enum status status = write_pcap_file_header(ojf->file);
+        enum status status = write_pcap_file_header(ojf->file, ojf->nanosecond);
         if (status) {
             perror("error: could not write pcap file header");
             return status_err;
@@ -279,6 +292,30 @@ enum status output_file_rotate(struct output_file *ojf) {
     return status_ok;
 }
 
+/*
+ * output_write(out_ctx, msg) writes the record in msg to the output
+ * file, or publishes it to the shared memory ring
+ */
+static inline void output_write(struct output_file *out_ctx, const struct llq_msg *msg) {
+    if (out_ctx->type == file_type_shm) {
+        shm_ring_write(&out_ctx->ring, msg->buf, msg->len);
+    } else {
+        fwrite(msg->buf, msg->len, 1, out_ctx->file);
+    }
+}
+
+/*
+ * output_record_latency(out_ctx, msg) records the time from the
+ * capture of the packet in msg to the completion of its write
+ */
+static inline void output_record_latency(struct output_file *out_ctx, const struct llq_msg *msg) {
+    if (out_ctx->track_latency) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        latency_histogram_record(&out_ctx->wire_to_write, latency_ns(&now, &msg->ts));
+    }
+}
+
 void *output_thread_func(void *arg) {
 
     struct output_file *out_ctx = (struct output_file *)arg;
@@ -390,7 +427,10 @@ void *output_thread_func(void *arg) {
 
             struct llq_msg *wmsg = &(out_ctx->qs.queue[wq].msgs[out_ctx->qs.queue[wq].ridx]);
             if (wmsg->used == 1) {
-                fwrite(wmsg->buf, wmsg->len, 1, out_ctx->file);
+                output_write(out_ctx, wmsg);
+                metrics_add(out_ctx->bytes_written, wmsg->len);
+                metrics_increment(out_ctx->records_written);
+                output_record_latency(out_ctx, wmsg);
 
                 /* A full memory barrier prevents the following flag (un)set from happening too soon */
                 __sync_synchronize();
@@ -444,7 +484,10 @@ void *output_thread_func(void *arg) {
                 break;
             } else if (time_less(&(wmsg->ts), &old_ts) == 1) {
                 //fprintf(stderr, "DEBUG: writing old message from queue %d\n", wq);
-                fwrite(wmsg->buf, wmsg->len, 1, out_ctx->file);
+                output_write(out_ctx, wmsg);
+                metrics_add(out_ctx->bytes_written, wmsg->len);
+                metrics_increment(out_ctx->records_written);
+                output_record_latency(out_ctx, wmsg);
 
                 /* A full memory barrier prevents the following flag (un)set from happening too soon */
                 __sync_synchronize();
@@ -478,7 +521,7 @@ void *output_thread_func(void *arg) {
     if (t_tree.tree) {
         free(t_tree.tree);
     }
-    if (fclose(out_ctx->file) != 0) {
+    if (out_ctx->file && fclose(out_ctx->file) != 0) {
         perror("could not close json file");
     }
 
@@ -486,7 +529,12 @@ void *output_thread_func(void *arg) {
 }
 
 
-int output_thread_init(pthread_t &output_thread, struct output_file &out_ctx, const struct mercury_config &cfg) {
+/*
+ * output_file_init(out_ctx, cfg) initializes the queues and the
+ * start condition of out_ctx, and the settings common to all of its
+ * types
+ */
+static int output_file_init(struct output_file &out_ctx, const struct mercury_config &cfg) {
 
     /* make the thread queues */
     thread_queues_init(&out_ctx.qs, cfg.num_threads);
@@ -505,32 +553,78 @@ int output_thread_init(pthread_t &output_thread, struct output_file &out_ctx, co
     out_ctx.file = NULL;
     out_ctx.max_records = cfg.rotate;
     out_ctx.record_countdown = 0;
-    if (cfg.fingerprint_filename) {
+    out_ctx.file_num = 0;
+    out_ctx.mode = cfg.mode;
+    out_ctx.track_latency = (cfg.capture_interface != NULL);
+    out_ctx.nanosecond = cfg.nanosecond;
+
+    return 0;
+}
+
+static int output_thread_create(pthread_t &output_thread, struct output_file &out_ctx) {
+    int err = pthread_create(&output_thread, NULL, output_thread_func, &out_ctx);
+    if (err != 0) {
+        perror("error creating output thread");
+        return -1;
+    }
+    return 0;
+}
+
+int output_thread_init(pthread_t &output_thread, struct output_file &out_ctx, const struct mercury_config &cfg) {
+
+    if (output_file_init(out_ctx, cfg) != 0) {
+        return -1;
+    }
+    if (cfg.shm) {
+        out_ctx.outfile_name = cfg.shm;
+        out_ctx.type = file_type_shm;
+        out_ctx.shm_size = cfg.shm_size ? cfg.shm_size : SHM_RING_DEFAULT_SIZE;
+    } else if (cfg.fingerprint_filename) {
         out_ctx.outfile_name = cfg.fingerprint_filename;
         out_ctx.type = file_type_json;
+    } else if (cfg.write_filename && cfg.write_direct) {
+        out_ctx.outfile_name = cfg.write_filename;
+        out_ctx.type = file_type_none;
     } else if (cfg.write_filename) {
         out_ctx.outfile_name = cfg.write_filename;
         out_ctx.type = file_type_pcap;
     } else {
         out_ctx.type = file_type_stdout;  // default output type
     }
-    out_ctx.file_num = 0;
-    out_ctx.mode = cfg.mode;
 
     //fprintf(stderr, "DEBUG: fingerprint filename: %s\n", cfg.fingerprint_filename);
     //fprintf(stderr, "DEBUG: max records: %ld\n", out_ctx.out_jf.max_records);
 
     /* Start the output thread */
-    int err = pthread_create(&output_thread, NULL, output_thread_func, &out_ctx);
-    if (err != 0) {
-        perror("error creating output thread");
+    return output_thread_create(output_thread, out_ctx);
+}
+
+int output_thread_init_pcap(pthread_t &output_thread, struct output_file &out_ctx, const struct mercury_config &cfg) {
+
+    if (output_file_init(out_ctx, cfg) != 0) {
         return -1;
     }
-    return 0;
+    out_ctx.outfile_name = cfg.write_filename;
+    out_ctx.type = file_type_pcap;
+    if (cfg.write_rotate) {
+        out_ctx.max_records = cfg.write_rotate;
+    }
+
+    return output_thread_create(output_thread, out_ctx);
+}
+
+int output_thread_start(struct output_file *out_ctx) {
+    out_ctx->t_output_p = 1;
+    int err = pthread_cond_broadcast(&(out_ctx->t_output_c)); /* Wake up output */
+    if (err == 0 && out_ctx->pcap_output != NULL) {
+        err = output_thread_start(out_ctx->pcap_output);
+    }
+    return err;
 }
 
 void output_thread_finalize(pthread_t output_thread, struct output_file *out_file) {
     out_file->sig_stop_output = 1;
     pthread_join(output_thread, NULL);
+    shm_ring_close(&out_file->ring);
     thread_queues_free(&out_file->qs);
 }
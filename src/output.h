@@ -8,12 +8,16 @@
 #include <pthread.h>
 #include "mercury.h"
 #include "llq.h"
+#include "latency.h"
+#include "shm_ring.h"
 
 enum file_type {
    file_type_unknown=0,
    file_type_json,
    file_type_pcap,
-   file_type_stdout
+   file_type_stdout,
+   file_type_none,     /* no output file; packets are written by each thread */
+   file_type_shm       /* shared memory ring (see shm_ring.h) */
 };
 
 struct output_file {
@@ -24,17 +28,49 @@ struct output_file {
     char *outfile_name;
     const char *mode;
     enum file_type type;
+    bool nanosecond;               /* pcap files have nanosecond timestamps */
     int t_output_p;
     pthread_cond_t t_output_c;
     pthread_mutex_t t_output_m;
     struct thread_queues qs;
     int sig_stop_output = 0;
+    uint64_t bytes_written = 0;    /* written by the output thread, read by metrics */
+    uint64_t records_written = 0;
+    uint64_t rotations = 0;
+    bool track_latency = false;    /* true if llq_msg timestamps are from a live capture */
+    struct latency_histogram wire_to_write = {};  /* packet timestamp to fwrite() completion */
+    uint64_t shm_size = 0;         /* size of the shared memory ring, in bytes */
+    struct shm_ring ring = {};     /* shared memory ring, for file_type_shm */
+    struct output_file *pcap_output = NULL;  /* packets, when written along with JSON records */
 };
 
 void *output_thread_func(void *arg);
 
 int output_thread_init(pthread_t &output_thread, struct output_file &out_ctx, const struct mercury_config &cfg);
 
+/*
+ * output_thread_init_pcap(output_thread, out_ctx, cfg) starts an
+ * output thread for the PCAP file of a configuration that writes both
+ * JSON records and packets (-f and -w); each packet processor writes
+ * its records into the queues of the thread started by
+ * output_thread_init(), and its packets into those of this thread
+ */
+int output_thread_init_pcap(pthread_t &output_thread, struct output_file &out_ctx, const struct mercury_config &cfg);
+
+/*
+ * output_thread_start(out_ctx) lets the output thread of out_ctx (and
+ * that of out_ctx->pcap_output, if there is one) open its file and
+ * start writing; it returns 0 on success, and an error number
+ * otherwise
+ */
+int output_thread_start(struct output_file *out_ctx);
+
+/*
+ * output_thread_finalize(output_thread, out_file) stops the output
+ * thread once it has written all of the queued records, then closes
+ * the shared memory ring (if any) and frees the queues; it must follow
+ * metrics_finalize(), since the metrics server reads both of them
+ */
 void output_thread_finalize(pthread_t output_thread, struct output_file *out_file);
 
 char *stdout_string();
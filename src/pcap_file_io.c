@@ -30,12 +30,35 @@
 #include "utils.h"
 #include "llq.h"
 #include "buffer_stream.h"
+#include "metrics.h"
 
 /*
  * constants used in file format
  */
 static uint32_t magic = 0xa1b2c3d4;
 static uint32_t cagim = 0xd4c3b2a1;
+static uint32_t magic_nsec = 0xa1b23c4d;  /* nanosecond timestamps */
+static uint32_t cagim_nsec = 0x4d3cb2a1;
+
+/*
+ * pcapng format (draft-ietf-opsawg-pcapng): a file is a sequence of
+ * sections, each starting with a Section Header Block that sets the
+ * byte order, followed by Interface Description Blocks and packet
+ * blocks; each block has a type and a total length before its body,
+ * and that length again after it
+ */
+#define PCAPNG_SECTION_HEADER_BLOCK         0x0a0d0d0a
+#define PCAPNG_INTERFACE_DESCRIPTION_BLOCK  0x00000001
+#define PCAPNG_PACKET_BLOCK                 0x00000002  /* obsolete */
+#define PCAPNG_SIMPLE_PACKET_BLOCK          0x00000003
+#define PCAPNG_ENHANCED_PACKET_BLOCK        0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC             0x1a2b3c4d
+#define PCAPNG_BLOCK_HDR_LEN                8           /* type and total length */
+#define PCAPNG_BLOCK_TRAILER_LEN            4           /* total length          */
+#define PCAPNG_OPT_ENDOFOPT                 0
+#define PCAPNG_OPT_IF_TSRESOL               9
+#define PCAPNG_OPT_IF_TSOFFSET              14
+#define PCAPNG_DEFAULT_UNITS_PER_SEC        1000000     /* microseconds          */
 
 /*
  * global pcap header (one per file, at beginning)
@@ -55,7 +78,7 @@ struct pcap_file_hdr {
  */
 struct pcap_packet_hdr {
     uint32_t ts_sec;         /* timestamp seconds */
-    uint32_t ts_usec;        /* timestamp microseconds */
+    uint32_t ts_usec;        /* timestamp microseconds (or nanoseconds) */
     uint32_t incl_len;       /* number of octets of packet saved in file */
     uint32_t orig_len;       /* actual length of packet */
 };  // TBD: pack structure
@@ -84,15 +107,19 @@ static inline void set_file_io_buffer(struct pcap_file *f, const char *fname) {
     }
 }
 
-enum status write_pcap_file_header(FILE *f) {
+static void pcap_file_hdr_init(struct pcap_file_hdr *file_header, uint32_t snaplen, bool nanosecond) {
+    file_header->magic_number = nanosecond ? magic_nsec : magic;
+    file_header->version_major = 2;
+    file_header->version_minor = 4;
+    file_header->thiszone = 0;     /* no GMT correction for now */
+    file_header->sigfigs = 0;      /* we don't claim sigfigs for now */
+    file_header->snaplen = snaplen;
+    file_header->network = 1;      /* ethernet */
+}
+
+enum status write_pcap_file_header(FILE *f, bool nanosecond) {
     struct pcap_file_hdr file_header;
-    file_header.magic_number = magic;
-    file_header.version_major = 2;
-    file_header.version_minor = 4;
-    file_header.thiszone = 0;     /* no GMT correction for now */
-    file_header.sigfigs = 0;      /* we don't claim sigfigs for now */
-    file_header.snaplen = 65535;
-    file_header.network = 1;      /* ethernet */
+    pcap_file_hdr_init(&file_header, 65535, nanosecond);
 
     size_t items_written = fwrite(&file_header, sizeof(file_header), 1, f);
     if (items_written == 0) {
@@ -105,10 +132,20 @@ enum status write_pcap_file_header(FILE *f) {
 enum status pcap_file_open(struct pcap_file *f,
                const char *fname,
                enum io_direction dir,
-               int flags) {
+               int flags,
+               bool nanosecond) {
     struct pcap_file_hdr file_header;
     ssize_t items_read;
 
+    f->format = pcap_file_format_pcap;
+    f->nanosecond = nanosecond;
+    f->first_record = sizeof(file_header);
+    f->interfaces = NULL;
+    f->num_interfaces = 0;
+    f->max_interfaces = 0;
+    f->last_ts.tv_sec = 0;
+    f->last_ts.tv_nsec = 0;
+
     switch(dir) {
     case io_direction_reader:
         f->flags = O_RDONLY;
@@ -152,7 +189,7 @@ enum status pcap_file_open(struct pcap_file *f,
         }
 #endif
 
-        enum status status = write_pcap_file_header(f->file_ptr);
+        enum status status = write_pcap_file_header(f->file_ptr, nanosecond);
         if (status) {
             perror("error writing pcap file header");
             fclose(f->file_ptr);
@@ -207,12 +244,27 @@ enum status pcap_file_open(struct pcap_file *f,
 	} else if (file_header.magic_number == cagim) {
 	    f->byteswap = 1;
 	    // printf("file is in pcap format\nbyteswap is needed\n");
+	} else if (file_header.magic_number == magic_nsec) {
+	    f->byteswap = 0;
+	    f->nanosecond = true;
+	} else if (file_header.magic_number == cagim_nsec) {
+	    f->byteswap = 1;
+	    f->nanosecond = true;
+	} else if (file_header.magic_number == PCAPNG_SECTION_HEADER_BLOCK) {
+	    /*
+	     * pcapng: the section header is read, along with all other
+	     * blocks, by pcap_file_read_packet()
+	     */
+	    f->format = pcap_file_format_pcapng;
+	    f->first_record = 0;
+	    if (fseek(f->file_ptr, 0, SEEK_SET) != 0) {
+		perror("error: could not rewind file pointer\n");
+		return status_err;
+	    }
+	    return status_ok;
 	} else {
-	    printf("error: file %s not in pcap format (file header: %08x)\n",
+	    printf("error: file %s not in pcap or pcapng format (file header: %08x)\n",
 		   fname, file_header.magic_number);
-	    if (file_header.magic_number == 0x0a0d0d0a) {
-		printf("error: pcap-ng format found; this format is currently unsupported\n");
-	    }
 	    exit(255);
 	}
 	if (f->byteswap) {
@@ -233,7 +285,7 @@ enum status pcap_file_write_packet_direct(struct pcap_file *f,
                       const void *packet,
                       size_t length,
                       unsigned int sec,
-                      unsigned int usec) {
+                      unsigned int nsec) {
     size_t items_written;
     struct pcap_packet_hdr packet_hdr;
 
@@ -244,7 +296,7 @@ enum status pcap_file_write_packet_direct(struct pcap_file *f,
 
     /* note: we never perform byteswap when writing */
     packet_hdr.ts_sec = sec;
-    packet_hdr.ts_usec = usec;
+    packet_hdr.ts_usec = f->nanosecond ? nsec : nsec / 1000;
     packet_hdr.incl_len = length;
     packet_hdr.orig_len = length;
 
@@ -282,78 +334,288 @@ enum status pcap_file_write_packet_direct(struct pcap_file *f,
 
 #define BUFLEN  16384
 
-enum status pcap_file_read_packet(struct pcap_file *f,
-                  struct pcap_pkthdr *pkthdr, /* output */
-                  void *packet_data           /* output */
-                  ) {
-    ssize_t items_read;
-    struct pcap_packet_hdr packet_hdr;
+static inline uint16_t pcap_file_u16(const struct pcap_file *f, uint16_t x) {
+    return f->byteswap ? __builtin_bswap16(x) : x;
+}
 
-    if (f->file_ptr == NULL) {
-        printf("File not open\n");
+static inline uint32_t pcap_file_u32(const struct pcap_file *f, uint32_t x) {
+    return f->byteswap ? __builtin_bswap32(x) : x;
+}
+
+/*
+ * pcap_file_read_data(f, pi, packet_data, caplen, skip) reads the
+ * caplen bytes of a packet into packet_data, truncating it to BUFLEN
+ * bytes, then skips skip more bytes (padding, options, and trailers)
+ */
+static enum status pcap_file_read_data(struct pcap_file *f,
+                                       struct packet_info *pi,
+                                       void *packet_data,
+                                       uint32_t caplen,
+                                       long skip) {
+    uint32_t read_len = caplen < BUFLEN ? caplen : BUFLEN;
+    if (read_len && fread(packet_data, read_len, 1, f->file_ptr) == 0) {
+        printf("could not read packet from file, caplen: %u\n", caplen);
+        return status_err;          /* could not read packet from file */
+    }
+    skip += caplen - read_len;
+    if (skip && fseek(f->file_ptr, skip, SEEK_CUR) != 0) {
+        perror("error: could not advance file pointer\n");
         return status_err;
     }
+    pi->caplen = read_len;
+    pi->len = read_len;
+    return status_ok;
+}
 
-    items_read = fread(&packet_hdr, sizeof(packet_hdr), 1, f->file_ptr);
-    if (items_read == 0) {
+static enum status pcap_file_read_pcap_packet(struct pcap_file *f,
+                                              struct packet_info *pi,
+                                              void *packet_data) {
+    struct pcap_packet_hdr packet_hdr;
+
+    if (fread(&packet_hdr, sizeof(packet_hdr), 1, f->file_ptr) == 0) {
         return status_err_no_more_data; /* could not read packet header from file */
     }
+    uint32_t ts_frac = pcap_file_u32(f, packet_hdr.ts_usec);
+    pi->ts.tv_sec = pcap_file_u32(f, packet_hdr.ts_sec);
+    pi->ts.tv_nsec = f->nanosecond ? ts_frac : ts_frac * 1000;
 
-    if (f->byteswap) {
-        pkthdr->ts.tv_sec = ntohl(packet_hdr.ts_sec);
-        pkthdr->ts.tv_usec = ntohl(packet_hdr.ts_usec);
-        pkthdr->caplen = ntohl(packet_hdr.incl_len);
+    return pcap_file_read_data(f, pi, packet_data, pcap_file_u32(f, packet_hdr.incl_len), 0);
+}
+
+/*
+ * pcapng_read_section_header(f, raw_length) reads the body of a
+ * Section Header Block, whose (not yet byteswapped) total length is
+ * raw_length, and starts a new section: the byte order is set from
+ * the byte order magic, and the interfaces of the previous section
+ * are discarded
+ */
+static enum status pcapng_read_section_header(struct pcap_file *f, uint32_t raw_length) {
+    uint32_t byte_order_magic;
+    if (fread(&byte_order_magic, sizeof(byte_order_magic), 1, f->file_ptr) == 0) {
+        return status_err_no_more_data;
+    }
+    if (byte_order_magic == PCAPNG_BYTE_ORDER_MAGIC) {
+        f->byteswap = 0;
+    } else if (byte_order_magic == __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC)) {
+        f->byteswap = 1;
     } else {
-        pkthdr->ts.tv_sec = packet_hdr.ts_sec;
-        pkthdr->ts.tv_usec = packet_hdr.ts_usec;
-        pkthdr->caplen = packet_hdr.incl_len;
+        printf("error: pcapng section header has invalid byte order magic (%08x)\n", byte_order_magic);
+        return status_err;
     }
+    f->num_interfaces = 0;
 
-    if (pkthdr->caplen <= BUFLEN) {
-        items_read = fread(packet_data, pkthdr->caplen, 1, f->file_ptr);
-        if (items_read == 0) {
-            printf("could not read packet from file, caplen: %u\n", pkthdr->caplen);
-            return status_err;          /* could not read packet from file */
-        }
-    } else {
-        /*
-         * The packet length is much bigger than BUFLEN.
-         * Read BUFLEN bytes to process the packet and skip the remaining bytes.
-         */
-        if (fread(packet_data, BUFLEN, 1, f->file_ptr) == 0) {
-            printf("could not read %d bytes of the packet from file\n", (int)BUFLEN);
-            return status_err;          /* could not read packet from file */
-        }
+    uint32_t length = pcap_file_u32(f, raw_length);
+    long skip = (long)length - PCAPNG_BLOCK_HDR_LEN - sizeof(byte_order_magic);
+    if (length % 4 || skip < PCAPNG_BLOCK_TRAILER_LEN) {
+        printf("error: malformed pcapng section header (length %u)\n", length);
+        return status_err;
+    }
+    if (fseek(f->file_ptr, skip, SEEK_CUR) != 0) {
+        perror("error: could not advance file pointer\n");
+        return status_err;
+    }
+    return status_ok;
+}
 
-        // advance the file pointer to skip the large packet
-        if (fseek(f->file_ptr, pkthdr->caplen - BUFLEN, SEEK_CUR) != 0) {
-            perror("error: could not advance file pointer\n");
+/*
+ * pcapng_read_interface(f, body_len, scratch) reads the body and the
+ * trailer of an Interface Description Block, using scratch (which
+ * holds at least BUFLEN bytes) to hold the body, and adds the
+ * interface to f
+ */
+static enum status pcapng_read_interface(struct pcap_file *f, uint32_t body_len, uint8_t *scratch) {
+    uint32_t read_len = body_len < BUFLEN ? body_len : BUFLEN;
+    if (read_len < 8 || fread(scratch, read_len, 1, f->file_ptr) == 0) {
+        printf("error: malformed pcapng interface description block\n");
+        return status_err;
+    }
+    if (fseek(f->file_ptr, body_len - read_len + PCAPNG_BLOCK_TRAILER_LEN, SEEK_CUR) != 0) {
+        perror("error: could not advance file pointer\n");
+        return status_err;
+    }
+
+    if (f->num_interfaces == f->max_interfaces) {
+        unsigned int max = f->max_interfaces ? 2 * f->max_interfaces : 4;
+        struct pcapng_interface *tmp = (struct pcapng_interface *)realloc(f->interfaces, max * sizeof(struct pcapng_interface));
+        if (tmp == NULL) {
+            printf("error: could not allocate memory for pcapng interfaces\n");
             return status_err;
         }
+        f->interfaces = tmp;
+        f->max_interfaces = max;
+    }
+    struct pcapng_interface *intf = &f->interfaces[f->num_interfaces++];
+    uint16_t u16;
+    uint32_t u32;
+    memcpy(&u16, scratch, sizeof(u16));
+    intf->linktype = pcap_file_u16(f, u16);
+    memcpy(&u32, scratch + 4, sizeof(u32));
+    intf->snaplen = pcap_file_u32(f, u32);
+    intf->ts_units_per_sec = PCAPNG_DEFAULT_UNITS_PER_SEC;
+    intf->ts_offset = 0;
+
+    /* options: code, length, and a value padded to a multiple of four bytes */
+    uint32_t offset = 8;
+    while (offset + 4 <= read_len) {
+        memcpy(&u16, scratch + offset, sizeof(u16));
+        uint16_t code = pcap_file_u16(f, u16);
+        memcpy(&u16, scratch + offset + 2, sizeof(u16));
+        uint16_t length = pcap_file_u16(f, u16);
+        offset += 4;
+        if (code == PCAPNG_OPT_ENDOFOPT || offset + length > read_len) {
+            break;
+        }
+        if (code == PCAPNG_OPT_IF_TSRESOL && length >= 1) {
+            uint8_t tsresol = scratch[offset];
+            uint64_t units = 1;
+            if (tsresol & 0x80) {
+                units <<= (tsresol & 0x7f) < 63 ? (tsresol & 0x7f) : 63;
+            } else {
+                for (unsigned int i = 0; i < tsresol && i < 19; i++) {
+                    units *= 10;
+                }
+            }
+            intf->ts_units_per_sec = units;
+        } else if (code == PCAPNG_OPT_IF_TSOFFSET && length >= 8) {
+            uint64_t u64;
+            memcpy(&u64, scratch + offset, sizeof(u64));
+            intf->ts_offset = f->byteswap ? __builtin_bswap64(u64) : u64;
+        }
+        offset += (length + 3) & ~3;
+    }
+    return status_ok;
+}
 
-        // adjust the packet len and caplen
-        pkthdr->len = pkthdr->caplen;
-        pkthdr->caplen = BUFLEN;
-        return status_ok;
+static inline void pcapng_set_timestamp(struct timespec *ts,
+                                        const struct pcapng_interface *intf,
+                                        uint32_t ts_high,
+                                        uint32_t ts_low) {
+    uint64_t t = ((uint64_t)ts_high << 32) | ts_low;
+    uint64_t frac = t % intf->ts_units_per_sec;
+    ts->tv_sec = t / intf->ts_units_per_sec + intf->ts_offset;
+    if (intf->ts_units_per_sec <= 1000000000) {
+        ts->tv_nsec = frac * 1000000000 / intf->ts_units_per_sec;   /* frac < 10^9, so no overflow */
+    } else {
+        ts->tv_nsec = (long double)frac * 1000000000 / intf->ts_units_per_sec;
     }
+}
 
-    return status_ok;
+static enum status pcap_file_read_pcapng_packet(struct pcap_file *f,
+                                                struct packet_info *pi,
+                                                void *packet_data) {
+    enum status status;
+    uint32_t block_hdr[2];
+    uint32_t fields[5];
+
+    while (fread(block_hdr, sizeof(block_hdr), 1, f->file_ptr) == 1) {
+
+        if (block_hdr[0] == PCAPNG_SECTION_HEADER_BLOCK) {
+            status = pcapng_read_section_header(f, block_hdr[1]);
+            if (status) {
+                return status;
+            }
+            continue;
+        }
+        uint32_t type = pcap_file_u32(f, block_hdr[0]);
+        uint32_t length = pcap_file_u32(f, block_hdr[1]);
+        if (length % 4 || length < PCAPNG_BLOCK_HDR_LEN + PCAPNG_BLOCK_TRAILER_LEN) {
+            printf("error: malformed pcapng block (type %08x, length %u)\n", type, length);
+            return status_err;
+        }
+        uint32_t body_len = length - PCAPNG_BLOCK_HDR_LEN - PCAPNG_BLOCK_TRAILER_LEN;
+
+        switch (type) {
+        case PCAPNG_ENHANCED_PACKET_BLOCK:
+        case PCAPNG_PACKET_BLOCK:
+            {
+                /*
+                 * interface id (32 bits, or 16 bits followed by a drop
+                 * count in the obsolete Packet Block), timestamp (high
+                 * and low), captured length, and original length
+                 */
+                if (body_len < sizeof(fields) || fread(fields, sizeof(fields), 1, f->file_ptr) == 0) {
+                    printf("error: malformed pcapng packet block\n");
+                    return status_err;
+                }
+                uint32_t interface_id;
+                if (type == PCAPNG_PACKET_BLOCK) {
+                    uint16_t id16;
+                    memcpy(&id16, &fields[0], sizeof(id16));
+                    interface_id = pcap_file_u16(f, id16);
+                } else {
+                    interface_id = pcap_file_u32(f, fields[0]);
+                }
+                uint32_t caplen = pcap_file_u32(f, fields[3]);
+                if (interface_id >= f->num_interfaces || caplen > body_len - sizeof(fields)) {
+                    printf("error: malformed pcapng packet block (interface %u, caplen %u)\n", interface_id, caplen);
+                    return status_err;
+                }
+                pcapng_set_timestamp(&pi->ts, &f->interfaces[interface_id],
+                                     pcap_file_u32(f, fields[1]), pcap_file_u32(f, fields[2]));
+                f->last_ts = pi->ts;
+                return pcap_file_read_data(f, pi, packet_data, caplen,
+                                           body_len - sizeof(fields) - caplen + PCAPNG_BLOCK_TRAILER_LEN);
+            }
+        case PCAPNG_SIMPLE_PACKET_BLOCK:
+            {
+                /*
+                 * original length, then the packet, which is truncated
+                 * to the snaplen of the first interface; there is no
+                 * timestamp, so the previous one is used
+                 */
+                uint32_t orig_len;
+                if (body_len < sizeof(orig_len) || f->num_interfaces == 0
+                    || fread(&orig_len, sizeof(orig_len), 1, f->file_ptr) == 0) {
+                    printf("error: malformed pcapng simple packet block\n");
+                    return status_err;
+                }
+                uint32_t caplen = pcap_file_u32(f, orig_len);
+                if (caplen > body_len - sizeof(orig_len)) {
+                    caplen = body_len - sizeof(orig_len);
+                }
+                if (f->interfaces[0].snaplen && caplen > f->interfaces[0].snaplen) {
+                    caplen = f->interfaces[0].snaplen;
+                }
+                pi->ts = f->last_ts;
+                return pcap_file_read_data(f, pi, packet_data, caplen,
+                                           body_len - sizeof(orig_len) - caplen + PCAPNG_BLOCK_TRAILER_LEN);
+            }
+        case PCAPNG_INTERFACE_DESCRIPTION_BLOCK:
+            status = pcapng_read_interface(f, body_len, (uint8_t *)packet_data);
+            if (status) {
+                return status;
+            }
+            break;
+        default:
+            /* name resolution, statistics, custom, and other blocks are skipped */
+            if (fseek(f->file_ptr, body_len + PCAPNG_BLOCK_TRAILER_LEN, SEEK_CUR) != 0) {
+                perror("error: could not advance file pointer\n");
+                return status_err;
+            }
+        }
+    }
+    return status_err_no_more_data;
 }
 
+enum status pcap_file_read_packet(struct pcap_file *f,
+                  struct packet_info *pi,     /* output */
+                  void *packet_data           /* output */
+                  ) {
 
-void packet_info_init_from_pkthdr(struct packet_info *pi,
-				  struct pcap_pkthdr *pkthdr) {
-    pi->len = pkthdr->caplen;
-    pi->caplen = pkthdr->caplen;
-    pi->ts.tv_sec = pkthdr->ts.tv_sec;
-    pi->ts.tv_nsec = pkthdr->ts.tv_usec * 1000;
-} 
+    if (f->file_ptr == NULL) {
+        printf("File not open\n");
+        return status_err;
+    }
+    if (f->format == pcap_file_format_pcapng) {
+        return pcap_file_read_pcapng_packet(f, pi, packet_data);
+    }
+    return pcap_file_read_pcap_packet(f, pi, packet_data);
+}
 
 enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
                                              struct pkt_proc *pkt_processor,
                                              int loop_count) {
     enum status status = status_ok;
-    struct pcap_pkthdr pkthdr;
     uint8_t packet_data[BUFLEN];
     unsigned long total_length = sizeof(struct pcap_file_hdr); // file header is already written
     unsigned long num_packets = 0;
@@ -361,19 +623,23 @@ enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
 
     for (int i=0; i < loop_count && sig_close_flag == 0; i++) {
         do {
-            status = pcap_file_read_packet(f, &pkthdr, packet_data);
+            status = pcap_file_read_packet(f, &pi, packet_data);
             if (status == status_ok) {
-                packet_info_init_from_pkthdr(&pi, &pkthdr);
                 // process the packet that was read
                 pkt_processor->apply(&pi, packet_data);
+                if (pkt_processor->metrics) {
+                    metrics_increment(pkt_processor->metrics->packets);
+                    metrics_add(pkt_processor->metrics->bytes, pi.caplen);
+                }
                 num_packets++;
-                total_length += pkthdr.caplen + sizeof(struct pcap_packet_hdr);
+                total_length += pi.caplen + sizeof(struct pcap_packet_hdr);
             }
         } while (status == status_ok && sig_close_flag == 0);
         
         if (i < loop_count - 1) {
-            // Rewind the file to the first packet after skipping file header.
-            if (fseek(f->file_ptr, sizeof(struct pcap_file_hdr), SEEK_SET) != 0) {
+            // Rewind the file to the first packet after skipping file header
+            // (or, for pcapng, to the first section header)
+            if (fseek(f->file_ptr, f->first_record, SEEK_SET) != 0) {
                 perror("error: could not rewind file pointer\n");
                 status = status_err;
             }
@@ -397,9 +663,213 @@ enum status pcap_file_close(struct pcap_file *f) {
     if (f->buffer) {
 	free(f->buffer);
     }
+    free(f->interfaces);
+    f->interfaces = NULL;
+    return status_ok;
+}
+
+
+
+/*
+ * direct pcap output
+ */
+
+static enum status pcap_direct_file_write_all(struct pcap_direct_file *f,
+                                              const uint8_t *data,
+                                              size_t length) {
+    while (length > 0) {
+        ssize_t bytes = write(f->fd, data, length);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("error: could not write to direct pcap file");
+            return status_err;
+        }
+        data += bytes;
+        length -= bytes;
+    }
     return status_ok;
 }
 
+/*
+ * pcap_direct_file_write_pages(f) writes out all of the whole pages
+ * in the buffer, then moves the remaining partial page (if any) to
+ * the start of the buffer, so that every write() is aligned as
+ * needed for O_DIRECT
+ */
+static enum status pcap_direct_file_write_pages(struct pcap_direct_file *f) {
+    size_t pages = f->buf_used & ~((size_t)PCAP_DIRECT_ALIGNMENT - 1);
+    if (pages == 0) {
+        return status_ok;
+    }
+    if (pcap_direct_file_write_all(f, f->buffer, pages) != status_ok) {
+        return status_err;
+    }
+    f->buf_used -= pages;
+    if (f->buf_used) {
+        memcpy(f->buffer, f->buffer + pages, f->buf_used);
+    }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    if ((f->allocated_size > 0) && (f->allocated_size - (off_t)f->bytes_written) <= (off_t)PCAP_DIRECT_BUFFER_SIZE) {
+        if (fallocate(f->fd, FALLOC_FL_KEEP_SIZE, f->bytes_written, PRE_ALLOCATE_DISK_SPACE) != 0) {
+            perror("warning: could not increase direct write file allocation by 100 MB");
+            f->allocated_size = 0;
+        } else {
+            f->allocated_size = f->bytes_written + PRE_ALLOCATE_DISK_SPACE;
+        }
+    }
+#endif
+
+    return status_ok;
+}
+
+enum status pcap_direct_file_open(struct pcap_direct_file *f,
+                                  const char *fname,
+                                  int flags,
+                                  bool nanosecond) {
+
+    f->fd = -1;
+    f->direct = false;
+    f->nanosecond = nanosecond;
+    f->buffer = NULL;
+    f->buf_used = 0;
+    f->allocated_size = 0;
+    f->bytes_written = 0;
+    f->packets_written = 0;
+
+    if (posix_memalign((void **)&f->buffer, PCAP_DIRECT_ALIGNMENT, PCAP_DIRECT_BUFFER_SIZE) != 0) {
+        fprintf(stderr, "error: could not allocate output buffer for direct pcap file %s\n", fname);
+        f->buffer = NULL;
+        return status_err;
+    }
+
+    /*
+     * open with O_DIRECT if possible; some filesystems (e.g. tmpfs)
+     * do not support it, in which case we fall back to buffered i/o,
+     * with the same large writes
+     */
+    int open_flags = O_WRONLY | O_CREAT | flags;
+#ifdef O_DIRECT
+    f->fd = open(fname, open_flags | O_DIRECT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (f->fd >= 0) {
+        f->direct = true;
+    } else if (errno == EINVAL) {
+        f->fd = open(fname, open_flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
+#else
+    f->fd = open(fname, open_flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+#endif
+    if (f->fd < 0) {
+        fprintf(stderr, "%s: error opening direct pcap file %s\n", strerror(errno), fname);
+        free(f->buffer);
+        f->buffer = NULL;
+        return status_err;
+    }
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    if (fallocate(f->fd, FALLOC_FL_KEEP_SIZE, 0, PRE_ALLOCATE_DISK_SPACE) != 0) {
+        fprintf(stderr, "warning: %s: could not pre-allocate %d MB disk space for pcap file %s\n",
+                strerror(errno), PRE_ALLOCATE_DISK_SPACE / ONE_MB, fname);
+    } else {
+        f->allocated_size = PRE_ALLOCATE_DISK_SPACE;
+    }
+#endif
+
+    pcap_file_hdr_init((struct pcap_file_hdr *)f->buffer, PCAP_DIRECT_SNAPLEN, nanosecond);
+    f->buf_used = sizeof(struct pcap_file_hdr);
+    f->bytes_written = sizeof(struct pcap_file_hdr);
+
+    return status_ok;
+}
+
+enum status pcap_direct_file_write_packet(struct pcap_direct_file *f,
+                                          const void *packet,
+                                          size_t length,
+                                          size_t orig_length,
+                                          unsigned int sec,
+                                          unsigned int nsec) {
+
+    if (packet && !length) {
+        fprintf(stderr, "warning: attempt to write an empty packet\n");
+        return status_ok;
+    }
+
+    struct pcap_packet_hdr packet_hdr;
+    packet_hdr.ts_sec = sec;
+    packet_hdr.ts_usec = f->nanosecond ? nsec : nsec / 1000;
+    packet_hdr.incl_len = length < PCAP_DIRECT_SNAPLEN ? length : PCAP_DIRECT_SNAPLEN;
+    packet_hdr.orig_len = orig_length;
+
+    size_t record_len = sizeof(struct pcap_packet_hdr) + packet_hdr.incl_len;
+    if (f->buf_used + record_len > PCAP_DIRECT_BUFFER_SIZE) {
+        if (pcap_direct_file_write_pages(f) != status_ok) {
+            return status_err;
+        }
+    }
+
+    memcpy(f->buffer + f->buf_used, &packet_hdr, sizeof(struct pcap_packet_hdr));
+    memcpy(f->buffer + f->buf_used + sizeof(struct pcap_packet_hdr), packet, packet_hdr.incl_len);
+    f->buf_used += record_len;
+
+    f->bytes_written += record_len;
+    f->packets_written++;
+
+    return status_ok;
+}
+
+/*
+ * pcap_direct_file_flush(f) writes out the whole pages in the buffer;
+ * a trailing partial page stays in the buffer until it is filled, or
+ * until the file is closed
+ */
+enum status pcap_direct_file_flush(struct pcap_direct_file *f) {
+    if (f->buffer == NULL) {
+        return status_err;
+    }
+    return pcap_direct_file_write_pages(f);
+}
+
+enum status pcap_direct_file_close(struct pcap_direct_file *f) {
+    enum status status = status_ok;
+
+    if (f->fd < 0 || f->buffer == NULL) {
+        return status_err;
+    }
+    if (pcap_direct_file_write_pages(f) != status_ok) {
+        status = status_err;
+    }
+
+    /*
+     * the final partial page cannot be written with O_DIRECT, so that
+     * flag is cleared before it is written
+     */
+    if (f->buf_used) {
+#ifdef O_DIRECT
+        if (f->direct) {
+            int fl = fcntl(f->fd, F_GETFL);
+            if (fl == -1 || fcntl(f->fd, F_SETFL, fl & ~O_DIRECT) == -1) {
+                perror("warning: could not clear O_DIRECT on pcap file");
+            }
+        }
+#endif
+        if (pcap_direct_file_write_all(f, f->buffer, f->buf_used) != status_ok) {
+            status = status_err;
+        }
+        f->buf_used = 0;
+    }
+
+    if (close(f->fd) != 0) {
+        perror("could not close direct pcap file");
+        status = status_err;
+    }
+    f->fd = -1;
+    free(f->buffer);
+    f->buffer = NULL;
+
+    return status;
+}
 
 
 /*
@@ -409,9 +879,12 @@ enum status pcap_file_close(struct pcap_file *f) {
 void pcap_queue_write(struct ll_queue *llq,
                       uint8_t *packet,
                       size_t length,
+                      size_t orig_length,
                       unsigned int sec,
                       unsigned int nsec,
-                      bool blocking) {
+                      bool blocking,
+                      bool nanosecond,
+                      struct thread_metrics *metrics) {
 
     if (blocking) {
         while (llq->msgs[llq->widx].used != 0) {
@@ -439,9 +912,9 @@ void pcap_queue_write(struct ll_queue *llq,
         /* note: we never perform byteswap when writing */
         struct pcap_packet_hdr packet_hdr;
         packet_hdr.ts_sec = sec;
-        packet_hdr.ts_usec = nsec;
+        packet_hdr.ts_usec = nanosecond ? nsec : nsec / 1000;
         packet_hdr.incl_len = length;
-        packet_hdr.orig_len = length;
+        packet_hdr.orig_len = orig_length;
 
         // write the packet header
         int r = append_memcpy(llq->msgs[llq->widx].buf, &ooff, olen, &trunc, &packet_hdr, sizeof(packet_hdr));
@@ -464,13 +937,8 @@ void pcap_queue_write(struct ll_queue *llq,
             llq->widx = (llq->widx + 1) % LLQ_DEPTH;
         }
     }
-    else {
-        //fprintf(stderr, "DEBUG: queue bucket used!\n");
-
-        // TODO: this is where we'd update an output drop counter
-        // but currently this spot in the code doesn't have access to
-        // any thread stats pointer or similar and I don't want
-        // to update a global variable in this location.
+    else if (metrics) {
+        metrics_increment(metrics->queue_full);
     }
 
 }
@@ -38,6 +38,23 @@ enum io_direction {
     io_direction_writer = 2
 };
 
+enum pcap_file_format {
+    pcap_file_format_pcap   = 0,   /* libpcap, with usec or nsec timestamps */
+    pcap_file_format_pcapng = 1
+};
+
+/*
+ * struct pcapng_interface holds the properties of an interface that
+ * are defined in a pcapng Interface Description Block, which are
+ * needed to interpret the packet blocks that refer to it
+ */
+struct pcapng_interface {
+    uint64_t ts_units_per_sec;  /* timestamp resolution, from if_tsresol  */
+    int64_t ts_offset;          /* seconds added to each timestamp        */
+    uint32_t snaplen;
+    uint16_t linktype;
+};
+
 struct pcap_file {
     FILE *file_ptr;
     int fd;                /* file descriptor that is returned by fileno() */
@@ -48,19 +65,42 @@ struct pcap_file {
     off_t  allocated_size; /* file size allocated using posix_fallocate    */
     uint64_t bytes_written; /* number of bytes written to this file       */
     uint64_t packets_written; /* number of packets written to this file   */
+    enum pcap_file_format format;
+    bool nanosecond;       /* pcap timestamps are nsec, not usec           */
+    long first_record;     /* file offset to rewind to, when looping       */
+    struct pcapng_interface *interfaces; /* pcapng interfaces in section   */
+    unsigned int num_interfaces;
+    unsigned int max_interfaces;
+    struct timespec last_ts; /* time of the previous pcapng packet         */
 };
 
 #define pcap_file_init() { NULL, 0, 0, 0, NULL, NULL, NULL }
 
+/*
+ * pcap_file_open(f, fname, dir, flags, nanosecond) opens the file
+ * fname for reading or writing.  A file opened for reading can be in
+ * pcap format, with microsecond or nanosecond timestamps, in either
+ * byte order, or in pcapng format; a file opened for writing is in
+ * pcap format, with nanosecond timestamps if nanosecond is true.
+ */
 enum status pcap_file_open(struct pcap_file *f,
 			   const char *fname,
 			   enum io_direction dir,
-			   int flags);
-
+			   int flags,
+			   bool nanosecond=false);
 
+/*
+ * pcap_file_read_packet(f, pi, packet_data) reads the next packet in
+ * the file f into packet_data, which must hold at least 16384 bytes
+ * (longer packets are truncated to that length), and sets pi to its
+ * length and its timestamp, at the full resolution of the file.  In a
+ * pcapng file, Enhanced, Simple, and obsolete Packet Blocks are read,
+ * with the timestamp resolution and offset of their interface, and
+ * all other blocks are skipped.
+ */
 enum status pcap_file_read_packet(struct pcap_file *f,
-				  struct pcap_pkthdr *pkthdr, /* output */
-				  void *packet_data           /* output */
+				  struct packet_info *pi, /* output */
+				  void *packet_data       /* output */
 				  );
 
 enum status pcap_file_write_packet(struct pcap_file *f,
@@ -71,7 +111,7 @@ enum status pcap_file_write_packet_direct(struct pcap_file *f,
 					  const void *packet,
 					  size_t length,
 					  unsigned int sec,
-					  unsigned int usec);
+					  unsigned int nsec);
 
 enum status pcap_file_close(struct pcap_file *f);
 
@@ -83,13 +123,63 @@ enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
  * start of serialized output code - first cut
  */
 
+/*
+ * pcap_queue_write() writes a pcap packet record into the queue llq,
+ * holding the first length bytes of a packet of orig_length bytes,
+ * with a nanosecond timestamp if nanosecond is true, and otherwise a
+ * microsecond timestamp; nsec is always in nanoseconds
+ */
 void pcap_queue_write(struct ll_queue *llq,
                       uint8_t *packet,
                       size_t length,
+                      size_t orig_length,
                       unsigned int sec,
                       unsigned int nsec,
-                      bool blocking);
+                      bool blocking,
+                      bool nanosecond,
+                      struct thread_metrics *metrics=NULL);
+
+enum status write_pcap_file_header(FILE *f, bool nanosecond=false);
+
+/*
+ * direct pcap output: each capture thread writes its own pcap file,
+ * without going through the lockless queues and the ordering merge
+ * performed by the output thread.  Packets are appended to a large,
+ * page-aligned buffer, which is written out in whole pages to a file
+ * opened with O_DIRECT (when the filesystem supports it), so that
+ * the page cache is bypassed.  The packets in each file are in the
+ * order in which they were received by that thread's ring; a merge
+ * tool (e.g. mergecap) can restore the global time order later.
+ */
+#define PCAP_DIRECT_ALIGNMENT    4096                 /* O_DIRECT block alignment   */
+#define PCAP_DIRECT_BUFFER_SIZE  (8 * 1024 * 1024)    /* bytes per write() call     */
+#define PCAP_DIRECT_SNAPLEN      262144               /* allows jumbo and GRO frames */
+
+struct pcap_direct_file {
+    int fd;
+    bool direct;              /* true if O_DIRECT is in effect                */
+    bool nanosecond;          /* true if timestamps are written in nsec       */
+    uint8_t *buffer;          /* PCAP_DIRECT_ALIGNMENT aligned output buffer  */
+    size_t buf_used;          /* number of bytes in buffer                    */
+    off_t allocated_size;     /* file size allocated using fallocate          */
+    uint64_t bytes_written;   /* number of bytes written to this file         */
+    uint64_t packets_written; /* number of packets written to this file       */
+};
+
+enum status pcap_direct_file_open(struct pcap_direct_file *f,
+                                  const char *fname,
+                                  int flags,
+                                  bool nanosecond=false);
+
+enum status pcap_direct_file_write_packet(struct pcap_direct_file *f,
+                                          const void *packet,
+                                          size_t length,
+                                          size_t orig_length,
+                                          unsigned int sec,
+                                          unsigned int nsec);
+
+enum status pcap_direct_file_flush(struct pcap_direct_file *f);
 
-enum status write_pcap_file_header(FILE *f);
+enum status pcap_direct_file_close(struct pcap_direct_file *f);
 
 #endif /* PCAP_FILE_IO_H */
@@ -3,23 +3,28 @@
  */
 
 #include <errno.h>
+#include <sched.h>
 #include "pcap_reader.h"
 #include "output.h"
 #include "pkt_proc.h"
 #include "utils.h"
+#include "rnd_pkt_drop.h"
+#include "metrics.h"
+#include "signal_handling.h"
 
 #define BILLION 1000000000L
 
 enum status pcap_reader_thread_context_init_from_config(struct pcap_reader_thread_context *tc,
                                                         struct mercury_config *cfg,
                                                         int tnum,
-                                                        struct ll_queue *llq) {
+                                                        struct ll_queue *llq,
+                                                        struct ll_queue *pcap_llq) {
     char input_filename[MAX_FILENAME];
     tc->tnum = tnum;
 	tc->loop_count = cfg->loop_count;
     enum status status;
 
-    tc->pkt_processor = pkt_proc_new_from_config(cfg, tnum, llq);
+    tc->pkt_processor = pkt_proc_new_from_config(cfg, tnum, llq, NULL, pcap_llq);
     if (tc->pkt_processor == NULL) {
         printf("error: could not initialize frame handler\n");
         return status_err;
@@ -58,7 +63,166 @@ void *pcap_file_processing_thread_func(void *userdata) {
     return NULL;
 }
 
+/*
+ * worker_index(packet, length, num_workers) returns the worker that
+ * processes the flow of the packet, which is the same for both of its
+ * directions; packets that are not IP all go to the first worker
+ */
+static unsigned int worker_index(const uint8_t *packet, size_t length, unsigned int num_workers) {
+    struct key k;
+    if (!flow_key_from_packet(&k, packet, length)) {
+        return 0;
+    }
+    return (flow_key_symmetric_hash(k) >> 32) % num_workers;
+}
+
+void *pcap_reader_worker_thread_func(void *userdata) {
+    struct pcap_reader_worker_context *wc = (struct pcap_reader_worker_context *)userdata;
+    struct pcap_reader_packet_queue *q = wc->queue;
+
+    while (true) {
+        struct pcap_reader_packet &p = q->packets[q->ridx];
+        if (p.used) {
+            __sync_synchronize(); /* read the packet only after seeing the flag */
+            wc->pkt_processor->apply(&p.pi, p.data);
+            if (wc->pkt_processor->metrics) {
+                metrics_increment(wc->pkt_processor->metrics->packets);
+                metrics_add(wc->pkt_processor->metrics->bytes, p.pi.caplen);
+            }
+            wc->packets++;
+            wc->bytes += p.pi.caplen;
+            __sync_synchronize(); /* finish with the packet before releasing it */
+            p.used = 0;
+            q->ridx = (q->ridx + 1) % PCAP_READER_QUEUE_DEPTH;
+        } else if (*wc->done) {
+            __sync_synchronize();
+            if (p.used == 0) {
+                break;
+            }
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * open_and_dispatch_parallel(cfg, of) reads the file in one thread
+ * and divides its packets between cfg->num_threads worker threads,
+ * each of which has its own packet processor and output queue, by a
+ * hash of their flow key, so that each flow is processed by a single
+ * worker, in order.  It is used when JSON records are written, which
+ * the output thread merges in time order.
+ */
+static enum status open_and_dispatch_parallel(struct mercury_config *cfg, struct output_file *of) {
+    struct timer t;
+    timer_start(&t);
+
+    struct pcap_file rf;
+    char input_filename[MAX_FILENAME];
+    enum status status = filename_append(input_filename, cfg->read_filename, "/", NULL);
+    if (status) {
+        return status;
+    }
+    status = pcap_file_open(&rf, input_filename, io_direction_reader, cfg->flags);
+    if (status) {
+        printf("%s: could not open pcap input file %s\n", strerror(errno), cfg->read_filename);
+        return status;
+    }
+
+    int num_workers = cfg->num_threads;
+    struct pcap_reader_worker_context *workers = new (std::nothrow) struct pcap_reader_worker_context[num_workers];
+    if (workers == NULL) {
+        pcap_file_close(&rf);
+        return status_err;
+    }
+    volatile int done = 0;
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].pkt_processor = pkt_proc_new_from_config(cfg, i, &of->qs.queue[i], NULL, NULL);
+        workers[i].queue = (struct pcap_reader_packet_queue *)calloc(1, sizeof(struct pcap_reader_packet_queue));
+        if (workers[i].pkt_processor == NULL || workers[i].queue == NULL) {
+            printf("error: could not initialize frame handler\n");
+            exit(255);
+        }
+        workers[i].done = &done;
+        workers[i].packets = 0;
+        workers[i].bytes = 0;
+    }
+
+    int err = output_thread_start(of);
+    if (err != 0) {
+        printf("%s: error broadcasting all clear on output start condition\n", strerror(err));
+        exit(255);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        err = pthread_create(&workers[i].tid, NULL, pcap_reader_worker_thread_func, &workers[i]);
+        if (err) {
+            printf("%s: error creating file reader thread\n", strerror(err));
+            exit(255);
+        }
+    }
+
+    uint8_t packet_data[PCAP_READER_MAX_PACKET];
+    struct packet_info pi;
+    for (int i = 0; i < cfg->loop_count && sig_close_flag == 0; i++) {
+        do {
+            status = pcap_file_read_packet(&rf, &pi, packet_data);
+            if (status == status_ok) {
+                size_t length = pi.caplen < PCAP_READER_MAX_PACKET ? pi.caplen : PCAP_READER_MAX_PACKET;
+                struct pcap_reader_packet_queue *q = workers[worker_index(packet_data, length, num_workers)].queue;
+                struct pcap_reader_packet &p = q->packets[q->widx];
+                while (p.used) {
+                    sched_yield();   /* wait for the worker to catch up */
+                }
+                __sync_synchronize();
+                p.pi = pi;
+                memcpy(p.data, packet_data, length);
+                __sync_synchronize(); /* write the packet before setting the flag */
+                p.used = 1;
+                q->widx = (q->widx + 1) % PCAP_READER_QUEUE_DEPTH;
+            }
+        } while (status == status_ok && sig_close_flag == 0);
+
+        if (i < cfg->loop_count - 1) {
+            if (fseek(rf.file_ptr, rf.first_record, SEEK_SET) != 0) {
+                perror("error: could not rewind file pointer\n");
+                status = status_err;
+                break;
+            }
+        }
+    }
+    __sync_synchronize();
+    done = 1;
+
+    uint64_t bytes_read = 0;
+    uint64_t packets_read = 0;
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i].tid, NULL);
+        bytes_read += workers[i].bytes;
+        packets_read += workers[i].packets;
+        delete workers[i].pkt_processor;
+        free(workers[i].queue);
+    }
+    delete[] workers;
+    pcap_file_close(&rf);
+
+    uint64_t nano_seconds = timer_stop(&t);
+    if (cfg->verbosity) {
+        double byte_rate = ((double)bytes_read * BILLION) / (double)nano_seconds;
+        fprintf(stderr, "packets read: %" PRIu64 ", bytes read: %" PRIu64 ", threads: %d, nano sec: %" PRIu64 ", bytes per second: %.4e\n",
+                packets_read, bytes_read, num_workers, nano_seconds, byte_rate);
+    }
+
+    if (status == status_err_no_more_data) {
+        return status_ok;
+    }
+    return status;
+}
+
 enum status open_and_dispatch(struct mercury_config *cfg, struct output_file *of) {
+    if (cfg->num_threads > 1 && cfg->read_filename && cfg->write_filename == NULL) {
+        return open_and_dispatch_parallel(cfg, of);
+    }
     enum status status;
     struct timer t;
 	u_int64_t nano_seconds = 0;
@@ -69,7 +233,8 @@ enum status open_and_dispatch(struct mercury_config *cfg, struct output_file *of
 
     struct pcap_reader_thread_context tc;
 
-    status = pcap_reader_thread_context_init_from_config(&tc, cfg, 0, &of->qs.queue[0]);
+    struct ll_queue *pcap_llq = of->pcap_output ? &of->pcap_output->qs.queue[0] : NULL;
+    status = pcap_reader_thread_context_init_from_config(&tc, cfg, 0, &of->qs.queue[0], pcap_llq);
     if (status != status_ok) {
         if (errno) {
             perror("could not initialize pcap reader thread context");
@@ -78,8 +243,7 @@ enum status open_and_dispatch(struct mercury_config *cfg, struct output_file *of
     }
 
     /* Wake up output thread so it's polling the queues waiting for data */
-    of->t_output_p = 1;
-    int err = pthread_cond_broadcast(&(of->t_output_c)); /* Wake up output */
+    int err = output_thread_start(of);
     if (err != 0) {
         printf("%s: error broadcasting all clear on output start condition\n", strerror(err));
         exit(255);
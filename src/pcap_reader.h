@@ -9,6 +9,7 @@
 #include "pcap_file_io.h"
 #include "mercury.h"
 #include "llq.h"
+#include "pkt_proc.h"
 
 /*
  * struct pcap_reader_thread_context holds thread-specific information
@@ -27,10 +28,42 @@ struct pcap_reader_thread_context {
 enum status pcap_reader_thread_context_init_from_config(struct pcap_reader_thread_context *tc,
                                                         struct mercury_config *cfg,
                                                         int tnum,
-                                                        struct ll_queue *llq);
+                                                        struct ll_queue *llq,
+                                                        struct ll_queue *pcap_llq);
 
 void pcap_reader_thread_context_finalize(struct pcap_reader_thread_context *tc);
 
+/*
+ * struct pcap_reader_packet_queue is a single-producer, single-consumer
+ * queue of packets, through which the reader thread passes packets to
+ * a worker thread when a file is read with more than one thread; each
+ * flow is passed to a single worker, so that the packets of a flow are
+ * processed in order (which TLS decryption requires)
+ */
+#define PCAP_READER_QUEUE_DEPTH   256
+#define PCAP_READER_MAX_PACKET  16384   /* as read by pcap_file_read_packet() */
+
+struct pcap_reader_packet {
+    volatile int used;        /* set by the reader, cleared by the worker */
+    struct packet_info pi;
+    uint8_t data[PCAP_READER_MAX_PACKET];
+};
+
+struct pcap_reader_packet_queue {
+    struct pcap_reader_packet packets[PCAP_READER_QUEUE_DEPTH];
+    unsigned int widx;        /* used only by the reader */
+    unsigned int ridx;        /* used only by the worker */
+};
+
+struct pcap_reader_worker_context {
+    struct pkt_proc *pkt_processor;
+    pthread_t tid;
+    struct pcap_reader_packet_queue *queue;
+    volatile int *done;       /* set when the reader has queued every packet */
+    uint64_t packets;
+    uint64_t bytes;
+};
+
 
 enum status open_and_dispatch(struct mercury_config *cfg, struct output_file *of);
 
@@ -14,25 +14,34 @@
 #include "pkt_proc.h"
 #include "utils.h"
 #include "llq.h"
-
-/*
- * packet_filter_threshold is a (somewhat arbitrary) threshold used in
- * the packet metadata filter; it will probably get eliminated soon,
- * in favor of extractor::proto_state::state, but for now it remains
- */
-unsigned int packet_filter_threshold = 7;
+#include "metrics.h"
+#include "os_identification.h"
 
 struct pkt_proc *pkt_proc_new_from_config(struct mercury_config *cfg,
                                           int tnum,
-                                          struct ll_queue *llq) {
+                                          struct ll_queue *llq,
+                                          const char *ingress_interface,
+                                          struct ll_queue *pcap_llq) {
 
     try {
 
         enum status status;
+        struct pkt_proc *pkt_processor;
         char outfile[MAX_FILENAME];
         pid_t pid = tnum;
 
-        if (cfg->write_filename) {
+        if (cfg->write_filename && cfg->fingerprint_filename) {
+            /*
+             * write fingerprints into output file, and packets (or
+             * only those with metadata) into capture file
+             */
+            struct libmerc_config libmerc_cfg = cfg->libmerc;
+            libmerc_cfg.packet_filter_cfg = cfg->packet_filter_cfg;
+            pkt_processor = new pkt_proc_combined_writer_llq(llq, pcap_llq, cfg->libmerc_resources, &libmerc_cfg,
+                                                             cfg->filter, cfg->output_block, cfg->nanosecond,
+                                                             cfg->snaplen, ingress_interface);
+
+        } else if (cfg->write_filename) {
 
             status = filename_append(outfile, cfg->write_filename, "/", NULL);
             if (status) {
@@ -42,17 +51,33 @@ struct pkt_proc *pkt_proc_new_from_config(struct mercury_config *cfg,
                 fprintf(stderr, "initializing thread function %x with filename %s\n", pid, outfile);
             }
 
-            if (cfg->filter) {
+            if (cfg->write_direct) {
+                /*
+                 * write packets to a per-thread capture file, without
+                 * the output thread
+                 */
+                char thread_num[MAX_HEX];
+                snprintf(thread_num, MAX_HEX, "%x", tnum);
+                status = filename_append(outfile, cfg->write_filename, "-", thread_num);
+                if (status) {
+                    throw "error in filename";
+                }
+                if (cfg->verbosity) {
+                    fprintf(stderr, "thread %x writing packets directly to file %s\n", pid, outfile);
+                }
+                pkt_processor = new pkt_proc_pcap_direct_writer(outfile, cfg->flags, cfg->packet_filter_cfg, cfg->filter, cfg->nanosecond, cfg->snaplen);
+
+            } else if (cfg->filter) {
                 /*
                  * write only packet metadata (TLS clientHellos, TCP SYNs, ...) to capture file
                  */
-                return new pkt_proc_filter_pcap_writer_llq(llq, cfg->packet_filter_cfg, cfg->output_block);
+                pkt_processor = new pkt_proc_filter_pcap_writer_llq(llq, cfg->packet_filter_cfg, cfg->output_block, cfg->nanosecond, cfg->snaplen);
 
             } else {
                 /*
                  * write all packets to capture file
                  */
-                return new pkt_proc_pcap_writer_llq(llq, cfg->output_block);
+                pkt_processor = new pkt_proc_pcap_writer_llq(llq, cfg->output_block, cfg->nanosecond);
 
             }
 
@@ -61,12 +86,18 @@ struct pkt_proc *pkt_proc_new_from_config(struct mercury_config *cfg,
              * write fingerprints into output file
              */
 
-            return new pkt_proc_json_writer_llq(llq, cfg->packet_filter_cfg);
+            struct libmerc_config libmerc_cfg = cfg->libmerc;
+            libmerc_cfg.packet_filter_cfg = cfg->packet_filter_cfg;
+            pkt_processor = new pkt_proc_json_writer_llq(llq, cfg->libmerc_resources, &libmerc_cfg, ingress_interface);
 
         }
         // note: we no longer have a 'packet dumper' option
         //    return new pkt_proc_dumper();
 
+        pkt_processor->metrics = metrics_get_thread(tnum);
+        pkt_processor->os_queue = os_identification_get_thread(tnum);
+        return pkt_processor;
+
     }
     catch (const char *s) {
         fprintf(stdout, "error: %s\n", s);
@@ -24,8 +24,6 @@ struct packet_info {
   uint32_t len;        /* length this packet (off wire) */
 };
 
-extern unsigned int packet_filter_threshold;
-
 struct pkt_proc_stats {
     size_t bytes_written;
     size_t packets_written;
@@ -43,6 +41,8 @@ struct pkt_proc {
     virtual ~pkt_proc() {};
     size_t bytes_written = 0;
     size_t packets_written = 0;
+    struct thread_metrics *metrics = NULL;  /* this thread's counters, if any */
+    struct os_observation_queue *os_queue = NULL;  /* for OS identification, if any */
 };
 
 /*
@@ -53,28 +53,35 @@ struct pkt_proc {
  */
 struct pkt_proc_json_writer_llq : public pkt_proc {
     struct ll_queue *llq;
-    struct packet_filter pf;
+    struct mercury_context *ctx;
+    const char *ingress_interface;  /* included in each record, if not NULL */
     // struct tcp_reassembler reassembler;
 
     /*
-     * pkt_proc_json_writer(outfile_name, mode, max_records)
-     * initializes object to write a single JSON line containing the
-     * flow key, time, fingerprints, and metadata to the output file
-     * with the path outfile_name and mode passed as arguments; that
-     * file is opened by this invocation, with that mode.  If
-     * max_records is nonzero, then it defines the maximum number of
-     * records (lines) per file; after that limit is reached, file
-     * rotation will take place.
+     * pkt_proc_json_writer_llq(llq_ptr, resources, config, interface)
+     * initializes an object to write a single JSON line containing
+     * the flow key, time, fingerprints, and metadata of each packet
+     * into the queue llq_ptr, through a libmerc context of its own
+     * that uses the shared analysis resources (which may be NULL if
+     * analysis is not configured) and the configuration config.
      */
-    explicit pkt_proc_json_writer_llq(struct ll_queue *llq_ptr, const char *filter) { //: reassembler{} {
+    explicit pkt_proc_json_writer_llq(struct ll_queue *llq_ptr,
+                                      const struct mercury_resources *resources,
+                                      const struct libmerc_config *config,
+                                      const char *interface=NULL) : ingress_interface{interface} { //: reassembler{} {
         llq = llq_ptr;
-        if (packet_filter_init(&pf, filter) == status_err) {
-            throw "could not initialize packet filter";
+        ctx = mercury_context_init(resources, config);
+        if (ctx == NULL) {
+            throw "could not initialize libmerc context";
         }
     }
 
+    ~pkt_proc_json_writer_llq() {
+        mercury_context_finalize(ctx);
+    }
+
     void apply(struct packet_info *pi, uint8_t *eth) override {
-        json_queue_write(llq, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec);
+        json_queue_write(llq, ctx, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec, ingress_interface, metrics, os_queue);
     }
 
     void flush() override {
@@ -82,6 +89,94 @@ struct pkt_proc_json_writer_llq : public pkt_proc {
     }
 };
 
+/*
+ * struct pkt_proc_combined_writer_llq represents a packet processing
+ * object that writes JSON records into one queue, as
+ * pkt_proc_json_writer_llq does, and packets into another, as
+ * pkt_proc_filter_pcap_writer_llq (or, if filter is false,
+ * pkt_proc_pcap_writer_llq) does.  Each packet is parsed only once:
+ * the packets written are selected by the classification that was
+ * made while writing their JSON records (see struct packet_summary),
+ * rather than by a packet_filter, except when TCP initial messages
+ * are selected, which requires the flow tracking of the packet_filter.
+ */
+struct pkt_proc_combined_writer_llq : public pkt_proc {
+    struct ll_queue *json_llq;
+    struct ll_queue *pcap_llq;
+    struct mercury_context *ctx;
+    const char *ingress_interface;  /* included in each record, if not NULL */
+    struct protocol_selection selection;
+    struct packet_filter pf;
+    bool filter;       /* write only selected packets */
+    bool block;
+    bool nanosecond;   /* write nanosecond timestamps */
+    int snaplen;       /* as in pkt_proc_filter_pcap_writer_llq */
+
+    pkt_proc_combined_writer_llq(struct ll_queue *json_llq_ptr,
+                                 struct ll_queue *pcap_llq_ptr,
+                                 const struct mercury_resources *resources,
+                                 const struct libmerc_config *config,
+                                 bool use_filter,
+                                 bool blocking,
+                                 bool nsec=false,
+                                 int snap=-1,
+                                 const char *interface=NULL) :
+        json_llq{json_llq_ptr},
+        pcap_llq{pcap_llq_ptr},
+        ingress_interface{interface},
+        filter{use_filter},
+        block{blocking},
+        nanosecond{nsec},
+        snaplen{snap} {
+
+        if (protocol_selection_init(&selection, config->packet_filter_cfg) != status_ok) {
+            throw "could not initialize packet filter";
+        }
+        if (filter && selection.tcp_message && packet_filter_init(&pf, config->packet_filter_cfg) == status_err) {
+            throw "could not initialize packet filter";
+        }
+        ctx = mercury_context_init(resources, config);
+        if (ctx == NULL) {
+            throw "could not initialize libmerc context";
+        }
+    }
+
+    ~pkt_proc_combined_writer_llq() {
+        mercury_context_finalize(ctx);
+    }
+
+    void apply(struct packet_info *pi, uint8_t *eth) override {
+        struct packet_summary summary;
+        json_queue_write(json_llq, ctx, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec, ingress_interface, metrics, os_queue, &summary);
+
+        if (rnd_pkt_drop_enabled && drop_this_packet(eth, pi->len)) {
+            return;  /* adaptive packet drop configured, and this packet's flow got selected to be discarded */
+        }
+        size_t length = pi->len;
+        if (filter) {
+            if (selection.tcp_message) {
+                if (!packet_filter_apply(&pf, eth, length)) {
+                    return;
+                }
+                if (snaplen >= 0) {
+                    length = packet_filter_truncated_length(&pf, eth, length, snaplen);
+                }
+            } else {
+                if (!packet_summary_is_selected(summary, selection)) {
+                    return;
+                }
+                if (snaplen >= 0) {
+                    length = message_truncated_length(eth, length, summary.msg_type, summary.payload, snaplen);
+                }
+            }
+        }
+        pcap_queue_write(pcap_llq, eth, length, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec, block, nanosecond, metrics);
+    }
+
+    void flush() override {
+    }
+};
+
 /*
  * struct pkt_proc_pcap_writer represents a packet processing object
  * that writes out packets in PCAP file format.
@@ -89,18 +184,17 @@ struct pkt_proc_json_writer_llq : public pkt_proc {
 struct pkt_proc_pcap_writer_llq : public pkt_proc {
     struct ll_queue *llq;
     bool block;
+    bool nanosecond;   /* write nanosecond timestamps */
 
-    explicit pkt_proc_pcap_writer_llq(struct ll_queue *llq_ptr, bool blocking) : block{blocking} {
+    explicit pkt_proc_pcap_writer_llq(struct ll_queue *llq_ptr, bool blocking, bool nsec=false) : block{blocking}, nanosecond{nsec} {
         llq = llq_ptr;
     }
 
     void apply(struct packet_info *pi, uint8_t *eth) override {
-        extern int rnd_pkt_drop_percent_accept;  /* defined in rnd_pkt_drop.c */
-
-        if (rnd_pkt_drop_percent_accept && drop_this_packet()) {
-            return;  /* random packet drop configured, and this packet got selected to be discarded */
+        if (rnd_pkt_drop_enabled && drop_this_packet(eth, pi->len)) {
+            return;  /* adaptive packet drop configured, and this packet's flow got selected to be discarded */
         }
-        pcap_queue_write(llq, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000, block);
+        pcap_queue_write(llq, eth, pi->len, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec, block, nanosecond, metrics);
     }
 
     void flush() override {
@@ -122,20 +216,18 @@ struct pkt_proc_pcap_writer : public pkt_proc {
      * and flags passed as arguments; that file is opened by this
      * invocation, with those flags.
      */
-    pkt_proc_pcap_writer(const char *outfile, int flags) {
-        enum status status = pcap_file_open(&pcap_file, outfile, io_direction_writer, flags);
+    pkt_proc_pcap_writer(const char *outfile, int flags, bool nanosecond=false) {
+        enum status status = pcap_file_open(&pcap_file, outfile, io_direction_writer, flags, nanosecond);
         if (status) {
             throw "could not open PCAP output file";
         }
     }
 
     void apply(struct packet_info *pi, uint8_t *eth) override {
-        extern int rnd_pkt_drop_percent_accept;  /* defined in rnd_pkt_drop.c */
-
-        if (rnd_pkt_drop_percent_accept && drop_this_packet()) {
-            return;  /* random packet drop configured, and this packet got selected to be discarded */
+        if (rnd_pkt_drop_enabled && drop_this_packet(eth, pi->len)) {
+            return;  /* adaptive packet drop configured, and this packet's flow got selected to be discarded */
         }
-        pcap_file_write_packet_direct(&pcap_file, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000);
+        pcap_file_write_packet_direct(&pcap_file, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec);
     }
 
     void flush() override {
@@ -164,8 +256,8 @@ struct pkt_proc_filter_pcap_writer : public pkt_proc {
      */
     unsigned int packet_filter_threshold = 8;
 
-    pkt_proc_filter_pcap_writer(const char *outfile, int flags) {
-        enum status status = pcap_file_open(&pcap_file, outfile, io_direction_writer, flags);
+    pkt_proc_filter_pcap_writer(const char *outfile, int flags, bool nanosecond=false) {
+        enum status status = pcap_file_open(&pcap_file, outfile, io_direction_writer, flags, nanosecond);
         if (status) {
             throw "could not open PCAP output file";
         }
@@ -175,15 +267,13 @@ struct pkt_proc_filter_pcap_writer : public pkt_proc {
         uint8_t *packet = eth;
         unsigned int length = pi->len;
 
-        extern int rnd_pkt_drop_percent_accept;  /* defined in rnd_pkt_drop.c */
-
-        if (rnd_pkt_drop_percent_accept && drop_this_packet()) {
-            return;  /* random packet drop configured, and this packet got selected to be discarded */
+        if (rnd_pkt_drop_enabled && drop_this_packet(eth, pi->len)) {
+            return;  /* adaptive packet drop configured, and this packet's flow got selected to be discarded */
         }
 
         struct packet_filter pf;
         if (packet_filter_apply(&pf, packet, length)) {
-            pcap_file_write_packet_direct(&pcap_file, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000);
+            pcap_file_write_packet_direct(&pcap_file, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec);
         }
     }
 
@@ -201,13 +291,18 @@ struct pkt_proc_filter_pcap_writer : public pkt_proc {
 /*
  * struct pkt_proc_filter_pcap_writer represents a packet processing
  * object that first filters packets, then writes tem out in PCAP file
- * format.
+ * format.  If snaplen is not negative, each packet is truncated to its
+ * headers, the protocol message that the filter recognized, and at
+ * most snaplen bytes of other payload (see
+ * packet_filter_truncated_length()).
  */
 struct pkt_proc_filter_pcap_writer_llq : public pkt_proc {
     struct ll_queue *llq;
     struct packet_filter pf;
     bool block;
-    
+    bool nanosecond;   /* write nanosecond timestamps */
+    int snaplen;       /* bytes of unrecognized payload kept, or -1 for all */
+
     /*
      * packet_filter_threshold is a (somewhat arbitrary) threshold used in
      * the packet metadata filter; it will probably get eliminated soon,
@@ -215,7 +310,7 @@ struct pkt_proc_filter_pcap_writer_llq : public pkt_proc {
      */
     unsigned int packet_filter_threshold = 8;
 
-    explicit pkt_proc_filter_pcap_writer_llq(struct ll_queue *llq_ptr, const char *filter, bool blocking) : block{blocking} {
+    explicit pkt_proc_filter_pcap_writer_llq(struct ll_queue *llq_ptr, const char *filter, bool blocking, bool nsec=false, int snap=-1) : block{blocking}, nanosecond{nsec}, snaplen{snap} {
         llq = llq_ptr;
         if (packet_filter_init(&pf, filter) == status_err) {
             throw "could not initialize packet filter";
@@ -226,18 +321,70 @@ struct pkt_proc_filter_pcap_writer_llq : public pkt_proc {
         uint8_t *packet = eth;
         unsigned int length = pi->len;
 
-        extern int rnd_pkt_drop_percent_accept;  /* defined in rnd_pkt_drop.c */
-
-        if (rnd_pkt_drop_percent_accept && drop_this_packet()) {
-            return;  /* random packet drop configured, and this packet got selected to be discarded */
+        if (rnd_pkt_drop_enabled && drop_this_packet(eth, pi->len)) {
+            return;  /* adaptive packet drop configured, and this packet's flow got selected to be discarded */
         }
 
         if (packet_filter_apply(&pf, packet, length)) {
-            pcap_queue_write(llq, eth, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec / 1000, block);
+            if (snaplen >= 0) {
+                length = packet_filter_truncated_length(&pf, packet, length, snaplen);
+            }
+            pcap_queue_write(llq, eth, length, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec, block, nanosecond, metrics);
+        }
+    }
+
+    void flush() override {
+    }
+
+};
+
+/*
+ * struct pkt_proc_pcap_direct_writer represents a packet processing
+ * object that writes packets (optionally, only those selected by a
+ * packet filter) into its own PCAP file, bypassing the lockless queue
+ * and the output thread, using large page-aligned writes; see struct
+ * pcap_direct_file.  Each capture thread has its own file, so packets
+ * are not merged into time order across threads.
+ */
+struct pkt_proc_pcap_direct_writer : public pkt_proc {
+    struct pcap_direct_file pcap_file;
+    struct packet_filter pf;
+    bool filter;
+    int snaplen;       /* as in pkt_proc_filter_pcap_writer_llq */
+
+    pkt_proc_pcap_direct_writer(const char *outfile, int flags, const char *filter_cfg, bool use_filter, bool nanosecond=false, int snap=-1) : filter{use_filter}, snaplen{snap} {
+        if (filter && packet_filter_init(&pf, filter_cfg) == status_err) {
+            throw "could not initialize packet filter";
+        }
+        if (pcap_direct_file_open(&pcap_file, outfile, flags, nanosecond) != status_ok) {
+            throw "could not open PCAP output file";
+        }
+    }
+
+    ~pkt_proc_pcap_direct_writer() {
+        pcap_direct_file_close(&pcap_file);
+        bytes_written = pcap_file.bytes_written;
+        packets_written = pcap_file.packets_written;
+    }
+
+    void apply(struct packet_info *pi, uint8_t *eth) override {
+        if (rnd_pkt_drop_enabled && drop_this_packet(eth, pi->len)) {
+            return;  /* adaptive packet drop configured, and this packet's flow got selected to be discarded */
+        }
+        size_t length = pi->len;
+        if (filter) {
+            if (!packet_filter_apply(&pf, eth, length)) {
+                return;
+            }
+            if (snaplen >= 0) {
+                length = packet_filter_truncated_length(&pf, eth, length, snaplen);
+            }
         }
+        pcap_direct_file_write_packet(&pcap_file, eth, length, pi->len, pi->ts.tv_sec, pi->ts.tv_nsec);
     }
 
     void flush() override {
+        pcap_direct_file_flush(&pcap_file);
     }
 
 };
@@ -260,13 +407,19 @@ struct pkt_proc_dumper : public pkt_proc {
 
 /*
  * the function pkt_proc_new_from_config() takes as input a
- * configuration structure, a thread number, and a pointer to a
- * fileset identifier, and returns a pointer to a new packet processor
- * object.  This is a factory function that chooses what type of class
- * to return based on the details of the configuration.
+ * configuration structure, a thread number, a pointer to a
+ * fileset identifier, the name of the interface on which packets
+ * are captured (or NULL if it need not be reported), and, when both
+ * JSON and PCAP output are configured, a second fileset identifier
+ * for the packets, and returns a pointer to a new packet processor
+ * object.  This is a factory
+ * function that chooses what type of class to return based on the
+ * details of the configuration.
  */
 struct pkt_proc *pkt_proc_new_from_config(struct mercury_config *cfg,
                                           int tnum,
-                                          struct ll_queue *llq);
+                                          struct ll_queue *llq,
+                                          const char *ingress_interface=NULL,
+                                          struct ll_queue *pcap_llq=NULL);
 
 #endif /* PKT_PROC_H */
@@ -0,0 +1,212 @@
+/*
+ * public_suffix.h
+ *
+ * registered domain extraction with the public suffix list
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef PUBLIC_SUFFIX_H
+#define PUBLIC_SUFFIX_H
+
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "datum.h"
+
+/*
+ * class public_suffix_list holds the rules of the public suffix list
+ * (https://publicsuffix.org/list/) as a trie of labels, from the
+ * rightmost label of a rule to the leftmost, so that the public
+ * suffix of a domain name can be found by following its labels from
+ * right to left, in a single pass over the name, without copying it.
+ *
+ * The rules are interpreted as in the equivalence classes of
+ * pmercury (python/pmercury/utils/eqv_classes.py), which compute the
+ * classes_hostname_domains of the fingerprint database: the last
+ * label of a name is always a public suffix, a wildcard rule *.x is
+ * treated as the rule x, and exception rules are ignored.  With no
+ * rules, every public suffix is a single label, and the registered
+ * domain of a name is its last two labels.
+ */
+class public_suffix_list {
+
+    struct edge {
+        uint32_t label;       /* offset of label in labels */
+        uint32_t label_len;
+        uint32_t node;        /* index of child node in nodes */
+    };
+
+    struct node {
+        uint32_t first_edge;  /* edges of node are edges[first_edge, first_edge + num_edges) */
+        uint32_t num_edges;   /* sorted by label */
+        bool suffix;          /* path from root to node is a rule */
+    };
+
+    std::string labels;
+    std::vector<struct edge> edges;
+    std::vector<struct node> nodes{ { 0, 0, true } };
+    size_t num_rules = 0;
+
+    /*
+     * struct trie_builder is the trie as it is built, one rule at a
+     * time, before it is flattened into nodes and edges
+     */
+    struct trie_builder {
+        std::map<std::string, struct trie_builder> children;
+        bool suffix = false;
+    };
+
+    // find_child(n, label, len) returns the index of the child of
+    // node n with the given label, or 0 (the root, which is never a
+    // child) if there is none
+    uint32_t find_child(const struct node &n, const char *label, size_t len) const {
+        uint32_t lo = n.first_edge;
+        uint32_t hi = n.first_edge + n.num_edges;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            const struct edge &e = edges[mid];
+            int cmp = memcmp(&labels[e.label], label, e.label_len < len ? e.label_len : len);
+            if (cmp == 0) {
+                if (e.label_len == len) {
+                    return e.node;
+                }
+                cmp = e.label_len < len ? -1 : 1;
+            }
+            if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return 0;
+    }
+
+    // suffix_start(name, len, &labels_before) returns the offset in
+    // name of the longest public suffix of name, and sets
+    // labels_before to the number of labels that precede it
+    size_t suffix_start(const char *name, size_t len, size_t *labels_before) const {
+        const char *label_end = name + len;
+        const char *suffix = name;
+        const struct node *n = &nodes[0];
+        bool matching = true;
+        size_t labels_before_suffix = 0;
+        size_t num_labels = 0;
+        while (true) {
+            const char *label = (const char *)memrchr(name, '.', label_end - name);
+            label = label ? label + 1 : name;
+            num_labels++;
+            if (matching) {
+                uint32_t child = find_child(*n, label, label_end - label);
+                if (child == 0) {
+                    matching = false;
+                } else {
+                    n = &nodes[child];
+                }
+                if (num_labels == 1 || (matching && n->suffix)) {
+                    suffix = label;
+                    labels_before_suffix = num_labels;
+                }
+            }
+            if (label == name) {
+                break;
+            }
+            label_end = label - 1;
+        }
+        *labels_before = num_labels - labels_before_suffix;
+        return suffix - name;
+    }
+
+    // flatten(b, index) writes the children of the builder node b,
+    // whose node is nodes[index], then their children, and so on
+    void flatten(const struct trie_builder &b, uint32_t index) {
+        nodes[index].first_edge = edges.size();
+        nodes[index].num_edges = b.children.size();
+        uint32_t first_child = nodes.size();
+        for (const auto &child : b.children) {
+            edges.push_back({ (uint32_t)labels.size(), (uint32_t)child.first.size(), (uint32_t)nodes.size() });
+            labels.append(child.first);
+            nodes.push_back({ 0, 0, child.second.suffix });
+        }
+        for (const auto &child : b.children) {
+            flatten(child.second, first_child++);
+        }
+    }
+
+public:
+
+    /*
+     * load(filename) reads the rules from a public suffix list file
+     * (which may be gzip compressed), replacing any rules already
+     * loaded; it returns true on success, and false (leaving the list
+     * empty) if the file could not be read
+     */
+    bool load(const char *filename) {
+        clear();
+        gzFile in_file = gzopen(filename, "r");
+        if (in_file == NULL) {
+            return false;
+        }
+        struct trie_builder root;
+        char line[1024];
+        while (gzgets(in_file, line, sizeof(line)) != NULL) {
+            char *rule = line + strspn(line, " \t");
+            rule[strcspn(rule, " \t\r\n")] = '\0';
+            if (rule[0] == '\0' || rule[0] == '!' || strncmp(rule, "//", 2) == 0) {
+                continue;
+            }
+            if (strncmp(rule, "*.", 2) == 0) {
+                rule += 2;
+            }
+            struct trie_builder *b = &root;
+            char *label_end = rule + strlen(rule);
+            while (true) {
+                char *label = (char *)memrchr(rule, '.', label_end - rule);
+                label = label ? label + 1 : rule;
+                b = &b->children[std::string(label, label_end - label)];
+                if (label == rule) {
+                    break;
+                }
+                label_end = label - 1;
+            }
+            if (!b->suffix) {
+                b->suffix = true;
+                num_rules++;
+            }
+        }
+        gzclose(in_file);
+        flatten(root, 0);
+        return true;
+    }
+
+    void clear() {
+        labels.clear();
+        edges.clear();
+        nodes.assign(1, { 0, 0, true });
+        num_rules = 0;
+    }
+
+    size_t size() const { return num_rules; }
+
+    /*
+     * registered_domain(name, len) returns the registered domain of
+     * name, that is, its longest public suffix and the label before
+     * that (or all of name, if the suffix is all of it), as a datum
+     * that points into name
+     */
+    struct datum registered_domain(const char *name, size_t len) const {
+        size_t labels_before;
+        size_t start = suffix_start(name, len, &labels_before);
+        if (labels_before > 0) {
+            const char *dot = (const char *)memrchr(name, '.', start - 1);
+            start = dot ? dot + 1 - name : 0;
+        }
+        return datum{(const unsigned char *)name + start, (const unsigned char *)name + len};
+    }
+};
+
+#endif /* PUBLIC_SUFFIX_H */
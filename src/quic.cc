@@ -0,0 +1,572 @@
+/*
+ * quic.cc
+ *
+ * QUIC Initial packet processing (RFC 9000, RFC 9001, RFC 9369)
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <string.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include "extractor.h"
+#include "json_object.h"
+#include "quic.h"
+
+/*
+ * struct quic_version_parameters holds the values that differ between
+ * the versions of QUIC in the derivation of the Initial keys, and the
+ * type of Initial packets
+ */
+struct quic_version_parameters {
+    uint8_t salt[20];
+    const char *key_label;
+    const char *iv_label;
+    const char *hp_label;
+    uint8_t initial_type;
+};
+
+static const struct quic_version_parameters quic_v1 = {
+    { 0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+      0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a },
+    "quic key", "quic iv", "quic hp", 0
+};
+
+static const struct quic_version_parameters quic_v2 = {
+    { 0x0d, 0xed, 0xe3, 0xde, 0xf7, 0x00, 0xa6, 0xdb, 0x81, 0x93,
+      0x81, 0xbe, 0x6e, 0x26, 0x9d, 0xcb, 0xf9, 0xbd, 0x2e, 0xd9 },
+    "quicv2 key", "quicv2 iv", "quicv2 hp", 1
+};
+
+static const struct quic_version_parameters quic_draft_29 = {
+    { 0xaf, 0xbf, 0xec, 0x28, 0x99, 0x93, 0xd2, 0x4c, 0x9e, 0x97,
+      0x86, 0xf1, 0x9c, 0x61, 0x11, 0xe0, 0x43, 0x90, 0xa8, 0x99 },
+    "quic key", "quic iv", "quic hp", 0
+};
+
+static const struct quic_version_parameters quic_draft_23 = {
+    { 0xc3, 0xee, 0xf7, 0x12, 0xc7, 0x2e, 0xbb, 0x5a, 0x11, 0xa7,
+      0xd2, 0x43, 0x2b, 0xb4, 0x63, 0x65, 0xbe, 0xf9, 0xf5, 0x02 },
+    "quic key", "quic iv", "quic hp", 0
+};
+
+static const struct quic_version_parameters quic_draft_22 = {
+    { 0x7f, 0xbc, 0xdb, 0x0e, 0x7c, 0x66, 0xbb, 0xe9, 0x19, 0x3a,
+      0x96, 0xcd, 0x21, 0x51, 0x9e, 0xbd, 0x7a, 0x02, 0x64, 0x4a },
+    "quic key", "quic iv", "quic hp", 0
+};
+
+/*
+ * quic_version_parameters_get(version) returns the parameters of a
+ * version, or NULL if it is not known
+ */
+static const struct quic_version_parameters *quic_version_parameters_get(uint32_t version) {
+    switch (version) {
+    case 0x00000001:
+        return &quic_v1;
+    case 0x6b3343cf:
+        return &quic_v2;
+    case 0xff00001d:   /* draft-29 through draft-32 */
+    case 0xff00001e:
+    case 0xff00001f:
+    case 0xff000020:
+        return &quic_draft_29;
+    case 0xff000017:   /* draft-23 through draft-28 */
+    case 0xff000018:
+    case 0xff000019:
+    case 0xff00001a:
+    case 0xff00001b:
+    case 0xff00001c:
+        return &quic_draft_23;
+    case 0xff000016:
+        return &quic_draft_22;
+    default:
+        ;
+    }
+    return NULL;
+}
+
+#define L_QUIC_Version           4
+#define QUIC_LONG_HEADER         0x80
+#define QUIC_PN_LENGTH_MASK      0x03
+#define QUIC_SAMPLE_OFFSET       4     /* from the start of the packet number */
+#define QUIC_SAMPLE_LENGTH       16
+#define QUIC_TAG_LENGTH          16
+
+/*
+ * read_varint(d, value) reads a variable-length integer (RFC 9000,
+ * Section 16), whose length is given by the two most significant bits
+ * of its first byte
+ */
+static bool read_varint(struct datum &d, uint64_t *value) {
+    uint8_t first;
+    if (!d.read_uint8(&first)) {
+        return false;
+    }
+    size_t num_bytes = (size_t)1 << (first >> 6);
+    uint64_t tmp = first & 0x3f;
+    if (d.length() < (ssize_t)(num_bytes - 1)) {
+        d.set_null();
+        return false;
+    }
+    for (size_t i = 1; i < num_bytes; i++) {
+        tmp = (tmp << 8) | *d.data++;
+    }
+    *value = tmp;
+    return true;
+}
+
+void quic_initial_packet::parse(struct datum &d) {
+    const uint8_t *start = d.data;
+
+    if (!d.read_uint8(&connection_info) || (connection_info & QUIC_LONG_HEADER) == 0) {
+        return;
+    }
+    if (!d.read_uint32(&version)) {
+        return;
+    }
+    const struct quic_version_parameters *params = quic_version_parameters_get(version);
+    if (params == NULL || ((connection_info >> 4) & 0x03) != params->initial_type) {
+        return;
+    }
+    uint8_t cid_len;
+    if (!d.read_uint8(&cid_len) || cid_len > QUIC_MAX_CID_LEN) {
+        return;
+    }
+    dcid.parse(d, cid_len);
+    if (!d.read_uint8(&cid_len) || cid_len > QUIC_MAX_CID_LEN) {
+        return;
+    }
+    scid.parse(d, cid_len);
+    uint64_t token_len;
+    if (!read_varint(d, &token_len) || token_len > (uint64_t)d.length()) {
+        return;
+    }
+    token.parse(d, token_len);
+    uint64_t length;
+    if (!read_varint(d, &length) || length > (uint64_t)d.length()) {
+        return;
+    }
+    if (length < QUIC_SAMPLE_OFFSET + QUIC_SAMPLE_LENGTH) {
+        return;
+    }
+    header = { start, d.data };
+    payload.parse(d, length);
+}
+
+bool quic_initial_packet::is_initial(const uint8_t *data, size_t len) {
+    if (len < 1 + L_QUIC_Version || (data[0] & QUIC_LONG_HEADER) == 0) {
+        return false;
+    }
+    uint32_t version = ((uint32_t)data[1] << 24) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 8) | data[4];
+    const struct quic_version_parameters *params = quic_version_parameters_get(version);
+    return params != NULL && ((data[0] >> 4) & 0x03) == params->initial_type;
+}
+
+/*
+ * hkdf_expand_label(secret, label, out, out_len) implements
+ * HKDF-Expand-Label from RFC 8446, Section 7.1, with SHA-256 and an
+ * empty context, for outputs of at most one hash length
+ */
+static bool hkdf_expand_label(const uint8_t *secret, const char *label, uint8_t *out, size_t out_len) {
+    const char prefix[] = "tls13 ";
+    size_t label_len = strlen(label);
+    uint8_t info[2 + 1 + sizeof(prefix) - 1 + 32 + 1 + 1];
+    if (out_len > SHA256_DIGEST_LENGTH || label_len > 32) {
+        return false;
+    }
+    size_t i = 0;
+    info[i++] = 0;
+    info[i++] = out_len;
+    info[i++] = sizeof(prefix) - 1 + label_len;
+    memcpy(info + i, prefix, sizeof(prefix) - 1);
+    i += sizeof(prefix) - 1;
+    memcpy(info + i, label, label_len);
+    i += label_len;
+    info[i++] = 0;      /* context length */
+    info[i++] = 1;      /* HKDF-Expand block counter */
+
+    uint8_t block[SHA256_DIGEST_LENGTH];
+    unsigned int block_len = sizeof(block);
+    if (HMAC(EVP_sha256(), secret, SHA256_DIGEST_LENGTH, info, i, block, &block_len) == NULL) {
+        return false;
+    }
+    memcpy(out, block, out_len);
+    return true;
+}
+
+bool quic_initial_keys_init(struct quic_initial_keys &keys, uint32_t version, const struct datum &dcid, bool server) {
+    const struct quic_version_parameters *params = quic_version_parameters_get(version);
+    if (params == NULL) {
+        return false;
+    }
+    uint8_t initial_secret[SHA256_DIGEST_LENGTH];
+    unsigned int secret_len = sizeof(initial_secret);
+    if (HMAC(EVP_sha256(), params->salt, sizeof(params->salt), dcid.data, dcid.length(), initial_secret, &secret_len) == NULL) {
+        return false;
+    }
+    uint8_t secret[SHA256_DIGEST_LENGTH];
+    return hkdf_expand_label(initial_secret, server ? "server in" : "client in", secret, sizeof(secret))
+        && hkdf_expand_label(secret, params->key_label, keys.key, sizeof(keys.key))
+        && hkdf_expand_label(secret, params->iv_label, keys.iv, sizeof(keys.iv))
+        && hkdf_expand_label(secret, params->hp_label, keys.hp, sizeof(keys.hp));
+}
+
+bool quic_connection_keys::client_sent(const struct quic_initial_packet &pkt) const {
+    return valid
+        && version == pkt.version
+        && dcid_len == pkt.dcid.length()
+        && memcmp(dcid, pkt.dcid.data, dcid_len) == 0;
+}
+
+bool quic_connection_keys::server_sent(const struct quic_initial_packet &pkt) const {
+    return valid
+        && version == pkt.version
+        && scid_len > 0
+        && scid_len == pkt.dcid.length()
+        && memcmp(scid, pkt.dcid.data, scid_len) == 0;
+}
+
+bool quic_header_protection_mask(EVP_CIPHER_CTX *ctx, const uint8_t *hp, const uint8_t *sample, uint8_t *mask) {
+    uint8_t block[QUIC_SAMPLE_LENGTH];
+    int len = 0;
+    if (EVP_EncryptInit_ex(ctx, NULL, NULL, hp, NULL) != 1
+        || EVP_EncryptUpdate(ctx, block, &len, sample, QUIC_SAMPLE_LENGTH) != 1
+        || len != QUIC_SAMPLE_LENGTH) {
+        return false;
+    }
+    memcpy(mask, block, 5);
+    return true;
+}
+
+quic_initial_processor::quic_initial_processor() :
+    gcm{EVP_CIPHER_CTX_new()},
+    ecb{EVP_CIPHER_CTX_new()},
+    gcm_generation{0},
+    next_generation{1},
+    keys{},
+    new_keys{},
+    next_stream{0} {
+
+    if (gcm == NULL || ecb == NULL
+        || EVP_DecryptInit_ex(gcm, EVP_aes_128_gcm(), NULL, NULL, NULL) != 1
+        || EVP_EncryptInit_ex(ecb, EVP_aes_128_ecb(), NULL, NULL, NULL) != 1) {
+        EVP_CIPHER_CTX_free(gcm);
+        EVP_CIPHER_CTX_free(ecb);
+        gcm = ecb = NULL;
+        return;
+    }
+    EVP_CIPHER_CTX_set_padding(ecb, 0);
+}
+
+quic_initial_processor::~quic_initial_processor() {
+    EVP_CIPHER_CTX_free(gcm);
+    EVP_CIPHER_CTX_free(ecb);
+}
+
+bool quic_initial_processor::decrypt(const struct quic_initial_packet &pkt, struct datum &out, bool &from_server) {
+    if (pkt.is_not_empty() == false || is_valid() == false) {
+        return false;
+    }
+
+    /*
+     * use the keys of the last connection, if the packet belongs to
+     * it, or derive new ones, which are kept if the packet can be
+     * authenticated
+     */
+    struct quic_initial_keys *k;
+    from_server = false;
+    if (keys.client_sent(pkt)) {
+        k = &keys.client;
+    } else if (keys.server_sent(pkt)) {
+        if (keys.server.generation == 0) {
+            if (!quic_initial_keys_init(keys.server, keys.version, datum{keys.dcid, keys.dcid + keys.dcid_len}, true)) {
+                return false;
+            }
+            keys.server.generation = next_generation++;
+        }
+        k = &keys.server;
+        from_server = true;
+    } else {
+        if (!quic_initial_keys_init(new_keys, pkt.version, pkt.dcid)) {
+            return false;
+        }
+        new_keys.generation = next_generation++;
+        k = &new_keys;
+    }
+
+    /*
+     * remove header protection (RFC 9001, Section 5.4)
+     */
+    const uint8_t *pn = pkt.payload.data;
+    uint8_t mask[5];
+    if (!quic_header_protection_mask(ecb, k->hp, pn + QUIC_SAMPLE_OFFSET, mask)) {
+        return false;
+    }
+    uint8_t first = pkt.connection_info ^ (mask[0] & 0x0f);
+    size_t pn_len = (first & QUIC_PN_LENGTH_MASK) + 1;
+    if (pkt.payload.length() < (ssize_t)(pn_len + QUIC_TAG_LENGTH)) {
+        return false;
+    }
+    uint8_t packet_number[4];
+    uint8_t nonce[sizeof(k->iv)];
+    memcpy(nonce, k->iv, sizeof(nonce));
+    for (size_t i = 0; i < pn_len; i++) {
+        packet_number[i] = pn[i] ^ mask[1 + i];
+        nonce[sizeof(nonce) - pn_len + i] ^= packet_number[i];
+    }
+
+    /*
+     * decrypt and authenticate the payload, with the unprotected
+     * header as the associated data
+     */
+    const uint8_t *ciphertext = pn + pn_len;
+    size_t ciphertext_len = pkt.payload.length() - pn_len - QUIC_TAG_LENGTH;
+    if (ciphertext_len > sizeof(plaintext)) {
+        return false;
+    }
+    bool set_key = (gcm_generation != k->generation);
+    if (EVP_DecryptInit_ex(gcm, NULL, NULL, set_key ? k->key : NULL, nonce) != 1) {
+        gcm_generation = 0;
+        return false;
+    }
+    gcm_generation = k->generation;
+    int len = 0;
+    int plaintext_len = 0;
+    if (EVP_DecryptUpdate(gcm, NULL, &len, &first, 1) != 1
+        || EVP_DecryptUpdate(gcm, NULL, &len, pkt.header.data + 1, pkt.header.length() - 1) != 1
+        || EVP_DecryptUpdate(gcm, NULL, &len, packet_number, pn_len) != 1
+        || EVP_DecryptUpdate(gcm, plaintext, &plaintext_len, ciphertext, ciphertext_len) != 1
+        || EVP_CIPHER_CTX_ctrl(gcm, EVP_CTRL_GCM_SET_TAG, QUIC_TAG_LENGTH, (void *)(ciphertext + ciphertext_len)) != 1
+        || EVP_DecryptFinal_ex(gcm, plaintext + plaintext_len, &len) != 1) {
+        return false;
+    }
+
+    if (k == &new_keys) {
+        keys.valid = true;
+        keys.version = pkt.version;
+        keys.dcid_len = pkt.dcid.length();
+        memcpy(keys.dcid, pkt.dcid.data, keys.dcid_len);
+        keys.scid_len = pkt.scid.length();
+        memcpy(keys.scid, pkt.scid.data, keys.scid_len);
+        keys.client = new_keys;
+        keys.server.generation = 0;
+    }
+    out = { plaintext, plaintext + plaintext_len + len };
+    return true;
+}
+
+/*
+ * QUIC frame types that may appear in a client's Initial packets
+ * (RFC 9000, Section 12.4)
+ */
+enum quic_frame_type {
+    quic_frame_padding          = 0x00,
+    quic_frame_ping             = 0x01,
+    quic_frame_ack              = 0x02,
+    quic_frame_ack_ecn          = 0x03,
+    quic_frame_crypto           = 0x06,
+    quic_frame_connection_close = 0x1c
+};
+
+bool quic_initial_processor::process(const struct quic_initial_packet &pkt, struct datum &client_hello) {
+    struct datum frames;
+    bool from_server;
+    if (!decrypt(pkt, frames, from_server) || from_server) {
+        return false;   /* a server's Initials hold no clientHello */
+    }
+
+    struct quic_crypto_stream *s = NULL;
+    for (struct quic_crypto_stream &candidate : stream) {
+        if ((candidate.in_use || candidate.done) && candidate.matches(pkt)) {
+            s = &candidate;
+            break;
+        }
+    }
+    if (s && s->done) {
+        return false;   /* a retransmission of a clientHello already reported */
+    }
+
+    while (frames.is_not_empty()) {
+        uint64_t type;
+        if (!read_varint(frames, &type)) {
+            break;
+        }
+        uint64_t tmp = 0, count = 0;
+        switch (type) {
+        case quic_frame_padding:
+        case quic_frame_ping:
+            break;
+        case quic_frame_ack:
+        case quic_frame_ack_ecn:
+            /* largest acknowledged, delay, range count, first range */
+            read_varint(frames, &tmp);
+            read_varint(frames, &tmp);
+            read_varint(frames, &count);
+            read_varint(frames, &tmp);
+            for (uint64_t i = 0; i < count && frames.is_not_empty(); i++) {
+                read_varint(frames, &tmp);  /* gap    */
+                read_varint(frames, &tmp);  /* length */
+            }
+            if (type == quic_frame_ack_ecn) {
+                read_varint(frames, &tmp);
+                read_varint(frames, &tmp);
+                read_varint(frames, &tmp);
+            }
+            break;
+        case quic_frame_crypto:
+            {
+                uint64_t offset, length;
+                if (!read_varint(frames, &offset) || !read_varint(frames, &length) || length > (uint64_t)frames.length()) {
+                    return false;
+                }
+                struct datum data;
+                data.parse(frames, length);
+                if (s == NULL) {
+                    s = &stream[next_stream];
+                    next_stream = (next_stream + 1) % QUIC_NUM_CRYPTO_STREAMS;
+                    s->init(pkt);
+                }
+                if (!s->add(offset, data)) {
+                    s->in_use = false;
+                    return false;
+                }
+            }
+            break;
+        case quic_frame_connection_close:
+            return false;
+        default:
+            return false;   /* not allowed in Initial packets */
+        }
+        if (frames.data == NULL) {   /* truncated frame */
+            return false;
+        }
+    }
+
+    if (s && s->get_handshake(client_hello)) {
+        s->in_use = false;  /* its data remains valid until the stream is reused */
+        s->done = true;
+        return true;
+    }
+    return false;
+}
+
+bool quic_crypto_stream::matches(const struct quic_initial_packet &pkt) const {
+    return version == pkt.version
+        && dcid_len == pkt.dcid.length()
+        && memcmp(dcid, pkt.dcid.data, dcid_len) == 0;
+}
+
+void quic_crypto_stream::init(const struct quic_initial_packet &pkt) {
+    in_use = true;
+    done = false;
+    version = pkt.version;
+    dcid_len = pkt.dcid.length();
+    memcpy(dcid, pkt.dcid.data, dcid_len);
+    num_ranges = 0;
+}
+
+bool quic_crypto_stream::add(uint64_t offset, const struct datum &frame_data) {
+    uint64_t length = frame_data.length();
+    if (offset + length > QUIC_CRYPTO_MAX_LENGTH) {
+        return false;
+    }
+    if (length == 0) {
+        return true;
+    }
+    memcpy(data + offset, frame_data.data, length);
+
+    /*
+     * merge [begin, end) into the sorted list of disjoint ranges
+     */
+    uint32_t begin = offset;
+    uint32_t end = offset + length;
+    unsigned int i = 0;
+    while (i < num_ranges && range[i].end < begin) {
+        i++;
+    }
+    unsigned int j = i;
+    while (j < num_ranges && range[j].begin <= end) {
+        begin = range[j].begin < begin ? range[j].begin : begin;
+        end = range[j].end > end ? range[j].end : end;
+        j++;
+    }
+    if (i == j) {
+        if (num_ranges == QUIC_CRYPTO_MAX_RANGES) {
+            return false;
+        }
+        memmove(&range[i + 1], &range[i], (num_ranges - i) * sizeof(range[0]));
+        num_ranges++;
+    } else if (j > i + 1) {
+        memmove(&range[i + 1], &range[j], (num_ranges - j) * sizeof(range[0]));
+        num_ranges -= j - i - 1;
+    }
+    range[i].begin = begin;
+    range[i].end = end;
+    return true;
+}
+
+bool quic_crypto_stream::get_handshake(struct datum &msg) const {
+    const size_t handshake_header_length = 4;  /* type and 24-bit length */
+    if (num_ranges == 0 || range[0].begin != 0 || range[0].end < handshake_header_length) {
+        return false;
+    }
+    size_t msg_len = handshake_header_length + ((data[1] << 16) | (data[2] << 8) | data[3]);
+    if (range[0].end < msg_len) {
+        return false;
+    }
+    msg = { data, data + msg_len };
+    return true;
+}
+
+void quic_client_hello::parse(const struct quic_initial_packet &pkt, struct datum &handshake_msg) {
+    version = { pkt.header.data + 1, pkt.header.data + 1 + L_QUIC_Version };
+    dcid = pkt.dcid;
+    scid = pkt.scid;
+    struct tls_handshake handshake;
+    handshake.parse(handshake_msg);
+    if (handshake.msg_type == handshake_type::client_hello) {
+        hello.parse(handshake.body);
+    }
+}
+
+void quic_client_hello::operator()(struct buffer_stream &buf) const {
+    buf.write_char('\"');
+    buf.write_char('(');
+    buf.raw_as_hex(version.data, version.length());
+    buf.write_char(')');
+    hello.write_fingerprint(buf);
+    buf.write_char('\"');
+}
+
+void quic_client_hello::write_json(struct json_object &record, bool output_metadata) const {
+    struct json_object quic{record, "quic"};
+    quic.print_key_hex("version", version);
+    if (output_metadata) {
+        quic.print_key_hex("dcid", dcid);
+        quic.print_key_hex("scid", scid);
+    }
+    quic.close();
+    hello.write_json(record, output_metadata);
+}
+
+unsigned int parser_extractor_process_quic(struct datum *p, struct extractor *x) {
+    (void)x;
+
+    extractor_debug("%s: processing packet\n", __func__);
+
+    /*
+     * the clientHello can only be read after decryption, which is
+     * done by libmerc (see quic_initial_processor), so the packet
+     * filter just selects each Initial packet, reporting the length
+     * of its header as the number of bytes extracted
+     */
+    struct datum d = *p;
+    struct quic_initial_packet initial;
+    initial.parse(d);
+    if (initial.is_not_empty() == false) {
+        return 0;
+    }
+    return initial.header.length();
+}
@@ -0,0 +1,243 @@
+/*
+ * quic.h
+ *
+ * QUIC Initial packet processing
+ *
+ * A QUIC client's first flight is a TLS clientHello, carried in
+ * CRYPTO frames in one or more Initial packets.  Those packets are
+ * protected with keys that are derived from the Destination
+ * Connection ID that the client chose (RFC 9001, Section 5.2), so
+ * they can be decrypted by any observer, which is what the
+ * quic_initial_processor does: it removes the header protection,
+ * decrypts the payload with AES-128-GCM (using OpenSSL's libcrypto,
+ * which uses AES-NI where it is available), and reassembles the
+ * CRYPTO frames of each connection, until the clientHello is
+ * complete.
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef QUIC_H
+#define QUIC_H
+
+#include <openssl/evp.h>
+#include "datum.h"
+#include "tls.h"
+
+/*
+ * struct quic_initial_packet holds the fields of the long header of
+ * a QUIC Initial packet (RFC 9000, Section 17.2.2), with header
+ * protection still in place; parse() accepts only the versions whose
+ * Initial keys are known
+ *
+ *    Initial Packet {
+ *      Header Form (1) = 1,
+ *      Fixed Bit (1) = 1,
+ *      Long Packet Type (2) = 0,
+ *      Reserved Bits (2),
+ *      Packet Number Length (2),
+ *      Version (32),
+ *      Destination Connection ID Length (8),
+ *      Destination Connection ID (0..160),
+ *      Source Connection ID Length (8),
+ *      Source Connection ID (0..160),
+ *      Token Length (i),
+ *      Token (..),
+ *      Length (i),
+ *      Packet Number (8..32),
+ *      Packet Payload (8..),
+ *    }
+ */
+struct quic_initial_packet {
+    uint8_t connection_info;      /* first byte, still protected          */
+    uint32_t version;
+    struct datum dcid;
+    struct datum scid;
+    struct datum token;
+    struct datum header;          /* from the first byte up to the packet number */
+    struct datum payload;         /* packet number and protected payload  */
+
+    quic_initial_packet() : connection_info{0}, version{0}, dcid{NULL, NULL}, scid{NULL, NULL}, token{NULL, NULL}, header{NULL, NULL}, payload{NULL, NULL} {}
+
+    void parse(struct datum &d);
+
+    bool is_not_empty() const { return payload.is_not_empty(); }
+
+    /*
+     * is_initial(data, len) returns true if data starts with the
+     * long header of an Initial packet of a known version; it is
+     * used to identify the message type of a UDP payload
+     */
+    static bool is_initial(const uint8_t *data, size_t len);
+};
+
+/*
+ * struct quic_crypto_stream collects the CRYPTO frames sent in the
+ * Initial packets of a single connection, which may arrive out of
+ * order, split across packets, and repeated; once its clientHello is
+ * complete, the stream is marked done, so that the Initials that the
+ * client retransmits are recognized and not reported again, until the
+ * stream is reused for another connection
+ */
+#define QUIC_MAX_CID_LEN         20
+#define QUIC_CRYPTO_MAX_LENGTH   8192   /* longest clientHello reassembled */
+#define QUIC_CRYPTO_MAX_RANGES   16     /* disjoint ranges of CRYPTO data  */
+
+struct quic_crypto_stream {
+    bool in_use;
+    bool done;
+    uint32_t version;
+    uint8_t dcid_len;
+    uint8_t dcid[QUIC_MAX_CID_LEN];
+    unsigned int num_ranges;
+    struct { uint32_t begin; uint32_t end; } range[QUIC_CRYPTO_MAX_RANGES];  /* sorted, disjoint */
+    uint8_t data[QUIC_CRYPTO_MAX_LENGTH];
+
+    quic_crypto_stream() : in_use{false}, done{false}, version{0}, dcid_len{0}, num_ranges{0} {}
+
+    bool matches(const struct quic_initial_packet &pkt) const;
+
+    void init(const struct quic_initial_packet &pkt);
+
+    /*
+     * add(offset, frame_data) copies the data of a CRYPTO frame into
+     * the stream; it returns false if the data does not fit
+     */
+    bool add(uint64_t offset, const struct datum &frame_data);
+
+    /*
+     * get_handshake(msg) sets msg to the first handshake message in
+     * the stream and returns true, if all of its bytes have been
+     * received
+     */
+    bool get_handshake(struct datum &msg) const;
+};
+
+/*
+ * struct quic_initial_keys holds the keys that protect the Initial
+ * packets sent by a client or by a server; its generation identifies
+ * the keys to the quic_initial_processor, so that the key is set in
+ * its cipher context only when it changes
+ */
+struct quic_initial_keys {
+    uint8_t key[16];
+    uint8_t iv[12];
+    uint8_t hp[16];
+    uint64_t generation;          /* zero if the keys have not been derived */
+};
+
+/*
+ * struct quic_connection_keys holds the Initial keys of a single
+ * connection: the client's Initials carry the Destination Connection
+ * ID from which both sets of keys are derived, and the server's
+ * Initials carry the client's Source Connection ID in its place
+ */
+struct quic_connection_keys {
+    bool valid;
+    uint32_t version;
+    uint8_t dcid_len;
+    uint8_t dcid[QUIC_MAX_CID_LEN];
+    uint8_t scid_len;
+    uint8_t scid[QUIC_MAX_CID_LEN];
+    struct quic_initial_keys client;
+    struct quic_initial_keys server;
+
+    quic_connection_keys() : valid{false}, version{0}, dcid_len{0}, scid_len{0}, client{}, server{} {}
+
+    bool client_sent(const struct quic_initial_packet &pkt) const;
+
+    bool server_sent(const struct quic_initial_packet &pkt) const;
+};
+
+/*
+ * struct quic_initial_processor holds the state of QUIC Initial
+ * processing for a single thread: the cipher contexts, the client and
+ * server keys of the most recent connection (which are reused for the
+ * retransmitted and continuation Initials of that connection, so that
+ * they need not be derived again), the plaintext buffer, and a small
+ * table of crypto streams, which is used in round-robin order.  The
+ * keys of a new connection replace those of the last one only once a
+ * packet has been authenticated with them.
+ */
+#define QUIC_NUM_CRYPTO_STREAMS  8
+#define QUIC_MAX_PAYLOAD_LENGTH  16384
+
+struct quic_initial_processor {
+    EVP_CIPHER_CTX *gcm;
+    EVP_CIPHER_CTX *ecb;
+    uint64_t gcm_generation;      /* of the key set in gcm                */
+    uint64_t next_generation;
+    struct quic_connection_keys keys;
+    struct quic_initial_keys new_keys;
+    uint8_t plaintext[QUIC_MAX_PAYLOAD_LENGTH];
+    struct quic_crypto_stream stream[QUIC_NUM_CRYPTO_STREAMS];
+    unsigned int next_stream;
+
+    quic_initial_processor();
+
+    ~quic_initial_processor();
+
+    quic_initial_processor(const quic_initial_processor &) = delete;
+    quic_initial_processor &operator=(const quic_initial_processor &) = delete;
+
+    /*
+     * is_valid() returns false if the ciphers could not be initialized
+     */
+    bool is_valid() const { return gcm != NULL; }
+
+    /*
+     * decrypt(pkt, plaintext, from_server) removes the protection
+     * from the Initial packet pkt, sets plaintext to its payload, and
+     * sets from_server to true if the server of the last connection
+     * sent it; it returns false if the packet could not be
+     * authenticated
+     */
+    bool decrypt(const struct quic_initial_packet &pkt, struct datum &plaintext, bool &from_server);
+
+    /*
+     * process(pkt, client_hello) decrypts pkt and adds its CRYPTO
+     * frames to the stream of its connection; if that completes the
+     * clientHello, then process() sets client_hello to its handshake
+     * message (which is valid until the next call) and returns true
+     */
+    bool process(const struct quic_initial_packet &pkt, struct datum &client_hello);
+};
+
+/*
+ * quic_initial_keys_init(keys, version, dcid, server) derives the
+ * client Initial keys (or the server's, if server is true) for the
+ * given version and the Destination Connection ID of the client's
+ * first Initial, and returns false if the version is not known
+ */
+bool quic_initial_keys_init(struct quic_initial_keys &keys, uint32_t version, const struct datum &dcid, bool server=false);
+
+/*
+ * quic_header_protection_mask(ctx, hp, sample, mask) sets the five
+ * bytes of mask from the 16 byte sample, as in RFC 9001, Section 5.4.3
+ */
+bool quic_header_protection_mask(EVP_CIPHER_CTX *ctx, const uint8_t *hp, const uint8_t *sample, uint8_t *mask);
+
+/*
+ * struct quic_client_hello is the clientHello of a QUIC connection;
+ * its fingerprint is the QUIC version, in hexadecimal and in
+ * parenthesis, followed by the TLS fingerprint of the clientHello
+ */
+struct quic_client_hello {
+    struct datum version;
+    struct datum dcid;
+    struct datum scid;
+    struct tls_client_hello hello;
+
+    quic_client_hello() : version{NULL, NULL}, dcid{NULL, NULL}, scid{NULL, NULL}, hello{} {}
+
+    void parse(const struct quic_initial_packet &pkt, struct datum &handshake_msg);
+
+    bool is_not_empty() const { return hello.is_not_empty(); }
+
+    void operator()(struct buffer_stream &buf) const;
+
+    void write_json(struct json_object &record, bool output_metadata) const;
+};
+
+#endif /* QUIC_H */
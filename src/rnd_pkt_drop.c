@@ -1,57 +1,277 @@
 /**
  * rand_pkt_drop.c
  *
- * random packet drops, to enable testing that adaptively finds the
- * maximum packet throughput
+ * flow-consistent packet drops, to adaptively shed load when the
+ * offered packet rate exceeds the maximum packet throughput
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "rnd_pkt_drop.h"
+#include "eth.h"
 
-int rnd_pkt_drop_percent_accept = 0; /* default */
+bool rnd_pkt_drop_enabled = false;
+
+static uint32_t accept_level = PKT_DROP_LEVEL_MAX;  /* accessed atomically */
+static uint64_t flow_hash_seed = 0;
+
+/*
+ * tuning parameters for adjust_percent_accept()
+ */
+#define PKT_DROP_MIN_FRACTION  0.01  /* never accept fewer than 1% of flows             */
+#define PKT_DROP_INCREASE      0.05  /* additive increase per second, when underloaded  */
+#define PKT_DROP_BACKOFF       0.8   /* margin applied to estimated capacity, on drops  */
+#define PKT_DROP_RING_HIGH     0.5   /* ring usage above which the level is decreased   */
+#define PKT_DROP_RING_LOW      0.2   /* ring usage below which the level is increased   */
+
+static inline uint32_t get_accept_level(void) {
+    return __atomic_load_n(&accept_level, __ATOMIC_RELAXED);
+}
+
+static inline void set_accept_level(uint32_t level) {
+    __atomic_store_n(&accept_level, level, __ATOMIC_RELAXED);
+}
 
 int get_percent_accept(void) {
-    int zero = 0;
-    return __sync_add_and_fetch(&rnd_pkt_drop_percent_accept, zero);
+    if (!rnd_pkt_drop_enabled) {
+        return 0;
+    }
+    return (get_accept_level() * 100 + PKT_DROP_LEVEL_MAX / 2) / PKT_DROP_LEVEL_MAX;
+}
+
+double get_fraction_accept(void) {
+    if (!rnd_pkt_drop_enabled) {
+        return 1.0;
+    }
+    return (double)get_accept_level() / PKT_DROP_LEVEL_MAX;
+}
+
+static uint64_t get_seed(void) {
+    uint64_t seed = 0;
+    FILE *f = fopen("/dev/urandom", "r");
+    if (f != NULL) {
+        if (fread(&seed, sizeof(seed), 1, f) != 1) {
+            seed = 0;
+        }
+        fclose(f);
+    }
+    if (seed == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ ((uint64_t)getpid() << 16);
+    }
+    return seed;
 }
 
 void set_percent_accept(unsigned int p) {
-    rnd_pkt_drop_percent_accept = p;
+    if (p > 100) {
+        p = 100;
+    }
+    if (flow_hash_seed == 0) {
+        flow_hash_seed = get_seed();
+    }
+    set_accept_level(p * PKT_DROP_LEVEL_MAX / 100);
+    rnd_pkt_drop_enabled = (p > 0);
+}
+
+int adjust_percent_accept(double ring_usage,
+                          uint64_t socket_packets,
+                          uint64_t socket_drops,
+                          uint64_t socket_freezes) {
+
+    double level = get_fraction_accept();
+
+    if (socket_drops || socket_freezes) {
+        /*
+         * overloaded: the fraction of packets that the socket did not
+         * drop estimates the capacity at the current level, so back
+         * off to somewhat below that
+         */
+        double delivered = 0.5;
+        if (socket_packets > socket_drops) {
+            delivered = (double)(socket_packets - socket_drops) / socket_packets;
+        }
+        level *= delivered * PKT_DROP_BACKOFF;
+
+    } else if (ring_usage > PKT_DROP_RING_HIGH) {
+        /*
+         * the ring buffers are filling up, so back off in proportion
+         * to how far they are above the high water mark
+         */
+        level *= 1.0 - (ring_usage - PKT_DROP_RING_HIGH);
+
+    } else if (ring_usage < PKT_DROP_RING_LOW) {
+        level += PKT_DROP_INCREASE;
+    }
+
+    if (level < PKT_DROP_MIN_FRACTION) {
+        level = PKT_DROP_MIN_FRACTION;
+    } else if (level > 1.0) {
+        level = 1.0;
+    }
+    set_accept_level(level * PKT_DROP_LEVEL_MAX);
+
+    return get_percent_accept();
 }
 
+/*
+ * flow key extraction: just enough parsing of the ethernet, IP, and
+ * transport headers to find the addresses, ports and protocol; this
+ * avoids running the full extractor on packets that will be dropped
+ */
+
+static inline uint16_t read_u16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+bool flow_key_from_packet(struct key *k, const uint8_t *packet, size_t length) {
+    const uint8_t *p = packet;
+    const uint8_t *end = packet + length;
+
+    if (p + 2 * ETH_ADDR_LEN + 2 > end) {
+        return false;
+    }
+    p += 2 * ETH_ADDR_LEN;
+    uint16_t ethertype = read_u16(p);
+    p += 2;
+    while (ethertype == ETH_TYPE_1AD || ethertype == ETH_TYPE_VLAN) {
+        if (p + 4 > end) {
+            return false;
+        }
+        ethertype = read_u16(p + 2);
+        p += 4;
+    }
+    if (ethertype == ETH_TYPE_MPLS) {
+        uint32_t mpls_label = 0;
+        while (!(mpls_label & MPLS_BOTTOM_OF_STACK)) {
+            if (p + MPLS_HDR_LEN > end) {
+                return false;
+            }
+            mpls_label = (read_u16(p) << 16) | read_u16(p + 2);
+            p += MPLS_HDR_LEN;
+        }
+        ethertype = (p < end && (*p & 0xf0) == 0x60) ? ETH_TYPE_IPV6 : ETH_TYPE_IP;
+    }
+
+    const uint8_t *transport = NULL;
+    if (ethertype == ETH_TYPE_IP) {
+        if (p + 20 > end || (p[0] & 0xf0) != 0x40) {
+            return false;
+        }
+        *k = key();
+        k->ip_vers = 4;
+        k->protocol = p[9];
+        memcpy(&k->addr.ipv4.src, p + 12, sizeof(uint32_t));
+        memcpy(&k->addr.ipv4.dst, p + 16, sizeof(uint32_t));
+        if ((read_u16(p + 6) & 0x1fff) == 0) {
+            transport = p + ((p[0] & 0x0f) << 2);   /* not a non-initial fragment */
+        }
+
+    } else if (ethertype == ETH_TYPE_IPV6) {
+        if (p + 40 > end || (p[0] & 0xf0) != 0x60) {
+            return false;
+        }
+        *k = key();
+        k->ip_vers = 6;
+        memcpy(&k->addr.ipv6.src, p + 8, sizeof(ipv6_addr));
+        memcpy(&k->addr.ipv6.dst, p + 24, sizeof(ipv6_addr));
+        uint8_t next_header = p[6];
+        transport = p + 40;
+        while (next_header == IPPROTO_HOPOPTS || next_header == IPPROTO_ROUTING || next_header == IPPROTO_DSTOPTS) {
+            if (transport + 2 > end) {
+                transport = NULL;
+                break;
+            }
+            next_header = transport[0];
+            transport += (transport[1] + 1) * 8;
+        }
+        k->protocol = next_header;
 
-int increment_percent_accept(int incr) {
-    int val = get_percent_accept();
-    int new_val = val + incr;
-    if (new_val <= 10 || new_val >= 100) {
-       /* do not set the value out of range 10 to 100 */
-       return val;
     } else {
-       return __sync_add_and_fetch(&rnd_pkt_drop_percent_accept, incr);
+        return false;
+    }
+
+    if (transport && transport + 4 <= end) {
+        switch (k->protocol) {
+        case IPPROTO_TCP:
+        case IPPROTO_UDP:
+        case IPPROTO_SCTP:
+            k->src_port = read_u16(transport);
+            k->dst_port = read_u16(transport + 2);
+            break;
+        default:
+            ;
+        }
     }
+    return true;
 }
 
-int select_random(int percent) {
-    /* get random number in the range of 1 to 101 */
-    int random_num = rand() % 101 + 1;
+static inline uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+uint64_t flow_key_symmetric_hash(const struct key &k) {
+    uint64_t a[2], b[2];
+    uint16_t a_port, b_port;
 
-    /**
-     * from the random_num, determine if we want to select this packet
-     * depending on the accept_percentage (defined and set in configure.c)
+    /*
+     * put the endpoints into a canonical order, so that the hash does
+     * not depend on the direction of the packet; an IPv4 key holds
+     * both of its addresses in the first eight bytes of the union, so
+     * the addresses must be read according to the IP version
      */
-    if (random_num < percent) {
-        return 1;
+    if (k.ip_vers == 4) {
+        a[0] = 0;
+        a[1] = k.addr.ipv4.src;
+        b[0] = 0;
+        b[1] = k.addr.ipv4.dst;
     } else {
-        return 0;
+        a[0] = ((uint64_t)k.addr.ipv6.src.a << 32) | k.addr.ipv6.src.b;
+        a[1] = ((uint64_t)k.addr.ipv6.src.c << 32) | k.addr.ipv6.src.d;
+        b[0] = ((uint64_t)k.addr.ipv6.dst.a << 32) | k.addr.ipv6.dst.b;
+        b[1] = ((uint64_t)k.addr.ipv6.dst.c << 32) | k.addr.ipv6.dst.d;
+    }
+    a_port = k.src_port;
+    b_port = k.dst_port;
+    if (a[0] > b[0] || (a[0] == b[0] && (a[1] > b[1] || (a[1] == b[1] && a_port > b_port)))) {
+        uint64_t t0 = a[0], t1 = a[1];
+        a[0] = b[0];
+        a[1] = b[1];
+        b[0] = t0;
+        b[1] = t1;
+        uint16_t tp = a_port;
+        a_port = b_port;
+        b_port = tp;
     }
-}
 
+    uint64_t h = flow_hash_seed;
+    h = hash_mix(h ^ a[0]);
+    h = hash_mix(h ^ a[1]);
+    h = hash_mix(h ^ b[0]);
+    h = hash_mix(h ^ b[1]);
+    h = hash_mix(h ^ ((uint64_t)a_port << 32 | (uint64_t)b_port << 16 | (uint64_t)k.protocol << 8 | k.ip_vers));
+    return h;
+}
 
-unsigned int drop_this_packet(void) {
-    int percent = get_percent_accept();
-    if (percent > 0) {
-        if (select_random(percent) == 0) {
-            return 1;
-        }
+unsigned int drop_this_packet(const uint8_t *packet, size_t length) {
+    uint32_t level = get_accept_level();
+    if (level >= PKT_DROP_LEVEL_MAX) {
+        return 0;
+    }
+    struct key k;
+    if (!flow_key_from_packet(&k, packet, length)) {
+        return 0;   /* non-IP packets are never dropped */
+    }
+    uint64_t h = flow_key_symmetric_hash(k);
+    if ((h >> 48) < level) {
+        return 0;
     }
-    return 0;
+    return 1;
 }
@@ -1,18 +1,63 @@
 /*
  * rnd_pkt_drop.h
+ *
+ * flow-consistent adaptive packet dropping (load shedding)
  */
 
 #ifndef RND_PKT_DROP_H
 #define RND_PKT_DROP_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include "tcp.h"
+
+/*
+ * The accept level is the fraction of flows that are accepted, in
+ * units of 1/PKT_DROP_LEVEL_MAX; it is shared by all of the worker
+ * threads, and adjusted by the stats thread.  Each packet is accepted
+ * when the symmetric hash of its flow key falls below the accept
+ * level, so that both directions of a flow are either kept or
+ * dropped together, and lowering the level only drops flows, without
+ * thinning out the packets within the flows that remain.
+ */
+#define PKT_DROP_LEVEL_MAX  65536
+
+extern bool rnd_pkt_drop_enabled;   /* true if adaptive dropping is configured */
+
 int get_percent_accept(void);
 
+double get_fraction_accept(void);
+
 void set_percent_accept(unsigned int p);
 
-int increment_percent_accept(int incr);
+/*
+ * adjust_percent_accept(ring_usage, socket_packets, socket_drops,
+ * socket_freezes) is called by the stats thread once per second with
+ * the worst per-thread ring buffer usage (from 0.0 to 1.0) and the
+ * socket counters for that second; it lowers the accept level
+ * multiplicatively when the kernel drops packets or the ring buffers
+ * fill up, and raises it additively when they drain.  It returns the
+ * new percent accept.
+ */
+int adjust_percent_accept(double ring_usage,
+                          uint64_t socket_packets,
+                          uint64_t socket_drops,
+                          uint64_t socket_freezes);
+
+/*
+ * flow_key_from_packet(k, packet, length) sets the addresses, ports,
+ * and protocol of the key k from the ethernet frame packet, and
+ * returns true if it is an IPv4 or IPv6 packet
+ */
+bool flow_key_from_packet(struct key *k, const uint8_t *packet, size_t length);
 
-int select_random(int percent);
+/*
+ * flow_key_symmetric_hash(k) returns a seeded hash of k that is the
+ * same for both directions of the flow (that is, it does not change
+ * if the source and destination are swapped)
+ */
+uint64_t flow_key_symmetric_hash(const struct key &k);
 
-unsigned int drop_this_packet(void);
+unsigned int drop_this_packet(const uint8_t *packet, size_t length);
 
 #endif /* RND_PKT_DROP_H */
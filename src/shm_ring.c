@@ -0,0 +1,311 @@
+/*
+ * shm_ring.c
+ *
+ * single-producer, multiple-consumer ring of variable-length records
+ * in POSIX shared memory; see shm_ring.h for the layout and protocol
+ *
+ * This file depends only on the C library, so that readers can build
+ * it into their own programs.
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm_ring.h"
+
+#define SHM_RING_MIN_SIZE  4096
+#define SHM_RING_NAME_LEN  256
+
+#define shm_ring_align(n) (((n) + SHM_RING_ALIGN - 1) & ~((uint64_t)SHM_RING_ALIGN - 1))
+
+/*
+ * shm_ring_name(buf, name) writes name into buf with a leading slash,
+ * as required by shm_open(), and returns buf, or NULL if name is too
+ * long
+ */
+static const char *shm_ring_name(char *buf, const char *name) {
+    int len = snprintf(buf, SHM_RING_NAME_LEN, "%s%s", name[0] == '/' ? "" : "/", name);
+    if (len < 0 || len >= SHM_RING_NAME_LEN) {
+        fprintf(stderr, "error: shared memory name %s is too long\n", name);
+        return NULL;
+    }
+    return buf;
+}
+
+static inline struct shm_ring_record_hdr *shm_ring_record(const struct shm_ring *r, uint64_t position) {
+    return (struct shm_ring_record_hdr *)(r->data + (position & (r->hdr->capacity - 1)));
+}
+
+int shm_ring_create(struct shm_ring *r, const char *name, size_t size) {
+    char shm_name[SHM_RING_NAME_LEN];
+
+    memset(r, 0, sizeof(*r));
+    if (shm_ring_name(shm_name, name) == NULL) {
+        return -1;
+    }
+    uint64_t capacity = SHM_RING_MIN_SIZE;
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t data_offset = (sizeof(struct shm_ring_header) + page_size - 1) & ~((uint64_t)page_size - 1);
+
+    /*
+     * readers that still have the old ring mapped keep it until they
+     * detach; new readers get the new one
+     */
+    shm_unlink(shm_name);
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd < 0) {
+        fprintf(stderr, "%s: could not create shared memory %s\n", strerror(errno), shm_name);
+        return -1;
+    }
+    r->map_size = data_offset + capacity;
+    if (ftruncate(fd, r->map_size) != 0) {
+        fprintf(stderr, "%s: could not set the size of shared memory %s\n", strerror(errno), shm_name);
+        close(fd);
+        shm_unlink(shm_name);
+        return -1;
+    }
+    void *map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: could not map shared memory %s\n", strerror(errno), shm_name);
+        shm_unlink(shm_name);
+        return -1;
+    }
+    struct shm_ring_header *hdr = (struct shm_ring_header *)map;
+    r->data = (uint8_t *)map + data_offset;
+
+    /* the new object is zero-filled, so head, tail, and the reader slots are clear */
+    hdr->version = SHM_RING_VERSION;
+    hdr->data_offset = data_offset;
+    hdr->capacity = capacity;
+    hdr->writer_pid = getpid();
+    __atomic_store_n(&hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);  /* readers check the magic last */
+    __atomic_store_n(&r->hdr, hdr, __ATOMIC_RELEASE);                 /* as does the metrics server    */
+
+    return 0;
+}
+
+/*
+ * shm_ring_reserve(r, n) advances the tail of the ring past the
+ * oldest records, until there are n free bytes after the head
+ */
+static inline void shm_ring_reserve(struct shm_ring *r, uint64_t n) {
+    struct shm_ring_header *hdr = r->hdr;
+    uint64_t tail = hdr->tail;
+    if (hdr->head + n - tail <= hdr->capacity) {
+        return;
+    }
+    while (hdr->head + n - tail > hdr->capacity) {
+        tail += shm_ring_align(sizeof(struct shm_ring_record_hdr) + shm_ring_record(r, tail)->length);
+    }
+    __atomic_store_n(&hdr->tail, tail, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);  /* tail is stored before the records are overwritten */
+}
+
+static inline void shm_ring_publish(struct shm_ring *r, uint64_t length, uint32_t flags, uint64_t seq, const void *data) {
+    uint64_t n = shm_ring_align(sizeof(struct shm_ring_record_hdr) + length);
+    shm_ring_reserve(r, n);
+
+    struct shm_ring_record_hdr *rec = shm_ring_record(r, r->hdr->head);
+    rec->length = length;
+    rec->flags = flags;
+    rec->seq = seq;
+    if (data) {
+        memcpy(rec + 1, data, length);
+    }
+    __atomic_store_n(&r->hdr->head, r->hdr->head + n, __ATOMIC_RELEASE);
+}
+
+int shm_ring_write(struct shm_ring *r, const void *data, size_t length) {
+    struct shm_ring_header *hdr = r->hdr;
+    uint64_t n = shm_ring_align(sizeof(struct shm_ring_record_hdr) + length);
+    if (n > hdr->capacity / 2) {
+        __atomic_store_n(&hdr->records_dropped, hdr->records_dropped + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    uint64_t offset = hdr->head & (hdr->capacity - 1);
+    if (offset + n > hdr->capacity) {
+        /* pad out the end of the data area, so that the record does not wrap */
+        shm_ring_publish(r, hdr->capacity - offset - sizeof(struct shm_ring_record_hdr), SHM_RING_FLAG_PAD, hdr->next_seq, NULL);
+    }
+    shm_ring_publish(r, length, 0, hdr->next_seq, data);
+    __atomic_store_n(&hdr->next_seq, hdr->next_seq + 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void shm_ring_close(struct shm_ring *r) {
+    if (r->hdr == NULL) {
+        return;
+    }
+    __atomic_store_n(&r->hdr->closed, 1, __ATOMIC_RELEASE);
+    munmap(r->hdr, r->map_size);
+    r->hdr = NULL;
+    r->data = NULL;
+}
+
+/*
+ * shm_ring_claim_slot(r) claims a free reader slot, or one that
+ * belongs to a process that has exited, and returns it, or NULL if
+ * there are none
+ */
+static struct shm_ring_reader_slot *shm_ring_claim_slot(struct shm_ring *r) {
+    int32_t pid = getpid();
+    for (int i = 0; i < SHM_RING_MAX_READERS; i++) {
+        struct shm_ring_reader_slot *slot = &r->hdr->readers[i];
+        int32_t owner = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+        if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH)) {
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&slot->pid, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&slot->records_read, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->records_lost, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->overruns, 0, __ATOMIC_RELAXED);
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+int shm_ring_attach(struct shm_ring *r, const char *name, enum shm_ring_start start) {
+    char shm_name[SHM_RING_NAME_LEN];
+
+    memset(r, 0, sizeof(*r));
+    if (shm_ring_name(shm_name, name) == NULL) {
+        return -1;
+    }
+    int prot = PROT_READ | PROT_WRITE;
+    int fd = shm_open(shm_name, O_RDWR, 0);
+    if (fd < 0 && errno == EACCES) {
+        prot = PROT_READ;  /* read-only access; the reader will not have a slot */
+        fd = shm_open(shm_name, O_RDONLY, 0);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "%s: could not open shared memory %s\n", strerror(errno), shm_name);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct shm_ring_header)) {
+        fprintf(stderr, "error: shared memory %s is not a ring\n", shm_name);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: could not map shared memory %s\n", strerror(errno), shm_name);
+        return -1;
+    }
+    r->hdr = (struct shm_ring_header *)map;
+    r->map_size = st.st_size;
+    if (__atomic_load_n(&r->hdr->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC
+        || r->hdr->version != SHM_RING_VERSION
+        || r->hdr->data_offset + r->hdr->capacity > r->map_size) {
+        fprintf(stderr, "error: shared memory %s is not a ring, or has an unsupported version\n", shm_name);
+        munmap(map, r->map_size);
+        r->hdr = NULL;
+        return -1;
+    }
+    r->data = (uint8_t *)map + r->hdr->data_offset;
+
+    if (start == shm_ring_start_oldest) {
+        r->position = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+    } else {
+        r->position = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+    }
+    r->expected_seq = UINT64_MAX;  /* not known until the first record is read */
+    if (prot & PROT_WRITE) {
+        r->slot = shm_ring_claim_slot(r);
+        if (r->slot) {
+            __atomic_store_n(&r->slot->position, r->position, __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+}
+
+ssize_t shm_ring_read(struct shm_ring *r, void *buf, size_t buf_len, uint64_t *lost) {
+    struct shm_ring_header *hdr = r->hdr;
+    uint64_t overrun_lost = 0;
+
+    while (1) {
+        uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+        if (r->position == head) {
+            if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE) && r->position == __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE)) {
+                return -1;
+            }
+            return 0;
+        }
+        uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+        if (r->position < tail) {
+            r->position = tail;  /* overrun: the records at position were overwritten */
+            if (r->slot) {
+                __atomic_store_n(&r->slot->overruns, r->slot->overruns + 1, __ATOMIC_RELAXED);
+            }
+            continue;
+        }
+
+        /*
+         * copy the record, then check that the writer did not
+         * overwrite it while we did so
+         */
+        uint64_t offset = r->position & (hdr->capacity - 1);
+        struct shm_ring_record_hdr rec;
+        memcpy(&rec, r->data + offset, sizeof(rec));
+        size_t length = rec.length;
+        if (length > hdr->capacity - offset - sizeof(rec)) {
+            length = hdr->capacity - offset - sizeof(rec);   /* torn header; caught below */
+        }
+        size_t copy_len = length < buf_len ? length : buf_len;
+        if ((rec.flags & SHM_RING_FLAG_PAD) == 0) {
+            memcpy(buf, r->data + offset + sizeof(rec), copy_len);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (r->position < __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED)) {
+            continue;  /* overrun while copying; the next pass moves to the tail */
+        }
+
+        r->position += shm_ring_align(sizeof(rec) + rec.length);
+        if (rec.flags & SHM_RING_FLAG_PAD) {
+            continue;
+        }
+        if (r->expected_seq != UINT64_MAX && rec.seq > r->expected_seq) {
+            overrun_lost += rec.seq - r->expected_seq;
+        }
+        r->expected_seq = rec.seq + 1;
+        if (r->slot) {
+            __atomic_store_n(&r->slot->position, r->position, __ATOMIC_RELAXED);
+            __atomic_store_n(&r->slot->records_read, r->slot->records_read + 1, __ATOMIC_RELAXED);
+            if (overrun_lost) {
+                __atomic_store_n(&r->slot->records_lost, r->slot->records_lost + overrun_lost, __ATOMIC_RELAXED);
+            }
+        }
+        if (lost) {
+            *lost = overrun_lost;
+        }
+        return copy_len;
+    }
+}
+
+void shm_ring_detach(struct shm_ring *r) {
+    if (r->hdr == NULL) {
+        return;
+    }
+    if (r->slot) {
+        __atomic_store_n(&r->slot->pid, 0, __ATOMIC_RELEASE);
+        r->slot = NULL;
+    }
+    munmap(r->hdr, r->map_size);
+    r->hdr = NULL;
+    r->data = NULL;
+}
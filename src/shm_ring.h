@@ -0,0 +1,173 @@
+/*
+ * shm_ring.h
+ *
+ * single-producer, multiple-consumer ring of variable-length records
+ * in POSIX shared memory (/dev/shm), through which mercury's output
+ * thread publishes its records to co-located processes
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * LAYOUT
+ *
+ * The shared memory object holds a struct shm_ring_header, followed
+ * (at offset header.data_offset) by a data area of header.capacity
+ * bytes, where capacity is a power of two.  All fields are in host
+ * byte order.
+ *
+ * Positions in the ring are 64-bit byte counts that never wrap; the
+ * byte at position p is at offset (p & (capacity - 1)) in the data
+ * area.  The records between header.tail and header.head are valid.
+ * Each record starts at a multiple of SHM_RING_ALIGN with a struct
+ * shm_ring_record_hdr, which holds the length of the record data and
+ * its sequence number, followed by the data, padded to a multiple of
+ * SHM_RING_ALIGN.  A record never wraps around the end of the data
+ * area; when the next record does not fit before the end, the writer
+ * fills the rest of the area with a record that has the flag
+ * SHM_RING_FLAG_PAD, which readers skip.  Sequence numbers start at
+ * zero, and count the records that are not padding.
+ *
+ * PROTOCOL
+ *
+ * There is a single writer, which never waits for readers.  To
+ * publish a record of n bytes (with its header and padding) at
+ * position head, the writer
+ *
+ *    1. advances tail, record by record, until tail >= head + n - capacity,
+ *    2. stores tail, then issues a release fence,
+ *    3. writes the record into the data area,
+ *    4. stores head + n into head, with release semantics.
+ *
+ * A reader at position pos loads head (with acquire semantics) to see
+ * if a record is available, copies the record out, issues an acquire
+ * fence, and then loads tail: if pos < tail, then the writer may have
+ * overwritten the record as it was being copied, and the reader
+ * discards it and resumes at tail.  Readers thus never block the
+ * writer; a reader that falls more than capacity bytes behind loses
+ * records, which it counts using the sequence numbers.  This is the
+ * same discipline as a sequence lock, with tail as the sequence.
+ *
+ * Readers can attach and detach at any time, and start either at the
+ * oldest record in the ring or at the next record to be written.  An
+ * attached reader claims one of the SHM_RING_MAX_READERS slots in the
+ * header, where it reports its position and the number of records it
+ * lost to overruns, so that the writer can report them.  The writer
+ * sets closed when it stops; the ring is then left in place, so that
+ * readers can finish reading it, until the writer creates it anew.
+ */
+
+#define SHM_RING_MAGIC          0x314d48534352454dULL  /* "MERCSHM1", in little endian order */
+#define SHM_RING_VERSION        1
+#define SHM_RING_ALIGN          16   /* sizeof(struct shm_ring_record_hdr) */
+#define SHM_RING_MAX_READERS    16
+#define SHM_RING_FLAG_PAD       0x1
+#define SHM_RING_DEFAULT_SIZE   (64 * 1024 * 1024)
+
+struct shm_ring_reader_slot {
+    int32_t pid;                /* reader process, or zero if the slot is free */
+    uint32_t reserved;
+    uint64_t position;          /* position of the next record to be read      */
+    uint64_t records_read;
+    uint64_t records_lost;      /* records overwritten before they were read   */
+    uint64_t overruns;          /* times that the reader was overrun           */
+} __attribute__((aligned(64)));
+
+struct shm_ring_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t data_offset;       /* offset of the data area from the header     */
+    uint64_t capacity;          /* size of the data area in bytes              */
+    int32_t  writer_pid;
+    uint32_t closed;            /* nonzero once the writer has stopped         */
+    uint64_t records_dropped;   /* records larger than the ring, not written   */
+    uint64_t head __attribute__((aligned(64)));  /* end of the last record     */
+    uint64_t next_seq;          /* sequence number of the next record          */
+    uint64_t tail __attribute__((aligned(64)));  /* start of the oldest record */
+    struct shm_ring_reader_slot readers[SHM_RING_MAX_READERS];
+};
+
+struct shm_ring_record_hdr {
+    uint32_t length;            /* bytes of record data                        */
+    uint32_t flags;             /* SHM_RING_FLAG_PAD, or zero                  */
+    uint64_t seq;               /* sequence number                             */
+};
+
+/*
+ * struct shm_ring is a handle on a mapped ring, for a writer or a
+ * reader
+ */
+struct shm_ring {
+    struct shm_ring_header *hdr;
+    uint8_t *data;
+    size_t map_size;
+    struct shm_ring_reader_slot *slot;  /* reader only */
+    uint64_t position;                  /* reader only */
+    uint64_t expected_seq;              /* reader only */
+};
+
+/*
+ * shm_ring_create(r, name, size) creates the shared memory object
+ * name (e.g. /mercury, in /dev/shm/mercury; a leading slash is added
+ * if there is none) with a data area of size bytes, rounded up to a
+ * power of two, replacing any existing object with that name, and
+ * maps it into r for writing.  Returns 0 on success and -1 on failure.
+ */
+int shm_ring_create(struct shm_ring *r, const char *name, size_t size);
+
+/*
+ * shm_ring_write(r, data, length) publishes a record; it returns 0 on
+ * success, and -1 if the record is too large for the ring
+ */
+int shm_ring_write(struct shm_ring *r, const void *data, size_t length);
+
+/*
+ * shm_ring_close(r) marks the ring as closed and unmaps it; no other
+ * thread may be reading r->hdr
+ */
+void shm_ring_close(struct shm_ring *r);
+
+enum shm_ring_start {
+    shm_ring_start_oldest = 0,  /* read the records already in the ring first */
+    shm_ring_start_newest = 1   /* read only records published after attaching */
+};
+
+/*
+ * shm_ring_attach(r, name, start) maps the ring name into r for
+ * reading, and claims a reader slot in it (if one is free).  Returns 0
+ * on success and -1 on failure.
+ */
+int shm_ring_attach(struct shm_ring *r, const char *name, enum shm_ring_start start);
+
+/*
+ * shm_ring_read(r, buf, buf_len, lost) copies the next record into
+ * buf and returns its length; it returns zero if no record is
+ * available, and -1 if the ring is closed and all of its records have
+ * been read.  If lost is not NULL, it is set to the number of records
+ * lost to overruns before this one.  Records longer than buf_len are
+ * truncated.
+ */
+ssize_t shm_ring_read(struct shm_ring *r, void *buf, size_t buf_len, uint64_t *lost);
+
+/*
+ * shm_ring_detach(r) releases the reader slot and unmaps the ring
+ */
+void shm_ring_detach(struct shm_ring *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHM_RING_H */
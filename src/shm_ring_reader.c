@@ -0,0 +1,95 @@
+/*
+ * shm_ring_reader.c
+ *
+ * example reader for mercury's shared memory ring output (--shm),
+ * which writes each record to stdout, and the number of records lost
+ * to overruns to stderr
+ *
+ * USAGE: shm_ring_reader [-n] [-x] name
+ *
+ *    -n   read only the records published after attaching (by default,
+ *         the records already in the ring are read first)
+ *    -x   exit when all records have been read, rather than waiting
+ *         for more; the reader always exits once mercury has stopped
+ *         and all records have been read
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include "shm_ring.h"
+
+#define READ_BUFFER_SIZE  65536
+#define POLL_INTERVAL     1000     /* microseconds to sleep when the ring is empty */
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+    enum shm_ring_start start = shm_ring_start_oldest;
+    int exit_when_empty = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "nx")) != -1) {
+        switch (opt) {
+        case 'n':
+            start = shm_ring_start_newest;
+            break;
+        case 'x':
+            exit_when_empty = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n] [-x] name\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-n] [-x] name\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct shm_ring ring;
+    if (shm_ring_attach(&ring, argv[optind], start) != 0) {
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    static char buf[READ_BUFFER_SIZE];
+    uint64_t records = 0, total_lost = 0;
+    while (!stop) {
+        uint64_t lost = 0;
+        ssize_t len = shm_ring_read(&ring, buf, sizeof(buf), &lost);
+        if (lost) {
+            fprintf(stderr, "warning: %" PRIu64 " records lost to overrun\n", lost);
+            total_lost += lost;
+        }
+        if (len < 0) {
+            break;  /* the writer has stopped, and we have read everything */
+        }
+        if (len == 0) {
+            if (exit_when_empty) {
+                break;
+            }
+            usleep(POLL_INTERVAL);
+            continue;
+        }
+        fwrite(buf, len, 1, stdout);
+        records++;
+    }
+    shm_ring_detach(&ring);
+    fflush(stdout);
+
+    fprintf(stderr, "read %" PRIu64 " records, lost %" PRIu64 "\n", records, total_lost);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,363 @@
+/*
+ * simd_encode.h
+ *
+ * vectorized hex, base64, and JSON string escaping, with runtime CPU
+ * dispatch and a portable scalar fallback
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef SIMD_ENCODE_H
+#define SIMD_ENCODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_ENCODE_X86 1
+#include <immintrin.h>
+#endif
+
+static char hex_table[] = {'0', '1', '2', '3',
+                           '4', '5', '6', '7',
+                           '8', '9', 'a', 'b',
+                           'c', 'd', 'e', 'f'};
+
+static char encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
+                                'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
+                                'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
+                                'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
+                                'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
+                                'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
+                                'w', 'x', 'y', 'z', '0', '1', '2', '3',
+                                '4', '5', '6', '7', '8', '9', '+', '/'};
+
+/*
+ * The encoders below write to an output buffer that the caller
+ * guarantees to be large enough for the worst case, and return the
+ * number of bytes written.  They perform no bounds checking;
+ * buffer_stream.h uses them only after it has checked that the whole
+ * output fits, and otherwise falls back to its byte-at-a-time path,
+ * so that truncated output is unchanged.
+ *
+ *    hex_encode(out, in, len)          writes exactly 2 * len bytes
+ *    base64_encode(out, in, len)       writes exactly base64_length(len)
+ *                                      bytes, including '=' padding
+ *    json_escape(out, in, len)         writes at most 6 * len bytes
+ *
+ * json_escape() uses the same rules as append_json_string_escaped():
+ * bytes below 0x20 and above 0x7f are written as \u00XX, and '"' and
+ * '\' are preceded by a backslash.
+ */
+
+static inline size_t base64_length(size_t len) {
+    return ((len + 2) / 3) * 4;
+}
+
+static inline size_t hex_encode_scalar(char *out, const uint8_t *in, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        out[2*i]     = hex_table[in[i] >> 4];
+        out[2*i + 1] = hex_table[in[i] & 0x0f];
+    }
+    return 2 * len;
+}
+
+static inline size_t base64_encode_scalar(char *out, const uint8_t *in, size_t len) {
+    char *o = out;
+    size_t i = 0;
+    for ( ; i + 3 <= len; i += 3) {
+        uint32_t trip = (in[i] << 0x10) + (in[i+1] << 0x08) + in[i+2];
+        *o++ = encoding_table[(trip >> 18) & 0x3f];
+        *o++ = encoding_table[(trip >> 12) & 0x3f];
+        *o++ = encoding_table[(trip >>  6) & 0x3f];
+        *o++ = encoding_table[trip & 0x3f];
+    }
+    if (len - i == 1) {
+        uint32_t trip = in[i] << 0x10;
+        *o++ = encoding_table[(trip >> 18) & 0x3f];
+        *o++ = encoding_table[(trip >> 12) & 0x3f];
+        *o++ = '=';
+        *o++ = '=';
+    } else if (len - i == 2) {
+        uint32_t trip = (in[i] << 0x10) + (in[i+1] << 0x08);
+        *o++ = encoding_table[(trip >> 18) & 0x3f];
+        *o++ = encoding_table[(trip >> 12) & 0x3f];
+        *o++ = encoding_table[(trip >>  6) & 0x3f];
+        *o++ = '=';
+    }
+    return o - out;
+}
+
+static inline char *json_escape_byte(char *o, uint8_t c) {
+    if (c < 0x20 || c > 0x7f) {
+        *o++ = '\\';
+        *o++ = 'u';
+        *o++ = '0';
+        *o++ = '0';
+        *o++ = hex_table[c >> 4];
+        *o++ = hex_table[c & 0x0f];
+    } else {
+        if (c == '"' || c == '\\') {
+            *o++ = '\\';
+        }
+        *o++ = c;
+    }
+    return o;
+}
+
+static inline size_t json_escape_scalar(char *out, const uint8_t *in, size_t len) {
+    char *o = out;
+    for (size_t i = 0; i < len; i++) {
+        o = json_escape_byte(o, in[i]);
+    }
+    return o - out;
+}
+
+#ifdef SIMD_ENCODE_X86
+
+/*
+ * SSSE3 kernels: pshufb is used as a 16-entry lookup table for hex
+ * digits and for the base64 alphabet offsets; the base64 bit
+ * manipulation follows the well-known multiply-shift approach of
+ * W. Mula and D. Lemire, "Faster Base64 Encoding and Decoding using
+ * AVX2 Instructions" (2018).
+ */
+
+__attribute__((target("ssse3")))
+static inline void hex_encode_16_ssse3(char *out, __m128i v) {
+    const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+    __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), low_nibble));
+    __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, low_nibble));
+    _mm_storeu_si128((__m128i *)out,        _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi8(hi, lo));
+}
+
+__attribute__((target("ssse3")))
+static inline size_t hex_encode_ssse3(char *out, const uint8_t *in, size_t len) {
+    size_t i = 0;
+    for ( ; i + 16 <= len; i += 16) {
+        hex_encode_16_ssse3(out + 2*i, _mm_loadu_si128((const __m128i *)(in + i)));
+    }
+    hex_encode_scalar(out + 2*i, in + i, len - i);
+    return 2 * len;
+}
+
+// base64_lookup_ssse3(indices) maps each byte in [0, 63] to its
+// character in the base64 alphabet
+//
+__attribute__((target("ssse3")))
+static inline __m128i base64_lookup_ssse3(__m128i indices) {
+    const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                            '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                            '/' - 63, 'A', 0, 0);
+    __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    result = _mm_shuffle_epi8(shift_lut, result);
+    return _mm_add_epi8(result, indices);
+}
+
+// base64_split_ssse3(v) takes the first 12 bytes of v and returns
+// the sixteen 6-bit indices that encode them
+//
+__attribute__((target("ssse3")))
+static inline __m128i base64_split_ssse3(__m128i v) {
+    __m128i in = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11,  9, 10,
+                                                   7,  8,  6,  7,
+                                                   4,  5,  3,  4,
+                                                   1,  2,  0,  1));
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static inline size_t base64_encode_ssse3(char *out, const uint8_t *in, size_t len) {
+    char *o = out;
+    size_t i = 0;
+    for ( ; i + 16 <= len; i += 12) {   // reads 16 bytes, consumes 12
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)o, base64_lookup_ssse3(base64_split_ssse3(v)));
+        o += 16;
+    }
+    o += base64_encode_scalar(o, in + i, len - i);
+    return o - out;
+}
+
+__attribute__((target("ssse3")))
+static inline size_t json_escape_ssse3(char *out, const uint8_t *in, size_t len) {
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    char *o = out;
+    size_t i = 0;
+    while (i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+
+        // a signed compare against 0x20 catches both control
+        // characters and bytes with the high bit set
+        //
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                                    _mm_cmpeq_epi8(v, backslash)));
+        unsigned int mask = _mm_movemask_epi8(special);
+        _mm_storeu_si128((__m128i *)o, v);
+        if (mask == 0) {
+            o += 16;
+            i += 16;
+            continue;
+        }
+        unsigned int clean = __builtin_ctz(mask);
+        o += clean;
+        i += clean;
+        o = json_escape_byte(o, in[i++]);
+    }
+    o += json_escape_scalar(o, in + i, len - i);
+    return o - out;
+}
+
+/*
+ * AVX2 kernels: the same algorithms as above, operating on two
+ * 128-bit lanes at a time
+ */
+
+__attribute__((target("avx2")))
+static inline size_t hex_encode_avx2(char *out, const uint8_t *in, size_t len) {
+    const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                            '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+                                            '0', '1', '2', '3', '4', '5', '6', '7',
+                                            '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+    const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for ( ; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibble));
+        __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(v, low_nibble));
+        __m256i a = _mm256_unpacklo_epi8(hi, lo);   // bytes 0-7 | 16-23
+        __m256i b = _mm256_unpackhi_epi8(hi, lo);   // bytes 8-15 | 24-31
+        _mm256_storeu_si256((__m256i *)(out + 2*i),      _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + 2*i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    hex_encode_ssse3(out + 2*i, in + i, len - i);
+    return 2 * len;
+}
+
+__attribute__((target("avx2")))
+static inline size_t base64_encode_avx2(char *out, const uint8_t *in, size_t len) {
+    const __m256i shuffle = _mm256_set_epi8(10, 11,  9, 10,  7,  8,  6,  7,
+                                             4,  5,  3,  4,  1,  2,  0,  1,
+                                            10, 11,  9, 10,  7,  8,  6,  7,
+                                             4,  5,  3,  4,  1,  2,  0,  1);
+    const __m256i shift_lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                               '/' - 63, 'A', 0, 0,
+                                               'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                               '/' - 63, 'A', 0, 0);
+    char *o = out;
+    size_t i = 0;
+    for ( ; i + 28 <= len; i += 24) {   // reads 28 bytes, consumes 24
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + i))),
+                                            _mm_loadu_si128((const __m128i *)(in + i + 12)), 1);
+        __m256i x = _mm256_shuffle_epi8(v, shuffle);
+        __m256i t0 = _mm256_and_si256(x, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(x, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        result = _mm256_shuffle_epi8(shift_lut, result);
+        _mm256_storeu_si256((__m256i *)o, _mm256_add_epi8(result, indices));
+        o += 32;
+    }
+    o += base64_encode_ssse3(o, in + i, len - i);
+    return o - out;
+}
+
+__attribute__((target("avx2")))
+static inline size_t json_escape_avx2(char *out, const uint8_t *in, size_t len) {
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    char *o = out;
+    size_t i = 0;
+    while (i + 32 <= len) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i special = _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+                                          _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                                          _mm256_cmpeq_epi8(v, backslash)));
+        unsigned int mask = _mm256_movemask_epi8(special);
+        _mm256_storeu_si256((__m256i *)o, v);
+        if (mask == 0) {
+            o += 32;
+            i += 32;
+            continue;
+        }
+        unsigned int clean = __builtin_ctz(mask);
+        o += clean;
+        i += clean;
+        o = json_escape_byte(o, in[i++]);
+    }
+    o += json_escape_ssse3(o, in + i, len - i);
+    return o - out;
+}
+
+#endif /* SIMD_ENCODE_X86 */
+
+/*
+ * struct simd_encoder holds one implementation of each encoder;
+ * simd_encoder_select() returns the best one supported by the CPU
+ * that we are running on, which is determined once
+ */
+struct simd_encoder {
+    const char *name;
+    size_t (*hex)(char *out, const uint8_t *in, size_t len);
+    size_t (*base64)(char *out, const uint8_t *in, size_t len);
+    size_t (*json_escape)(char *out, const uint8_t *in, size_t len);
+};
+
+static const struct simd_encoder simd_encoder_scalar = {
+    "scalar", hex_encode_scalar, base64_encode_scalar, json_escape_scalar
+};
+
+#ifdef SIMD_ENCODE_X86
+static const struct simd_encoder simd_encoder_ssse3 = {
+    "ssse3", hex_encode_ssse3, base64_encode_ssse3, json_escape_ssse3
+};
+
+static const struct simd_encoder simd_encoder_avx2 = {
+    "avx2", hex_encode_avx2, base64_encode_avx2, json_escape_avx2
+};
+#endif
+
+static inline const struct simd_encoder *simd_encoder_detect() {
+#ifdef SIMD_ENCODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &simd_encoder_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return &simd_encoder_ssse3;
+    }
+#endif
+    return &simd_encoder_scalar;
+}
+
+static inline const struct simd_encoder &simd_encoder_select() {
+    static const struct simd_encoder *encoder = simd_encoder_detect();
+    return *encoder;
+}
+
+#endif /* SIMD_ENCODE_H */
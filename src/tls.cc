@@ -5,7 +5,6 @@
 #include "extractor.h"
 #include "json_object.h"
 #include "tls.h"
-#include "match.h"
 #include "asn1/x509.h"
 
 /* TLS Constants */
@@ -35,11 +34,6 @@
 #define L_CertificateLength        3
 #define L_CertificateListLength    3
 
-/*
- * expanded set of static extensions
- */
-#define num_static_extension_types 34
-
 /*
  * extension types used in normalization
  */
@@ -48,42 +42,51 @@
 #define type_supported_versions 0x002b
 #define type_session_ticket     0x0023
 
-static uint16_t static_extension_types[num_static_extension_types] = {
-        1,         /* max fragment length                    */
-        5,         /* status_request                         */
-        7,         /* client authz                           */
-        8,         /* server authz                           */
-        9,         /* cert type                              */
-        10,        /* supported_groups                       */
-        11,        /* ec_point_formats                       */
-        13,        /* signature_algorithms                   */
-        15,        /* heartbeat                              */
-        16,        /* application_layer_protocol_negotiation */
-        17,        /* status request v2                      */
-        24,        /* token binding                          */
-        27,        /* compressed certificate                 */
-        28,        /* record size limit                      */
-        43,        /* supported_versions                     */
-        45,        /* psk_key_exchange_modes                 */
-        50,        /* signature algorithms cert              */
-        2570,      /* GREASE                                 */
-        6682,      /* GREASE                                 */
-        10794,     /* GREASE                                 */
-        14906,     /* GREASE                                 */
-        19018,     /* GREASE                                 */
-        21760,     /* token binding (old)                    */
-        23130,     /* GREASE                                 */
-        27242,     /* GREASE                                 */
-        31354,     /* GREASE                                 */
-        35466,     /* GREASE                                 */
-        39578,     /* GREASE                                 */
-        43690,     /* GREASE                                 */
-        47802,     /* GREASE                                 */
-        51914,     /* GREASE                                 */
-        56026,     /* GREASE                                 */
-        60138,     /* GREASE                                 */
-        64250      /* GREASE                                 */
-    };
+/*
+ * expanded set of static extensions, whose values are included in
+ * fingerprints:
+ *
+ *    1      max fragment length
+ *    5      status_request
+ *    7      client authz
+ *    8      server authz
+ *    9      cert type
+ *    10     supported_groups
+ *    11     ec_point_formats
+ *    13     signature_algorithms
+ *    15     heartbeat
+ *    16     application_layer_protocol_negotiation
+ *    17     status request v2
+ *    24     token binding
+ *    27     compressed certificate
+ *    28     record size limit
+ *    43     supported_versions
+ *    45     psk_key_exchange_modes
+ *    50     signature algorithms cert
+ *    21760  token binding (old)
+ *
+ * along with the sixteen GREASE values 0x0a0a, 0x1a1a, ..., 0xfafa.
+ * The types below 64 are held in a bitmap, so that
+ * extension_type_is_static() takes constant time.
+ */
+#define bit(x) ((uint64_t)1 << (x))
+
+static const uint64_t static_extension_types_below_64 =
+    bit(1)  | bit(5)  | bit(7)  | bit(8)  | bit(9)  | bit(10) | bit(11) |
+    bit(13) | bit(15) | bit(16) | bit(17) | bit(24) | bit(27) | bit(28) |
+    bit(43) | bit(45) | bit(50);
+
+#undef bit
+
+static inline bool extension_type_is_static(uint16_t type) {
+    if (type < 64) {
+        return static_extension_types_below_64 & ((uint64_t)1 << type);
+    }
+    if ((type & 0x0f0f) == 0x0a0a && (type >> 8) == (type & 0xff)) {
+        return true;  /* GREASE */
+    }
+    return type == 21760;
+}
 
 uint16_t degrease_uint16(uint16_t x);
 void degrease_octet_string(void *data, ssize_t len);
@@ -118,160 +121,167 @@ struct tls_security_assessment tls_client_hello::security_assesment() {
     return a;
 }
 
-void tls_extensions::print(struct json_object &o, const char *key) const {
-
-    struct datum ext_parser{this->data, this->data_end};
-
-    struct json_array array{o, key};
+/*
+ * read_extension(p, type, value) reads the extension at the start of p
+ * into type and value, and advances p past it; it returns false (and
+ * leaves p unchanged) if p does not start with a complete extension
+ */
+static inline bool read_extension(struct datum &p, uint16_t &type, struct datum &value) {
+    struct datum tmp{p.data, p.data_end};
+    uint16_t length;
+    if (tmp.read_uint16(&type) == false || tmp.read_uint16(&length) == false || length > tmp.length()) {
+        return false;
+    }
+    value.data = tmp.data;
+    value.data_end = tmp.data + length;
+    p.data = value.data_end;
+    return true;
+}
 
-    while (parser_get_data_length(&ext_parser) > 0) {
-        size_t tmp_len = 0;
-        size_t tmp_type;
+void tls_extensions::build_index() {
+    num_indexed = 0;
+    unindexed = nullptr;
+    present = 0;
 
-        const uint8_t *data = ext_parser.data;
-        if (parser_read_and_skip_uint(&ext_parser, L_ExtensionType, &tmp_type) == status_err) {
-            break;
+    struct datum ext_parser{this->data, this->data_end};
+    uint16_t type;
+    struct datum value;
+    while (ext_parser.length() > 0) {
+        if (num_indexed == max_indexed_extensions || ext_parser.data - data > UINT16_MAX) {
+            unindexed = ext_parser.data;  /* leave the rest for for_each_extension() */
+            return;
         }
-        if (parser_read_and_skip_uint(&ext_parser, L_ExtensionLength, &tmp_len) == status_err) {
-            break;
+        const uint8_t *start_of_extension = ext_parser.data;
+        if (read_extension(ext_parser, type, value) == false) {
+            return;
         }
-        if (parser_skip(&ext_parser, tmp_len) == status_err) {
-            break;
+        index[num_indexed].type = type;
+        index[num_indexed].offset = start_of_extension - data;
+        index[num_indexed].length = value.length();
+        num_indexed++;
+        if (type < 64) {
+            present |= (uint64_t)1 << type;
         }
-
-        struct datum ext{data, ext_parser.data};
-        array.print_hex(ext);
-
     }
+}
 
-    array.close();
+/*
+ * for_each_extension(e, f) calls f(type, ext, value) for each
+ * extension in e, in order, where ext holds the entire extension and
+ * value holds its value, using the index of e and then (if needed)
+ * walking its unindexed extensions; f returns false to stop
+ */
+template <typename F>
+static inline void for_each_extension(const struct tls_extensions &e, F f) {
+    for (unsigned int i = 0; i < e.num_indexed; i++) {
+        const uint8_t *start_of_extension = e.data + e.index[i].offset;
+        const uint8_t *value_start = start_of_extension + L_ExtensionType + L_ExtensionLength;
+        struct datum ext{start_of_extension, value_start + e.index[i].length};
+        struct datum value{value_start, ext.data_end};
+        if (f(e.index[i].type, ext, value) == false) {
+            return;
+        }
+    }
+    if (e.unindexed != nullptr) {
+        struct datum ext_parser{e.unindexed, e.data_end};
+        uint16_t type;
+        struct datum value;
+        while (ext_parser.length() > 0) {
+            const uint8_t *start_of_extension = ext_parser.data;
+            if (read_extension(ext_parser, type, value) == false) {
+                return;
+            }
+            struct datum ext{start_of_extension, ext_parser.data};
+            if (f(type, ext, value) == false) {
+                return;
+            }
+        }
+    }
 }
 
-void tls_extensions::print_server_name(struct json_object &o, const char *key) const {
+void tls_extensions::print(struct json_object &o, const char *key) const {
 
-    struct datum ext_parser{this->data, this->data_end};
+    struct json_array array{o, key};
 
-    while (parser_get_data_length(&ext_parser) > 0) {
-        size_t tmp_len = 0;
-        size_t tmp_type;
+    for_each_extension(*this, [&array](uint16_t, struct datum &ext, struct datum &) {
+        array.print_hex(ext);
+        return true;
+    });
 
-        const uint8_t *data = ext_parser.data;
-        if (parser_read_and_skip_uint(&ext_parser, L_ExtensionType, &tmp_type) == status_err) {
-            break;
-        }
-        if (parser_read_and_skip_uint(&ext_parser, L_ExtensionLength, &tmp_len) == status_err) {
-            break;
-        }
-        if (parser_skip(&ext_parser, tmp_len) == status_err) {
-            break;
-        }
-        const uint8_t *data_end = ext_parser.data;
+    array.close();
+}
 
-        if (tmp_type == type_sni) {
-            struct datum ext{data, data_end};
+void tls_extensions::print_server_name(struct json_object &o, const char *key) const {
+
+    if (!may_contain(type_sni)) {
+        return;
+    }
+    for_each_extension(*this, [&o, key](uint16_t type, struct datum &ext, struct datum &) {
+        if (type == type_sni) {
             //            tls.print_key_json_string("server_name", pf.x.packet_data.value + SNI_HDR_LEN, pf.x.packet_data.length - SNI_HDR_LEN);
             // o.print_key_json_string(key, ext.data + SNI_HDR_LEN, ext.length() - SNI_HDR_LEN);
             ext.skip(SNI_HDR_LEN);
             o.print_key_json_string(key, ext);
         }
-    }
+        return true;
+    });
 
 }
 
 void tls_extensions::set_server_name(struct datum &server_name) const {
 
-    struct datum ext_parser{this->data, this->data_end};
-
-    while (parser_get_data_length(&ext_parser) > 0) {
-        size_t tmp_len = 0;
-        size_t tmp_type;
-
-        const uint8_t *data = ext_parser.data;
-        if (parser_read_and_skip_uint(&ext_parser, L_ExtensionType, &tmp_type) == status_err) {
-            break;
-        }
-        if (parser_read_and_skip_uint(&ext_parser, L_ExtensionLength, &tmp_len) == status_err) {
-            break;
-        }
-        if (parser_skip(&ext_parser, tmp_len) == status_err) {
-            break;
-        }
-        const uint8_t *data_end = ext_parser.data;
-
-        if (tmp_type == type_sni) {
-            struct datum ext{data, data_end};
+    if (!may_contain(type_sni)) {
+        return;
+    }
+    for_each_extension(*this, [&server_name](uint16_t type, struct datum &ext, struct datum &) {
+        if (type == type_sni) {
             ext.skip(SNI_HDR_LEN);
             server_name = ext;
-            return;
+            return false;
         }
-    }
+        return true;
+    });
 
 }
 
-struct tls_extension {
-    uint16_t type;
-    uint16_t length;
-    struct datum value;
-
-    tls_extension(struct datum &p) : type{0}, length{0}, value{NULL, NULL} {
+bool tls_extensions::find(uint16_t type, struct datum &value) const {
 
-        if (p.read_uint16(&type) == false) { return; }
-        if (p.read_uint16(&length) == false) { return; }
-        if (length <= p.length()) {
-            value.data = p.data;
-            value.data_end = value.data + length;
-            p.data += length;
-        }
+    if (!may_contain(type)) {
+        return false;
     }
-};
+    bool found = false;
+    for_each_extension(*this, [type, &value, &found](uint16_t ext_type, struct datum &, struct datum &ext_value) {
+        if (ext_type == type) {
+            value = ext_value;
+            found = true;
+            return false;
+        }
+        return true;
+    });
+    return found;
+}
 
 void tls_extensions::fingerprint(struct buffer_stream &b) const {
 
-    struct datum ext_parser{this->data, this->data_end};
-
-    while (parser_get_data_length(&ext_parser) > 0) {
-
-        const uint8_t *start_of_extension = ext_parser.data;
-        tls_extension x{ext_parser};
-        const uint8_t *end_of_extension = ext_parser.data;
-        if (x.value.data == NULL) {
-            break;
-        }
-        if (uint16_match(x.type, static_extension_types, num_static_extension_types) == true) {
-            b.write_char('(');
-            raw_as_hex_degrease(b, start_of_extension, L_ExtensionType);
-            b.raw_as_hex(start_of_extension + L_ExtensionType, end_of_extension - start_of_extension - L_ExtensionType);
-            b.write_char(')');
-        } else {
-            b.write_char('(');
-            raw_as_hex_degrease(b, start_of_extension, L_ExtensionType);
-            b.write_char(')');
+    for_each_extension(*this, [&b](uint16_t type, struct datum &ext, struct datum &) {
+        b.write_char('(');
+        raw_as_hex_degrease(b, ext.data, L_ExtensionType);
+        if (extension_type_is_static(type)) {
+            b.raw_as_hex(ext.data + L_ExtensionType, ext.length() - L_ExtensionType);
         }
-
-    }
+        b.write_char(')');
+        return true;
+    });
 
 }
 
 void tls_extensions::print_session_ticket(struct json_object &o, const char *key) const {
 
-    struct datum ext_parser{this->data, this->data_end};
-
-    while (parser_get_data_length(&ext_parser) > 0) {
-        size_t tmp_len = 0;
-        size_t tmp_type;
-
-        const uint8_t *data = ext_parser.data;
-        if (parser_read_and_skip_uint(&ext_parser, L_ExtensionType, &tmp_type) == status_err) {
-            break;
-        }
-        if (parser_read_and_skip_uint(&ext_parser, L_ExtensionLength, &tmp_len) == status_err) {
-            break;
-        }
-        if (parser_skip(&ext_parser, tmp_len) == status_err) {
-            break;
-        }
-
-        if (tmp_type == type_session_ticket) {
+    if (!may_contain(type_session_ticket)) {
+        return;
+    }
+    for_each_extension(*this, [&o, key](uint16_t type, struct datum &, struct datum &value) {
+        if (type == type_session_ticket) {
 
             // possible format, as per https://tools.ietf.org/html/rfc5077#section-4
             //
@@ -282,10 +292,10 @@ void tls_extensions::print_session_ticket(struct json_object &o, const char *key
             //    opaque mac[32];
             // } ticket;
 
-            struct datum ext{data + L_ExtensionType + L_ExtensionLength, ext_parser.data};
-            o.print_key_hex(key, ext);
+            o.print_key_hex(key, value);
         }
-    }
+        return true;
+    });
 
 }
 
@@ -533,3 +543,9 @@ void tls_server_certificate::write_json(struct json_array &a, bool json_output)
         }
     }
 }
+
+std::string x509_cert_get_json_string(const uint8_t *data, size_t length) {
+    struct x509_cert c;
+    c.parse(data, length);
+    return c.get_json_string();
+}
@@ -199,6 +199,15 @@ struct tls_server_certificate {
 
 };
 
+/*
+ * x509_cert_get_json_string(data, length) returns the JSON object for
+ * the DER certificate at data, as in the "cert" objects of TLS server
+ * records.  It lives here because asn1/x509.h defines functions that
+ * are not inline, and thus can be included by only one translation
+ * unit of a program.
+ */
+std::string x509_cert_get_json_string(const uint8_t *data, size_t length);
+
 #define L_ExtensionType            2
 #define L_ExtensionLength          2
 
@@ -211,11 +220,55 @@ struct tls_server_certificate {
 
 #define SNI_HDR_LEN 9
 
+/*
+ * struct tls_extensions holds the extensions vector of a clientHello
+ * or serverHello, along with an index of it that is built once, when
+ * the vector is parsed, and then used by each of the functions that
+ * read the extensions.  The index holds the type, offset (relative to
+ * data), and length of each of the first max_indexed_extensions
+ * extensions, and a bitmap of the types below 64 that are present;
+ * if there are more extensions than that, unindexed points to the
+ * first of them, and they are found by walking the vector from there.
+ * The index ends at the first malformed extension, as does the walk.
+ */
 struct tls_extensions : public datum {
 
+    static constexpr unsigned int max_indexed_extensions = 64;
+
+    struct index_entry {
+        uint16_t type;
+        uint16_t offset;   /* of the extension's type field        */
+        uint16_t length;   /* of the extension's (variable) value   */
+    };
+
+    struct index_entry index[max_indexed_extensions];
+    unsigned int num_indexed = 0;
+    const uint8_t *unindexed = nullptr;
+    uint64_t present = 0;
+
     tls_extensions() = default;
 
-    tls_extensions(const uint8_t *data, const uint8_t *data_end) : datum{data, data_end} {}
+    tls_extensions(const uint8_t *data, const uint8_t *data_end) : datum{data, data_end} {
+        build_index();
+    }
+
+    void parse(struct datum &p, size_t num_bytes) {
+        datum::parse(p, num_bytes);
+        build_index();
+    }
+
+    void parse_soft_fail(struct datum &p, size_t num_bytes) {
+        datum::parse_soft_fail(p, num_bytes);
+        build_index();
+    }
+
+    /*
+     * may_contain(type) returns false if an extension of the given
+     * type is certainly not present, and true otherwise
+     */
+    bool may_contain(uint16_t type) const {
+        return unindexed != nullptr || type >= 64 || (present & ((uint64_t)1 << type));
+    }
 
     void print(struct json_object &o, const char *key) const;
 
@@ -223,9 +276,17 @@ struct tls_extensions : public datum {
 
     void set_server_name(struct datum &server_name) const;
 
+    /*
+     * find(type, value) sets value to the value of the first
+     * extension of the given type, and returns true, if there is one
+     */
+    bool find(uint16_t type, struct datum &value) const;
+
     void print_session_ticket(struct json_object &o, const char *key) const;
 
     void fingerprint(struct buffer_stream &b) const;
+
+    void build_index();
 };
 
 
@@ -0,0 +1,712 @@
+/*
+ * tls_decrypt.cc
+ *
+ * offline decryption of TLS sessions with a key log file (RFC 5246,
+ * RFC 8446, and the NSS key log format)
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <openssl/hmac.h>
+#include "tls_decrypt.h"
+#include "tls.h"
+
+/*
+ * tls_keylog_labels[] lists the labels of the key log lines that are
+ * used in decryption, and the secrets that they set; the labels of
+ * the other lines (e.g. EXPORTER_SECRET) are ignored
+ */
+static const struct {
+    const char *label;
+    struct tls_secret tls_session_secrets::*secret;
+} tls_keylog_labels[] = {
+    { "CLIENT_RANDOM",                   &tls_session_secrets::master_secret                   },
+    { "CLIENT_HANDSHAKE_TRAFFIC_SECRET", &tls_session_secrets::client_handshake_traffic_secret },
+    { "SERVER_HANDSHAKE_TRAFFIC_SECRET", &tls_session_secrets::server_handshake_traffic_secret },
+    { "CLIENT_TRAFFIC_SECRET_0",         &tls_session_secrets::client_traffic_secret_0         },
+    { "SERVER_TRAFFIC_SECRET_0",         &tls_session_secrets::server_traffic_secret_0         },
+};
+
+/*
+ * hex_decode(hex, out, out_len) decodes the null-terminated hex string
+ * into out, and returns the number of bytes decoded, or zero if hex is
+ * not a hex string of at most out_len bytes
+ */
+static size_t hex_decode(const char *hex, uint8_t *out, size_t out_len) {
+    size_t hex_len = strlen(hex);
+    if (hex_len == 0 || hex_len % 2 || hex_len / 2 > out_len) {
+        return 0;
+    }
+    for (size_t i = 0; i < hex_len; i++) {
+        char c = hex[i];
+        uint8_t nibble;
+        if (c >= '0' && c <= '9') {
+            nibble = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            nibble = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            nibble = c - 'A' + 10;
+        } else {
+            return 0;
+        }
+        if (i % 2 == 0) {
+            out[i / 2] = nibble << 4;
+        } else {
+            out[i / 2] |= nibble;
+        }
+    }
+    return hex_len / 2;
+}
+
+bool tls_keylog::load(const char *filename, int verbosity) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "error: could not open key log file %s (%s)\n", filename, strerror(errno));
+        return false;
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t num_secrets = 0;
+    size_t num_malformed = 0;
+    while (getline(&line, &line_size, f) != -1) {
+        char *saveptr = NULL;
+        const char *label = strtok_r(line, " \t\r\n", &saveptr);
+        const char *random_hex = strtok_r(NULL, " \t\r\n", &saveptr);
+        const char *secret_hex = strtok_r(NULL, " \t\r\n", &saveptr);
+        if (label == NULL || label[0] == '#') {
+            continue;   /* blank line or comment */
+        }
+        for (const auto &l : tls_keylog_labels) {
+            if (strcmp(label, l.label) != 0) {
+                continue;
+            }
+            tls_client_random random;
+            struct tls_secret secret;
+            if (random_hex == NULL || secret_hex == NULL
+                || hex_decode(random_hex, random.data(), random.size()) != random.size()
+                || (secret.length = hex_decode(secret_hex, secret.value, sizeof(secret.value))) == 0) {
+                num_malformed++;
+                break;
+            }
+            sessions[random].*l.secret = secret;   /* a new entry is zero-initialized */
+            num_secrets++;
+            break;
+        }
+    }
+    free(line);
+    fclose(f);
+    if (verbosity) {
+        fprintf(stderr, "read %zu secrets of %zu TLS sessions from key log file %s\n", num_secrets, sessions.size(), filename);
+    }
+    if (num_malformed) {
+        fprintf(stderr, "warning: ignored %zu malformed lines in key log file %s\n", num_malformed, filename);
+    }
+    return true;
+}
+
+const struct tls_session_secrets *tls_keylog::find(const uint8_t *client_random) const {
+    tls_client_random random;
+    memcpy(random.data(), client_random, random.size());
+    auto it = sessions.find(random);
+    return it == sessions.end() ? NULL : &it->second;
+}
+
+/*
+ * tls_cipher_suite_get(suite, md) returns the AEAD cipher of the
+ * cipher suite, and sets md to the hash used in its key derivation,
+ * or returns NULL if the suite is not supported
+ */
+static const EVP_CIPHER *tls_cipher_suite_get(uint16_t suite, const EVP_MD **md) {
+    switch (suite) {
+    case 0x1301:   /* TLS_AES_128_GCM_SHA256                        */
+    case 0x009c:   /* TLS_RSA_WITH_AES_128_GCM_SHA256               */
+    case 0x009e:   /* TLS_DHE_RSA_WITH_AES_128_GCM_SHA256           */
+    case 0xc02b:   /* TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256       */
+    case 0xc02f:   /* TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256         */
+        *md = EVP_sha256();
+        return EVP_aes_128_gcm();
+    case 0x1302:   /* TLS_AES_256_GCM_SHA384                        */
+    case 0x009d:   /* TLS_RSA_WITH_AES_256_GCM_SHA384               */
+    case 0x009f:   /* TLS_DHE_RSA_WITH_AES_256_GCM_SHA384           */
+    case 0xc02c:   /* TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384       */
+    case 0xc030:   /* TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384         */
+        *md = EVP_sha384();
+        return EVP_aes_256_gcm();
+    case 0x1303:   /* TLS_CHACHA20_POLY1305_SHA256                  */
+    case 0xcca8:   /* TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256   */
+    case 0xcca9:   /* TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256 */
+    case 0xccaa:   /* TLS_DHE_RSA_WITH_CHACHA20_POLY1305_SHA256     */
+        *md = EVP_sha256();
+        return EVP_chacha20_poly1305();
+    default:
+        ;
+    }
+    return NULL;
+}
+
+/*
+ * tls13_hkdf_expand_label(md, secret, label, out, out_len) implements
+ * HKDF-Expand-Label (RFC 8446, Section 7.1) with an empty context,
+ * for outputs of at most one hash length
+ */
+static bool tls13_hkdf_expand_label(const EVP_MD *md, const struct tls_secret &secret, const char *label, uint8_t *out, size_t out_len) {
+    const char prefix[] = "tls13 ";
+    size_t label_len = strlen(label);
+    uint8_t info[2 + 1 + sizeof(prefix) - 1 + 32 + 1 + 1];
+    if (out_len > (size_t)EVP_MD_size(md) || label_len > 32) {
+        return false;
+    }
+    size_t i = 0;
+    info[i++] = out_len >> 8;
+    info[i++] = out_len;
+    info[i++] = sizeof(prefix) - 1 + label_len;
+    memcpy(info + i, prefix, sizeof(prefix) - 1);
+    i += sizeof(prefix) - 1;
+    memcpy(info + i, label, label_len);
+    i += label_len;
+    info[i++] = 0;      /* context length */
+    info[i++] = 1;      /* HKDF-Expand block counter */
+
+    uint8_t block[EVP_MAX_MD_SIZE];
+    unsigned int block_len = sizeof(block);
+    if (HMAC(md, secret.value, secret.length, info, i, block, &block_len) == NULL) {
+        return false;
+    }
+    memcpy(out, block, out_len);
+    return true;
+}
+
+/*
+ * tls12_prf(md, secret, label, seed, out, out_len) implements the PRF
+ * of TLS 1.2 (RFC 5246, Section 5), P_hash(secret, label + seed)
+ */
+static bool tls12_prf(const EVP_MD *md, const struct tls_secret &secret, const char *label,
+                      const uint8_t *seed, size_t seed_len, uint8_t *out, size_t out_len) {
+    uint8_t label_seed[32 + 2 * TLS_RANDOM_LENGTH];
+    size_t label_len = strlen(label);
+    if (label_len + seed_len > sizeof(label_seed)) {
+        return false;
+    }
+    memcpy(label_seed, label, label_len);
+    memcpy(label_seed + label_len, seed, seed_len);
+    size_t label_seed_len = label_len + seed_len;
+
+    uint8_t a[EVP_MAX_MD_SIZE + sizeof(label_seed)];   /* A(i) + label + seed */
+    unsigned int a_len = EVP_MAX_MD_SIZE;
+    if (HMAC(md, secret.value, secret.length, label_seed, label_seed_len, a, &a_len) == NULL) {
+        return false;
+    }
+    while (out_len > 0) {
+        memcpy(a + a_len, label_seed, label_seed_len);
+        uint8_t block[EVP_MAX_MD_SIZE];
+        unsigned int block_len = sizeof(block);
+        if (HMAC(md, secret.value, secret.length, a, a_len + label_seed_len, block, &block_len) == NULL) {
+            return false;
+        }
+        size_t n = out_len < block_len ? out_len : block_len;
+        memcpy(out, block, n);
+        out += n;
+        out_len -= n;
+        if (HMAC(md, secret.value, secret.length, a, a_len, block, &block_len) == NULL) {
+            return false;
+        }
+        memcpy(a, block, block_len);
+        a_len = block_len;
+    }
+    return true;
+}
+
+/*
+ * TLS content types, handshake message types, and extension types
+ * used in decryption
+ */
+#define TLS_CHANGE_CIPHER_SPEC         20
+#define TLS_HANDSHAKE                  22
+#define TLS_APPLICATION_DATA           23
+
+#define TLS_SERVER_HELLO                2
+#define TLS_ENCRYPTED_EXTENSIONS        8
+#define TLS_FINISHED                   20
+#define TLS_KEY_UPDATE                 24
+
+#define TLS_EXT_ALPN               0x0010
+#define TLS_EXT_SUPPORTED_VERSIONS 0x002b
+
+#define TLS_VERSION_1_3            0x0304
+
+#define TLS_MAX_HANDSHAKE_LENGTH   (1 << 18)
+#define TLS_MAX_AUTH_FAILURES       8
+
+/*
+ * the random of a HelloRetryRequest, which has the form of a
+ * serverHello (RFC 8446, Section 4.1.3)
+ */
+static const uint8_t tls13_hello_retry_request_random[TLS_RANDOM_LENGTH] = {
+    0xcf, 0x21, 0xad, 0x74, 0xe5, 0x9a, 0x61, 0x11, 0xbe, 0x1d, 0x8c, 0x02, 0x1e, 0x65, 0xb8, 0x91,
+    0xc2, 0xa2, 0x11, 0x16, 0x7a, 0xbb, 0x8c, 0x5e, 0x07, 0x9e, 0x09, 0xe2, 0xc8, 0xa8, 0x33, 0x9c
+};
+
+/*
+ * set_app_protocol(s, extensions) sets the application protocol of
+ * the session from the ALPN extension of the server, if there is one
+ */
+static void set_app_protocol(struct tls_session &s, const struct tls_extensions &extensions) {
+    struct datum alpn;
+    if (!extensions.find(TLS_EXT_ALPN, alpn)) {
+        return;
+    }
+    uint16_t list_length;
+    uint8_t name_length;
+    alpn.read_uint16(&list_length);
+    alpn.read_uint8(&name_length);
+    struct datum name;
+    name.parse(alpn, name_length);
+    if (name.length() == 2 && memcmp(name.data, "h2", 2) == 0) {
+        s.app_protocol = tls_app_protocol::http2;
+    } else if (name.length() > 6 && memcmp(name.data, "http/1", 6) == 0) {
+        s.app_protocol = tls_app_protocol::http1;
+    }
+}
+
+/*
+ * is_http1_message(data, from_server) returns true if data starts
+ * with an HTTP/1.x response line (if from_server) or request line
+ */
+static bool is_http1_message(const struct datum &data, bool from_server) {
+    const char version[] = "HTTP/1.";
+    size_t version_len = sizeof(version) - 1;
+    if (from_server) {
+        return data.length() > (ssize_t)version_len && memcmp(data.data, version, version_len) == 0;
+    }
+    const uint8_t *eol = (const uint8_t *)memchr(data.data, '\r', data.length());
+    if (eol == NULL || eol - data.data < (ssize_t)version_len + 4) {
+        return false;
+    }
+    return memcmp(eol - version_len - 1, version, version_len) == 0 && eol[-version_len - 2] == ' ';
+}
+
+tls_decryptor::tls_decryptor(const struct tls_keylog &k) :
+    keylog{k},
+    sessions{},
+    ctx{EVP_CIPHER_CTX_new()},
+    ctx_generation{0},
+    next_generation{1},
+    messages{},
+    h2_messages{} {
+}
+
+tls_decryptor::~tls_decryptor() {
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+const std::vector<struct tls_decrypted_message> &tls_decryptor::process(const struct key &k,
+                                                                        const struct tcp_packet &tcp,
+                                                                        struct datum payload) {
+    messages.clear();
+    if (tcp.header == NULL || !is_valid()) {
+        return messages;
+    }
+
+    unsigned int dir = 0;
+    auto it = sessions.find(k);
+    if (it == sessions.end()) {
+        struct key reverse = (k.ip_vers == 4)
+            ? key{k.dst_port, k.src_port, k.addr.ipv4.dst, k.addr.ipv4.src, k.protocol}
+            : key{k.dst_port, k.src_port, k.addr.ipv6.dst, k.addr.ipv6.src, k.protocol};
+        it = sessions.find(reverse);
+        dir = 1;
+    }
+    uint32_t seq = ntohl(tcp.header->seq);
+
+    if (it == sessions.end()) {
+        /*
+         * a session starts with a segment that holds the start of a
+         * clientHello whose client random is in the key log
+         */
+        const size_t random_offset = TLS_RECORD_HEADER_LENGTH + 4 + 2;
+        if (payload.length() < (ssize_t)(random_offset + TLS_RANDOM_LENGTH)
+            || payload.data[0] != TLS_HANDSHAKE
+            || payload.data[TLS_RECORD_HEADER_LENGTH] != (uint8_t)handshake_type::client_hello) {
+            return messages;
+        }
+        const struct tls_session_secrets *secrets = keylog.find(payload.data + random_offset);
+        if (secrets == NULL) {
+            return messages;
+        }
+        if (sessions.size() >= TLS_MAX_SESSIONS) {
+            sessions.erase(sessions.begin());
+        }
+        it = sessions.emplace(k, tls_session{secrets, payload.data + random_offset}).first;
+        dir = 0;
+        it->second.direction[0].seq_known = true;
+        it->second.direction[0].next_seq = seq;
+    }
+    struct tls_session &s = it->second;
+    struct tls_direction &d = s.direction[dir];
+
+    if (TCP_IS_RST(tcp.header->flags)) {
+        sessions.erase(it);
+        return messages;
+    }
+    if (!d.seq_known && payload.length() > TLS_RECORD_HEADER_LENGTH
+        && payload.data[0] == TLS_HANDSHAKE
+        && payload.data[TLS_RECORD_HEADER_LENGTH] == (uint8_t)handshake_type::server_hello) {
+        d.seq_known = true;    /* the server's first segment */
+        d.next_seq = seq;
+    }
+    if (d.seq_known && !d.failed && payload.is_not_empty()) {
+        add_segment(s, dir, seq, payload);
+    }
+    if (TCP_IS_FIN(tcp.header->flags)) {
+        d.fin = true;
+        if (s.direction[0].fin && s.direction[1].fin) {
+            sessions.erase(it);
+        }
+    }
+    return messages;
+}
+
+void tls_decryptor::add_segment(struct tls_session &s, unsigned int dir, uint32_t seq, struct datum data) {
+    struct tls_direction &d = s.direction[dir];
+    uint32_t end = seq + data.length();
+    if (LEQ(end, d.next_seq)) {
+        return;    /* retransmission */
+    }
+    if (GT(seq, d.next_seq)) {
+        /* hold on to a segment that arrived early, until the gap is filled */
+        if (d.pending.size() >= TLS_MAX_PENDING_SEGMENTS) {
+            d.failed = true;
+            d.pending.clear();
+            d.stream.clear();
+            return;
+        }
+        d.pending.push_back({seq, std::vector<uint8_t>(data.data, data.data_end)});
+        return;
+    }
+    d.stream.insert(d.stream.end(), data.data + (d.next_seq - seq), data.data_end);
+    d.next_seq = end;
+
+    bool progress = true;
+    while (progress && !d.pending.empty()) {
+        progress = false;
+        for (auto p = d.pending.begin(); p != d.pending.end(); ) {
+            uint32_t p_end = p->first + p->second.size();
+            if (LEQ(p->first, d.next_seq)) {
+                if (GT(p_end, d.next_seq)) {
+                    d.stream.insert(d.stream.end(), p->second.begin() + (d.next_seq - p->first), p->second.end());
+                    d.next_seq = p_end;
+                    progress = true;
+                }
+                p = d.pending.erase(p);
+            } else {
+                ++p;
+            }
+        }
+    }
+    process_stream(s, dir);
+}
+
+void tls_decryptor::process_stream(struct tls_session &s, unsigned int dir) {
+    struct tls_direction &d = s.direction[dir];
+    size_t offset = 0;
+    while (!d.failed && d.stream.size() - offset >= TLS_RECORD_HEADER_LENGTH) {
+        const uint8_t *header = d.stream.data() + offset;
+        size_t length = ((size_t)header[3] << 8) | header[4];
+        if (header[0] < TLS_CHANGE_CIPHER_SPEC || header[0] > 24 || header[1] != 3 || length > TLS_MAX_CIPHERTEXT_LENGTH) {
+            d.failed = true;   /* not (or no longer) a TLS record stream */
+            break;
+        }
+        if (d.stream.size() - offset < TLS_RECORD_HEADER_LENGTH + length) {
+            break;             /* record is not yet complete */
+        }
+        const uint8_t *fragment = header + TLS_RECORD_HEADER_LENGTH;
+        process_record(s, dir, header, { fragment, fragment + length });
+        offset += TLS_RECORD_HEADER_LENGTH + length;
+    }
+    if (d.failed) {
+        d.stream.clear();
+        d.pending.clear();
+        d.handshake.clear();
+    } else {
+        d.stream.erase(d.stream.begin(), d.stream.begin() + offset);
+    }
+}
+
+void tls_decryptor::process_record(struct tls_session &s, unsigned int dir, const uint8_t *header, struct datum fragment) {
+    struct tls_direction &d = s.direction[dir];
+    uint8_t content_type = header[0];
+
+    if (content_type == TLS_CHANGE_CIPHER_SPEC) {
+        if (s.version != TLS_VERSION_1_3 && d.keys.cipher != NULL) {
+            d.encrypted = true;    /* TLS 1.2: the following records are protected */
+            d.keys.seq = 0;
+        }
+        return;
+    }
+    if (!d.encrypted) {
+        if (content_type == TLS_HANDSHAKE) {
+            process_handshake(s, dir, fragment);
+        }
+        return;
+    }
+
+    struct datum plaintext;
+    if (!decrypt(s, dir, header, fragment, &content_type, plaintext)) {
+        if (++d.auth_failures >= TLS_MAX_AUTH_FAILURES) {
+            d.failed = true;
+        }
+        return;
+    }
+    d.auth_failures = 0;
+    if (content_type == TLS_HANDSHAKE) {
+        process_handshake(s, dir, plaintext);
+    } else if (content_type == TLS_APPLICATION_DATA) {
+        process_application_data(s, dir, plaintext);
+    }
+}
+
+bool tls_decryptor::decrypt(struct tls_session &s, unsigned int dir, const uint8_t *header, struct datum fragment,
+                            uint8_t *content_type, struct datum &out) {
+    struct tls_traffic_keys &keys = s.direction[dir].keys;
+    if (keys.cipher == NULL) {
+        return false;
+    }
+
+    /*
+     * form the nonce, which is the implicit salt and explicit nonce
+     * for AES-GCM in TLS 1.2, and otherwise the IV xor the sequence
+     * number
+     */
+    uint8_t nonce[TLS_AEAD_NONCE_LENGTH];
+    if (keys.explicit_nonce) {
+        if (fragment.length() < 8 + TLS_AEAD_TAG_LENGTH) {
+            return false;
+        }
+        memcpy(nonce, keys.iv, 4);
+        memcpy(nonce + 4, fragment.data, 8);
+        fragment.skip(8);
+    } else {
+        if (fragment.length() < TLS_AEAD_TAG_LENGTH) {
+            return false;
+        }
+        memcpy(nonce, keys.iv, sizeof(nonce));
+        for (unsigned int i = 0; i < 8; i++) {
+            nonce[4 + i] ^= keys.seq >> (56 - 8 * i);
+        }
+    }
+    size_t ciphertext_len = fragment.length() - TLS_AEAD_TAG_LENGTH;
+
+    /*
+     * the associated data is the record header in TLS 1.3, and the
+     * sequence number, type, version, and plaintext length in TLS 1.2
+     */
+    uint8_t aad[13];
+    size_t aad_len = 0;
+    if (s.version == TLS_VERSION_1_3) {
+        memcpy(aad, header, TLS_RECORD_HEADER_LENGTH);
+        aad_len = TLS_RECORD_HEADER_LENGTH;
+    } else {
+        for (unsigned int i = 0; i < 8; i++) {
+            aad[aad_len++] = keys.seq >> (56 - 8 * i);
+        }
+        aad[aad_len++] = header[0];
+        aad[aad_len++] = header[1];
+        aad[aad_len++] = header[2];
+        aad[aad_len++] = ciphertext_len >> 8;
+        aad[aad_len++] = ciphertext_len;
+    }
+
+    bool new_keys = (ctx_generation != keys.generation);
+    int len = 0;
+    int plaintext_len = 0;
+    if (EVP_DecryptInit_ex(ctx, new_keys ? keys.cipher : NULL, NULL, new_keys ? keys.key : NULL, nonce) != 1) {
+        ctx_generation = 0;
+        return false;
+    }
+    ctx_generation = keys.generation;
+    if (EVP_DecryptUpdate(ctx, NULL, &len, aad, aad_len) != 1
+        || EVP_DecryptUpdate(ctx, plaintext, &plaintext_len, fragment.data, ciphertext_len) != 1
+        || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TLS_AEAD_TAG_LENGTH, (void *)(fragment.data + ciphertext_len)) != 1
+        || EVP_DecryptFinal_ex(ctx, plaintext + plaintext_len, &len) != 1) {
+        return false;
+    }
+    keys.seq++;
+
+    size_t n = plaintext_len + len;
+    if (s.version == TLS_VERSION_1_3) {
+        /* TLSInnerPlaintext: content, type, and zero padding */
+        while (n > 0 && plaintext[n - 1] == 0) {
+            n--;
+        }
+        if (n == 0) {
+            return false;
+        }
+        *content_type = plaintext[--n];
+    }
+    out = { plaintext, plaintext + n };
+    return true;
+}
+
+void tls_decryptor::process_handshake(struct tls_session &s, unsigned int dir, struct datum data) {
+    struct tls_direction &d = s.direction[dir];
+    d.handshake.insert(d.handshake.end(), data.data, data.data_end);
+    size_t offset = 0;
+    while (!d.failed && d.handshake.size() - offset >= 4) {
+        const uint8_t *msg = d.handshake.data() + offset;
+        size_t length = ((size_t)msg[1] << 16) | ((size_t)msg[2] << 8) | msg[3];
+        if (length > TLS_MAX_HANDSHAKE_LENGTH) {
+            d.failed = true;
+            break;
+        }
+        if (d.handshake.size() - offset < 4 + length) {
+            break;      /* message continues in the next record */
+        }
+        process_handshake_message(s, dir, msg[0], { msg + 4, msg + 4 + length });
+        offset += 4 + length;
+    }
+    if (d.failed) {
+        d.handshake.clear();
+    } else {
+        d.handshake.erase(d.handshake.begin(), d.handshake.begin() + offset);
+    }
+}
+
+void tls_decryptor::process_handshake_message(struct tls_session &s, unsigned int dir, uint8_t msg_type, struct datum body) {
+    struct tls_direction &d = s.direction[dir];
+    switch (msg_type) {
+    case TLS_SERVER_HELLO:
+        if (dir == 1 && s.cipher_suite == 0) {
+            process_server_hello(s, body);
+        }
+        break;
+    case TLS_ENCRYPTED_EXTENSIONS:
+        if (dir == 1) {
+            struct tls_extensions extensions;
+            uint16_t length;
+            body.read_uint16(&length);
+            extensions.parse(body, length);
+            set_app_protocol(s, extensions);
+        }
+        break;
+    case TLS_FINISHED:
+        if (s.version == TLS_VERSION_1_3) {
+            /* the handshake keys give way to the application keys */
+            const struct tls_secret &secret = dir == 0 ? s.secrets->client_traffic_secret_0 : s.secrets->server_traffic_secret_0;
+            if (!set_traffic_keys(s, dir, secret)) {
+                d.failed = true;
+            }
+        }
+        break;
+    case TLS_KEY_UPDATE:
+        if (s.version == TLS_VERSION_1_3) {
+            struct tls_secret next;
+            next.length = d.traffic_secret.length;
+            if (!tls13_hkdf_expand_label(s.md, d.traffic_secret, "traffic upd", next.value, next.length)
+                || !set_traffic_keys(s, dir, next)) {
+                d.failed = true;
+            }
+        }
+        break;
+    default:
+        ;
+    }
+}
+
+void tls_decryptor::process_server_hello(struct tls_session &s, struct datum body) {
+    struct tls_server_hello hello;
+    hello.parse(body);
+    if (!hello.is_not_empty() || hello.random.length() != TLS_RANDOM_LENGTH || hello.protocol_version.length() != 2) {
+        return;
+    }
+    if (memcmp(hello.random.data, tls13_hello_retry_request_random, TLS_RANDOM_LENGTH) == 0) {
+        return;    /* a HelloRetryRequest, after which another clientHello and serverHello follow */
+    }
+    s.cipher_suite = ((uint16_t)hello.ciphersuite_vector.data[0] << 8) | hello.ciphersuite_vector.data[1];
+    s.version = ((uint16_t)hello.protocol_version.data[0] << 8) | hello.protocol_version.data[1];
+    struct datum supported_version;
+    if (hello.extensions.find(TLS_EXT_SUPPORTED_VERSIONS, supported_version) && supported_version.length() == 2) {
+        s.version = ((uint16_t)supported_version.data[0] << 8) | supported_version.data[1];
+    }
+    set_app_protocol(s, hello.extensions);
+
+    bool keys_set = false;
+    const EVP_CIPHER *cipher = tls_cipher_suite_get(s.cipher_suite, &s.md);
+    if (cipher == NULL) {
+        ;   /* cipher suite not supported */
+
+    } else if (s.version == TLS_VERSION_1_3) {
+        keys_set = set_traffic_keys(s, 0, s.secrets->client_handshake_traffic_secret)
+            && set_traffic_keys(s, 1, s.secrets->server_handshake_traffic_secret);
+        s.direction[0].encrypted = s.direction[1].encrypted = keys_set;
+
+    } else if (s.secrets->master_secret.length == 48) {
+        /*
+         * TLS 1.2: the key block holds the client and server write
+         * keys, then the client and server write IVs (RFC 5246,
+         * Section 6.3); the keys are used after ChangeCipherSpec
+         */
+        size_t key_len = EVP_CIPHER_key_length(cipher);
+        bool gcm = EVP_CIPHER_mode(cipher) == EVP_CIPH_GCM_MODE;
+        size_t iv_len = gcm ? 4 : TLS_AEAD_NONCE_LENGTH;
+        uint8_t seed[2 * TLS_RANDOM_LENGTH];
+        memcpy(seed, hello.random.data, TLS_RANDOM_LENGTH);
+        memcpy(seed + TLS_RANDOM_LENGTH, s.client_random, TLS_RANDOM_LENGTH);
+        uint8_t key_block[2 * (TLS_MAX_KEY_LENGTH + TLS_AEAD_NONCE_LENGTH)];
+        if (tls12_prf(s.md, s.secrets->master_secret, "key expansion", seed, sizeof(seed), key_block, 2 * (key_len + iv_len))) {
+            for (unsigned int dir = 0; dir < 2; dir++) {
+                struct tls_traffic_keys &k = s.direction[dir].keys;
+                k.cipher = cipher;
+                k.explicit_nonce = gcm;
+                memcpy(k.key, key_block + dir * key_len, key_len);
+                memcpy(k.iv, key_block + 2 * key_len + dir * iv_len, iv_len);
+                k.seq = 0;
+                k.generation = next_generation++;
+            }
+            keys_set = true;
+        }
+    }
+    if (!keys_set) {
+        s.direction[0].failed = s.direction[1].failed = true;
+    }
+}
+
+bool tls_decryptor::set_traffic_keys(struct tls_session &s, unsigned int dir, const struct tls_secret &secret) {
+    struct tls_direction &d = s.direction[dir];
+    const EVP_MD *md = NULL;
+    const EVP_CIPHER *cipher = tls_cipher_suite_get(s.cipher_suite, &md);
+    if (cipher == NULL || secret.length != EVP_MD_size(md)) {
+        return false;
+    }
+    struct tls_traffic_keys &k = d.keys;
+    if (!tls13_hkdf_expand_label(md, secret, "key", k.key, EVP_CIPHER_key_length(cipher))
+        || !tls13_hkdf_expand_label(md, secret, "iv", k.iv, TLS_AEAD_NONCE_LENGTH)) {
+        k.cipher = NULL;
+        return false;
+    }
+    k.cipher = cipher;
+    k.explicit_nonce = false;
+    k.seq = 0;
+    k.generation = next_generation++;
+    d.traffic_secret = secret;
+    return true;
+}
+
+void tls_decryptor::process_application_data(struct tls_session &s, unsigned int dir, struct datum data) {
+    if (s.app_protocol == tls_app_protocol::unknown) {
+        bool h2 = (dir == 0 && http2_reader::is_client_preface(data));
+        s.app_protocol = h2 ? tls_app_protocol::http2 : tls_app_protocol::http1;
+    }
+    if (s.app_protocol == tls_app_protocol::http2) {
+        h2_messages.clear();
+        s.direction[dir].h2.process(data, h2_messages);
+        for (std::string &m : h2_messages) {
+            messages.push_back({ dir == 1, std::move(m) });
+        }
+    } else if (is_http1_message(data, dir == 1)) {
+        messages.push_back({ dir == 1, std::string{(const char *)data.data, (size_t)data.length()} });
+    }
+}
@@ -0,0 +1,238 @@
+/*
+ * tls_decrypt.h
+ *
+ * offline decryption of TLS sessions, with the secrets that a client
+ * wrote into a key log file (the SSLKEYLOGFILE format of NSS, which
+ * is also written by OpenSSL, BoringSSL, and the major browsers), so
+ * that the HTTP/1.x and HTTP/2 messages inside of those sessions can
+ * be fingerprinted
+ *
+ * A tls_decryptor follows the TCP connections that it sees, from the
+ * clientHello on, by putting the segments of each direction in order;
+ * it reads the TLS records of each direction, derives the traffic
+ * keys of the session from the serverHello and the logged secrets,
+ * and decrypts the records protected with AES-GCM or
+ * ChaCha20-Poly1305 (using OpenSSL's libcrypto, which uses the AES-NI
+ * and vector instructions where they are available).  TLS 1.3 and the
+ * AEAD cipher suites of TLS 1.2 are supported; sessions that use
+ * other cipher suites are not decrypted.
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef TLS_DECRYPT_H
+#define TLS_DECRYPT_H
+
+#include <string.h>
+#include <array>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <openssl/evp.h>
+#include "datum.h"
+#include "tcp.h"
+#include "tcpip.h"
+#include "http2.h"
+
+#define TLS_RANDOM_LENGTH          32
+#define TLS_MAX_SECRET_LENGTH      48
+#define TLS_MAX_KEY_LENGTH         32
+#define TLS_AEAD_NONCE_LENGTH      12
+#define TLS_AEAD_TAG_LENGTH        16
+#define TLS_RECORD_HEADER_LENGTH    5
+#define TLS_MAX_CIPHERTEXT_LENGTH  (16384 + 2048)
+
+struct tls_secret {
+    uint8_t length;                        /* zero if it was not logged */
+    uint8_t value[TLS_MAX_SECRET_LENGTH];
+};
+
+/*
+ * struct tls_session_secrets holds the secrets logged for the client
+ * random of a session: the master secret for TLS 1.2 and earlier
+ * (CLIENT_RANDOM), or the traffic secrets for TLS 1.3
+ */
+struct tls_session_secrets {
+    struct tls_secret master_secret;
+    struct tls_secret client_handshake_traffic_secret;
+    struct tls_secret server_handshake_traffic_secret;
+    struct tls_secret client_traffic_secret_0;
+    struct tls_secret server_traffic_secret_0;
+};
+
+typedef std::array<uint8_t, TLS_RANDOM_LENGTH> tls_client_random;
+
+/*
+ * tls_client_random_hash uses the last eight bytes of a client
+ * random, which are random in every version of TLS (the first four
+ * bytes hold the time in TLS 1.2 and earlier)
+ */
+struct tls_client_random_hash {
+    size_t operator()(const tls_client_random &r) const {
+        size_t h;
+        memcpy(&h, r.data() + TLS_RANDOM_LENGTH - sizeof(h), sizeof(h));
+        return h;
+    }
+};
+
+/*
+ * struct tls_keylog is the index of a key log file, by client random;
+ * it is read-only once it has been loaded, so a single keylog can be
+ * shared by all of the threads that decrypt sessions
+ */
+struct tls_keylog {
+    std::unordered_map<tls_client_random, struct tls_session_secrets, tls_client_random_hash> sessions;
+
+    tls_keylog() : sessions{} {}
+
+    /*
+     * load(filename, verbosity) reads the key log file, skipping lines
+     * with labels that are not used in decryption, and returns false
+     * if the file could not be read
+     */
+    bool load(const char *filename, int verbosity);
+
+    /*
+     * find(client_random) returns the secrets logged for the session
+     * with the given (32 byte) client random, or NULL if there are none
+     */
+    const struct tls_session_secrets *find(const uint8_t *client_random) const;
+};
+
+/*
+ * struct tls_traffic_keys holds the keys and the record sequence
+ * number of one direction of a session
+ */
+struct tls_traffic_keys {
+    const EVP_CIPHER *cipher;                /* NULL if not (yet) known    */
+    bool explicit_nonce;                     /* TLS 1.2 AES-GCM            */
+    uint8_t key[TLS_MAX_KEY_LENGTH];
+    uint8_t iv[TLS_AEAD_NONCE_LENGTH];       /* or four byte salt          */
+    uint64_t seq;
+    uint64_t generation;                     /* identifies the keys in use */
+};
+
+/*
+ * struct tls_direction holds the state of one direction of a TCP
+ * connection carrying TLS: the stream of bytes received in order
+ * (with a few segments that arrived early), the incomplete handshake
+ * message, the traffic keys, and the HTTP/2 frame reader
+ */
+#define TLS_MAX_PENDING_SEGMENTS  32
+
+struct tls_direction {
+    bool seq_known;
+    bool failed;                             /* direction is not followed  */
+    bool fin;
+    bool encrypted;                          /* records are protected      */
+    unsigned int auth_failures;              /* in a row                   */
+    uint32_t next_seq;
+    std::vector<uint8_t> stream;             /* bytes not yet in a record  */
+    std::vector<std::pair<uint32_t, std::vector<uint8_t>>> pending;
+    std::vector<uint8_t> handshake;          /* incomplete handshake msg   */
+    struct tls_traffic_keys keys;
+    struct tls_secret traffic_secret;        /* TLS 1.3 */
+    struct http2_reader h2;
+
+    explicit tls_direction(bool client) :
+        seq_known{false}, failed{false}, fin{false}, encrypted{false}, auth_failures{0}, next_seq{0},
+        stream{}, pending{}, handshake{}, keys{}, traffic_secret{}, h2{client} {}
+};
+
+enum class tls_app_protocol : uint8_t {
+    unknown = 0,
+    http1   = 1,
+    http2   = 2
+};
+
+/*
+ * struct tls_session holds the state of a TLS session whose secrets
+ * are in the key log
+ */
+struct tls_session {
+    const struct tls_session_secrets *secrets;
+    uint8_t client_random[TLS_RANDOM_LENGTH];
+    uint16_t version;                        /* 0x0304 for TLS 1.3         */
+    uint16_t cipher_suite;
+    const EVP_MD *md;                        /* hash of the cipher suite   */
+    tls_app_protocol app_protocol;
+    struct tls_direction direction[2];       /* client, server             */
+
+    tls_session(const struct tls_session_secrets *s, const uint8_t *random) :
+        secrets{s}, client_random{}, version{0}, cipher_suite{0}, md{NULL},
+        app_protocol{tls_app_protocol::unknown}, direction{tls_direction{true}, tls_direction{false}} {
+        memcpy(client_random, random, TLS_RANDOM_LENGTH);
+    }
+};
+
+/*
+ * struct tls_decrypted_message is a request or response that was
+ * decrypted, in HTTP/1.x form (see struct http2_reader)
+ */
+struct tls_decrypted_message {
+    bool from_server;
+    std::string data;
+};
+
+/*
+ * struct tls_decryptor holds the sessions being decrypted by a single
+ * thread, along with its cipher context and plaintext buffer
+ */
+#define TLS_MAX_SESSIONS  65536
+
+struct tls_decryptor {
+    const struct tls_keylog &keylog;
+    std::unordered_map<struct key, struct tls_session> sessions;  /* by client-to-server flow key */
+    EVP_CIPHER_CTX *ctx;
+    uint64_t ctx_generation;                 /* of the keys set in ctx     */
+    uint64_t next_generation;
+    uint8_t plaintext[TLS_MAX_CIPHERTEXT_LENGTH];
+    std::vector<struct tls_decrypted_message> messages;
+    std::vector<std::string> h2_messages;
+
+    explicit tls_decryptor(const struct tls_keylog &k);
+
+    ~tls_decryptor();
+
+    tls_decryptor(const tls_decryptor &) = delete;
+    tls_decryptor &operator=(const tls_decryptor &) = delete;
+
+    /*
+     * is_valid() returns false if the cipher context could not be
+     * allocated
+     */
+    bool is_valid() const { return ctx != NULL; }
+
+    /*
+     * process(k, tcp, payload) processes a TCP segment with the flow
+     * key k and the given payload, and returns the messages that it
+     * completed, which remain valid until the next call
+     */
+    const std::vector<struct tls_decrypted_message> &process(const struct key &k,
+                                                             const struct tcp_packet &tcp,
+                                                             struct datum payload);
+
+private:
+
+    void add_segment(struct tls_session &s, unsigned int dir, uint32_t seq, struct datum data);
+
+    void process_stream(struct tls_session &s, unsigned int dir);
+
+    void process_record(struct tls_session &s, unsigned int dir, const uint8_t *header, struct datum fragment);
+
+    bool decrypt(struct tls_session &s, unsigned int dir, const uint8_t *header, struct datum fragment,
+                 uint8_t *content_type, struct datum &out);
+
+    void process_handshake(struct tls_session &s, unsigned int dir, struct datum data);
+
+    void process_handshake_message(struct tls_session &s, unsigned int dir, uint8_t msg_type, struct datum body);
+
+    void process_server_hello(struct tls_session &s, struct datum body);
+
+    void process_application_data(struct tls_session &s, unsigned int dir, struct datum data);
+
+    bool set_traffic_keys(struct tls_session &s, unsigned int dir, const struct tls_secret &secret);
+};
+
+#endif /* TLS_DECRYPT_H */
@@ -9,6 +9,7 @@
 #include "proto_identify.h"
 #include "match.h"
 #include "utils.h"
+#include "quic.h"
 
 #define VXLAN_PORT 4789
 /*
@@ -114,6 +115,18 @@ struct pi_container wireguard = {
     WIREGUARD_PORT
 };
 
+/*
+ * quic: Initial packets are identified by their version, which
+ * cannot be matched with a mask (see quic_initial_packet::is_initial),
+ * so select_quic is cleared when they are not selected
+ */
+bool select_quic = 1;
+
+struct pi_container quic_initial = {
+    DIR_CLIENT,
+    QUIC_PORT
+};
+
 const struct pi_container *proto_identify_udp(const uint8_t *udp_data,
                                               unsigned int len) {
 
@@ -159,6 +172,9 @@ const struct pi_container *proto_identify_udp(const uint8_t *udp_data,
                                          wireguard_value)) {
         return &wireguard;
     }
+    if (select_quic && quic_initial_packet::is_initial(udp_data, len)) {
+        return &quic_initial;
+    }
 
     return NULL;
 }
@@ -201,6 +217,9 @@ enum msg_type udp_get_message_type(const uint8_t *udp_data,
                                          wireguard_value)) {
         return msg_type_wireguard;
     }
+    if (select_quic && quic_initial_packet::is_initial(udp_data, len)) {
+        return msg_type_quic;
+    }
 
     return msg_type_unknown;
 }
@@ -300,6 +319,7 @@ unsigned int parser_extractor_process_dtls_server(struct datum *p, struct extrac
 unsigned int parser_extractor_process_dhcp(struct datum *p, struct extractor *x);
 unsigned int parser_extractor_process_dns(struct datum *p, struct extractor *x);
 unsigned int parser_extractor_process_wireguard(struct datum *p, struct extractor *x);
+unsigned int parser_extractor_process_quic(struct datum *p, struct extractor *x);
 
 unsigned int parser_extractor_process_udp_data(struct datum *p, struct extractor *x) {
     const struct pi_container *pi;
@@ -343,6 +363,10 @@ unsigned int parser_extractor_process_udp_data(struct datum *p, struct extractor
         x->msg_type = msg_type_wireguard;
         return parser_extractor_process_wireguard(p, x);
         break;
+    case QUIC_PORT:
+        x->msg_type = msg_type_quic;
+        return parser_extractor_process_quic(p, x);
+        break;
     default:
         ;
     }
@@ -0,0 +1,285 @@
+/*
+ * analysis_test.cc
+ *
+ * checks the scores computed by perform_analysis(), from the tables
+ * that are precomputed when the fingerprint database is loaded,
+ * against a straightforward long double implementation that looks
+ * up each feature of each process in the JSON database, for many
+ * combinations of fingerprint and destination
+ *
+ * usage: analysis_test <resource directory>
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+
+#include "../src/analysis.h"
+#include "../src/public_suffix.h"
+#include "../src/rapidjson/document.h"
+
+std::string get_port_app(uint16_t dst_port);
+
+#define TOLERANCE 1e-9
+
+static const char *dst_ips[] = {
+    "172.217.7.228", "8.8.8.8", "13.107.21.200", "151.101.1.69",
+    "10.0.2.15", "1.2.3.4", "2607:f8b0:4004:0800:0000:0000:0000:200e"
+};
+static const char *server_names[] = {
+    "www.google.com", "s.youtube.com", "api.github.com", "a.b.c.d.microsoft.com",
+    "x", "", "example.org", "www.bbc.co.uk", "localhost"
+};
+static const uint16_t dst_ports[] = { 443, 8443, 993, 9001, 80, 12345 };
+
+#define NUM_IPS   (sizeof(dst_ips)/sizeof(dst_ips[0]))
+#define NUM_SNIS  (sizeof(server_names)/sizeof(server_names[0]))
+#define NUM_PORTS (sizeof(dst_ports)/sizeof(dst_ports[0]))
+#define NUM_DSTS  (NUM_IPS * NUM_SNIS * NUM_PORTS)
+
+struct reference_score {
+    std::string process;
+    bool malware;
+    long double score;    /* normalized */
+};
+
+struct reference_result {
+    struct analysis_result result;
+    std::vector<struct reference_score> scores;
+};
+
+static long double feature_score(const rapidjson::Value &proc, const char *feature, const char *value,
+                                 uint32_t fp_tc, long double base_prior, long double weight) {
+    rapidjson::Value::ConstMemberIterator itr = proc.FindMember(feature);
+    if (itr != proc.MemberEnd()) {
+        rapidjson::Value::ConstMemberIterator count = itr->value.FindMember(value);
+        if (count != itr->value.MemberEnd()) {
+            return log((long double)count->value.GetUint()/fp_tc)*weight;
+        }
+    }
+    return base_prior*weight;
+}
+
+/*
+ * reference_analysis() is the analysis computed from the JSON
+ * database entry fp, with all of the arithmetic in long double
+ */
+static void reference_analysis(struct reference_result &ref,
+                               const rapidjson::Value &fp,
+                               const struct subnet_db *subnets,
+                               const public_suffix_list &public_suffixes,
+                               bool malware_db,
+                               bool extended_fp_metadata,
+                               const char *server_name,
+                               const char *dst_ip,
+                               uint16_t dst_port) {
+    std::string asn = std::to_string(subnet_db_get_asn(subnets, dst_ip));
+    std::string domain = public_suffixes.registered_domain(server_name, strlen(server_name)).get_string();
+    std::string port_app = get_port_app(dst_port);
+
+    uint32_t fp_tc = fp["total_count"].GetUint();
+    long double max_score = -1.0;
+    long double sec_score = -1.0;
+    long double score_sum = 0.0;
+    long double malware_prob = 0.0;
+    std::string max_proc, sec_proc;
+    bool max_mal = false;
+    bool sec_mal = false;
+
+    const rapidjson::Value &procs = fp["process_info"];
+    ref.scores.clear();
+    for (rapidjson::SizeType i = 0; i < procs.Size(); i++) {
+        const rapidjson::Value &proc = procs[i];
+        long double base_prior = log(1.0/fp_tc);
+        rapidjson::Value::ConstMemberIterator itr = proc.FindMember("domain_mean");
+        if (itr != proc.MemberEnd() && itr->value.GetFloat() < 0.5) {
+            base_prior = log(.1/fp_tc);
+        }
+
+        long double score = fmax(log((long double)proc["count"].GetUint()/fp_tc), log(.1));
+        score += feature_score(proc, "classes_ip_as", asn.c_str(), fp_tc, base_prior, 0.13924);
+        score += feature_score(proc, "classes_hostname_domains", domain.c_str(), fp_tc, base_prior, 0.15590);
+        score += feature_score(proc, "classes_port_applications", port_app.c_str(), fp_tc, base_prior, 0.00528);
+        if (extended_fp_metadata) {
+            score += feature_score(proc, "classes_ip_ip", dst_ip, fp_tc, base_prior, 0.56735);
+            score += feature_score(proc, "classes_hostname_sni", server_name, fp_tc, base_prior, 0.96941);
+        }
+        score = exp(score);
+        score_sum += score;
+
+        bool malware = malware_db && proc["malware"].GetBool();
+        ref.scores.push_back({ proc["process"].GetString(), malware, score });
+        if (malware && score > 0.0) {
+            malware_prob += score;
+        }
+        if (score > max_score) {
+            sec_score = max_score;
+            sec_proc = max_proc;
+            sec_mal = max_mal;
+            max_score = score;
+            max_proc = proc["process"].GetString();
+            max_mal = malware;
+        } else if (score > sec_score) {
+            sec_score = score;
+            sec_proc = proc["process"].GetString();
+            sec_mal = malware;
+        }
+    }
+
+    if (malware_db && max_proc == "Generic DMZ Traffic" && sec_mal == false) {
+        max_proc = sec_proc;
+        max_score = sec_score;
+        max_mal = sec_mal;
+    }
+
+    if (score_sum > 0.0) {
+        max_score /= score_sum;
+        malware_prob /= score_sum;
+        for (auto &s : ref.scores) {
+            s.score /= score_sum;
+        }
+    }
+
+    strncpy(ref.result.process, max_proc.c_str(), sizeof(ref.result.process) - 1);
+    ref.result.process[sizeof(ref.result.process) - 1] = '\0';
+    ref.result.score = max_score;
+    ref.result.malware_info = malware_db;
+    ref.result.malware = max_mal;
+    ref.result.p_malware = malware_db ? malware_prob : 0.0;
+}
+
+/*
+ * result_matches_reference() returns true if the scores of result
+ * are within TOLERANCE of those of the reference; the process may
+ * differ from that of the reference only if the two processes have
+ * the same score, to within TOLERANCE, since which of them comes out
+ * on top depends on rounding
+ */
+static bool result_matches_reference(const struct analysis_result &result, const struct reference_result &ref) {
+    if (result.malware_info != ref.result.malware_info
+        || fabsl(result.score - ref.result.score) > TOLERANCE
+        || fabsl(result.p_malware - ref.result.p_malware) > TOLERANCE) {
+        return false;
+    }
+    if (strcmp(result.process, ref.result.process) == 0 && result.malware == ref.result.malware) {
+        return true;
+    }
+    for (const auto &s : ref.scores) {
+        if (s.process == result.process && s.malware == result.malware
+            && fabsl(s.score - ref.result.score) <= TOLERANCE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <resource directory>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    std::string resource_dir = argv[1];
+
+    struct analysis_resources *r = analysis_resources_init(0, resource_dir.c_str());
+    if (r == NULL) {
+        fprintf(stderr, "error: could not initialize analysis resources from %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    struct subnet_db *subnets = subnet_db_init((resource_dir + "/pyasn.db").c_str());
+    gzFile in_file = gzopen((resource_dir + "/fingerprint_db.json.gz").c_str(), "r");
+    if (subnets == NULL || in_file == NULL) {
+        fprintf(stderr, "error: could not read the databases in %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // as in the analysis module, the first entry for a fingerprint
+    // is the one that counts
+    std::vector<rapidjson::Document> fp_db;
+    std::unordered_set<std::string> fp_strs;
+    bool malware_db = true;
+    bool extended_fp_metadata = true;
+    bool registered_domains = false;
+    std::vector<char> line(1 << 24);
+    while (gzgets(in_file, line.data(), line.size()) != NULL) {
+        fp_db.emplace_back();
+        rapidjson::Document &fp = fp_db.back();
+        fp.Parse(line.data());
+        if (fp.HasParseError()) {
+            fprintf(stderr, "error: could not parse fingerprint database line %zu\n", fp_db.size());
+            return EXIT_FAILURE;
+        }
+        if (!fp_strs.insert(fp["str_repr"].GetString()).second) {
+            fp_db.pop_back();
+            continue;
+        }
+        const rapidjson::Value &proc = fp["process_info"][0];
+        malware_db = malware_db && proc.HasMember("malware");
+        extended_fp_metadata = extended_fp_metadata && proc.HasMember("classes_hostname_sni");
+        for (const auto &p : fp["process_info"].GetArray()) {
+            rapidjson::Value::ConstMemberIterator domains = p.FindMember("classes_hostname_domains");
+            if (domains == p.MemberEnd()) {
+                continue;
+            }
+            for (const auto &domain : domains->value.GetObject()) {
+                const char *name = domain.name.GetString();
+                registered_domains = registered_domains || std::count(name, name + domain.name.GetStringLength(), '.') > 1;
+            }
+        }
+    }
+    gzclose(in_file);
+
+    // the domain classes are either registered domains, or the last
+    // two labels of each server name
+    public_suffix_list public_suffixes;
+    if (registered_domains && !public_suffixes.load((resource_dir + "/public_suffix_list.dat.gz").c_str())) {
+        fprintf(stderr, "error: could not read the public suffix list in %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // test each fingerprint with a different, overlapping subset of
+    // the destinations, or with all of them if the database is small
+    size_t stride = fp_db.size() < 64 ? 1 : 16;
+    unsigned long num_tests = 0;
+    unsigned long num_failures = 0;
+    struct reference_result ref;
+    for (size_t n = 0; n < fp_db.size(); n++) {
+        const rapidjson::Value &fp = fp_db[n];
+        for (size_t d = n % stride; d < NUM_DSTS; d += stride) {
+            const char *dst_ip = dst_ips[d % NUM_IPS];
+            const char *server_name = server_names[(d / NUM_IPS) % NUM_SNIS];
+            uint16_t dst_port = dst_ports[d / (NUM_IPS * NUM_SNIS)];
+
+            struct analysis_result result;
+            if (!perform_analysis(*r, result, fp["str_repr"].GetString(), server_name, dst_ip, dst_port)) {
+                fprintf(stderr, "error: fingerprint %s not found\n", fp["str_repr"].GetString());
+                return EXIT_FAILURE;
+            }
+            reference_analysis(ref, fp, subnets, public_suffixes, malware_db, extended_fp_metadata, server_name, dst_ip, dst_port);
+            num_tests++;
+            if (!result_matches_reference(result, ref)) {
+                if (num_failures++ < 10) {
+                    fprintf(stderr, "error: analysis of %s for (%s, %s, %u) is %s %.12Lf %d %.12Lf, expected %s %.12Lf %d %.12Lf\n",
+                            fp["str_repr"].GetString(), dst_ip, server_name, dst_port,
+                            result.process, result.score, result.malware, result.p_malware,
+                            ref.result.process, ref.result.score, ref.result.malware, ref.result.p_malware);
+                }
+            }
+        }
+    }
+    fprintf(stderr, "%lu of %lu analyses of %zu fingerprints match the reference (malware: %s, extended: %s, public suffixes: %zu)\n",
+            num_tests - num_failures, num_tests, fp_db.size(),
+            malware_db ? "yes" : "no", extended_fp_metadata ? "yes" : "no", public_suffixes.size());
+
+    subnet_db_finalize(subnets);
+    analysis_resources_finalize(r);
+
+    return num_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,105 @@
+/*
+ * flow_hash_test.cc
+ *
+ * checks that the flow hash used for adaptive packet dropping is the
+ * same for both directions of IPv4 and IPv6 flows, whether the keys
+ * are made directly or parsed from packets, and that it tells
+ * different flows apart
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "../src/rnd_pkt_drop.h"
+
+static unsigned int num_failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "error: %s\n", what);
+        num_failures++;
+    }
+}
+
+static struct key reverse(const struct key &k) {
+    struct key r = k;
+    r.src_port = k.dst_port;
+    r.dst_port = k.src_port;
+    if (k.ip_vers == 4) {
+        r.addr.ipv4.src = k.addr.ipv4.dst;
+        r.addr.ipv4.dst = k.addr.ipv4.src;
+    } else {
+        r.addr.ipv6.src = k.addr.ipv6.dst;
+        r.addr.ipv6.dst = k.addr.ipv6.src;
+    }
+    return r;
+}
+
+// tcp_frame(ip_vers, src, dst, sport, dport) returns an ethernet frame
+// holding a TCP header, with the 4 or 16 byte addresses src and dst
+static std::vector<uint8_t> tcp_frame(int ip_vers, const uint8_t *src, const uint8_t *dst,
+                                      uint16_t sport, uint16_t dport) {
+    std::vector<uint8_t> f(12, 0);
+    if (ip_vers == 4) {
+        f.insert(f.end(), { 0x08, 0x00, 0x45, 0, 0, 40, 0, 0, 0x40, 0, 64, 6, 0, 0 });
+        f.insert(f.end(), src, src + 4);
+        f.insert(f.end(), dst, dst + 4);
+    } else {
+        f.insert(f.end(), { 0x86, 0xdd, 0x60, 0, 0, 0, 0, 20, 6, 64 });
+        f.insert(f.end(), src, src + 16);
+        f.insert(f.end(), dst, dst + 16);
+    }
+    f.insert(f.end(), { (uint8_t)(sport >> 8), (uint8_t)sport, (uint8_t)(dport >> 8), (uint8_t)dport });
+    f.resize(f.size() + 16, 0);
+    return f;
+}
+
+int main() {
+    set_percent_accept(50);   // sets the hash seed
+
+    ipv6_addr v6a = { htonl(0x20010db8), 0, 0, htonl(1) };
+    ipv6_addr v6b = { htonl(0x20010db8), 0, 0, htonl(2) };
+    struct key keys[] = {
+        key(htons(51000), htons(443), htonl(0x0a00020f), htonl(0xacd907e4), 6),
+        key(htons(443), htons(443), htonl(0x0a00020f), htonl(0x0a00020e), 17),
+        key(htons(53), htons(5353), htonl(0x01020304), htonl(0x01020304), 17),
+        key(htons(51000), htons(443), v6a, v6b, 6),
+        key(htons(8080), htons(8080), v6b, v6a, 17),
+    };
+    for (const struct key &k : keys) {
+        check(flow_key_symmetric_hash(k) == flow_key_symmetric_hash(reverse(k)),
+              k.ip_vers == 4 ? "IPv4 key and its reverse hash differently" : "IPv6 key and its reverse hash differently");
+    }
+    check(flow_key_symmetric_hash(keys[0]) != flow_key_symmetric_hash(keys[1]), "different IPv4 flows hash the same");
+    check(flow_key_symmetric_hash(keys[3]) != flow_key_symmetric_hash(keys[4]), "different IPv6 flows hash the same");
+
+    // keys parsed from the packets of both directions of a flow
+    const uint8_t v4src[4] = { 10, 0, 2, 15 };
+    const uint8_t v4dst[4] = { 172, 217, 7, 228 };
+    const uint8_t v6src[16] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+    const uint8_t v6dst[16] = { 0x26, 0x07, 0xf8, 0xb0, 0x40, 0x04, 0x08, 0, 0, 0, 0, 0, 0, 0, 0x20, 0x0e };
+    for (int ip_vers : { 4, 6 }) {
+        const uint8_t *src = ip_vers == 4 ? v4src : v6src;
+        const uint8_t *dst = ip_vers == 4 ? v4dst : v6dst;
+        std::vector<uint8_t> out = tcp_frame(ip_vers, src, dst, 51000, 443);
+        std::vector<uint8_t> in = tcp_frame(ip_vers, dst, src, 443, 51000);
+        struct key k_out, k_in;
+        check(flow_key_from_packet(&k_out, out.data(), out.size()) && flow_key_from_packet(&k_in, in.data(), in.size()),
+              "could not parse flow key from packet");
+        check(k_out.ip_vers == ip_vers && k_out.src_port == 51000 && k_in.dst_port == 51000, "wrong flow key parsed from packet");
+        check(flow_key_symmetric_hash(k_out) == flow_key_symmetric_hash(k_in),
+              ip_vers == 4 ? "IPv4 packets of the same flow hash differently" : "IPv6 packets of the same flow hash differently");
+        check(drop_this_packet(out.data(), out.size()) == drop_this_packet(in.data(), in.size()),
+              "packets of the same flow are not dropped together");
+    }
+
+    if (num_failures) {
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "flow hashes of both directions match\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+/*
+ * libmerc_test.c
+ *
+ * checks that libmerc contexts are independent of each other: two
+ * threads, each with its own context and configuration, process the
+ * same PCAP file at the same time, and write the JSON records that
+ * they produce to separate files, which should match mercury's output
+ * with the same options.  The first thread also checks that the TLS
+ * fingerprints returned by mercury_context_get_fingerprint() appear
+ * in its JSON records.  This file is C, to check that libmerc.h is
+ * usable from C.
+ *
+ * USAGE: libmerc_test [-r resource_dir] file.pcap all.json selected.json
+ *
+ *    all.json       records written with the default configuration
+ *                   (and analysis, if -r is given)
+ *    selected.json  records written with --metadata and --select http
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../src/libmerc.h"
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define MAX_PACKET_LEN  65536
+#define JSON_BUF_LEN    65536
+
+struct pcap_record_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_frac;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+struct worker {
+    const char *pcap_file;
+    const char *output_file;
+    struct mercury_context *ctx;
+    int check_fingerprints;
+    int failures;
+};
+
+static void *process_file(void *arg) {
+    struct worker *w = (struct worker *)arg;
+
+    FILE *in = fopen(w->pcap_file, "r");
+    FILE *out = fopen(w->output_file, "w");
+    if (in == NULL || out == NULL) {
+        perror("could not open file");
+        w->failures++;
+        return NULL;
+    }
+    uint32_t file_hdr[6];
+    if (fread(file_hdr, sizeof(file_hdr), 1, in) != 1
+        || (file_hdr[0] != PCAP_MAGIC && file_hdr[0] != PCAP_MAGIC_NSEC)) {
+        fprintf(stderr, "error: %s is not a (little endian) PCAP file\n", w->pcap_file);
+        w->failures++;
+        return NULL;
+    }
+    long nsec_per_frac = (file_hdr[0] == PCAP_MAGIC_NSEC) ? 1 : 1000;
+
+    static __thread uint8_t packet[MAX_PACKET_LEN];
+    static __thread uint8_t json[JSON_BUF_LEN];
+    struct pcap_record_hdr hdr;
+    while (fread(&hdr, sizeof(hdr), 1, in) == 1) {
+        if (hdr.incl_len > MAX_PACKET_LEN || fread(packet, hdr.incl_len, 1, in) != 1) {
+            fprintf(stderr, "error: truncated packet in %s\n", w->pcap_file);
+            w->failures++;
+            break;
+        }
+        struct timespec ts = { hdr.ts_sec, hdr.ts_frac * nsec_per_frac };
+        size_t json_len = mercury_context_write_json(w->ctx, json, sizeof(json) - 1, packet, hdr.incl_len, &ts);
+        fwrite(json, 1, json_len, out);
+
+        struct mercury_fingerprint_result fp;
+        if (w->check_fingerprints
+            && mercury_context_get_fingerprint(w->ctx, packet, hdr.incl_len, &fp)
+            && fp.type == fingerprint_type_tls) {
+            char expected[8192];
+            snprintf(expected, sizeof(expected), "\"tls\":\"%s\"", fp.fingerprint);
+            json[json_len] = '\0';
+            if (strstr((char *)json, expected) == NULL) {
+                fprintf(stderr, "error: fingerprint %s not found in JSON record %s\n", fp.fingerprint, json);
+                w->failures++;
+            }
+        }
+    }
+    fclose(in);
+    fclose(out);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const char *resource_dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt == 'r') {
+            resource_dir = optarg;
+        } else {
+            fprintf(stderr, "usage: %s [-r resource_dir] file.pcap all.json selected.json\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 3) {
+        fprintf(stderr, "usage: %s [-r resource_dir] file.pcap all.json selected.json\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct mercury_resources *resources = NULL;
+    struct libmerc_config all_cfg = libmerc_config_init();
+    if (resource_dir) {
+        resources = mercury_resources_init(resource_dir, 0);
+        if (resources == NULL) {
+            return EXIT_FAILURE;
+        }
+        all_cfg.do_analysis = true;
+    }
+    struct libmerc_config selected_cfg = libmerc_config_init();
+    selected_cfg.metadata_output = true;
+    selected_cfg.packet_filter_cfg = "http";
+
+    struct worker workers[2] = {
+        { argv[optind], argv[optind + 1], mercury_context_init(resources, &all_cfg), 1, 0 },
+        { argv[optind], argv[optind + 2], mercury_context_init(resources, &selected_cfg), 0, 0 }
+    };
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        if (workers[i].ctx == NULL) {
+            fprintf(stderr, "error: could not initialize libmerc context\n");
+            return EXIT_FAILURE;
+        }
+        pthread_create(&threads[i], NULL, process_file, &workers[i]);
+    }
+    int failures = 0;
+    for (int i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        mercury_context_finalize(workers[i].ctx);
+        failures += workers[i].failures;
+    }
+    mercury_resources_finalize(resources);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
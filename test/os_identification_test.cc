@@ -0,0 +1,339 @@
+/*
+ * os_identification_test.cc
+ *
+ * checks the OS identification of hosts, whose fingerprints are
+ * queued by several threads at once, against a straightforward long
+ * double implementation of the model that reads the OS fingerprint
+ * databases and os_detection_model.json directly; some of the hosts
+ * have more distinct fingerprints than are held inline, and some of
+ * the fingerprints are not in the databases; also checks that a host
+ * that goes idle, with no later traffic, is reported before shutdown
+ *
+ * usage: os_identification_test <resource directory>
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "../src/os_identification.h"
+#include "../src/rapidjson/document.h"
+#include "../src/rapidjson/istreamwrapper.h"
+
+#define NUM_HOSTS    200
+#define NUM_THREADS  4
+#define TOLERANCE    1e-6   /* scores are written with six decimals */
+
+static const char *fp_file_name[] = {
+    "/fingerprint-db-tcp-os.json.gz",
+    "/fingerprint-db-tls-os.json.gz",
+    "/fingerprint-db-http-os.json.gz"
+};
+static const char *fp_type_name[] = { "tcp", "tls", "http" };
+
+struct os_fingerprint {
+    std::string str_repr;
+    std::map<std::string, long double> os_info;
+};
+
+struct observation {
+    enum os_fp_type type;
+    const std::string *fp;
+    bool known;
+    struct timespec ts;
+};
+
+struct host {
+    uint32_t addr;
+    std::vector<struct observation> obs;
+};
+
+static uint64_t lcg_state = 1;
+
+static unsigned int lcg(unsigned int n) {
+    lcg_state = lcg_state * 6364136223846793005ull + 1442695040888963407ull;
+    return (lcg_state >> 33) % n;
+}
+
+static bool read_fingerprints(const std::string &file_name, std::vector<struct os_fingerprint> &fps) {
+    gzFile in_file = gzopen(file_name.c_str(), "r");
+    if (in_file == NULL) {
+        return false;
+    }
+    std::unordered_set<std::string> seen;
+    std::vector<char> line(1 << 20);
+    while (gzgets(in_file, line.data(), line.size()) != NULL) {
+        rapidjson::Document fp;
+        fp.Parse(line.data());
+        if (fp.HasParseError() || !fp.HasMember("str_repr") || !fp.HasMember("os_info")) {
+            continue;
+        }
+        if (!seen.insert(fp["str_repr"].GetString()).second) {
+            continue;   /* as in the OS identification module, the first entry counts */
+        }
+        fps.emplace_back();
+        fps.back().str_repr = fp["str_repr"].GetString();
+        for (const auto &os : fp["os_info"].GetObject()) {
+            fps.back().os_info[os.name.GetString()] += os.value.GetDouble();
+        }
+    }
+    gzclose(in_file);
+    return true;
+}
+
+/*
+ * reference_os(model, fp_os, h, &score) returns the most probable OS
+ * of host h, and sets score to its probability
+ */
+static std::string reference_os(const rapidjson::Document &model,
+                                const std::map<const std::string *, const struct os_fingerprint *> &fp_os,
+                                const struct host &h,
+                                long double *score) {
+    size_t os_len = model["os_len"].GetUint();
+    std::vector<long double> features(3 * os_len, 0.0);
+    for (const struct observation &o : h.obs) {
+        if (!o.known) {
+            continue;
+        }
+        for (const auto &os : fp_os.at(o.fp)->os_info) {
+            rapidjson::Value::ConstMemberIterator idx = model["os_map"].FindMember(os.first.c_str());
+            if (idx != model["os_map"].MemberEnd() && idx->value.GetUint() < os_len) {
+                features[o.type * os_len + idx->value.GetUint()] += os.second;
+            }
+        }
+    }
+    for (size_t t = 0; t < 3; t++) {
+        long double sum = 0.0;
+        for (size_t k = 0; k < os_len; k++) {
+            sum += features[t * os_len + k];
+        }
+        for (size_t k = 0; sum > 0.0 && k < os_len; k++) {
+            features[t * os_len + k] /= sum;
+        }
+    }
+
+    const rapidjson::Value &labels = model["labels"];
+    std::vector<long double> scores;
+    size_t best = 0;
+    for (rapidjson::SizeType i = 0; i < labels.Size(); i++) {
+        long double s = model["intercepts"][i].GetDouble();
+        const rapidjson::Value &c = model["coefficients"][i];
+        for (rapidjson::SizeType j = 0; j < c.Size() && j < features.size(); j++) {
+            s += c[j].GetDouble() * features[j];
+        }
+        scores.push_back(s);
+        if (s > scores[best]) {
+            best = i;
+        }
+    }
+    long double sum = 0.0;
+    for (long double s : scores) {
+        sum += expl(s - scores[best]);
+    }
+    *score = 1.0 / sum;
+    return labels[best].GetString();
+}
+
+/*
+ * idle_host_reported(resource_dir, fp) queues a single observation of
+ * the fingerprint fp, with an idle timeout of one second, and returns
+ * true if its host is reported within a few seconds, while OS
+ * identification is still running, and only once
+ */
+static bool idle_host_reported(const char *resource_dir, const std::string &fp) {
+    std::string output_file = "tmp-os-idle.json";
+    if (os_identification_init(0, resource_dir, output_file.c_str(), 0, 1, 1) != 0) {
+        fprintf(stderr, "error: could not initialize OS identification\n");
+        return false;
+    }
+    struct key k(htons(50000), htons(443), htonl(0x0a010001), htonl(0xc0000201), 6);
+    struct timespec ts = { 1600000000, 0 };
+    os_identification_update(os_identification_get_thread(0), k, os_fp_type_tls, fp.data(), fp.length(), &ts);
+
+    unsigned int num_reports = 0;
+    for (int i = 0; i < 100 && num_reports == 0; i++) {
+        usleep(100000);
+        std::ifstream reports{output_file};
+        std::string line;
+        while (std::getline(reports, line)) {
+            num_reports += line.find("\"src_ip\":\"10.1.0.1\"") != std::string::npos;
+        }
+    }
+    os_identification_finalize();
+    if (num_reports == 0) {
+        fprintf(stderr, "error: idle host was not reported before shutdown\n");
+        remove(output_file.c_str());
+        return false;
+    }
+    num_reports = 0;
+    std::ifstream reports{output_file};
+    std::string line;
+    while (std::getline(reports, line)) {
+        num_reports++;
+    }
+    remove(output_file.c_str());
+    if (num_reports != 1) {
+        fprintf(stderr, "error: idle host reported %u times, expected once\n", num_reports);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <resource directory>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    std::string resource_dir = argv[1];
+
+    std::ifstream model_file{resource_dir + "/os_detection_model.json"};
+    rapidjson::IStreamWrapper isw{model_file};
+    rapidjson::Document model;
+    model.ParseStream(isw);
+    std::vector<struct os_fingerprint> fps[3];
+    for (int t = 0; t < 3; t++) {
+        if (model.HasParseError() || !read_fingerprints(resource_dir + fp_file_name[t], fps[t]) || fps[t].empty()) {
+            fprintf(stderr, "error: could not read the OS identification resources in %s\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+    }
+    std::map<const std::string *, const struct os_fingerprint *> fp_os;
+    for (int t = 0; t < 3; t++) {
+        for (const struct os_fingerprint &fp : fps[t]) {
+            fp_os[&fp.str_repr] = &fp;
+        }
+    }
+    std::string unknown_fp[3] = { "(ffff)(00)", "(0303)(c02b)((0000))", "(474554)(00)" };
+
+    // each host has a few fingerprints of each type, seen several
+    // times; every tenth host has more than can be held inline
+    //
+    std::vector<struct host> hosts(NUM_HOSTS);
+    for (unsigned int i = 0; i < NUM_HOSTS; i++) {
+        struct host &h = hosts[i];
+        h.addr = htonl(0x0a000000 + i + 1);
+        unsigned int num_distinct = i % 10 == 0 ? 24 : 1 + lcg(6);
+        std::vector<std::pair<enum os_fp_type, const std::string *>> distinct;
+        for (unsigned int j = 0; j < num_distinct; j++) {
+            enum os_fp_type type = (enum os_fp_type)lcg(3);
+            distinct.push_back({ type, &fps[type][lcg(fps[type].size())].str_repr });
+        }
+        unsigned int num_obs = num_distinct + lcg(20);
+        for (unsigned int j = 0; j < num_obs; j++) {
+            struct timespec ts = { 1600000000 + (time_t)lcg(100), (long)lcg(1000000000) };
+            if (lcg(8) == 0) {
+                enum os_fp_type type = (enum os_fp_type)lcg(3);
+                h.obs.push_back({ type, &unknown_fp[type], false, ts });
+            } else {
+                const auto &d = j < num_distinct ? distinct[j] : distinct[lcg(num_distinct)];
+                h.obs.push_back({ d.first, d.second, true, ts });
+            }
+        }
+    }
+
+    std::string output_file = "tmp-os.json";
+    if (os_identification_init(0, argv[1], output_file.c_str(), 0, 0, NUM_THREADS) != 0) {
+        fprintf(stderr, "error: could not initialize OS identification\n");
+        return EXIT_FAILURE;
+    }
+
+    // the observations of each host are spread over all of the threads
+    //
+    std::vector<std::thread> threads;
+    for (int t = 0; t < NUM_THREADS; t++) {
+        threads.emplace_back([&hosts, t]() {
+            struct os_observation_queue *q = os_identification_get_thread(t);
+            for (const struct host &h : hosts) {
+                for (size_t j = t; j < h.obs.size(); j += NUM_THREADS) {
+                    const struct observation &o = h.obs[j];
+                    struct key k(htons(50000 + j), htons(443), h.addr, htonl(0xc0000201), 6);
+                    os_identification_update(q, k, o.type, o.fp->data(), o.fp->length(), &o.ts);
+                }
+            }
+        });
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    os_identification_finalize();
+
+    // every host is reported once, with the OS of the reference
+    //
+    unsigned int num_failures = 0;
+    unsigned int num_reports = 0;
+    std::ifstream reports{output_file};
+    std::string line;
+    while (std::getline(reports, line)) {
+        num_reports++;
+        rapidjson::Document r;
+        r.Parse(line.c_str());
+        uint32_t a[4];
+        if (r.HasParseError() || sscanf(r["src_ip"].GetString(), "%u.%u.%u.%u", &a[0], &a[1], &a[2], &a[3]) != 4) {
+            fprintf(stderr, "error: could not parse report %s\n", line.c_str());
+            return EXIT_FAILURE;
+        }
+        unsigned int i = ((a[2] << 8) | a[3]) - 1;
+        if (i >= NUM_HOSTS) {
+            fprintf(stderr, "error: report of unknown host %s\n", r["src_ip"].GetString());
+            return EXIT_FAILURE;
+        }
+        const struct host &h = hosts[i];
+
+        long double score;
+        std::string os = reference_os(model, fp_os, h, &score);
+        const char *result_os = r["os_info"]["os"].GetString();
+        double result_score = r["os_info"]["score"].GetDouble();
+        unsigned int counts[3] = { 0, 0, 0 };
+        double first = HUGE_VAL, last = 0.0;
+        for (const struct observation &o : h.obs) {
+            counts[o.type] += o.known;
+            double t = o.ts.tv_sec + o.ts.tv_nsec / 1.0e9;
+            if (o.known) {
+                first = t < first ? t : first;
+                last = t > last ? t : last;
+            }
+        }
+        bool ok = (os == result_os && fabsl(score - result_score) <= TOLERANCE)
+            && fabs(r["event_start"].GetDouble() - first) < 1e-5
+            && fabs(r["event_end"].GetDouble() - last) < 1e-5;
+        for (int t = 0; t < 3; t++) {
+            ok = ok && r["fingerprint_counts"][fp_type_name[t]].GetUint() == counts[t];
+        }
+        if (!ok && num_failures++ < 10) {
+            fprintf(stderr, "error: report %s, expected %s %.6Lf tcp %u tls %u http %u\n",
+                    line.c_str(), os.c_str(), score, counts[0], counts[1], counts[2]);
+        }
+    }
+    unsigned int num_hosts = 0;
+    for (const struct host &h : hosts) {
+        for (const struct observation &o : h.obs) {
+            if (o.known) {
+                num_hosts++;
+                break;
+            }
+        }
+    }
+    if (num_reports != num_hosts) {
+        fprintf(stderr, "error: %u hosts reported, expected %u\n", num_reports, num_hosts);
+        num_failures++;
+    }
+    fprintf(stderr, "%u of %u OS identification reports match the reference\n", num_reports - num_failures, num_reports);
+    remove(output_file.c_str());
+
+    if (!idle_host_reported(argv[1], fps[os_fp_type_tls][0].str_repr)) {
+        num_failures++;
+    }
+
+    return num_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,65 @@
+#!/bin/python
+#
+# USAGE: pcap-to-pcapng.py <pcapfilename> <pcapngfilename>
+#
+# converts a PCAP file into a PCAPNG file, for testing the PCAPNG
+# reader: the packets are written as Enhanced Packet Blocks with
+# nanosecond timestamps (if_tsresol = 9), alternating between two
+# interfaces, after a block of an unknown type that the reader must
+# skip
+#
+# RETURN: 0 on success, nonzero otherwise
+
+import struct
+import sys
+
+def block(block_type, body):
+    body += b'\0' * (-len(body) % 4)
+    length = len(body) + 12
+    return struct.pack('<II', block_type, length) + body + struct.pack('<I', length)
+
+def option(code, value):
+    return struct.pack('<HH', code, len(value)) + value + b'\0' * (-len(value) % 4)
+
+def main(infile, outfile):
+    with open(infile, 'rb') as f:
+        data = f.read()
+    magic, = struct.unpack('<I', data[:4])
+    if magic == 0xa1b2c3d4:
+        endian, tsmult = '<', 1000
+    elif magic == 0xd4c3b2a1:
+        endian, tsmult = '>', 1000
+    elif magic == 0xa1b23c4d:
+        endian, tsmult = '<', 1
+    elif magic == 0x4d3cb2a1:
+        endian, tsmult = '>', 1
+    else:
+        print('error: %s is not a PCAP file' % infile)
+        return 1
+    snaplen, linktype = struct.unpack(endian + 'II', data[16:24])
+
+    out = block(0x0a0d0d0a, struct.pack('<IHHq', 0x1a2b3c4d, 1, 0, -1))
+    idb_options = option(9, b'\x09') + option(0, b'')   # if_tsresol = 10^-9
+    for _ in range(2):
+        out += block(0x00000001, struct.pack('<HHI', linktype, 0, snaplen) + idb_options)
+    out += block(0x0badcafe, b'unknown block type')
+
+    offset, count = 24, 0
+    while offset + 16 <= len(data):
+        sec, frac, caplen, origlen = struct.unpack(endian + 'IIII', data[offset:offset + 16])
+        packet = data[offset + 16:offset + 16 + caplen]
+        offset += 16 + caplen
+        ts = sec * 1000000000 + frac * tsmult
+        body = struct.pack('<IIIII', count % 2, ts >> 32, ts & 0xffffffff, caplen, origlen) + packet
+        out += block(0x00000006, body + option(0, b''))
+        count += 1
+
+    with open(outfile, 'wb') as f:
+        f.write(out)
+    return 0
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print('usage: %s <pcapfilename> <pcapngfilename>' % sys.argv[0])
+        sys.exit(1)
+    sys.exit(main(sys.argv[1], sys.argv[2]))
@@ -0,0 +1,146 @@
+/*
+ * public_suffix_test.cc
+ *
+ * checks the registered domains found with the public suffix trie
+ * against a straightforward implementation of the rules of
+ * clean_hostname() in python/pmercury/utils/eqv_classes.py, for
+ * names made from each of the rules, and against some known answers
+ *
+ * usage: public_suffix_test <public suffix list file>
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.
+ * License at https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#include "../src/public_suffix.h"
+
+/*
+ * reference_domain() is the registered domain of hostname, computed
+ * as in pmercury, from the set of rules tlds
+ */
+static std::string reference_domain(const std::unordered_set<std::string> &tlds, const std::string &hostname) {
+    std::vector<std::string> tokens;
+    size_t start = 0;
+    size_t dot;
+    while ((dot = hostname.find('.', start)) != std::string::npos) {
+        tokens.push_back(hostname.substr(start, dot - start));
+        start = dot + 1;
+    }
+    tokens.push_back(hostname.substr(start));
+
+    size_t n = tokens.size();
+    std::string domain = tokens[n-1];
+    std::string tmp_domain = tokens[n-1];
+    std::string tmp_tld = tokens[n-1];
+    if (n > 1) {
+        domain = tokens[n-2] + "." + domain;
+        tmp_domain = tokens[n-2] + "." + tmp_domain;
+    }
+    for (size_t i = 2; i < 7; i++) {
+        if (n < i) {
+            break;
+        }
+        if (n > i) {
+            tmp_domain = tokens[n-i-1] + "." + tmp_domain;
+        }
+        tmp_tld = tokens[n-i] + "." + tmp_tld;
+        if (tlds.find(tmp_tld) != tlds.end()) {
+            domain = tmp_domain;
+        }
+    }
+    return domain;
+}
+
+static unsigned int num_failures = 0;
+
+static void check(const public_suffix_list &psl, const std::string &name, const std::string &expected) {
+    struct datum d = psl.registered_domain(name.data(), name.size());
+    if (d.get_string() != expected || (const char *)d.data_end != name.data() + name.size()) {
+        if (num_failures++ < 10) {
+            fprintf(stderr, "error: registered domain of '%s' is '%s', expected '%s'\n",
+                    name.c_str(), d.get_string().c_str(), expected.c_str());
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <public suffix list file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    public_suffix_list psl;
+    if (!psl.load(argv[1])) {
+        fprintf(stderr, "error: could not read %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // read the rules the way pmercury does
+    std::unordered_set<std::string> tlds;
+    std::vector<std::string> rules;
+    gzFile in_file = gzopen(argv[1], "r");
+    char line[1024];
+    while (gzgets(in_file, line, sizeof(line)) != NULL) {
+        std::string rule(line);
+        rule.erase(rule.find_last_not_of(" \t\r\n") + 1);
+        if (rule.empty() || rule.compare(0, 2, "//") == 0) {
+            continue;
+        }
+        if (rule[0] == '*') {
+            rule.erase(0, 2);
+        }
+        tlds.insert(rule);
+        if (rule[0] != '!') {
+            rules.push_back(rule);  /* exception rules are not names */
+        }
+    }
+    gzclose(in_file);
+
+    unsigned int num_tests = 0;
+    for (const std::string &rule : rules) {
+        std::string names[] = { rule, "example." + rule, "www.example." + rule, "a.b.c.d." + rule };
+        for (const std::string &name : names) {
+            check(psl, name, reference_domain(tlds, name));
+            num_tests++;
+        }
+    }
+
+    std::pair<std::string, std::string> known_answers[] = {
+        { "www.google.com", "google.com" },
+        { "google.com", "google.com" },
+        { "localhost", "localhost" },
+        { "", "" },
+        { "www.bbc.co.uk", "bbc.co.uk" },
+        { "co.uk", "co.uk" },
+        { "a.b.c.d.microsoft.com", "microsoft.com" },
+        { "mybucket.s3.amazonaws.com", "mybucket.s3.amazonaws.com" },
+        { "x.y.kawasaki.jp", "y.kawasaki.jp" },
+        { "city.kawasaki.jp", "city.kawasaki.jp" },
+        { "www.google.com.", "com." },
+        { ".com", ".com" },
+        { "a..b", ".b" },
+        { "www.example.notatld", "example.notatld" },
+    };
+    for (const auto &ka : known_answers) {
+        check(psl, ka.first, ka.second);
+        num_tests++;
+    }
+
+    // with no rules, the registered domain is the last two labels
+    public_suffix_list empty;
+    check(empty, "www.bbc.co.uk", "co.uk");
+    check(empty, "a.b.c.d.microsoft.com", "microsoft.com");
+    check(empty, "localhost", "localhost");
+    num_tests += 3;
+
+    fprintf(stderr, "%u of %u registered domains match (%zu rules)\n", num_tests - num_failures, num_tests, psl.size());
+
+    return num_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,346 @@
+/*
+ * quic_test.cc
+ *
+ * checks QUIC Initial processing: the key derivation and header
+ * protection against the test vectors of RFC 9001, Appendix A, and
+ * the reassembly of a clientHello from CRYPTO frames that are out of
+ * order and split across two Initial packets, which are built here
+ * from the first TLS clientHello in a PCAP file.  The QUIC
+ * fingerprint must be the QUIC version followed by the TLS
+ * fingerprint of the same clientHello.  If an output file is given,
+ * the Initial packets are written into it, in PCAP format.
+ *
+ * USAGE: quic_test file.pcap [quic.pcap]
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "../src/quic.h"
+#include "../src/libmerc.h"
+
+static unsigned int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "error: %s\n", what);
+        failures++;
+    }
+}
+
+static std::vector<uint8_t> from_hex(const char *hex) {
+    std::vector<uint8_t> v;
+    for (const char *c = hex; c[0] && c[1]; c += 2) {
+        unsigned int byte;
+        sscanf(c, "%2x", &byte);
+        v.push_back(byte);
+    }
+    return v;
+}
+
+static bool equals_hex(const uint8_t *data, size_t len, const char *hex) {
+    return from_hex(hex) == std::vector<uint8_t>(data, data + len);
+}
+
+// test vectors from RFC 9001, Appendix A.1 and A.2
+//
+static void test_rfc9001_vectors() {
+    std::vector<uint8_t> dcid = from_hex("8394c8f03e515708");
+    struct quic_initial_keys keys;
+    struct datum d{dcid.data(), dcid.data() + dcid.size()};
+    check(quic_initial_keys_init(keys, 0x00000001, d), "could not derive initial keys");
+    check(equals_hex(keys.key, sizeof(keys.key), "1f369613dd76d5467730efcbe3b1a22d"), "client initial key");
+    check(equals_hex(keys.iv, sizeof(keys.iv), "fa044b2f42a3fd3b46fb255c"), "client initial iv");
+    check(equals_hex(keys.hp, sizeof(keys.hp), "9f50449e04a0e810283a1e9933adedd2"), "client initial hp");
+    struct quic_initial_keys server_keys;
+    check(quic_initial_keys_init(server_keys, 0x00000001, d, true), "could not derive server initial keys");
+    check(equals_hex(server_keys.key, sizeof(server_keys.key), "cf3a5331653c364c88f0f379b6067e37"), "server initial key");
+    check(equals_hex(server_keys.iv, sizeof(server_keys.iv), "0ac1493ca1905853b0bba03e"), "server initial iv");
+    check(equals_hex(server_keys.hp, sizeof(server_keys.hp), "c206b8d9b9f0f37644430b490eeaa314"), "server initial hp");
+
+    EVP_CIPHER_CTX *ecb = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ecb, EVP_aes_128_ecb(), NULL, NULL, NULL);
+    std::vector<uint8_t> sample = from_hex("d1b1c98dd7689fb8ec11d242b123dc9b");
+    uint8_t mask[5];
+    check(quic_header_protection_mask(ecb, keys.hp, sample.data(), mask), "could not compute mask");
+    check(equals_hex(mask, sizeof(mask), "437b9aec36"), "header protection mask");
+    EVP_CIPHER_CTX_free(ecb);
+}
+
+// find_client_hello(file, hello, packet) sets hello to the handshake
+// message of the first TLS clientHello in a PCAP file, and packet to
+// the frame that holds it
+//
+static bool find_client_hello(const char *filename, std::vector<uint8_t> &hello, std::vector<uint8_t> &packet) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        perror("could not open file");
+        return false;
+    }
+    uint8_t file_hdr[24];
+    uint8_t rec_hdr[16];
+    if (fread(file_hdr, sizeof(file_hdr), 1, f) != 1) {
+        fclose(f);
+        return false;
+    }
+    while (fread(rec_hdr, sizeof(rec_hdr), 1, f) == 1) {
+        uint32_t incl_len;
+        memcpy(&incl_len, rec_hdr + 8, sizeof(incl_len));
+        packet.resize(incl_len);
+        if (fread(packet.data(), incl_len, 1, f) != 1) {
+            break;
+        }
+        // ethernet, IPv4, TCP, then a TLS record holding a clientHello
+        if (incl_len < 14 + 20 + 20 + 9 || packet[12] != 0x08 || packet[13] != 0x00 || packet[23] != 6) {
+            continue;
+        }
+        size_t tcp = 14 + (packet[14] & 0x0f) * 4;
+        size_t tls = tcp + (packet[tcp + 12] >> 4) * 4;
+        if (tls + 9 > incl_len || packet[tls] != 0x16 || packet[tls + 1] != 0x03 || packet[tls + 5] != 0x01) {
+            continue;
+        }
+        size_t msg_len = 4 + ((packet[tls + 6] << 16) | (packet[tls + 7] << 8) | packet[tls + 8]);
+        if (tls + 5 + msg_len > incl_len) {
+            continue;
+        }
+        hello.assign(packet.begin() + tls + 5, packet.begin() + tls + 5 + msg_len);
+        fclose(f);
+        return true;
+    }
+    fclose(f);
+    return false;
+}
+
+// protect_initial(frames, dcid, version, pn, scid, client_dcid)
+// returns an Ethernet frame holding a client Initial packet with the
+// given frames, padded to 1200 bytes and protected as in RFC 9001,
+// Section 5; if client_dcid is not NULL, the packet is a server
+// Initial, protected with the server keys of that connection
+//
+static std::vector<uint8_t> protect_initial(std::vector<uint8_t> frames,
+                                            const std::vector<uint8_t> &dcid,
+                                            uint32_t version,
+                                            uint32_t pn,
+                                            const std::vector<uint8_t> &scid = {},
+                                            const std::vector<uint8_t> *client_dcid = NULL) {
+    struct quic_initial_keys keys;
+    const std::vector<uint8_t> &key_dcid = client_dcid ? *client_dcid : dcid;
+    struct datum d{key_dcid.data(), key_dcid.data() + key_dcid.size()};
+    quic_initial_keys_init(keys, version, d, client_dcid != NULL);
+
+    const size_t pn_len = 4;
+    const size_t tag_len = 16;
+    while (frames.size() < 1100) {
+        frames.push_back(0x00);  // PADDING
+    }
+    size_t length = pn_len + frames.size() + tag_len;
+
+    std::vector<uint8_t> hdr;
+    hdr.push_back(0xc0 | (version == 0x6b3343cf ? 0x10 : 0x00) | (pn_len - 1));
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        hdr.push_back(version >> shift);
+    }
+    hdr.push_back(dcid.size());
+    hdr.insert(hdr.end(), dcid.begin(), dcid.end());
+    hdr.push_back(scid.size());
+    hdr.insert(hdr.end(), scid.begin(), scid.end());
+    hdr.push_back(0);            // token length
+    if (length > 0x3fff) {
+        hdr.push_back(0x80 | (length >> 24));
+        hdr.push_back(length >> 16);
+        hdr.push_back(length >> 8);
+    } else {
+        hdr.push_back(0x40 | (length >> 8));
+    }
+    hdr.push_back(length & 0xff);
+    size_t pn_offset = hdr.size();
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        hdr.push_back(pn >> shift);
+    }
+
+    uint8_t nonce[12];
+    memcpy(nonce, keys.iv, sizeof(nonce));
+    for (size_t i = 0; i < pn_len; i++) {
+        nonce[sizeof(nonce) - pn_len + i] ^= hdr[pn_offset + i];
+    }
+    std::vector<uint8_t> ciphertext(frames.size() + tag_len);
+    EVP_CIPHER_CTX *gcm = EVP_CIPHER_CTX_new();
+    int len;
+    EVP_EncryptInit_ex(gcm, EVP_aes_128_gcm(), NULL, keys.key, nonce);
+    EVP_EncryptUpdate(gcm, NULL, &len, hdr.data(), hdr.size());
+    EVP_EncryptUpdate(gcm, ciphertext.data(), &len, frames.data(), frames.size());
+    EVP_EncryptFinal_ex(gcm, ciphertext.data() + len, &len);
+    EVP_CIPHER_CTX_ctrl(gcm, EVP_CTRL_GCM_GET_TAG, tag_len, ciphertext.data() + frames.size());
+    EVP_CIPHER_CTX_free(gcm);
+
+    EVP_CIPHER_CTX *ecb = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ecb, EVP_aes_128_ecb(), NULL, NULL, NULL);
+    uint8_t mask[5];
+    quic_header_protection_mask(ecb, keys.hp, ciphertext.data() + 4 - pn_len, mask);
+    EVP_CIPHER_CTX_free(ecb);
+    hdr[0] ^= mask[0] & 0x0f;
+    for (size_t i = 0; i < pn_len; i++) {
+        hdr[pn_offset + i] ^= mask[1 + i];
+    }
+
+    std::vector<uint8_t> udp_payload(hdr);
+    udp_payload.insert(udp_payload.end(), ciphertext.begin(), ciphertext.end());
+
+    size_t ip_len = 20 + 8 + udp_payload.size();
+    size_t udp_len = 8 + udp_payload.size();
+    std::vector<uint8_t> pkt = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x00, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x08, 0x00,
+        0x45, 0x00, (uint8_t)(ip_len >> 8), (uint8_t)ip_len, 0x00, 0x00, 0x40, 0x00, 0x40, 17, 0x00, 0x00,
+        10, 0, 0, 1, 192, 0, 2, 1,
+        0xc3, 0x50, 0x01, 0xbb, (uint8_t)(udp_len >> 8), (uint8_t)udp_len, 0x00, 0x00
+    };
+    pkt.insert(pkt.end(), udp_payload.begin(), udp_payload.end());
+    return pkt;
+}
+
+static void append_crypto_frame(std::vector<uint8_t> &frames, const std::vector<uint8_t> &hello, size_t offset, size_t length) {
+    frames.push_back(0x06);
+    frames.push_back(0x40 | (offset >> 8));
+    frames.push_back(offset & 0xff);
+    frames.push_back(0x40 | (length >> 8));
+    frames.push_back(length & 0xff);
+    frames.insert(frames.end(), hello.begin() + offset, hello.begin() + offset + length);
+}
+
+// decrypt(processor, packet, from_server) decrypts the Initial packet
+// in an Ethernet frame made by protect_initial()
+//
+static bool decrypt(struct quic_initial_processor &processor, const std::vector<uint8_t> &packet, bool &from_server) {
+    struct datum d{packet.data() + 14 + 20 + 8, packet.data() + packet.size()};
+    struct quic_initial_packet initial;
+    initial.parse(d);
+    struct datum plaintext;
+    return processor.decrypt(initial, plaintext, from_server);
+}
+
+// the keys of a connection are kept for its client's and its server's
+// Initials, and are not replaced by those of a packet that can not be
+// decrypted, whatever the reason
+//
+static void test_key_cache() {
+    std::vector<uint8_t> dcid = from_hex("8394c8f03e515708");
+    std::vector<uint8_t> client_scid = from_hex("c1c2c3c4");
+    std::vector<uint8_t> server_scid = from_hex("f1f2f3f4f5f6f7f8");
+    std::vector<uint8_t> other_dcid = from_hex("0102030405060708");
+    std::vector<uint8_t> ping{ 0x01 };
+    std::vector<uint8_t> client_0 = protect_initial(ping, dcid, 1, 0, client_scid);
+    std::vector<uint8_t> client_1 = protect_initial(ping, dcid, 1, 1, client_scid);
+    std::vector<uint8_t> server_0 = protect_initial(ping, client_scid, 1, 0, server_scid, &dcid);
+    std::vector<uint8_t> other = protect_initial(ping, other_dcid, 1, 0);
+    other.back() ^= 0x01;
+    std::vector<uint8_t> too_long = protect_initial(std::vector<uint8_t>(QUIC_MAX_PAYLOAD_LENGTH + 1, 0x01), dcid, 1, 2, client_scid);
+
+    struct quic_initial_processor *processor = new quic_initial_processor;
+    bool from_server = true;
+    check(decrypt(*processor, too_long, from_server) == false, "Initial longer than the plaintext buffer accepted");
+    check(decrypt(*processor, client_0, from_server) && from_server == false, "client Initial not decrypted after a failure");
+    uint64_t client_generation = processor->keys.client.generation;
+    check(decrypt(*processor, server_0, from_server) && from_server == true, "server Initial not decrypted");
+    check(decrypt(*processor, other, from_server) == false, "corrupted Initial accepted");
+    check(decrypt(*processor, client_1, from_server) && from_server == false, "client Initial not decrypted after a server Initial");
+    check(processor->keys.client.generation == client_generation, "client keys derived again");
+    check(decrypt(*processor, server_0, from_server) && from_server == true, "server Initial not decrypted after a client Initial");
+    delete processor;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: %s file.pcap [quic.pcap]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    test_rfc9001_vectors();
+    test_key_cache();
+
+    std::vector<uint8_t> hello, tls_packet;
+    if (!find_client_hello(argv[1], hello, tls_packet)) {
+        fprintf(stderr, "error: no TLS clientHello found in %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    struct libmerc_config cfg = libmerc_config_init();
+    struct mercury_context *ctx = mercury_context_init(NULL, &cfg);
+    if (ctx == NULL) {
+        return EXIT_FAILURE;
+    }
+    struct mercury_fingerprint_result fp;
+    check(mercury_context_get_fingerprint(ctx, tls_packet.data(), tls_packet.size(), &fp), "no TLS fingerprint");
+    std::string tls_fp = fp.fingerprint;
+    std::string tls_sni = fp.server_name ? fp.server_name : "";
+
+    // the clientHello is split into three CRYPTO frames: the first
+    // packet holds the last frame and then the first one, preceded by
+    // a PING, and the second packet holds the middle frame; a third
+    // packet retransmits the whole clientHello, as a client does when
+    // the server's Initial is lost, and is not reported again
+    //
+    size_t a = hello.size() / 3;
+    size_t b = 2 * hello.size() / 3;
+    std::vector<uint8_t> dcid = from_hex("8394c8f03e515708");
+    std::vector<std::vector<uint8_t>> packets;
+    for (uint32_t version : { 0x00000001u, 0x6b3343cfu, 0xff00001du }) {
+        std::vector<uint8_t> first{ 0x01 };
+        append_crypto_frame(first, hello, b, hello.size() - b);
+        append_crypto_frame(first, hello, 0, a);
+        std::vector<uint8_t> second;
+        append_crypto_frame(second, hello, a, b - a);
+        dcid[0] = version;
+        packets.push_back(protect_initial(first, dcid, version, 0));
+        packets.push_back(protect_initial(second, dcid, version, 1));
+        std::vector<uint8_t> retransmission;
+        append_crypto_frame(retransmission, hello, 0, hello.size());
+        packets.push_back(protect_initial(retransmission, dcid, version, 2));
+
+        char version_hex[16];
+        snprintf(version_hex, sizeof(version_hex), "(%08x)", version);
+        std::vector<uint8_t> *p = &packets[packets.size() - 3];
+        check(mercury_context_get_fingerprint(ctx, p[0].data(), p[0].size(), &fp) == false,
+              "QUIC fingerprint reported before the clientHello is complete");
+        check(mercury_context_get_fingerprint(ctx, p[1].data(), p[1].size(), &fp), "no QUIC fingerprint");
+        check(fp.type == fingerprint_type_quic, "wrong fingerprint type");
+        check(version_hex + tls_fp == fp.fingerprint, "wrong QUIC fingerprint");
+        check(tls_sni == (fp.server_name ? fp.server_name : ""), "wrong QUIC server name");
+        check(mercury_context_get_fingerprint(ctx, p[2].data(), p[2].size(), &fp) == false,
+              "retransmitted clientHello reported again");
+    }
+
+    // a packet whose authentication tag does not match is ignored
+    //
+    std::vector<uint8_t> corrupt = packets[0];
+    corrupt.back() ^= 0x01;
+    check(mercury_context_get_fingerprint(ctx, corrupt.data(), corrupt.size(), &fp) == false, "corrupted packet accepted");
+
+    mercury_context_finalize(ctx);
+
+    if (argc == 3) {
+        FILE *out = fopen(argv[2], "w");
+        if (out == NULL) {
+            perror("could not open output file");
+            return EXIT_FAILURE;
+        }
+        uint32_t file_hdr[6] = { 0xa1b2c3d4, 0x00040002, 0, 0, 65535, 1 };
+        fwrite(file_hdr, sizeof(file_hdr), 1, out);
+        uint32_t sec = 1600000000;
+        for (const auto &p : packets) {
+            uint32_t rec_hdr[4] = { sec++, 0, (uint32_t)p.size(), (uint32_t)p.size() };
+            fwrite(rec_hdr, sizeof(rec_hdr), 1, out);
+            fwrite(p.data(), p.size(), 1, out);
+        }
+        fclose(out);
+    }
+
+    if (failures) {
+        fprintf(stderr, "%u failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
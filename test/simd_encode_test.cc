@@ -0,0 +1,252 @@
+/*
+ * simd_encode_test.cc
+ *
+ * checks that the vectorized encoders in src/simd_encode.h, and the
+ * buffer_stream functions that use them, produce output identical to
+ * the byte-at-a-time reference implementations below
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string>
+#include <vector>
+#include "../src/buffer_stream.h"
+
+// reference implementations: one output byte at a time, each through
+// append_putc(), so that truncation happens at exactly the same point
+// as in the original buffer_stream code
+//
+static int ref_raw_as_hex(char *dstr, int *doff, int dlen, int *trunc,
+                          const uint8_t *data, unsigned int len) {
+    if (*trunc == 1) {
+        return 0;
+    }
+    int r = 0;
+    char outb[256];
+    int oi = 0;
+    for (unsigned int i = 0; (i < len) && (*trunc == 0); i++) {
+        outb[oi]     = hex_table[(data[i] & 0xf0) >> 4];
+        outb[oi + 1] = hex_table[data[i] & 0x0f];
+        if (oi < 254) {
+            oi += 2;
+        } else {
+            r += append_memcpy(dstr, doff, dlen, trunc, outb, 256);
+            oi = 0;
+        }
+    }
+    if (oi > 0) {
+        r += append_memcpy(dstr, doff, dlen, trunc, outb, oi);
+    }
+    return r;
+}
+
+static int ref_json_string_escaped(char *dstr, int *doff, int dlen, int *trunc,
+                                   const char *key, const uint8_t *data, unsigned int len) {
+    if (*trunc == 1) {
+        return 0;
+    }
+    int r = 0;
+    r += append_putc(dstr, doff, dlen, trunc, '"');
+    r += append_strncpy(dstr, doff, dlen, trunc, key);
+    r += append_strncpy(dstr, doff, dlen, trunc, "\":\"");
+    for (unsigned int i = 0; (i < len) && (*trunc == 0); i++) {
+        if ((data[i] < 0x20) || (data[i] > 0x7f)) {
+            r += append_strncpy(dstr, doff, dlen, trunc, "\\u00");
+            r += append_putc(dstr, doff, dlen, trunc, hex_table[(data[i] & 0xf0) >> 4]);
+            r += append_putc(dstr, doff, dlen, trunc, hex_table[data[i] & 0x0f]);
+        } else {
+            if (data[i] == '"' || data[i] == '\\') {
+                r += append_putc(dstr, doff, dlen, trunc, '\\');
+            }
+            r += append_putc(dstr, doff, dlen, trunc, data[i]);
+        }
+    }
+    r += append_putc(dstr, doff, dlen, trunc, '"');
+    return r;
+}
+
+static int ref_raw_as_base64(char *dstr, int *doff, int dlen, int *trunc,
+                             const unsigned char *data, size_t input_length) {
+    if (*trunc == 1) {
+        return 0;
+    }
+    int r = 0;
+    size_t i = 0;
+    size_t rem = input_length % 3;
+    size_t len = input_length - rem;
+    uint32_t oct_a, oct_b, oct_c, trip;
+    char outb[256];
+    int oi = 0;
+    r += append_putc(dstr, doff, dlen, trunc, '"');
+    while ((i < len) && (*trunc == 0)) {
+        oct_a = data[i++];
+        oct_b = data[i++];
+        oct_c = data[i++];
+        trip = (oct_a << 0x10) + (oct_b << 0x08) + oct_c;
+        outb[oi]     = encoding_table[(trip >> (3 * 6)) & 0x3F];
+        outb[oi + 1] = encoding_table[(trip >> (2 * 6)) & 0x3F];
+        outb[oi + 2] = encoding_table[(trip >> (1 * 6)) & 0x3F];
+        outb[oi + 3] = encoding_table[(trip >> (0 * 6)) & 0x3F];
+        if (oi < 252) {
+            oi += 4;
+        } else {
+            r += append_memcpy(dstr, doff, dlen, trunc, outb, 256);
+            oi = 0;
+            if (*trunc == 1) {
+                return r;
+            }
+        }
+    }
+    if (oi > 0) {
+        r += append_memcpy(dstr, doff, dlen, trunc, outb, oi);
+    }
+    if (rem > 0) {
+        oct_a = data[i++];
+        oct_b = (i < input_length)? data[i++] : 0;
+        oct_c = (i < input_length)? data[i++] : 0;
+        trip = (oct_a << 0x10) + (oct_b << 0x08) + oct_c;
+        r += append_putc(dstr, doff, dlen, trunc, encoding_table[(trip >> (3 * 6)) & 0x3F]);
+        r += append_putc(dstr, doff, dlen, trunc, encoding_table[(trip >> (2 * 6)) & 0x3F]);
+        if (rem == 1) {
+            r += append_strncpy(dstr, doff, dlen, trunc, (char *)"==");
+        } else {
+            r += append_putc(dstr, doff, dlen, trunc, encoding_table[(trip >> (1 * 6)) & 0x3F]);
+            r += append_putc(dstr, doff, dlen, trunc, '=');
+        }
+    }
+    r += append_putc(dstr, doff, dlen, trunc, '"');
+    return r;
+}
+
+// test inputs: random bytes, printable ASCII with occasional
+// characters that need escaping, and runs of a single byte value
+//
+static std::vector<uint8_t> make_input(size_t len, int kind) {
+    std::vector<uint8_t> v(len);
+    for (auto &c : v) {
+        switch (kind) {
+        case 0:
+            c = rand() & 0xff;
+            break;
+        case 1:
+            c = 0x20 + rand() % 0x5f;
+            if (rand() % 23 == 0) {
+                const uint8_t special[] = { '"', '\\', '\n', 0x00, 0x7f, 0x80, 0xff };
+                c = special[rand() % sizeof(special)];
+            }
+            break;
+        default:
+            c = kind;
+        }
+    }
+    return v;
+}
+
+static unsigned int failures = 0;
+
+static void check(bool ok, const char *what, const char *impl, size_t len, int kind, int dlen=0) {
+    if (!ok) {
+        fprintf(stderr, "error: %s mismatch (encoder: %s, length: %zu, input kind: %d, dlen: %d)\n",
+                what, impl, len, kind, dlen);
+        failures++;
+    }
+}
+
+static void test_encoder(const struct simd_encoder &e, const std::vector<uint8_t> &in, int kind) {
+    size_t len = in.size();
+    std::string expected(6 * len + 64, '\0');
+    std::string actual(6 * len + 64, '\0');
+
+    size_t n = hex_encode_scalar(&expected[0], in.data(), len);
+    size_t m = e.hex(&actual[0], in.data(), len);
+    check(n == m && expected.compare(0, n, actual, 0, m) == 0, "hex", e.name, len, kind);
+
+    n = base64_encode_scalar(&expected[0], in.data(), len);
+    m = e.base64(&actual[0], in.data(), len);
+    check(n == m && n == base64_length(len) && expected.compare(0, n, actual, 0, m) == 0, "base64", e.name, len, kind);
+
+    n = json_escape_scalar(&expected[0], in.data(), len);
+    m = e.json_escape(&actual[0], in.data(), len);
+    check(n == m && expected.compare(0, n, actual, 0, m) == 0, "json_escape", e.name, len, kind);
+}
+
+// test_buffer_stream() runs the buffer_stream encoders and the
+// reference implementations over every output buffer size from
+// smaller than the prefix to larger than the whole output, so that
+// both the direct and the truncating paths are exercised
+//
+static void test_buffer_stream(const std::vector<uint8_t> &in, int kind) {
+    size_t len = in.size();
+    const char prefix[] = "{\"x\":";
+    int max_dlen = 6 * len + 32;
+    std::vector<char> a(max_dlen + 1), b(max_dlen + 1);
+
+    for (int dlen = 1; dlen <= max_dlen; dlen++) {
+        for (int test = 0; test < 3; test++) {
+            int doff_a = 0, trunc_a = 0, doff_b = 0, trunc_b = 0, r_a = 0, r_b = 0;
+            append_strncpy(a.data(), &doff_a, dlen, &trunc_a, prefix);
+            append_strncpy(b.data(), &doff_b, dlen, &trunc_b, prefix);
+            const char *what = NULL;
+            switch (test) {
+            case 0:
+                what = "append_raw_as_hex";
+                r_a = append_raw_as_hex(a.data(), &doff_a, dlen, &trunc_a, in.data(), len);
+                r_b = ref_raw_as_hex(b.data(), &doff_b, dlen, &trunc_b, in.data(), len);
+                break;
+            case 1:
+                what = "append_raw_as_base64";
+                r_a = append_raw_as_base64(a.data(), &doff_a, dlen, &trunc_a, in.data(), len);
+                r_b = ref_raw_as_base64(b.data(), &doff_b, dlen, &trunc_b, in.data(), len);
+                break;
+            case 2:
+                what = "append_json_string_escaped";
+                r_a = append_json_string_escaped(a.data(), &doff_a, dlen, &trunc_a, "k", in.data(), len);
+                r_b = ref_json_string_escaped(b.data(), &doff_b, dlen, &trunc_b, "k", in.data(), len);
+                break;
+            }
+            check(r_a == r_b && doff_a == doff_b && trunc_a == trunc_b && memcmp(a.data(), b.data(), doff_a) == 0,
+                  what, simd_encoder_select().name, len, kind, dlen);
+        }
+    }
+}
+
+int main(int, char *[]) {
+
+    std::vector<const struct simd_encoder *> encoders{ &simd_encoder_scalar };
+#ifdef SIMD_ENCODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        encoders.push_back(&simd_encoder_ssse3);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        encoders.push_back(&simd_encoder_avx2);
+    }
+#endif
+
+    srand(1);
+    for (size_t len = 0; len < 600; len++) {
+        for (int kind : { 0, 1, 0x00, 0x22, 0x41, 0xff }) {
+            std::vector<uint8_t> in = make_input(len, kind);
+            for (const auto &e : encoders) {
+                test_encoder(*e, in, kind);
+            }
+            if (len < 200 || len % 61 == 0) {
+                test_buffer_stream(in, kind);
+            }
+        }
+    }
+
+    for (const auto &e : encoders) {
+        fprintf(stdout, "tested encoder: %s\n", e->name);
+    }
+    fprintf(stdout, "selected encoder: %s\n", simd_encoder_select().name);
+    if (failures) {
+        fprintf(stderr, "%u failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}